@@ -334,6 +334,117 @@ Token *lexer_next(AsmState *as)
     return tok;
 }
 
+/* End of a data list element: a comma or the end of the line */
+static int is_data_end(char c)
+{
+    return c == ',' || c == '\0' || c == '\n' || c == ';' || c == '#';
+}
+
+/*
+ * A plain numeric literal at p, read as lexer_next() reads it.  Returns
+ * the first character after it and any blanks, or NULL if p holds
+ * something else or more digits than fit 32 bits.
+ */
+static const char *scan_literal(const char *p, unsigned long *value)
+{
+    const char *q;
+    unsigned long v = 0;
+    int base = 10;
+    int suffix = 0;
+    int digits = 0;
+    int max = 9;
+    int d;
+    
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '$' && isxdigit((unsigned char)p[1])) {
+        base = 16;
+        p++;
+    } else if (*p == '%' && (p[1] == '0' || p[1] == '1')) {
+        base = 2;
+        p++;
+    } else if (*p == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        suffix = 1;
+        p += 2;
+    } else if (isdigit((unsigned char)*p)) {
+        for (q = p; isxdigit((unsigned char)*q); q++)
+            ;
+        if ((*q == 'h' || *q == 'H') && !is_ident_char(q[1])) {
+            base = 16;
+        }
+        suffix = 1;
+    } else {
+        return NULL;
+    }
+    if (base == 16) max = 8;
+    if (base == 2) max = 32;
+    
+    for (;; p++, digits++) {
+        if (*p >= '0' && *p <= '9') {
+            d = *p - '0';
+        } else if (base == 16 && isxdigit((unsigned char)*p)) {
+            d = tolower((unsigned char)*p) - 'a' + 10;
+        } else {
+            break;
+        }
+        if (d >= base || digits == max) {
+            return NULL;
+        }
+        v = v * base + d;
+    }
+    if (digits == 0) {
+        return NULL;
+    }
+    if (suffix && (*p == 'h' || *p == 'H')) {
+        p++;
+    }
+    while (*p == ' ' || *p == '\t') p++;
+    *value = v;
+    return p;
+}
+
+/*
+ * Fast path for DB, DW and DL lists: with a number as the current
+ * token, converts it and the plain numeric literals after it to
+ * width-byte little-endian values in out, up to max of them, stopping
+ * before the first element that needs the expression parser.  Leaves
+ * the comma or end of line after the last as the current token, as
+ * parse_expression() would.  Returns the number of values, 0 if the
+ * current element is not a plain number.
+ */
+int lexer_data_run(AsmState *as, uint8 *out, int max, int width)
+{
+    const char *p = as->line_ptr;
+    const char *next;
+    unsigned long v;
+    int24 value;
+    int n = 0;
+    int i;
+    
+    if (as->current_token.type != TOK_NUMBER) {
+        return 0;
+    }
+    while (*p == ' ' || *p == '\t') p++;
+    if (!is_data_end(*p)) {
+        return 0;
+    }
+    value = as->current_token.value;
+    for (;;) {
+        for (i = 0; i < width; i++) {
+            *out++ = (uint8)((uint24)value >> (8 * i));
+        }
+        n++;
+        if (*p != ',' || n == max) break;
+        next = scan_literal(p + 1, &v);
+        if (!next || !is_data_end(*next)) break;
+        value = (int24)v;
+        p = next;
+    }
+    as->line_ptr = p;
+    lexer_next(as);
+    return n;
+}
+
 Token *lexer_peek(AsmState *as)
 {
     const char *saved_ptr;
@@ -430,7 +541,7 @@ int parse_condition(const char *name)
  * Symbol Table
  * ============================================================ */
 
-/* Case-sensitive hash for symbol names */
+/* Case-sensitive hash for symbol names; the low bits pick the bucket */
 static unsigned symbol_hash(const char *name)
 {
     unsigned h = 5381;
@@ -438,44 +549,62 @@ static unsigned symbol_hash(const char *name)
         h = ((h << 5) + h) ^ (unsigned char)*name;
         name++;
     }
-    return h & (SYM_HASH_SIZE - 1);
+    return h & 0xFFFF;
 }
 
-Symbol *symbol_find(AsmState *as, const char *name)
+/* Index of a symbol, or -1.  Names are only compared on a full hash
+ * match, as they may have to be read back from disk. */
+static int symbol_index(AsmState *as, const char *name)
 {
     unsigned h = symbol_hash(name);
-    int i = as->sym_hash[h];
-    while (i >= 0) {
-        if (strcmp(as->symbols[i].name, name) == 0) {
-            return &as->symbols[i];
+    unsigned i = as->sym_hash[h & (SYM_HASH_SIZE - 1)];
+    Symbol *sym;
+    
+    while (i != SYM_NONE) {
+        sym = symbol_at(as, (int)i);
+        if (sym->hash == h && symbol_name_is(as, sym, name)) {
+            return (int)i;
         }
-        i = as->symbols[i].hash_next;
+        i = sym->hash_next;
     }
-    return NULL;
+    return -1;
+}
+
+Symbol *symbol_find(AsmState *as, const char *name)
+{
+    int i = symbol_index(as, name);
+    
+    return i < 0 ? NULL : symbol_at(as, i);
 }
 
 Symbol *symbol_add(AsmState *as, const char *name)
 {
     Symbol *sym;
+    long name_off;
     unsigned h;
     
-    if (as->num_symbols >= MAX_SYMBOLS) {
-        asm_error(as, "symbol table full");
-        return NULL;
-    }
+    sym = store_symbol(as);
+    if (!sym) return NULL;
+    name_off = store_name(as, name);
+    if (name_off < 0) return NULL;
     
-    sym = &as->symbols[as->num_symbols];
-    str_copy(sym->name, name, MAX_LABEL_LEN);
+    sym->name_off = (uint24)name_off;
+    sym->local = strchr(name, ':') != NULL;
     sym->value = 0;
     sym->section = as->current_section;
     sym->flags = SYM_LOCAL;
     sym->defined = 0;
     sym->pass1_value = 0;
+    sym->size = 0;
+    sym->has_size = 0;
+    sym->kind = SYMK_NONE;
+    sym->cold = 0;
     
     /* Insert at head of hash chain */
     h = symbol_hash(name);
-    sym->hash_next = as->sym_hash[h];
-    as->sym_hash[h] = as->num_symbols;
+    sym->hash = (uint16)h;
+    sym->hash_next = as->sym_hash[h & (SYM_HASH_SIZE - 1)];
+    as->sym_hash[h & (SYM_HASH_SIZE - 1)] = (uint16)as->num_symbols;
     
     as->num_symbols++;
     
@@ -489,7 +618,7 @@ int symbol_define(AsmState *as, const char *name, uint24 value)
     sym = symbol_find(as, name);
     
     if (sym) {
-        if (sym->defined && as->pass == 1) {
+        if (sym->defined == as->relax_pass && as->pass == 1) {
             asm_error(as, "symbol '%s' already defined", name);
             return -1;
         }
@@ -502,9 +631,13 @@ int symbol_define(AsmState *as, const char *name, uint24 value)
         if (!sym) return -1;
     }
     
+    if (as->pass == 1 && sym->defined != 0 && sym->value != value) {
+        as->relax_moved = 1;
+    }
     sym->value = value;
     sym->section = as->current_section;
-    sym->defined = 1;
+    sym->cold = (uint8)as->in_cold;
+    sym->defined = (uint8)as->relax_pass;
     if (as->pass == 1) {
         sym->pass1_value = value;
     }
@@ -528,7 +661,6 @@ int symbol_set_export(AsmState *as, const char *name)
 int symbol_set_extern(AsmState *as, const char *name)
 {
     Symbol *sym;
-    int i;
     
     sym = symbol_find(as, name);
     if (sym && sym->defined) {
@@ -541,41 +673,30 @@ int symbol_set_extern(AsmState *as, const char *name)
     }
     sym->flags = SYM_EXTERN;
     
-    /* Check if already in externs list */
-    for (i = 0; i < as->num_externs; i++) {
-        if (strcmp(as->externs[i], name) == 0) {
-            return 0;  /* Already there */
-        }
-    }
-    
-    /* Add to externs list */
-    if (as->num_externs < MAX_EXTERNS) {
-        str_copy(as->externs[as->num_externs], name, MAX_LABEL_LEN);
-        as->num_externs++;
+    /* Add to externs list, unless already there */
+    if (symbol_extern_index(as, name) >= 0) {
+        return 0;
     }
-    
-    return 0;
+    return store_extern(as, symbol_index(as, name));
 }
 
 int symbol_is_extern(AsmState *as, const char *name)
 {
-    int i;
-    
-    for (i = 0; i < as->num_externs; i++) {
-        if (strcmp(name, as->externs[i]) == 0) {
-            return 1;
-        }
-    }
-    return 0;
+    return symbol_extern_index(as, name) >= 0;
 }
 
 /* Get external symbol index, returns -1 if not found */
 int symbol_extern_index(AsmState *as, const char *name)
 {
+    int index;
     int i;
     
-    for (i = 0; i < as->num_externs; i++) {
-        if (strcmp(name, as->externs[i]) == 0) {
+    if (as->num_externs == 0) {
+        return -1;
+    }
+    index = symbol_index(as, name);
+    for (i = 0; index >= 0 && i < as->num_externs; i++) {
+        if (as->externs[i] == (uint16)index) {
             return i;
         }
     }
@@ -804,6 +925,15 @@ int parse_expression(AsmState *as, int24 *result, char *symbol_out)
  * Operand Parser
  * ============================================================ */
 
+/* IX+d/IY+d displacements are signed 8-bit; check once values are final */
+static void check_index_disp(AsmState *as, const Operand *op)
+{
+    if (as->pass == 2 && !is_signed_8bit(op->value)) {
+        asm_error(as, "index displacement %ld out of range (-128..127)",
+                  (long)op->value);
+    }
+}
+
 int parse_operand(AsmState *as, Operand *op)
 {
     Token *tok;
@@ -912,6 +1042,7 @@ int parse_operand(AsmState *as, Operand *op)
                     return -1;
                 }
                 lexer_next(as);
+                check_index_disp(as, op);
                 return 0;
             }
         }
@@ -962,6 +1093,7 @@ int parse_operand(AsmState *as, Operand *op)
                     op->has_symbol = parse_expression(as, &op->value, op->symbol);
                     op->value = -op->value;
                 }
+                check_index_disp(as, op);
                 return 0;
             }
             
@@ -1015,19 +1147,94 @@ void emit_byte(AsmState *as, uint8 b)
         } else if (as->current_section == SECT_BSS) {
             /* BSS doesn't emit bytes, just tracks size */
             as->bss_size++;
+        } else if (as->current_section == SECT_ASSET) {
+            if (as->asset_tmp) {
+                fputc(b, as->asset_tmp);
+            }
+            as->asset_size++;
         }
+    } else if (as->isr_capture && as->current_section == SECT_CODE) {
+        isr_capture(as, b);
     }
     as->pc++;
 }
 
+/* Emit n bytes at once, as n calls of emit_byte would */
+void emit_block(AsmState *as, const uint8 *bytes, int n)
+{
+    FILE *fp = NULL;
+    int i;
+    
+    if (as->pass == 2) {
+        if (as->current_section == SECT_CODE) {
+            fp = as->code_tmp;
+            as->code_size += n;
+        } else if (as->current_section == SECT_DATA) {
+            fp = as->data_tmp;
+            as->data_size += n;
+        } else if (as->current_section == SECT_BSS) {
+            as->bss_size += n;
+        } else if (as->current_section == SECT_ASSET) {
+            fp = as->asset_tmp;
+            as->asset_size += n;
+        }
+        if (fp) {
+            fwrite(bytes, 1, (size_t)n, fp);
+        }
+    } else if (as->isr_capture && as->current_section == SECT_CODE) {
+        for (i = 0; i < n; i++, as->pc++) {
+            isr_capture(as, bytes[i]);
+        }
+        return;
+    }
+    as->pc += n;
+}
+
 void emit_word(AsmState *as, uint24 w)
 {
     emit_byte(as, w & 0xFF);
     emit_byte(as, (w >> 8) & 0xFF);
 }
 
+/* Write the relocation waiting for its addend */
+static void reloc_flush(AsmState *as)
+{
+    if (as->reloc_pending) {
+        fwrite(&as->pending_reloc, sizeof(Relocation), 1, as->reloc_tmp);
+        as->num_relocs++;
+        as->reloc_pending = 0;
+    }
+}
+
+/* Write a relocation to the temp file.  With explicit addends it waits
+ * for emit_long, which supplies the addend and emits zeros instead. */
+static void reloc_write(AsmState *as, Relocation *r)
+{
+    if (r->section == SECT_ASSET) {
+        asm_error(as, "relocatable values cannot be stored in the asset section");
+        return;
+    }
+    reloc_flush(as);
+    r->addend = 0;
+    if (as->explicit_addends) {
+        as->pending_reloc = *r;
+        as->reloc_pending = 1;
+        return;
+    }
+    fwrite(r, sizeof(Relocation), 1, as->reloc_tmp);
+    as->num_relocs++;
+}
+
 void emit_long(AsmState *as, uint24 l)
 {
+    if (as->reloc_pending) {
+        /* Sign-extend the 24-bit field */
+        l &= 0xFFFFFF;
+        as->pending_reloc.addend = (l & 0x800000)
+                                   ? -(int24)(0x1000000UL - l) : (int24)l;
+        reloc_flush(as);
+        l = 0;
+    }
     emit_byte(as, l & 0xFF);
     emit_byte(as, (l >> 8) & 0xFF);
     emit_byte(as, (l >> 16) & 0xFF);
@@ -1053,6 +1260,11 @@ void emit_reloc(AsmState *as, uint8 type, const char *symbol)
         } else {
             /* Local symbol - get its section */
             sym = symbol_find(as, symbol);
+            if (sym && sym->defined && sym->section == SECT_ASSET) {
+                asm_error(as, "asset '%s' has no address; use __asset_%s_off",
+                          symbol, symbol);
+                return;
+            }
             if (sym && sym->defined) {
                 r.target_sect = sym->section;
             } else {
@@ -1061,11 +1273,76 @@ void emit_reloc(AsmState *as, uint8 type, const char *symbol)
             r.ext_index = 0;
         }
         
-        fwrite(&r, sizeof(r), 1, as->reloc_tmp);
-        as->num_relocs++;
+        reloc_write(as, &r);
+    } else if (as->isr_capture && as->current_section == SECT_CODE &&
+               symbol[0] != '\0') {
+        isr_reloc(as, symbol, 0);
+    }
+}
+
+/* Relocation against the start of a section of this file */
+void emit_section_reloc(AsmState *as, uint8 type, uint8 target_sect)
+{
+    Relocation r;
+    
+    if (as->pass == 2 && as->reloc_tmp) {
+        r.offset = (as->current_section == SECT_CODE) ?
+                    as->code_size : as->data_size;
+        r.section = as->current_section;
+        r.type = type;
+        r.target_sect = target_sect;
+        r.ext_index = 0;
+        
+        reloc_write(as, &r);
+    } else if (as->isr_capture && as->current_section == SECT_CODE) {
+        isr_reloc(as, NULL, target_sect);
     }
 }
 
+/* ============================================================
+ * Size Relaxation
+ * ============================================================ */
+
+/*
+ * Code whose size depends on symbol values (jump table encodings and
+ * the like) asks for the size it wants; the choices are kept in
+ * source order.  A choice only ever grows, and pass 1 is repeated
+ * until none grows, so the label values the choices were made from
+ * are final.  Pass 2 gets the last choice.  Returns the choice, or
+ * wanted if out of memory (after reporting it).
+ */
+int asm_relax(AsmState *as, int wanted)
+{
+    int *grown;
+    int i = as->relax_index++;
+    
+    if (as->pass == 2) {
+        return i < as->num_relax ? as->relax[i] : wanted;
+    }
+    
+    if (i >= as->max_relax) {
+        int max = as->max_relax ? as->max_relax * 2 : 64;
+        grown = (int *)realloc(as->relax, max * sizeof(int));
+        if (!grown) {
+            asm_error(as, "out of memory");
+            return wanted;
+        }
+        as->relax = grown;
+        as->max_relax = max;
+    }
+    if (i >= as->num_relax) {
+        /* First sight: the values it was made from may be forward
+         * references, so look again */
+        as->relax[i] = wanted;
+        as->num_relax = i + 1;
+        as->relax_changed = 1;
+    } else if (wanted > as->relax[i]) {
+        as->relax[i] = wanted;
+        as->relax_changed = 1;
+    }
+    return as->relax[i];
+}
+
 /* ============================================================
  * Initialization and Cleanup
  * ============================================================ */
@@ -1076,32 +1353,34 @@ int asm_init(AsmState *as)
     
     memset(as, 0, sizeof(*as));
     
-    as->symbols = (Symbol *)malloc(MAX_SYMBOLS * sizeof(Symbol));
-    as->externs = (char (*)[MAX_LABEL_LEN])malloc(MAX_EXTERNS * MAX_LABEL_LEN);
-    
-    if (!as->symbols || !as->externs) {
-        asm_free(as);
-        return -1;
-    }
-    
-    /* Initialize hash buckets to empty */
+    /* The symbol store grows as symbols are added (ez80sym.c) */
     for (i = 0; i < SYM_HASH_SIZE; i++) {
-        as->sym_hash[i] = -1;
+        as->sym_hash[i] = SYM_NONE;
     }
     
     as->current_section = SECT_CODE;
     as->pass = 1;
+    as->di_budget = -1;
     
     return 0;
 }
 
 void asm_free(AsmState *as)
 {
-    if (as->symbols) free(as->symbols);
-    if (as->externs) free(as->externs);
+    store_free(as);
     if (as->code_tmp) fclose(as->code_tmp);
     if (as->data_tmp) fclose(as->data_tmp);
     if (as->reloc_tmp) fclose(as->reloc_tmp);
     if (as->list_file) fclose(as->list_file);
+    if (as->struct_fields) free(as->struct_fields);
+    if (as->relax) free(as->relax);
+    if (as->line_map) free(as->line_map);
+    if (as->fixed) free(as->fixed);
+    if (as->asset_tmp) fclose(as->asset_tmp);
+    cold_free(as);
+    asset_free(as);
+    pack_free(as);
+    isr_free(as);
+    flow_free(as);
     memset(as, 0, sizeof(*as));
 }
@@ -11,14 +11,26 @@
 
 #include <stdio.h>
 #include "objformat.h"
+#include "timetrace.h"
+
+typedef unsigned short uint16;
 
 /* Configuration limits */
 #define MAX_LINE_LEN    512
 #define MAX_LABEL_LEN   64
 #define MAX_STRING_LEN  256
-#define MAX_SYMBOLS     4096 /* was 512 */
-#define MAX_EXTERNS     128
+#define MAX_SYMBOLS     65535   /* Indices are 16-bit, SYM_NONE is not one */
 #define SYM_HASH_SIZE   256
+#define SYM_NONE        0xFFFF
+#define SYM_PAGE        64      /* Symbols per page of the symbol store */
+#define NAME_PAGE       1024    /* Bytes per page of the name pool */
+#define NAME_MIN_PAGES  4       /* Name pages kept in memory when spilling */
+#define MAX_STRUCT_FIELDS 256
+#define MAX_RELAX_PASSES 16
+#define DATA_RUN        64      /* Plain numbers DB/DW/DL convert at once */
+
+/* Assembler-only section: its bytes go to an OBJ_EXT_ASSETS chunk */
+#define SECT_ASSET      0x04
 
 /* Token types */
 #define TOK_EOF         0
@@ -120,15 +132,28 @@ typedef struct {
 
 /* Symbol definition */
 typedef struct {
-    char name[MAX_LABEL_LEN];
+    uint24 name_off;            /* Offset in the name pool (symbol_name) */
     uint24 value;
+    uint24 pass1_value;
+    uint24 size;                /* SIZE directive, if has_size */
+    uint16 hash;                /* symbol_hash() of the name */
+    uint16 hash_next;           /* next index in hash chain, SYM_NONE = end */
     uint8 section;
     uint8 flags;
-    int defined;
-    uint24 pass1_value;
-    int hash_next;              /* next index in hash chain, -1 = end */
+    uint8 defined;              /* Pass 1 iteration that defined it, 0 = not */
+    uint8 has_size;
+    uint8 kind;                 /* TYPE directive (SYMK_*), 0 = by section */
+    uint8 cold;                 /* Defined in the cold part of the code */
+    uint8 local;                /* Local label (its mangled name has a ':') */
 } Symbol;
 
+/* Page of the name pool */
+typedef struct {
+    char *text;                 /* NULL while only on disk */
+    long stamp;                 /* Last use, for choosing a page to spill */
+    int on_disk;                /* Written to the spill file */
+} NamePage;
+
 /* Relocation entry (for temp file) */
 typedef struct {
     uint24 offset;
@@ -136,14 +161,85 @@ typedef struct {
     uint8 type;
     uint8 target_sect;      /* Target section (0=external, 1=CODE, 2=DATA, 3=BSS) */
     uint24 ext_index;       /* External index if target_sect==0 */
+    int24 addend;           /* With explicit addends, else 0 */
 } Relocation;
 
+/* Field of a STRUCT being defined; offsets are assigned at ENDS */
+typedef struct {
+    char name[MAX_LABEL_LEN];
+    uint24 size;
+    uint24 offset;
+    long weight;            /* HOT weight, 0 if not annotated */
+    int line;
+} StructField;
+
+/* -Wperf lint rules */
+#define PERF_JP_JR      0x01    /* jp where jr reaches */
+#define PERF_TAIL_CALL  0x02    /* call followed by ret */
+#define PERF_LD_ZERO    0x04    /* ld a,0 instead of xor a */
+#define PERF_IX_LOOP    0x08    /* (ix+d) loads in a tight loop */
+#define PERF_TABLE_PAGE 0x10    /* Byte-indexed table crossing a page */
+#define PERF_PUSH_POP   0x20    /* push/pop pair that cancels out */
+#define PERF_ALL        0x3F
+
+/* Start of an instruction in the code section, recorded in pass 2
+ * for the code analyses */
+typedef struct {
+    uint24 offset;          /* Offset in the code section */
+    int line;
+    int file;               /* Index into AsmState.insn_files */
+    long bound;             /* LOOPBOUND given for it, 0 if none */
+} InsnLoc;
+
+/* Registers an exported routine may change (--clobbers) */
+typedef struct {
+    int symbol;             /* Index into AsmState.symbols */
+    unsigned writes;        /* RM_* bits, plus CLOB_UNKNOWN */
+    int *calls;             /* Extern indices it calls or jumps to */
+    int num_calls;
+} ClobberSummary;
+
+/* Run of cold code split from a routine (COLD), for the report */
+typedef struct {
+    char routine[MAX_LABEL_LEN];    /* "" before the first label */
+    uint24 start;           /* Code offset in the cold part */
+    uint24 size;
+} ColdSplit;
+
+/* Packed form of some data (INCBIN_PACKED, DB_PACKED), kept for the
+ * passes after the first by the hashes, codec and size of the data */
+typedef struct PackEntry {
+    unsigned long crc;          /* CRC-32 of the data */
+    unsigned long fnv;          /* FNV-1a of the data */
+    long size;
+    int codec;
+    int cached;                 /* Read from --pack-cache */
+    uint8 *packed;
+    long packed_size;
+    struct PackEntry *next;
+} PackEntry;
+
+/* Interrupt handler (ISR ... ENDISR), by source order; the saves are
+ * set by the last pass 1 iteration whose labels did not move */
+typedef struct {
+    char name[MAX_LABEL_LEN];   /* Routine it starts */
+    int line;
+    int shadow;                 /* ISR SHADOW */
+    uint24 body;                /* Code offset after the saves */
+    uint24 end;                 /* Code offset of the restores */
+    unsigned saves;             /* Registers saved (ISR_* in ez80isr.c) */
+    unsigned writes;            /* Registers the body writes (RM_*) */
+    int why;                    /* Why the body could not be followed */
+    int has_ei;                 /* The body enables interrupts */
+} IsrInfo;
+
 /* Assembler state */
 typedef struct {
     /* Source tracking */
     const char *filename;
     int line_num;
     int pass;
+    int relax_pass;             /* Pass 1 iteration, from 1 */
     int errors;
     int warnings;
     
@@ -162,6 +258,9 @@ typedef struct {
     uint24 data_size;
     uint24 bss_size;
     uint24 num_relocs;
+    int explicit_addends;       /* --explicit-addends: zeros at reloc sites */
+    int reloc_pending;          /* pending_reloc waits for its field */
+    Relocation pending_reloc;
     
     /* Current section and position */
     uint8 current_section;
@@ -172,22 +271,126 @@ typedef struct {
     uint24 data_pc;
     uint24 bss_pc;
     
-    /* Symbol table (kept in memory for lookups) */
-    Symbol *symbols;
+    /* Cold part of the code section (COLD), emitted apart and put
+     * after the hot code at the end of pass 2 */
+    int in_cold;                /* Code is going to the cold part */
+    int cold_used;              /* COLD was seen in this pass */
+    uint24 cold_base;           /* Code offset of the cold part */
+    uint24 cold_pc;             /* Next cold offset, while in hot code */
+    uint24 cold_size;
+    FILE *cold_tmp;             /* Swapped with code_tmp and reloc_tmp */
+    FILE *cold_reloc_tmp;       /* while in the cold part */
+    uint24 hot_tail;            /* Bytes of the instruction ending the hot
+                                 * code, 0 if it ends otherwise */
+    int hot_label;              /* A label follows it */
+    char routine[MAX_LABEL_LEN]; /* Last non-local code label */
+    ColdSplit *splits;
+    int num_splits;
+    
+    /* Code spans the linker must not shrink (OBJ_EXT_FIXED): start
+     * and end offsets of each, from pass 2 */
+    uint24 *fixed;
+    int num_fixed;
+    
+    /* Asset section (SECTION ASSET), written as named blobs in an
+     * OBJ_EXT_ASSETS chunk rather than as a section */
+    uint24 asset_pc;
+    uint24 asset_size;
+    FILE *asset_tmp;
+    int *assets;                /* Symbol starting each blob, by offset */
+    int num_assets;
+    
+    /* Packed data, by content (ez80pack.c) */
+    PackEntry *packs;
+    const char *pack_cache;     /* --pack-cache directory, NULL if none */
+    
+    /* Interrupt handlers (ez80isr.c); pass 1 keeps a copy of the code
+     * by PC once it has seen one, to look at their bodies */
+    IsrInfo *isrs;
+    int num_isrs;
+    int max_isrs;
+    int isr_index;              /* Next handler in this pass */
+    int in_isr;                 /* Between ISR and ENDISR */
+    int isr_capture;            /* Keep the code emitted in pass 1 */
+    int isr_partial;            /* Started keeping it in this iteration */
+    int isr_reloc;              /* Relocation of the next byte kept */
+    uint8 *isr_code;
+    uint8 *isr_mark;            /* Relocation at each byte kept */
+    uint24 isr_alloc;
+    uint24 isr_extent;          /* PC after the last byte kept */
+    
+    /* Symbol table (kept in memory for lookups), in pages grown as
+     * needed; names are in a pool of pages that can spill to disk */
+    Symbol **sym_pages;
+    int num_sym_pages;
+    int max_sym_pages;
     int num_symbols;
-    int sym_hash[SYM_HASH_SIZE]; /* hash bucket heads, -1 = empty */
+    uint16 sym_hash[SYM_HASH_SIZE]; /* hash bucket heads, SYM_NONE = empty */
+    NamePage *name_pages;
+    int num_name_pages;
+    int max_name_pages;
+    int name_fill;              /* Bytes used in the last name page */
+    long name_bytes;
+    long name_clock;            /* Stamps NamePage uses */
+    FILE *name_spill;           /* Spilled name pages, NULL if none */
+    long spill_reads;
+    long mem_used;              /* Bytes held by the symbol store */
+    long mem_peak;
+    long mem_budget;            /* --mem-budget in bytes, 0 = none */
+    int store_failed;           /* The store ran out; the pass stops */
     
-    /* External references */
-    char (*externs)[MAX_LABEL_LEN];
+    /* External references, as symbol indices */
+    uint16 *externs;
     int num_externs;
+    int max_externs;
     
     /* Local label scope counter */
     int local_scope;
     
+    /* Size choices of variable-size code, in source order; pass 1
+     * repeats until none of them grows */
+    int *relax;
+    int num_relax;
+    int max_relax;
+    int relax_index;            /* Next choice in this pass */
+    int relax_changed;          /* A choice grew in this pass 1 */
+    int relax_moved;            /* A label changed value in this pass 1 */
+    
+    /* STRUCT being defined (between STRUCT and ENDS) */
+    int in_struct;
+    int struct_reorder;         /* Lay out HOT fields first */
+    int struct_line;
+    char struct_name[MAX_LABEL_LEN];
+    StructField *struct_fields;
+    int num_struct_fields;
+    
     /* Options */
     int verbose;
     int list_enabled;
     FILE *list_file;
+    TimeTrace *trace;           /* --time-trace timeline, NULL if off */
+    
+    /* Code analyses (only recorded when one is requested) */
+    int analyse;                /* Record instruction locations in pass 2 */
+    int di_report;              /* --di-report */
+    long di_budget;             /* --di-budget, or -1 for none */
+    unsigned perf_rules;        /* -Wperf rules enabled (PERF_*) */
+    const char *profile;        /* --profile branch counts, NULL if none */
+    int split_cold;             /* --split-cold: rare blocks go cold */
+    int clobber_summary;        /* --clobbers: write routine summaries */
+    int wcet_report;            /* --wcet */
+    int wait_code;              /* --wait-states per code fetch */
+    int wait_data;              /* and per data access */
+    long loop_bound;            /* LOOPBOUND for the next instruction */
+    ClobberSummary *clobbers;
+    int num_clobbers;
+    int *line_map;              /* Source line of each line assembled, */
+    int num_line_map;           /* when the layout rewrote the source */
+    InsnLoc *insns;
+    int num_insns;
+    int max_insns;
+    char **insn_files;          /* Source file names for InsnLoc.file */
+    int num_insn_files;
 } AsmState;
 
 /* Function prototypes - Lexer */
@@ -195,6 +398,7 @@ void lexer_init(AsmState *as, const char *line);
 Token *lexer_next(AsmState *as);
 Token *lexer_peek(AsmState *as);
 void lexer_skip_whitespace(AsmState *as);
+int lexer_data_run(AsmState *as, uint8 *out, int max, int width);
 
 /* Function prototypes - Parser */
 int parse_operand(AsmState *as, Operand *op);
@@ -209,14 +413,29 @@ int symbol_define(AsmState *as, const char *name, uint24 value);
 int symbol_set_export(AsmState *as, const char *name);
 int symbol_set_extern(AsmState *as, const char *name);
 int symbol_is_extern(AsmState *as, const char *name);
+int symbol_extern_index(AsmState *as, const char *name);
 int symbol_is_local(const char *name);
 void symbol_mangle_local(AsmState *as, const char *name, char *out, int max_len);
 
+/* Function prototypes - Symbol store */
+Symbol *symbol_at(AsmState *as, int index);
+Symbol *store_symbol(AsmState *as);
+long store_name(AsmState *as, const char *name);
+char *symbol_name(AsmState *as, const Symbol *sym, char *buf);
+int symbol_name_is(AsmState *as, const Symbol *sym, const char *name);
+char *extern_name(AsmState *as, int index, char *buf);
+int store_extern(AsmState *as, int index);
+void store_report(AsmState *as);
+void store_free(AsmState *as);
+
 /* Function prototypes - Code generation */
 void emit_byte(AsmState *as, uint8 b);
+void emit_block(AsmState *as, const uint8 *bytes, int n);
 void emit_word(AsmState *as, uint24 w);
 void emit_long(AsmState *as, uint24 l);
 void emit_reloc(AsmState *as, uint8 type, const char *symbol);
+void emit_section_reloc(AsmState *as, uint8 type, uint8 target_sect);
+int asm_relax(AsmState *as, int wanted);
 
 /* Function prototypes - Main assembler */
 int asm_init(AsmState *as);
@@ -226,6 +445,48 @@ int asm_file(AsmState *as, const char *filename);
 int asm_pass(AsmState *as, FILE *fp);
 int asm_output(AsmState *as, const char *filename);
 
+/* Function prototypes - Code analysis */
+int flow_record_insn(AsmState *as);
+int flow_analyse(AsmState *as);
+unsigned flow_perf_rule(const char *name);
+void flow_free(AsmState *as);
+
+/* Function prototypes - Profile-guided layout */
+FILE *layout_file(AsmState *as, FILE *fp);
+
+/* Function prototypes - Hot/cold splitting */
+int cold_enter(AsmState *as);
+void cold_leave(AsmState *as);
+void cold_label(AsmState *as, const char *label);
+void cold_local_label(AsmState *as);
+void cold_track(AsmState *as, uint24 start, int insn);
+int cold_finish(AsmState *as);
+void cold_free(AsmState *as);
+
+/* Function prototypes - Asset section */
+int asset_enter(AsmState *as);
+int asset_finish(AsmState *as);
+void asset_write(AsmState *as, FILE *fp);
+void asset_free(AsmState *as);
+
+/* Function prototypes - Packed data */
+int pack_incbin(AsmState *as, const char *label);
+int pack_db(AsmState *as, const char *label);
+int pack_unpacker(AsmState *as);
+void pack_free(AsmState *as);
+
+/* Function prototypes - Module loader */
+int mod_loader(AsmState *as, const char *label);
+
+/* Function prototypes - Interrupt handlers */
+void isr_capture(AsmState *as, uint8 b);
+void isr_reloc(AsmState *as, const char *symbol, uint8 target_sect);
+int isr_begin(AsmState *as);
+int isr_end(AsmState *as);
+void isr_instruction(AsmState *as, const char *mnemonic);
+int isr_finish(AsmState *as);
+void isr_free(AsmState *as);
+
 /* Function prototypes - Error handling */
 void asm_error(AsmState *as, const char *fmt, ...);
 void asm_warning(AsmState *as, const char *fmt, ...);
@@ -236,6 +497,8 @@ int instr_execute(AsmState *as, const char *mnemonic);
 /* Function prototypes - Directives */
 int directive_execute(AsmState *as, const char *name);
 int try_equ_directive(AsmState *as, const char *label);
+int is_label_directive(const char *name);
+int define_constant(AsmState *as, const char *name, int24 value);
 
 /* Utility functions */
 int is_8bit(int24 val);
@@ -0,0 +1,175 @@
+/*
+ * eZ80 ADL Mode Assembler - Asset Section
+ *
+ * Large read-only data (pictures, maps, sound) need not take room in
+ * the program while it runs.  SECTION ASSET collects it apart; each
+ * non-local label there starts a named blob that runs to the next:
+ *
+ *             section asset
+ *     title:  incbin "title.bin"
+ *     level1: incbin "level1.bin"
+ *
+ * The blobs are written to an OBJ_EXT_ASSETS chunk, not as a section,
+ * and the linker puts them in an asset file beside the program with
+ * __asset_<name>_off and __asset_<name>_len for a loader to seek to
+ * and read.  An asset has no address: its labels cannot be relocated
+ * or exported, and no relocated value can be stored in one.  The
+ * difference of two asset labels is a constant, as in any section.
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+
+/* SECTION ASSET: the bytes go to a temp file of their own in pass 2 */
+int asset_enter(AsmState *as)
+{
+    if (as->pass == 2 && !as->asset_tmp) {
+        as->asset_tmp = tmpfile();
+        if (!as->asset_tmp) {
+            asm_error(as, "cannot create temp file for assets");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Symbols starting a blob, sorted by offset */
+static int asset_blobs(AsmState *as)
+{
+    const Symbol *sym;
+    int *list;
+    int n = 0;
+    int i, j;
+
+    asset_free(as);
+    for (i = 0; i < as->num_symbols; i++) {
+        sym = symbol_at(as, i);
+        if (sym->defined && sym->section == SECT_ASSET && !sym->local) n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    list = (int *)malloc(n * sizeof(int));
+    if (!list) {
+        asm_error(as, "out of memory for assets");
+        return -1;
+    }
+
+    n = 0;
+    for (i = 0; i < as->num_symbols; i++) {
+        sym = symbol_at(as, i);
+        if (!sym->defined || sym->section != SECT_ASSET || sym->local) {
+            continue;
+        }
+        for (j = n; j > 0 &&
+             symbol_at(as, list[j - 1])->value > sym->value; j--) {
+            list[j] = list[j - 1];
+        }
+        list[j] = i;
+        n++;
+    }
+    as->assets = list;
+    as->num_assets = n;
+    return 0;
+}
+
+/* Bytes of blob i */
+static uint24 blob_size(AsmState *as, int i)
+{
+    uint24 end = as->asset_size;
+
+    if (i + 1 < as->num_assets) {
+        end = symbol_at(as, as->assets[i + 1])->value;
+    }
+    return end - symbol_at(as, as->assets[i])->value;
+}
+
+/*
+ * End of pass 2: find the blobs, checking that every asset byte is in
+ * one and that no asset label is exported.
+ */
+int asset_finish(AsmState *as)
+{
+    const Symbol *sym;
+    char name[MAX_LABEL_LEN];
+    uint24 end;
+    int i;
+
+    if (as->pass != 2) {
+        return 0;
+    }
+    end = as->current_section == SECT_ASSET ? as->pc : as->asset_pc;
+    if (end != as->asset_size) {
+        asm_error(as, "ORG cannot be used in the asset section");
+        return -1;
+    }
+    if (asset_blobs(as) < 0) {
+        return -1;
+    }
+    if (as->asset_size > 0 &&
+        (as->num_assets == 0 || symbol_at(as, as->assets[0])->value > 0)) {
+        asm_error(as, "asset data before the first label");
+        return -1;
+    }
+
+    for (i = 0; i < as->num_symbols; i++) {
+        sym = symbol_at(as, i);
+        if (sym->flags == SYM_EXPORT && sym->section == SECT_ASSET) {
+            symbol_name(as, sym, name);
+            asm_error(as, "asset '%s' cannot be exported; the linker "
+                      "defines __asset_%s_off and __asset_%s_len",
+                      name, name, name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write the OBJ_EXT_ASSETS chunk */
+void asset_write(AsmState *as, FILE *fp)
+{
+    ObjExtHeader ext;
+    ObjAsset blob;
+    char name[MAX_LABEL_LEN];
+    uint24 size;
+    uint24 n;
+    int i;
+
+    size = 0;
+    for (i = 0; i < as->num_assets; i++) {
+        symbol_name(as, symbol_at(as, as->assets[i]), name);
+        size += sizeof(ObjAsset) + strlen(name) + blob_size(as, i);
+    }
+    ext.type = OBJ_EXT_ASSETS;
+    WRITE24(ext.size, size);
+    fwrite(&ext, sizeof(ext), 1, fp);
+
+    fflush(as->asset_tmp);
+    for (i = 0; i < as->num_assets; i++) {
+        symbol_name(as, symbol_at(as, as->assets[i]), name);
+        size = blob_size(as, i);
+        WRITE24(blob.size, size);
+        blob.name_len = (uint8)strlen(name);
+        fwrite(&blob, sizeof(blob), 1, fp);
+        fwrite(name, 1, blob.name_len, fp);
+
+        if (size > 0) {
+            fseek(as->asset_tmp, (long)symbol_at(as, as->assets[i])->value,
+                  SEEK_SET);
+        }
+        for (n = 0; n < size; n++) {
+            fputc(fgetc(as->asset_tmp), fp);
+        }
+    }
+}
+
+void asset_free(AsmState *as)
+{
+    if (as->assets) free(as->assets);
+    as->assets = NULL;
+    as->num_assets = 0;
+}
@@ -0,0 +1,335 @@
+/*
+ * eZ80 ADL Mode Assembler - Hot/Cold Splitting
+ *
+ * Routines that mix a short hot path with long error or setup paths
+ * waste fast memory when placed whole.  After COLD, the rest of a
+ * routine (up to the next non-local label or SECTION) goes to the
+ * cold part of the code section instead:
+ *
+ *     parse:  ld a,(hl)               hot part:  parse, then the next
+ *             cp 10                              routine
+ *             branch nc,@bad
+ *             ret                     cold part: @bad, after all the
+ *             cold                               hot code of the file
+ *     @bad:   ld a,ERR
+ *             ret
+ *
+ * The cold part follows the hot code in the object, and an
+ * OBJ_EXT_COLD chunk says where it starts, so the linker can gather
+ * the hot code of every object together.  Control only crosses
+ * between the parts through relocated jumps: BRANCH picks JP, and JR
+ * or DJNZ across is an error.  Nothing may run on from the hot code
+ * into the cold part either, since the next routine's hot code takes
+ * its place, so COLD is an error after an instruction that can
+ * continue to the next one, or after a label with no hot code.  Data
+ * before COLD is not checked.
+ *
+ * In pass 2 the cold bytes and relocations are written to temp files
+ * of their own, swapped in for the code and relocation files, and
+ * appended to them at the end of the pass.  Pass 1 places the cold
+ * part after the hot code of the iteration before, and repeats until
+ * the two agree.
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+#include "ez80dec.h"
+
+/* Swap the code output between the hot and cold parts */
+static void cold_swap(AsmState *as)
+{
+    FILE *fp;
+    uint24 n;
+
+    fp = as->code_tmp;
+    as->code_tmp = as->cold_tmp;
+    as->cold_tmp = fp;
+    fp = as->reloc_tmp;
+    as->reloc_tmp = as->cold_reloc_tmp;
+    as->cold_reloc_tmp = fp;
+    n = as->code_size;
+    as->code_size = as->cold_size;
+    as->cold_size = n;
+}
+
+/* Hot bytes of a routine: up to the next non-local label or the end
+ * of the hot code */
+static uint24 hot_extent(AsmState *as, const char *routine)
+{
+    const Symbol *sym = symbol_find(as, routine);
+    const Symbol *s;
+    uint24 end = as->cold_base;
+    int i;
+
+    if (!sym) {
+        return 0;
+    }
+
+    for (i = 0; i < as->num_symbols; i++) {
+        s = symbol_at(as, i);
+        if (s->defined && s->section == SECT_CODE && !s->cold &&
+            s->value > sym->value && s->value < end &&
+            !s->local) {
+            end = s->value;
+        }
+    }
+    return end > sym->value ? end - sym->value : 0;
+}
+
+/* Whether the instruction ending the hot code can continue to the
+ * next one; it is the last hot_tail bytes of the pass 2 hot code */
+static int hot_runs_on(AsmState *as)
+{
+    uint8 buf[8];
+    Ez80Insn insn;
+    FILE *fp = as->code_tmp;
+    long n = (long)as->hot_tail;
+    size_t got;
+
+    if (n == 0 || n > (long)sizeof(buf) || !fp) {
+        return 0;
+    }
+    fseek(fp, -n, SEEK_END);
+    got = fread(buf, 1, (size_t)n, fp);
+    fseek(fp, 0L, SEEK_END);
+    if (got != (size_t)n || ez80_decode(buf, (int)n, &insn) != n) {
+        return 0;
+    }
+    switch (insn.flow) {
+    case FLOW_JUMP:
+    case FLOW_RET:
+    case FLOW_RETI:
+    case FLOW_INDIRECT:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/* COLD: switch the code section to its cold part */
+int cold_enter(AsmState *as)
+{
+    ColdSplit *grown;
+
+    if (as->current_section != SECT_CODE) {
+        asm_error(as, "COLD must be in the code section");
+        return -1;
+    }
+    as->cold_used = 1;
+    if (as->in_cold) {
+        return 0;
+    }
+
+    if (as->pass == 2) {
+        if (as->hot_label) {
+            asm_error(as, "COLD directly after a label would leave the "
+                      "label on the hot code that follows");
+            return -1;
+        }
+        if (hot_runs_on(as)) {
+            asm_error(as, "code before COLD would run on into the hot "
+                      "code that follows; end it with jp, jr or ret");
+            return -1;
+        }
+        if (!as->cold_tmp) as->cold_tmp = tmpfile();
+        if (!as->cold_reloc_tmp) as->cold_reloc_tmp = tmpfile();
+        grown = (ColdSplit *)realloc(as->splits,
+                                     (as->num_splits + 1) * sizeof(ColdSplit));
+        if (!as->cold_tmp || !as->cold_reloc_tmp || !grown) {
+            if (grown) as->splits = grown;
+            asm_error(as, "out of memory for cold code");
+            return -1;
+        }
+        as->splits = grown;
+        strcpy(as->splits[as->num_splits].routine, as->routine);
+        as->splits[as->num_splits].start = as->cold_pc;
+        as->splits[as->num_splits].size = 0;
+        as->num_splits++;
+    }
+
+    as->code_pc = as->pc;
+    as->pc = as->cold_pc;
+    as->in_cold = 1;
+    cold_swap(as);
+    return 0;
+}
+
+/* Back to the hot part, at a non-local label or SECTION */
+void cold_leave(AsmState *as)
+{
+    ColdSplit *s;
+
+    if (!as->in_cold) {
+        return;
+    }
+    if (as->pass == 2 && as->num_splits > 0) {
+        s = &as->splits[as->num_splits - 1];
+        s->size = as->pc - s->start;
+    }
+    cold_swap(as);
+    as->cold_pc = as->pc;
+    as->pc = as->code_pc;
+    as->in_cold = 0;
+}
+
+/* A non-local label starts a routine, in the hot part */
+void cold_label(AsmState *as, const char *label)
+{
+    cold_leave(as);
+    if (as->current_section == SECT_CODE) {
+        strncpy(as->routine, label, MAX_LABEL_LEN - 1);
+        as->routine[MAX_LABEL_LEN - 1] = '\0';
+        as->hot_label = 1;
+    }
+}
+
+/* A local label in the hot part names the code after it */
+void cold_local_label(AsmState *as)
+{
+    if (as->current_section == SECT_CODE && !as->in_cold) {
+        as->hot_label = 1;
+    }
+}
+
+/* After a statement from start: what the hot code now ends with, an
+ * instruction of that many bytes or something else */
+void cold_track(AsmState *as, uint24 start, int insn)
+{
+    if (as->current_section != SECT_CODE || as->in_cold ||
+        as->pc == start) {
+        return;
+    }
+    as->hot_tail = insn ? as->pc - start : 0;
+    as->hot_label = 0;
+}
+
+/* Hot and cold sizes of each routine split */
+static void cold_report(AsmState *as)
+{
+    const char *name;
+    uint24 cold;
+    int routines = 0;
+    int i, j;
+
+    for (i = 0; i < as->num_splits; i++) {
+        name = as->splits[i].routine;
+        for (j = 0; j < i; j++) {
+            if (strcmp(as->splits[j].routine, name) == 0) break;
+        }
+        if (j < i) continue;
+
+        cold = 0;
+        for (j = i; j < as->num_splits; j++) {
+            if (strcmp(as->splits[j].routine, name) == 0) {
+                cold += as->splits[j].size;
+            }
+        }
+        if (!name[0]) {
+            printf("%s: note: split code before the first label: "
+                   "cold %u bytes\n", as->filename, (unsigned)cold);
+        } else {
+            printf("%s: note: split %s: hot %u bytes, cold %u bytes\n",
+                   as->filename, name, (unsigned)hot_extent(as, name),
+                   (unsigned)cold);
+        }
+        routines++;
+    }
+    printf("%s: note: cold part %u bytes from %d routine%s, hot code "
+           "%u bytes\n", as->filename, (unsigned)as->cold_size, routines,
+           routines == 1 ? "" : "s", (unsigned)as->cold_base);
+}
+
+/* Copy the cold part after the hot code */
+static int cold_append(FILE *dest, FILE *src, long nbytes)
+{
+    char buf[512];
+    long n;
+
+    fflush(src);
+    rewind(src);
+    fseek(dest, 0L, SEEK_END);
+    while (nbytes > 0) {
+        n = nbytes < (long)sizeof(buf) ? nbytes : (long)sizeof(buf);
+        if (fread(buf, 1, (size_t)n, src) != (size_t)n ||
+            fwrite(buf, 1, (size_t)n, dest) != (size_t)n) {
+            return -1;
+        }
+        nbytes -= n;
+    }
+    return 0;
+}
+
+/* Relocations of the cold part move up by the hot code before it */
+static int cold_relocs(AsmState *as)
+{
+    Relocation r;
+
+    fflush(as->cold_reloc_tmp);
+    rewind(as->cold_reloc_tmp);
+    fseek(as->reloc_tmp, 0L, SEEK_END);
+    while (fread(&r, sizeof(r), 1, as->cold_reloc_tmp) == 1) {
+        r.offset += as->cold_base;
+        if (fwrite(&r, sizeof(r), 1, as->reloc_tmp) != 1) {
+            return -1;
+        }
+    }
+    return ferror(as->cold_reloc_tmp) ? -1 : 0;
+}
+
+/*
+ * End of a pass.  Pass 1 moves the cold part to the end of the hot
+ * code, asking for another iteration if that changed; pass 2 puts
+ * the cold bytes and relocations after the hot ones.
+ */
+int cold_finish(AsmState *as)
+{
+    uint24 hot;
+
+    cold_leave(as);
+    hot = as->current_section == SECT_CODE ? as->pc : as->code_pc;
+
+    if (as->pass == 1) {
+        if (as->cold_used && hot != as->cold_base) {
+            as->relax_changed = 1;
+        }
+        as->cold_base = hot;
+        return 0;
+    }
+
+    if (!as->cold_used || as->errors > 0) {
+        return 0;
+    }
+    if (as->code_size != as->cold_base) {
+        asm_error(as, "COLD cannot be used with ORG in the code section");
+        return -1;
+    }
+
+    if (as->cold_size > 0 &&
+        (cold_append(as->code_tmp, as->cold_tmp, (long)as->cold_size) < 0 ||
+         cold_relocs(as) < 0)) {
+        fprintf(stderr, "error: cannot write cold code\n");
+        as->errors++;
+        return -1;
+    }
+    as->code_size += as->cold_size;
+
+    if (as->verbose || as->split_cold) {
+        cold_report(as);
+    }
+    return 0;
+}
+
+void cold_free(AsmState *as)
+{
+    if (as->cold_tmp) fclose(as->cold_tmp);
+    if (as->cold_reloc_tmp) fclose(as->cold_reloc_tmp);
+    if (as->splits) free(as->splits);
+    as->cold_tmp = NULL;
+    as->cold_reloc_tmp = NULL;
+    as->splits = NULL;
+    as->num_splits = 0;
+}
@@ -0,0 +1,697 @@
+/*
+ * eZ80 ADL Mode Instruction Decoder
+ *
+ * Table-free decoder following the usual x/y/z split of the opcode
+ * byte (x = bits 7-6, y = bits 5-3, z = bits 2-0).  DD/FD prefixed
+ * instructions reuse the unprefixed decoder with H, L and HL mapped
+ * to the index register, except for the eZ80 additions which are
+ * handled first.
+ *
+ * Cycle costs are built from three parts: every fetched byte (which
+ * is the instruction length), every data memory or I/O access, and
+ * any internal cycles.  Separate counts are kept for the taken and
+ * not-taken cases of conditional instructions.
+ *
+ * C89 compatible.
+ */
+
+#include <string.h>
+#include "ez80dec.h"
+
+typedef struct {
+    const uint8 *code;
+    int avail;
+    int pos;                /* Bytes consumed so far */
+    int imm_size;           /* 3, or 2 under a .SIS/.LIS suffix */
+    int data;               /* Data accesses (not taken) */
+    int extra;              /* Internal cycles (not taken) */
+    int data_taken;         /* Data accesses (taken) */
+    int extra_taken;        /* Internal cycles (taken) */
+    int short_input;        /* Ran out of bytes */
+} DecState;
+
+static const unsigned reg8_masks[8] = {
+    RM_B, RM_C, RM_D, RM_E, RM_H, RM_L, 0, RM_A
+};
+
+static const unsigned rp_masks[4] = { RM_BC, RM_DE, RM_HL, RM_SP };
+static const unsigned rp2_masks[4] = { RM_BC, RM_DE, RM_HL, RM_A | RM_F };
+
+/* ===== Operand Fetch ===== */
+
+static int dec_byte(DecState *s)
+{
+    if (s->pos >= s->avail) {
+        s->short_input = 1;
+        return 0;
+    }
+    return s->code[s->pos++];
+}
+
+/* 24-bit (or 16-bit with .SIS/.LIS) address or immediate operand */
+static void dec_imm(DecState *s, Ez80Insn *d)
+{
+    uint24 v;
+    int i;
+
+    d->imm_pos = s->pos;
+    v = 0;
+    for (i = 0; i < s->imm_size; i++) {
+        v |= (uint24)dec_byte(s) << (8 * i);
+    }
+    d->imm = v;
+}
+
+/* Signed displacement of an (IX+d)/(IY+d) operand */
+static void dec_index_disp(DecState *s, Ez80Insn *d)
+{
+    d->index_disp = (int)(int8)dec_byte(s);
+    d->attr |= INSN_INDEXED;
+}
+
+/* Signed displacement of a relative branch */
+static void dec_rel(DecState *s, Ez80Insn *d)
+{
+    d->disp = (int24)(int8)dec_byte(s);
+    d->attr |= INSN_REL;
+}
+
+/* 8-bit register r[n]; under an index prefix H/L become IXH/IXL etc. */
+static unsigned reg8_mask(int n, unsigned idx)
+{
+    if (idx && (n == 4 || n == 5)) return idx;
+    return reg8_masks[n];
+}
+
+/* Register pair rp[p]; under an index prefix HL becomes IX/IY */
+static unsigned rp_mask(int p, unsigned idx)
+{
+    if (idx && p == 2) return idx;
+    return rp_masks[p];
+}
+
+static unsigned rp2_mask(int p, unsigned idx)
+{
+    if (idx && p == 2) return idx;
+    return rp2_masks[p];
+}
+
+/* Flags and A written by ALU operation y (CP only sets flags) */
+static unsigned alu_writes(int y)
+{
+    return y == 7 ? RM_F : (RM_A | RM_F);
+}
+
+/* ===== CB Prefix ===== */
+
+/* Bit operations on register z; indexed forms have already consumed
+ * the displacement. */
+static void dec_cb(DecState *s, Ez80Insn *d, int op, int indexed)
+{
+    int x = op >> 6;
+    int z = op & 7;
+
+    if (indexed || z == 6) {
+        /* (HL) or (IX+d): read, and write back unless BIT */
+        d->attr |= INSN_MEMREAD;
+        if (x == 1) {
+            s->data = 1;
+        } else {
+            s->data = 2;
+            s->extra = 1;
+        }
+        if (x != 2 && x != 3) d->writes |= RM_F;
+        if (indexed && z != 6) d->attr |= INSN_INVALID;
+        return;
+    }
+
+    if (x == 1) {
+        d->writes |= RM_F;
+    } else if (x == 0) {
+        d->writes |= reg8_masks[z] | RM_F;
+    } else {
+        d->writes |= reg8_masks[z];
+    }
+}
+
+/* ===== ED Prefix ===== */
+
+static void dec_ed(DecState *s, Ez80Insn *d, int op)
+{
+    int x = op >> 6;
+    int y = (op >> 3) & 7;
+    int z = op & 7;
+    int p = y >> 1;
+    int q = y & 1;
+
+    if (x == 0) {
+        switch (z) {
+        case 0:                 /* IN0 r,(n) */
+            dec_byte(s);
+            s->data = 1;
+            d->writes |= reg8_masks[y] | RM_F;
+            if (y == 6) d->attr |= INSN_INVALID;
+            break;
+        case 1:
+            if (op == 0x31) {   /* LD IY,(HL) */
+                s->data = 3;
+                d->writes |= RM_IY;
+                d->attr |= INSN_MEMREAD;
+            } else {            /* OUT0 (n),r */
+                dec_byte(s);
+                s->data = 1;
+                if (y == 6) d->attr |= INSN_INVALID;
+            }
+            break;
+        case 2:                 /* LEA rp,IX+d */
+            dec_index_disp(s, d);
+            d->attr &= ~INSN_INDEXED;
+            d->writes |= (q ? 0 : (p == 3 ? RM_IX : rp_masks[p]));
+            if (q) d->attr |= INSN_INVALID;
+            break;
+        case 3:                 /* LEA rp,IY+d */
+            dec_index_disp(s, d);
+            d->attr &= ~INSN_INDEXED;
+            d->writes |= (q ? 0 : (p == 3 ? RM_IY : rp_masks[p]));
+            if (q) d->attr |= INSN_INVALID;
+            break;
+        case 4:                 /* TST A,r */
+            if (y == 6) {
+                s->data = 1;
+                d->attr |= INSN_MEMREAD;
+            }
+            d->writes |= RM_F;
+            break;
+        case 6:
+            if (op == 0x3E) {   /* LD (HL),IY */
+                s->data = 3;
+            } else {
+                d->attr |= INSN_INVALID;
+            }
+            break;
+        case 7:
+            s->data = 3;
+            if (q == 0) {       /* LD rp,(HL) */
+                d->writes |= (p == 3 ? RM_IX : rp_masks[p]);
+                d->attr |= INSN_MEMREAD;
+            }                   /* else LD (HL),rp */
+            break;
+        default:
+            d->attr |= INSN_INVALID;
+            break;
+        }
+        return;
+    }
+
+    if (x == 1) {
+        switch (z) {
+        case 0:                 /* IN r,(C) */
+            s->data = 1;
+            d->writes |= reg8_masks[y] | RM_F;
+            break;
+        case 1:                 /* OUT (C),r */
+            s->data = 1;
+            break;
+        case 2:                 /* SBC/ADC HL,rp */
+            d->writes |= RM_HL | RM_F;
+            break;
+        case 3:                 /* LD (nn),rp / LD rp,(nn) */
+            dec_imm(s, d);
+            s->data = 3;
+            if (q) {
+                d->writes |= rp_masks[p];
+                d->attr |= INSN_MEMREAD;
+            }
+            break;
+        case 4:
+            if (op == 0x44) {                   /* NEG */
+                d->writes |= RM_A | RM_F;
+            } else if (q == 1) {                /* MLT rp */
+                s->extra = 4;
+                d->writes |= rp_masks[p];
+            } else if (op == 0x54) {            /* LEA IX,IY+d */
+                dec_index_disp(s, d);
+                d->attr &= ~INSN_INDEXED;
+                d->writes |= RM_IX;
+            } else if (op == 0x64) {            /* TST A,n */
+                dec_byte(s);
+                d->writes |= RM_F;
+            } else if (op == 0x74) {            /* TSTIO n */
+                dec_byte(s);
+                s->data = 1;
+                d->writes |= RM_F;
+            }
+            break;
+        case 5:
+            if (op == 0x45 || op == 0x4D) {     /* RETN / RETI */
+                d->flow = FLOW_RETI;
+                d->attr |= INSN_STACK;
+                s->data = s->data_taken = 3;
+                s->extra = s->extra_taken = 3;
+            } else if (op == 0x55) {            /* LEA IY,IX+d */
+                dec_index_disp(s, d);
+                d->attr &= ~INSN_INDEXED;
+                d->writes |= RM_IY;
+            } else if (op == 0x65) {            /* PEA IX+d */
+                dec_index_disp(s, d);
+                d->attr &= ~INSN_INDEXED;
+                d->attr |= INSN_STACK;
+                s->data = 3;
+                d->writes |= RM_SP;
+            } else if (op == 0x6D) {            /* LD MB,A */
+                d->writes |= RM_MB;
+            } else if (op != 0x7D) {            /* STMIX */
+                d->attr |= INSN_INVALID;
+            }
+            break;
+        case 6:
+            if (op == 0x66) {                   /* PEA IY+d */
+                dec_index_disp(s, d);
+                d->attr &= ~INSN_INDEXED;
+                d->attr |= INSN_STACK;
+                s->data = 3;
+                d->writes |= RM_SP;
+            } else if (op == 0x6E) {            /* LD A,MB */
+                d->writes |= RM_A;
+            } else if (op == 0x76) {            /* SLP */
+                d->attr |= INSN_HALT;
+            } else if (op != 0x46 && op != 0x56 && op != 0x5E &&
+                       op != 0x7E) {            /* IM n / RSMIX */
+                d->attr |= INSN_INVALID;
+            }
+            break;
+        case 7:
+            if (op == 0x47 || op == 0x4F) {     /* LD I,A / LD R,A */
+                d->writes |= RM_I;
+            } else if (op == 0x57 || op == 0x5F) {  /* LD A,I / LD A,R */
+                d->writes |= RM_A | RM_F;
+            } else if (op == 0x67 || op == 0x6F) {  /* RRD / RLD */
+                s->data = 2;
+                s->extra = 1;
+                d->writes |= RM_A | RM_F;
+                d->attr |= INSN_MEMREAD;
+            } else {
+                d->attr |= INSN_INVALID;
+            }
+            break;
+        }
+        return;
+    }
+
+    if (x == 2) {
+        switch (op) {
+        case 0xA0: case 0xA8:                   /* LDI / LDD */
+        case 0xB0: case 0xB8:                   /* LDIR / LDDR */
+            s->data = 2;
+            s->extra = 1;
+            d->writes |= RM_BC | RM_DE | RM_HL | RM_F;
+            d->attr |= INSN_MEMREAD;
+            break;
+        case 0xA1: case 0xA9:                   /* CPI / CPD */
+        case 0xB1: case 0xB9:                   /* CPIR / CPDR */
+            s->data = 1;
+            s->extra = 1;
+            d->writes |= RM_BC | RM_HL | RM_F;
+            d->attr |= INSN_MEMREAD;
+            break;
+        case 0xA2: case 0xAA: case 0xB2: case 0xBA:  /* INI/IND(R) */
+        case 0xA3: case 0xAB: case 0xB3: case 0xBB:  /* OUTI/OUTD/OTIR/OTDR */
+            s->data = 2;
+            s->extra = 1;
+            d->writes |= RM_B | RM_HL | RM_F;
+            break;
+        case 0x82: case 0x83: case 0x84:        /* INIM / OTIM / INI2 */
+        case 0x8A: case 0x8B: case 0x8C:        /* INDM / OTDM / IND2 */
+        case 0x92: case 0x93: case 0x94:        /* INIMR / OTIMR / INI2R */
+        case 0x9A: case 0x9B: case 0x9C:        /* INDMR / OTDMR / IND2R */
+        case 0xA4: case 0xAC:                   /* OUTI2 / OUTD2 */
+        case 0xB4: case 0xBC:                   /* OTI2R / OTD2R */
+            s->data = 2;
+            s->extra = 1;
+            d->writes |= RM_BC | RM_HL | RM_F;
+            break;
+        default:
+            d->attr |= INSN_INVALID;
+            return;
+        }
+        /* Repeating forms: 9x and Bx rows */
+        if ((op & 0xF0) == 0x90 || (op & 0xF0) == 0xB0) {
+            d->attr |= INSN_REPEAT;
+        }
+        return;
+    }
+
+    switch (op) {
+    case 0xC2: case 0xC3: case 0xCA: case 0xCB:  /* INIRX/OTIRX/INDRX/OTDRX */
+        s->data = 2;
+        s->extra = 1;
+        d->writes |= RM_BC | RM_HL | RM_F;
+        d->attr |= INSN_REPEAT;
+        break;
+    case 0xC7:                                  /* LD I,HL */
+        d->writes |= RM_I;
+        break;
+    case 0xD7:                                  /* LD HL,I */
+        d->writes |= RM_HL;
+        break;
+    default:
+        d->attr |= INSN_INVALID;
+        break;
+    }
+}
+
+/* ===== Main Opcode Page ===== */
+
+/* Decode an unprefixed opcode, or a DD/FD one with idx set to RM_IX or
+ * RM_IY.  Index forms that do not touch H, L, HL or (HL) are marked
+ * invalid. */
+static void dec_main(DecState *s, Ez80Insn *d, int op, unsigned idx)
+{
+    int x = op >> 6;
+    int y = (op >> 3) & 7;
+    int z = op & 7;
+    int p = y >> 1;
+    int q = y & 1;
+    int uses_hl = 0;
+
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0:
+            if (y == 1) {                       /* EX AF,AF' */
+                d->writes |= RM_A | RM_F | RM_ALT;
+            } else if (y == 2) {                /* DJNZ e */
+                dec_rel(s, d);
+                d->flow = FLOW_BRANCH;
+                d->writes |= RM_B;
+                s->extra = 1;
+                s->extra_taken = 2;
+            } else if (y == 3) {                /* JR e */
+                dec_rel(s, d);
+                d->flow = FLOW_JUMP;
+                s->extra = s->extra_taken = 1;
+            } else if (y >= 4) {                /* JR cc,e */
+                dec_rel(s, d);
+                d->flow = FLOW_BRANCH;
+                d->cond = y - 4;
+                s->extra_taken = 1;
+            }                                   /* else NOP */
+            break;
+        case 1:
+            if (q == 0) {                       /* LD rp,nn */
+                dec_imm(s, d);
+                d->writes |= rp_mask(p, idx);
+            } else {                            /* ADD HL,rp */
+                d->writes |= rp_mask(2, idx) | RM_F;
+            }
+            uses_hl = (p == 2 || q == 1);
+            break;
+        case 2:
+            if (p == 2) {                       /* LD (nn),HL / LD HL,(nn) */
+                dec_imm(s, d);
+                s->data = 3;
+                if (q) {
+                    d->writes |= rp_mask(2, idx);
+                    d->attr |= INSN_MEMREAD;
+                }
+                uses_hl = 1;
+            } else {                            /* (BC)/(DE)/(nn) with A */
+                if (p == 3) dec_imm(s, d);
+                s->data = 1;
+                if (q) {
+                    d->writes |= RM_A;
+                    d->attr |= INSN_MEMREAD;
+                }
+            }
+            break;
+        case 3:                                 /* INC/DEC rp */
+            d->writes |= rp_mask(p, idx);
+            uses_hl = (p == 2);
+            break;
+        case 4:                                 /* INC r */
+        case 5:                                 /* DEC r */
+            if (y == 6) {
+                if (idx) dec_index_disp(s, d);
+                s->data = 2;
+                s->extra = 1;
+                d->writes |= RM_F;
+                d->attr |= INSN_MEMREAD;
+            } else {
+                d->writes |= reg8_mask(y, idx) | RM_F;
+            }
+            uses_hl = (y >= 4 && y <= 6);
+            break;
+        case 6:                                 /* LD r,n */
+            if (y == 6) {
+                if (idx) dec_index_disp(s, d);
+                s->data = 1;
+            } else {
+                d->writes |= reg8_mask(y, idx);
+            }
+            dec_byte(s);
+            uses_hl = (y >= 4 && y <= 6);
+            break;
+        case 7:
+            if (y <= 5) {                       /* Rotates, DAA, CPL */
+                d->writes |= RM_A | RM_F;
+            } else {                            /* SCF / CCF */
+                d->writes |= RM_F;
+            }
+            break;
+        }
+        break;
+
+    case 1:
+        if (y == 6 && z == 6) {                 /* HALT */
+            d->attr |= INSN_HALT;
+            s->extra = 1;
+        } else if (y == 6) {                    /* LD (HL),r */
+            if (idx) dec_index_disp(s, d);
+            s->data = 1;
+            uses_hl = 1;
+        } else if (z == 6) {                    /* LD r,(HL) */
+            if (idx) dec_index_disp(s, d);
+            s->data = 1;
+            d->writes |= reg8_masks[y];
+            d->attr |= INSN_MEMREAD;
+            uses_hl = 1;
+        } else {                                /* LD r,r' */
+            d->writes |= reg8_mask(y, idx);
+            uses_hl = (y == 4 || y == 5 || z == 4 || z == 5);
+        }
+        break;
+
+    case 2:                                     /* ALU A,r */
+        if (z == 6) {
+            if (idx) dec_index_disp(s, d);
+            s->data = 1;
+            d->attr |= INSN_MEMREAD;
+        }
+        d->writes |= alu_writes(y);
+        uses_hl = (z >= 4 && z <= 6);
+        break;
+
+    case 3:
+        switch (z) {
+        case 0:                                 /* RET cc */
+            d->flow = FLOW_RETCC;
+            d->cond = y;
+            d->attr |= INSN_STACK;
+            s->extra = 1;
+            s->data_taken = 3;
+            s->extra_taken = 3;
+            break;
+        case 1:
+            if (q == 0) {                       /* POP rp */
+                s->data = 3;
+                d->writes |= rp2_mask(p, idx) | RM_SP;
+                d->attr |= INSN_STACK;
+                uses_hl = (p == 2);
+            } else if (p == 0) {                /* RET */
+                d->flow = FLOW_RET;
+                d->attr |= INSN_STACK;
+                s->data = s->data_taken = 3;
+                s->extra = s->extra_taken = 2;
+            } else if (p == 1) {                /* EXX */
+                d->writes |= RM_BC | RM_DE | RM_HL | RM_ALT;
+            } else if (p == 2) {                /* JP (HL) */
+                d->flow = FLOW_INDIRECT;
+                s->extra = s->extra_taken = 2;
+                uses_hl = 1;
+            } else {                            /* LD SP,HL */
+                d->writes |= RM_SP;
+                uses_hl = 1;
+            }
+            break;
+        case 2:                                 /* JP cc,nn */
+            dec_imm(s, d);
+            d->flow = FLOW_BRANCH;
+            d->cond = y;
+            s->extra_taken = 1;
+            break;
+        case 3:
+            switch (y) {
+            case 0:                             /* JP nn */
+                dec_imm(s, d);
+                d->flow = FLOW_JUMP;
+                s->extra = s->extra_taken = 1;
+                break;
+            case 2:                             /* OUT (n),A */
+                dec_byte(s);
+                s->data = 1;
+                break;
+            case 3:                             /* IN A,(n) */
+                dec_byte(s);
+                s->data = 1;
+                d->writes |= RM_A;
+                break;
+            case 4:                             /* EX (SP),HL */
+                s->data = 6;
+                d->writes |= rp_mask(2, idx);
+                d->attr |= INSN_STACK;
+                uses_hl = 1;
+                break;
+            case 5:                             /* EX DE,HL */
+                d->writes |= RM_DE | RM_HL;
+                break;
+            case 6:                             /* DI */
+                d->attr |= INSN_DI;
+                break;
+            case 7:                             /* EI */
+                d->attr |= INSN_EI;
+                break;
+            }
+            break;
+        case 4:                                 /* CALL cc,nn */
+            dec_imm(s, d);
+            d->flow = FLOW_CALLCC;
+            d->cond = y;
+            d->attr |= INSN_STACK;
+            s->data_taken = 3;
+            break;
+        case 5:
+            if (q == 0) {                       /* PUSH rp */
+                s->data = 3;
+                d->writes |= RM_SP;
+                d->attr |= INSN_STACK;
+                uses_hl = (p == 2);
+            } else {                            /* CALL nn */
+                dec_imm(s, d);
+                d->flow = FLOW_CALL;
+                d->attr |= INSN_STACK;
+                s->data = s->data_taken = 3;
+            }
+            break;
+        case 6:                                 /* ALU A,n */
+            dec_byte(s);
+            d->writes |= alu_writes(y);
+            break;
+        case 7:                                 /* RST */
+            d->flow = FLOW_RST;
+            d->imm = (uint24)(y * 8);
+            d->attr |= INSN_STACK;
+            s->data = s->data_taken = 3;
+            s->extra = s->extra_taken = 2;
+            break;
+        }
+        break;
+    }
+
+    if (idx && !uses_hl) {
+        d->attr |= INSN_INVALID;
+    }
+}
+
+/* eZ80 16-bit loads and stores through (IX+d)/(IY+d).  Returns 1 if
+ * op was one of them. */
+static int dec_index_ez80(DecState *s, Ez80Insn *d, int op, unsigned idx)
+{
+    unsigned other = (idx == RM_IX) ? RM_IY : RM_IX;
+    unsigned reg;
+    int load;
+
+    switch (op) {
+    case 0x07: reg = RM_BC; load = 1; break;    /* LD BC,(IX+d) */
+    case 0x17: reg = RM_DE; load = 1; break;
+    case 0x27: reg = RM_HL; load = 1; break;
+    case 0x31: reg = other; load = 1; break;    /* LD IY,(IX+d) */
+    case 0x37: reg = idx;   load = 1; break;    /* LD IX,(IX+d) */
+    case 0x0F: reg = RM_BC; load = 0; break;    /* LD (IX+d),BC */
+    case 0x1F: reg = RM_DE; load = 0; break;
+    case 0x2F: reg = RM_HL; load = 0; break;
+    case 0x3E: reg = other; load = 0; break;    /* LD (IX+d),IY */
+    case 0x3F: reg = idx;   load = 0; break;    /* LD (IX+d),IX */
+    default:
+        return 0;
+    }
+
+    dec_index_disp(s, d);
+    s->data = 3;
+    if (load) {
+        d->writes |= reg;
+        d->attr |= INSN_MEMREAD;
+    }
+    return 1;
+}
+
+/* ===== Entry Point ===== */
+
+int ez80_decode(const uint8 *code, int avail, Ez80Insn *d)
+{
+    DecState s;
+    int op;
+    unsigned idx;
+
+    memset(d, 0, sizeof(*d));
+    d->cond = -1;
+    d->imm_pos = -1;
+
+    memset(&s, 0, sizeof(s));
+    s.code = code;
+    s.avail = avail;
+    s.imm_size = 3;
+
+    op = dec_byte(&s);
+    if (s.short_input) return 0;
+
+    /* Mode suffix; .SIS and .LIS take 16-bit immediates */
+    if (op == 0x40 || op == 0x49 || op == 0x52 || op == 0x5B) {
+        if (op == 0x40 || op == 0x49) s.imm_size = 2;
+        op = dec_byte(&s);
+    }
+
+    if (op == 0xCB) {
+        dec_cb(&s, d, dec_byte(&s), 0);
+    } else if (op == 0xED) {
+        dec_ed(&s, d, dec_byte(&s));
+    } else if (op == 0xDD || op == 0xFD) {
+        idx = (op == 0xDD) ? RM_IX : RM_IY;
+        op = dec_byte(&s);
+        if (op == 0xCB) {                       /* DD CB d op */
+            dec_index_disp(&s, d);
+            dec_cb(&s, d, dec_byte(&s), 1);
+        } else if (op == 0xDD || op == 0xED || op == 0xFD) {
+            /* Prefix ignored; decode it alone as a no-op */
+            s.pos--;
+            d->attr |= INSN_INVALID;
+        } else if (!dec_index_ez80(&s, d, op, idx)) {
+            dec_main(&s, d, op, idx);
+        }
+    } else {
+        dec_main(&s, d, op, 0);
+    }
+
+    if (s.short_input) return 0;
+
+    d->len = s.pos;
+    d->accesses = s.pos + s.data;
+    d->cycles = s.pos + s.data + s.extra;
+    if (d->flow == FLOW_NEXT) {
+        d->cycles_taken = d->cycles;
+        d->accesses_taken = d->accesses;
+    } else {
+        d->cycles_taken = s.pos + s.data_taken + s.extra_taken;
+        d->accesses_taken = s.pos + s.data_taken;
+    }
+    return d->len;
+}
@@ -0,0 +1,88 @@
+/*
+ * eZ80 ADL Mode Instruction Decoder
+ *
+ * Decodes one machine instruction into its length, control flow,
+ * cycle cost and the registers it writes.  Shared by the analyses
+ * in the assembler and the linker, which work on encoded bytes.
+ *
+ * Cycle counts are for ADL mode with zero wait states, following the
+ * eZ80 CPU User Manual: one cycle per opcode/operand fetch, one per
+ * data memory or I/O access, plus internal cycles for branches,
+ * MLT and similar.  Block instructions (LDIR etc.) are costed per
+ * iteration and flagged with INSN_REPEAT.
+ *
+ * C89 compatible.
+ */
+
+#ifndef EZ80DEC_H
+#define EZ80DEC_H
+
+#include "objformat.h"
+
+#define MAX_INSN_LEN    6       /* Suffix + ED prefix + opcode + 24-bit operand */
+
+/* Control flow kinds */
+#define FLOW_NEXT       0       /* Falls through to the next instruction */
+#define FLOW_JUMP       1       /* JP nn / JR e: always transfers */
+#define FLOW_BRANCH     2       /* JP cc / JR cc / DJNZ: transfers or falls through */
+#define FLOW_CALL       3       /* CALL nn */
+#define FLOW_CALLCC     4       /* CALL cc,nn */
+#define FLOW_RET        5       /* RET */
+#define FLOW_RETCC      6       /* RET cc */
+#define FLOW_RETI       7       /* RETI / RETN */
+#define FLOW_INDIRECT   8       /* JP (HL) / JP (IX) / JP (IY) */
+#define FLOW_RST        9       /* RST n: call to a fixed vector */
+
+/* Instruction attributes */
+#define INSN_REL        0x0001  /* Target is PC-relative (JR/DJNZ) */
+#define INSN_DI         0x0002  /* DI */
+#define INSN_EI         0x0004  /* EI */
+#define INSN_STACK      0x0008  /* Reads or writes memory through SP */
+#define INSN_REPEAT     0x0010  /* Repeating block instruction (LDIR etc.) */
+#define INSN_HALT       0x0020  /* HALT / SLP */
+#define INSN_INVALID    0x0040  /* Not a valid eZ80 instruction */
+#define INSN_INDEXED    0x0080  /* Uses (IX+d) / (IY+d) */
+#define INSN_MEMREAD    0x0100  /* Reads data memory (not via SP) */
+
+/* Register/flag masks for the registers an instruction writes */
+#define RM_A            0x0001
+#define RM_F            0x0002
+#define RM_B            0x0004
+#define RM_C            0x0008
+#define RM_D            0x0010
+#define RM_E            0x0020
+#define RM_H            0x0040
+#define RM_L            0x0080
+#define RM_IX           0x0100
+#define RM_IY           0x0200
+#define RM_SP           0x0400
+#define RM_I            0x0800  /* I or R */
+#define RM_MB           0x1000
+#define RM_ALT          0x2000  /* Shadow set (EX AF,AF' / EXX) */
+#define RM_BC           (RM_B | RM_C)
+#define RM_DE           (RM_D | RM_E)
+#define RM_HL           (RM_H | RM_L)
+#define RM_ALL          0x3FFF
+
+/* Decoded instruction */
+typedef struct {
+    int len;                /* Length in bytes, including any suffix */
+    int cycles;             /* Cycles when not taken / falling through */
+    int cycles_taken;       /* Cycles when a branch, call or return is taken */
+    int accesses;           /* Memory bus accesses (for wait states) */
+    int accesses_taken;     /* The same when taken */
+    int flow;               /* FLOW_* */
+    int cond;               /* Condition code 0-7, or -1 */
+    int24 disp;             /* Displacement for relative branches */
+    uint24 imm;             /* Address/immediate operand (or RST vector) */
+    int imm_pos;            /* Byte offset of the address operand, or -1 */
+    int index_disp;         /* (IX+d)/(IY+d) displacement, if INSN_INDEXED */
+    unsigned writes;        /* RM_* registers written */
+    unsigned attr;          /* INSN_* attributes */
+} Ez80Insn;
+
+/* Decode the instruction at code[0..avail-1].  Returns its length
+ * (at least 1), or 0 if avail is too short to hold it. */
+int ez80_decode(const uint8 *code, int avail, Ez80Insn *insn);
+
+#endif /* EZ80DEC_H */
@@ -21,6 +21,8 @@ static int dir_ds(AsmState *as);
 static int dir_section(AsmState *as);
 static int dir_xdef(AsmState *as);
 static int dir_xref(AsmState *as);
+static int dir_size(AsmState *as);
+static int dir_type(AsmState *as);
 static int dir_end(AsmState *as);
 static int dir_align(AsmState *as);
 static int dir_ascii(AsmState *as);
@@ -28,6 +30,12 @@ static int dir_asciz(AsmState *as);
 static int dir_assume(AsmState *as);
 static int dir_include(AsmState *as);
 static int dir_incbin(AsmState *as);
+static int dir_jumptable(AsmState *as);
+static int dir_branch(AsmState *as);
+static int dir_cold(AsmState *as);
+static int dir_loopbound(AsmState *as);
+static int dir_struct(AsmState *as, const char *label);
+static int struct_line(AsmState *as);
 
 /* ============================================================
  * Directive Execution
@@ -63,6 +71,8 @@ int directive_execute(AsmState *as, const char *name)
     if (str_casecmp(dir, "xref") == 0 ||
         str_casecmp(dir, "extrn") == 0 ||
         str_casecmp(dir, "extern") == 0) return dir_xref(as);
+    if (str_casecmp(dir, "size") == 0) return dir_size(as);
+    if (str_casecmp(dir, "type") == 0) return dir_type(as);
     if (str_casecmp(dir, "end") == 0) return dir_end(as);
     if (str_casecmp(dir, "align") == 0) return dir_align(as);
     if (str_casecmp(dir, "ascii") == 0) return dir_ascii(as);
@@ -71,10 +81,28 @@ int directive_execute(AsmState *as, const char *name)
     if (str_casecmp(dir, "assume") == 0) return dir_assume(as);
     if (str_casecmp(dir, "include") == 0) return dir_include(as);
     if (str_casecmp(dir, "incbin") == 0) return dir_incbin(as);
+    if (str_casecmp(dir, "jumptable") == 0) return dir_jumptable(as);
+    if (str_casecmp(dir, "branch") == 0) return dir_branch(as);
+    if (str_casecmp(dir, "cold") == 0) return dir_cold(as);
+    if (str_casecmp(dir, "loopbound") == 0) return dir_loopbound(as);
+    if (str_casecmp(dir, "unpacker") == 0) return pack_unpacker(as);
+    if (str_casecmp(dir, "isr") == 0) return isr_begin(as);
+    if (str_casecmp(dir, "endisr") == 0) return isr_end(as);
+    if (str_casecmp(dir, "ends") == 0) {
+        asm_error(as, "ENDS without STRUCT");
+        return -1;
+    }
     
     return -1;
 }
 
+/* Directives whose label is a name, not an address at the PC */
+int is_label_directive(const char *name)
+{
+    if (name[0] == '.') name++;
+    return str_casecmp(name, "equ") == 0 || str_casecmp(name, "struct") == 0;
+}
+
 int try_equ_directive(AsmState *as, const char *label)
 {
     if (str_casecmp(as->current_token.text, "equ") == 0 ||
@@ -105,11 +133,23 @@ static int dir_org(AsmState *as)
     return 0;
 }
 
+/* Define an absolute (section 0) symbol */
+int define_constant(AsmState *as, const char *name, int24 value)
+{
+    uint8 saved_section;
+    int result;
+    
+    saved_section = as->current_section;
+    as->current_section = 0;
+    result = symbol_define(as, name, value);
+    as->current_section = saved_section;
+    return result;
+}
+
 static int dir_equ(AsmState *as, const char *label)
 {
     int24 value;
     char symbol[MAX_LABEL_LEN];
-    uint8 saved_section;
     
     if (!label || label[0] == '\0') {
         asm_error(as, "EQU requires a label");
@@ -127,10 +167,7 @@ static int dir_equ(AsmState *as, const char *label)
     }
     
     /* EQU defines absolute symbols (section 0) */
-    saved_section = as->current_section;
-    as->current_section = 0;
-    symbol_define(as, label, value);
-    as->current_section = saved_section;
+    define_constant(as, label, value);
     return 0;
 }
 
@@ -138,7 +175,9 @@ static int dir_db(AsmState *as)
 {
     int24 value;
     char symbol[MAX_LABEL_LEN];
+    uint8 run[DATA_RUN];
     int has_sym;
+    int n;
     const char *p;
     
     lexer_next(as);
@@ -149,6 +188,8 @@ static int dir_db(AsmState *as)
                 emit_byte(as, (uint8)*p);
             }
             lexer_next(as);
+        } else if ((n = lexer_data_run(as, run, DATA_RUN, 1)) > 0) {
+            emit_block(as, run, n);
         } else {
             has_sym = parse_expression(as, &value, symbol);
             if (has_sym) {
@@ -169,17 +210,23 @@ static int dir_dw(AsmState *as)
 {
     int24 value;
     char symbol[MAX_LABEL_LEN];
+    uint8 run[DATA_RUN * 2];
     int has_sym;
+    int n;
     
     lexer_next(as);
     
     while (1) {
-        has_sym = parse_expression(as, &value, symbol);
-        if (has_sym) {
-            asm_error(as, "DW cannot use relocatable symbols, use DL");
-            return -1;
+        if ((n = lexer_data_run(as, run, DATA_RUN, 2)) > 0) {
+            emit_block(as, run, n * 2);
+        } else {
+            has_sym = parse_expression(as, &value, symbol);
+            if (has_sym) {
+                asm_error(as, "DW cannot use relocatable symbols, use DL");
+                return -1;
+            }
+            emit_word(as, value & 0xFFFF);
         }
-        emit_word(as, value & 0xFFFF);
         
         if (as->current_token.type != TOK_COMMA) break;
         lexer_next(as);
@@ -192,16 +239,22 @@ static int dir_dl(AsmState *as)
 {
     int24 value;
     char symbol[MAX_LABEL_LEN];
+    uint8 run[DATA_RUN * 3];
     int has_sym;
+    int n;
     
     lexer_next(as);
     
     while (1) {
-        has_sym = parse_expression(as, &value, symbol);
-        if (has_sym) {
-            emit_reloc(as, RELOC_ADDR24, symbol);
+        if ((n = lexer_data_run(as, run, DATA_RUN, 3)) > 0) {
+            emit_block(as, run, n * 3);
+        } else {
+            has_sym = parse_expression(as, &value, symbol);
+            if (has_sym) {
+                emit_reloc(as, RELOC_ADDR24, symbol);
+            }
+            emit_long(as, value & 0xFFFFFF);
         }
-        emit_long(as, value & 0xFFFFFF);
         
         if (as->current_token.type != TOK_COMMA) break;
         lexer_next(as);
@@ -248,12 +301,14 @@ static int dir_section(AsmState *as)
     }
     
     name = as->current_token.text;
+    cold_leave(as);
     
     /* Save current section's PC before switching */
     switch (as->current_section) {
         case SECT_CODE: as->code_pc = as->pc; break;
         case SECT_DATA: as->data_pc = as->pc; break;
         case SECT_BSS:  as->bss_pc = as->pc; break;
+        case SECT_ASSET: as->asset_pc = as->pc; break;
     }
     
     if (str_casecmp(name, "code") == 0 ||
@@ -272,6 +327,13 @@ static int dir_section(AsmState *as)
         as->current_section = SECT_BSS;
         as->pc = as->bss_pc;
     }
+    else if (str_casecmp(name, "asset") == 0) {
+        if (asset_enter(as) < 0) {
+            return -1;
+        }
+        as->current_section = SECT_ASSET;
+        as->pc = as->asset_pc;
+    }
     else {
         asm_warning(as, "unknown section '%s', using CODE", name);
         as->current_section = SECT_CODE;
@@ -319,6 +381,79 @@ static int dir_xref(AsmState *as)
     return 0;
 }
 
+/* The "name," that starts SIZE and TYPE; NULL after an error */
+static Symbol *symbol_operand(AsmState *as, const char *what)
+{
+    Symbol *sym;
+    
+    lexer_next(as);
+    if (as->current_token.type != TOK_IDENT ||
+        symbol_is_local(as->current_token.text)) {
+        asm_error(as, "%s requires a global symbol", what);
+        return NULL;
+    }
+    sym = symbol_find(as, as->current_token.text);
+    if (!sym) {
+        sym = symbol_add(as, as->current_token.text);
+        if (!sym) return NULL;
+    }
+    lexer_next(as);
+    if (as->current_token.type != TOK_COMMA) {
+        asm_error(as, "expected ',' after %s symbol", what);
+        return NULL;
+    }
+    lexer_next(as);
+    return sym;
+}
+
+/* SIZE name, bytes: the symbol's extent, instead of up to the next
+ * label.  "$ - name" after the end of a routine is the usual form. */
+static int dir_size(AsmState *as)
+{
+    Symbol *sym;
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+    
+    sym = symbol_operand(as, "SIZE");
+    if (!sym) return -1;
+    
+    /* A difference within the section is constant whatever the
+     * expression parser says about relocation */
+    parse_expression(as, &value, symbol);
+    if (value < 0) {
+        asm_error(as, "SIZE of '%s' is negative",
+                  symbol_name(as, sym, symbol));
+        return -1;
+    }
+    sym->size = (uint24)value;
+    sym->has_size = 1;
+    return 0;
+}
+
+/* TYPE name, function|object: what the symbol names, for a table in
+ * the code section or code in another */
+static int dir_type(AsmState *as)
+{
+    Symbol *sym;
+    
+    sym = symbol_operand(as, "TYPE");
+    if (!sym) return -1;
+    
+    if (as->current_token.type == TOK_IDENT &&
+        (str_casecmp(as->current_token.text, "function") == 0 ||
+         str_casecmp(as->current_token.text, "func") == 0)) {
+        sym->kind = SYMK_FUNC;
+    } else if (as->current_token.type == TOK_IDENT &&
+               str_casecmp(as->current_token.text, "object") == 0) {
+        sym->kind = SYMK_OBJECT;
+    } else {
+        asm_error(as, "TYPE must be function or object");
+        return -1;
+    }
+    lexer_next(as);
+    return 0;
+}
+
 static int dir_end(AsmState *as)
 {
     (void)as;
@@ -452,6 +587,8 @@ static int dir_include(AsmState *as)
     saved_filename = as->filename;
     saved_line_num = as->line_num;
     
+    ttrace_begin(as->trace, "include", filename);
+    
     /* Process included file */
     as->filename = filename;
     as->line_num = 0;
@@ -472,10 +609,15 @@ static int dir_include(AsmState *as)
         }
         
         asm_line(as, line);
+        if (as->store_failed) {
+            break;
+        }
     }
     
     fclose(fp);
     
+    ttrace_end(as->trace);
+    
     /* Restore file context */
     as->filename = saved_filename;
     as->line_num = saved_line_num;
@@ -512,6 +654,8 @@ static int dir_incbin(AsmState *as)
         return -1;
     }
     
+    ttrace_begin(as->trace, "incbin", filename);
+    
     /* Read and emit each byte */
     while ((c = fgetc(fp)) != EOF) {
         emit_byte(as, (uint8)c);
@@ -519,6 +663,653 @@ static int dir_incbin(AsmState *as)
     
     fclose(fp);
     
+    ttrace_end(as->trace);
+    
+    return 0;
+}
+
+/* ============================================================
+ * Jump Tables
+ *
+ *     jumptable op_nop, op_load, op_store, ...
+ *
+ * dispatches on the index in A to the listed targets, clobbering DE,
+ * HL and the flags.  The table entries are 8-bit or 16-bit offsets
+ * from the lowest target when all targets are labels in this section
+ * within reach, else 24-bit addresses; whichever of the three is
+ * smallest (stub included) is used.  The span of targets behind
+ * offsets has no relocations, so it is marked fixed for the linker.
+ * ============================================================ */
+
+#define JT_REL8         1
+#define JT_REL16        2
+#define JT_ABS24        3
+
+typedef struct {
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+} JumpTarget;
+
+/* Stub and table bytes of each encoding */
+static long jt_size(int enc, int n)
+{
+    switch (enc) {
+    case JT_REL8:  return 17 + (long)n;
+    case JT_REL16: return 20 + 2L * n;
+    default:       return 15 + 3L * n;
+    }
+}
+
+static const char *jt_name(int enc)
+{
+    switch (enc) {
+    case JT_REL8:  return "8-bit offsets";
+    case JT_REL16: return "16-bit offsets";
+    default:       return "24-bit addresses";
+    }
+}
+
+/* Whether an encoding reaches every target; span < 0 if the targets
+ * cannot be reached by offsets at all */
+static int jt_fits(int enc, long span)
+{
+    if (enc == JT_ABS24) return 1;
+    if (span < 0) return 0;
+    return span <= (enc == JT_REL8 ? 0xFFL : 0xFFFFL);
+}
+
+/* Mark code offsets start..end-1 as fixed in size */
+static int jt_fixed(AsmState *as, uint24 start, uint24 end)
+{
+    uint24 *grown;
+    
+    grown = (uint24 *)realloc(as->fixed,
+                              (as->num_fixed + 1) * 2 * sizeof(uint24));
+    if (!grown) {
+        asm_error(as, "out of memory");
+        return -1;
+    }
+    as->fixed = grown;
+    as->fixed[2 * as->num_fixed] = start;
+    as->fixed[2 * as->num_fixed + 1] = end;
+    as->num_fixed++;
+    return 0;
+}
+
+/* Emit one instruction of the stub */
+static void jt_insn(AsmState *as, const uint8 *bytes, int len)
+{
+    int i;
+    
+    if (as->analyse && as->pass == 2) flow_record_insn(as);
+    for (i = 0; i < len; i++) {
+        emit_byte(as, bytes[i]);
+    }
+}
+
+/* ld rr,nn with a relocation against a symbol or this section */
+static void jt_load(AsmState *as, uint8 opcode, int24 value,
+                    const char *symbol)
+{
+    if (as->analyse && as->pass == 2) flow_record_insn(as);
+    emit_byte(as, opcode);
+    if (symbol) emit_reloc(as, RELOC_ADDR24, symbol);
+    else emit_section_reloc(as, RELOC_ADDR24, as->current_section);
+    emit_long(as, value & 0xFFFFFF);
+}
+
+static int dir_jumptable(AsmState *as)
+{
+    static const uint8 ld_de_0[] = { 0x11, 0x00, 0x00, 0x00 };
+    static const uint8 ld_e_a[] = { 0x5F };
+    static const uint8 add_hl_de[] = { 0x19 };
+    static const uint8 ld_e_hl[] = { 0x5E };
+    static const uint8 inc_hl[] = { 0x23 };
+    static const uint8 ld_d_hl[] = { 0x56 };
+    static const uint8 ld_hl_hl[] = { 0xED, 0x27 };
+    static const uint8 jp_hl[] = { 0xE9 };
+    JumpTarget *targets;
+    Symbol *sym;
+    int n = 0;
+    int base = -1;
+    int part = -1;
+    long span = 0;
+    int enc, best;
+    int24 table;
+    int i, last;
+    
+    if (as->current_section != SECT_CODE) {
+        asm_error(as, "JUMPTABLE must be in the code section");
+        return -1;
+    }
+    
+    targets = (JumpTarget *)malloc(MAX_LINE_LEN / 2 * sizeof(JumpTarget));
+    if (!targets) {
+        asm_error(as, "out of memory");
+        return -1;
+    }
+    
+    lexer_next(as);
+    while (n < MAX_LINE_LEN / 2) {
+        parse_expression(as, &targets[n].value, targets[n].symbol);
+        n++;
+        if (as->current_token.type != TOK_COMMA) break;
+        lexer_next(as);
+    }
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "JUMPTABLE expects a list of targets");
+        free(targets);
+        return -1;
+    }
+    
+    /* Offsets need every target to be a label in this section, all
+     * in its hot part or all in its cold part.  Forward references
+     * are 0 in the first pass 1; the choice is made again once their
+     * values are known. */
+    for (i = 0; i < n && span >= 0; i++) {
+        sym = targets[i].symbol[0] ? symbol_find(as, targets[i].symbol) : NULL;
+        if (!sym && targets[i].symbol[0] && as->pass == 1) {
+            continue;               /* Not seen yet */
+        }
+        if (!sym || sym->flags == SYM_EXTERN ||
+            (sym->defined && sym->section != SECT_CODE) ||
+            (sym->defined && part >= 0 && sym->cold != part)) {
+            span = -1;
+        } else {
+            if (sym->defined) part = sym->cold;
+            if (base < 0 || targets[i].value < targets[base].value) base = i;
+        }
+    }
+    if (base < 0) base = 0;
+    for (i = 0; i < n && span >= 0; i++) {
+        if (targets[i].value - targets[base].value > span) {
+            span = targets[i].value - targets[base].value;
+        }
+    }
+    
+    best = JT_ABS24;
+    for (enc = JT_ABS24 - 1; enc >= JT_REL8; enc--) {
+        if (jt_fits(enc, span) && jt_size(enc, n) < jt_size(best, n)) {
+            best = enc;
+        }
+    }
+    enc = asm_relax(as, best);
+    if (as->pass == 2 && !jt_fits(enc, span)) {
+        asm_error(as, "JUMPTABLE targets moved after sizing");
+        free(targets);
+        return -1;
+    }
+    
+    /* Nothing may be deleted between the lowest and highest target */
+    if (as->pass == 2 && enc != JT_ABS24) {
+        last = base;
+        for (i = 0; i < n; i++) {
+            if (targets[i].value > targets[last].value) last = i;
+        }
+        if (targets[last].value > targets[base].value &&
+            jt_fixed(as, targets[base].value, targets[last].value) < 0) {
+            free(targets);
+            return -1;
+        }
+    }
+    
+    /* DE = A, HL = &table[A] */
+    table = as->pc + jt_size(enc, n) - (enc == JT_REL8 ? n :
+                                        enc == JT_REL16 ? 2 * n : 3 * n);
+    jt_insn(as, ld_de_0, sizeof(ld_de_0));
+    jt_insn(as, ld_e_a, sizeof(ld_e_a));
+    jt_load(as, 0x21, table, NULL);
+    jt_insn(as, add_hl_de, sizeof(add_hl_de));
+    if (enc == JT_REL8) {
+        jt_insn(as, ld_e_hl, sizeof(ld_e_hl));
+    } else if (enc == JT_REL16) {
+        jt_insn(as, add_hl_de, sizeof(add_hl_de));
+        jt_insn(as, ld_e_hl, sizeof(ld_e_hl));
+        jt_insn(as, inc_hl, sizeof(inc_hl));
+        jt_insn(as, ld_d_hl, sizeof(ld_d_hl));
+    } else {
+        jt_insn(as, add_hl_de, sizeof(add_hl_de));
+        jt_insn(as, add_hl_de, sizeof(add_hl_de));
+        jt_insn(as, ld_hl_hl, sizeof(ld_hl_hl));
+    }
+    if (enc != JT_ABS24) {
+        /* HL = base + offset */
+        jt_load(as, 0x21, targets[base].value, targets[base].symbol);
+        jt_insn(as, add_hl_de, sizeof(add_hl_de));
+    }
+    jt_insn(as, jp_hl, sizeof(jp_hl));
+    
+    for (i = 0; i < n; i++) {
+        if (enc == JT_REL8) {
+            emit_byte(as, (targets[i].value - targets[base].value) & 0xFF);
+        } else if (enc == JT_REL16) {
+            emit_word(as, (targets[i].value - targets[base].value) & 0xFFFF);
+        } else {
+            if (targets[i].symbol[0]) {
+                emit_reloc(as, RELOC_ADDR24, targets[i].symbol);
+            }
+            emit_long(as, targets[i].value & 0xFFFFFF);
+        }
+    }
+    
+    if (as->verbose && as->pass == 2) {
+        printf("%s:%d: note: jumptable of %d entries uses %s: %ld bytes, "
+               "%d relocations (dl table: %ld bytes, %d relocations)\n",
+               as->filename, as->line_num, n, jt_name(enc), jt_size(enc, n),
+               enc == JT_ABS24 ? n + 1 : 2, jt_size(JT_ABS24, n), n + 1);
+    }
+    
+    free(targets);
+    return 0;
+}
+
+/* BRANCH [cc,]target: JR when it reaches the target, else JP.  The
+ * choice is made by relaxation, so it holds for the final layout. */
+static int dir_branch(AsmState *as)
+{
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+    Symbol *sym = NULL;
+    int cc = CC_NONE;
+    int has_sym, near;
+    long disp;
+    
+    lexer_next(as);
+    if (as->current_token.type == TOK_IDENT &&
+        lexer_peek(as)->type == TOK_COMMA) {
+        cc = parse_condition(as->current_token.text);
+        if (cc == CC_NONE) {
+            asm_error(as, "BRANCH expects a condition");
+            return -1;
+        }
+        lexer_next(as);
+        lexer_next(as);
+    }
+    
+    has_sym = parse_expression(as, &value, symbol);
+    if (has_sym) sym = symbol_find(as, symbol);
+    disp = (long)value - ((long)as->pc + 2);
+    
+    if (!has_sym || (sym && sym->flags == SYM_EXTERN) || cc > CC_C) {
+        near = 0;
+    } else if (!sym || !sym->defined) {
+        near = as->pass == 1;       /* Not seen yet */
+    } else {
+        near = sym->section == as->current_section &&
+               sym->cold == as->in_cold && disp >= -128 && disp <= 127;
+    }
+    
+    if (asm_relax(as, near ? 2 : 4) == 2) {
+        if (as->pass == 2 && !near) {
+            asm_error(as, "BRANCH target moved after sizing");
+            return -1;
+        }
+        if (as->analyse && as->pass == 2) flow_record_insn(as);
+        emit_byte(as, cc == CC_NONE ? 0x18 : 0x20 | (cc << 3));
+        emit_byte(as, disp & 0xFF);
+    } else {
+        if (as->analyse && as->pass == 2) flow_record_insn(as);
+        emit_byte(as, cc == CC_NONE ? 0xC3 : 0xC2 | (cc << 3));
+        if (has_sym) emit_reloc(as, RELOC_ADDR24, symbol);
+        emit_long(as, value & 0xFFFFFF);
+    }
+    return 0;
+}
+
+/* COLD: the rest of the routine goes to the cold part (ez80cold.c) */
+static int dir_cold(AsmState *as)
+{
+    lexer_next(as);
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "COLD takes no operands");
+        return -1;
+    }
+    return cold_enter(as);
+}
+
+/* LOOPBOUND n: the loop containing the next instruction runs at most
+ * n times each time it is entered (for --wcet).  Before a block
+ * instruction such as LDIR it bounds its repeats instead. */
+static int dir_loopbound(AsmState *as)
+{
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+    
+    lexer_next(as);
+    if (parse_expression(as, &value, symbol)) {
+        asm_error(as, "LOOPBOUND requires constant expression");
+        return -1;
+    }
+    if (value < 1) {
+        asm_error(as, "LOOPBOUND must be at least 1");
+        return -1;
+    }
+    if (as->pass == 2) as->loop_bound = value;
+    return 0;
+}
+
+/* ============================================================
+ * Structures
+ *
+ *     point   STRUCT
+ *     x:      dl 0
+ *     y:      dl 0
+ *     flags:  db 0, hot
+ *             ENDS
+ *
+ * defines point.x, point.y and point.flags as the field offsets,
+ * point.x.size etc. as the field sizes, and point as the size of the
+ * whole structure.  Fields are reached through (ix+d)/(iy+d), so any
+ * field starting beyond offset 127 is warned about.  With
+ * "STRUCT name, REORDER" the fields marked HOT (optionally with a
+ * weight, "hot 10") are laid out first, heaviest first, so they stay
+ * within displacement range.
+ * ============================================================ */
+
+static void struct_free(AsmState *as)
+{
+    if (as->struct_fields) free(as->struct_fields);
+    as->struct_fields = NULL;
+    as->num_struct_fields = 0;
+    as->in_struct = 0;
+}
+
+static int dir_struct(AsmState *as, const char *label)
+{
+    const char *name = label;
+    int i;
+    
+    if (as->in_struct) {
+        asm_error(as, "STRUCT cannot be nested");
+        return -1;
+    }
+    
+    lexer_next(as);
+    
+    /* STRUCT name form */
+    if ((!name || name[0] == '\0') && as->current_token.type == TOK_IDENT) {
+        name = as->current_token.text;
+    }
+    if (!name || name[0] == '\0') {
+        asm_error(as, "STRUCT requires a name");
+        return -1;
+    }
+    for (i = 0; i < MAX_LABEL_LEN - 1 && name[i]; i++) {
+        as->struct_name[i] = name[i];
+    }
+    as->struct_name[i] = '\0';
+    if (name == as->current_token.text) lexer_next(as);
+    
+    as->struct_reorder = 0;
+    if (as->current_token.type == TOK_COMMA) lexer_next(as);
+    if (as->current_token.type == TOK_IDENT &&
+        str_casecmp(as->current_token.text, "reorder") == 0) {
+        as->struct_reorder = 1;
+        lexer_next(as);
+    }
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "STRUCT expects a name and optional REORDER");
+        return -1;
+    }
+    
+    as->struct_fields = (StructField *)malloc(MAX_STRUCT_FIELDS *
+                                              sizeof(StructField));
+    if (!as->struct_fields) {
+        asm_error(as, "out of memory");
+        return -1;
+    }
+    as->num_struct_fields = 0;
+    as->struct_line = as->line_num;
+    as->in_struct = 1;
+    return 0;
+}
+
+/* Directives that may start a line inside a STRUCT */
+static int is_struct_directive(const char *name)
+{
+    static const char *const dirs[] = {
+        "db", "defb", "byte", "dw", "defw", "word", "dl", "defl", "long",
+        "dd", "ds", "defs", "rmb", "blkb", "ends", NULL
+    };
+    int i;
+    
+    if (name[0] == '.') name++;
+    for (i = 0; dirs[i]; i++) {
+        if (str_casecmp(name, dirs[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Parse the optional "HOT [weight]" annotation of a field */
+static int struct_hot(AsmState *as, long *weight)
+{
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+    
+    lexer_next(as);
+    *weight = 1;
+    if (as->current_token.type == TOK_EOL || as->current_token.type == TOK_EOF) {
+        return 0;
+    }
+    if (parse_expression(as, &value, symbol) || value <= 0) {
+        asm_error(as, "HOT weight must be a positive constant");
+        return -1;
+    }
+    *weight = value;
+    return 0;
+}
+
+/* Size of a field from its data directive.  The values of DB/DW/DL
+ * are not stored, only counted. */
+static int struct_field_size(AsmState *as, const char *dir, uint24 *size,
+                             long *weight)
+{
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+    int width;
+    int count = 0;
+    
+    if (dir[0] == '.') dir++;
+    *weight = 0;
+    
+    if (str_casecmp(dir, "ds") == 0 || str_casecmp(dir, "defs") == 0 ||
+        str_casecmp(dir, "rmb") == 0 || str_casecmp(dir, "blkb") == 0) {
+        lexer_next(as);
+        if (parse_expression(as, &value, symbol) || value < 0) {
+            asm_error(as, "DS requires constant expression");
+            return -1;
+        }
+        *size = value;
+        if (as->current_token.type == TOK_COMMA) {
+            lexer_next(as);
+            if (as->current_token.type != TOK_IDENT ||
+                str_casecmp(as->current_token.text, "hot") != 0) {
+                asm_error(as, "DS in a STRUCT takes no fill value");
+                return -1;
+            }
+            return struct_hot(as, weight);
+        }
+        return 0;
+    }
+    
+    if (str_casecmp(dir, "db") == 0 || str_casecmp(dir, "defb") == 0 ||
+        str_casecmp(dir, "byte") == 0) {
+        width = 1;
+    } else if (str_casecmp(dir, "dw") == 0 || str_casecmp(dir, "defw") == 0 ||
+               str_casecmp(dir, "word") == 0) {
+        width = 2;
+    } else if (str_casecmp(dir, "dl") == 0 || str_casecmp(dir, "defl") == 0 ||
+               str_casecmp(dir, "long") == 0 || str_casecmp(dir, "dd") == 0) {
+        width = 3;
+    } else {
+        asm_error(as, "only DB, DW, DL and DS are allowed in a STRUCT");
+        return -1;
+    }
+    
+    lexer_next(as);
+    while (as->current_token.type != TOK_EOL &&
+           as->current_token.type != TOK_EOF) {
+        if (as->current_token.type == TOK_IDENT &&
+            str_casecmp(as->current_token.text, "hot") == 0) {
+            if (struct_hot(as, weight) < 0) return -1;
+            break;
+        }
+        if (as->current_token.type == TOK_STRING && width == 1) {
+            count += strlen(as->current_token.text);
+            lexer_next(as);
+        } else {
+            parse_expression(as, &value, symbol);
+            count++;
+        }
+        if (as->current_token.type != TOK_COMMA) break;
+        lexer_next(as);
+    }
+    
+    *size = (uint24)((count > 0 ? count : 1) * width);
+    return 0;
+}
+
+/* Define name.field (and name.field.size) */
+static int struct_define_field(AsmState *as, const StructField *f)
+{
+    char name[MAX_LABEL_LEN * 2 + 8];
+    
+    if (strlen(as->struct_name) + strlen(f->name) + 7 > MAX_LABEL_LEN - 1) {
+        asm_error(as, "field name '%s.%s' too long", as->struct_name, f->name);
+        return -1;
+    }
+    sprintf(name, "%s.%s", as->struct_name, f->name);
+    if (define_constant(as, name, f->offset) < 0) return -1;
+    sprintf(name, "%s.%s.size", as->struct_name, f->name);
+    return define_constant(as, name, f->size);
+}
+
+/* ENDS: lay out the fields and define their symbols */
+static int struct_end(AsmState *as)
+{
+    StructField *fields = as->struct_fields;
+    int n = as->num_struct_fields;
+    int order[MAX_STRUCT_FIELDS];
+    uint24 offset = 0;
+    int saved_line;
+    int result = 0;
+    int i, j, k;
+    
+    /* Declaration order, or HOT fields first by descending weight (the
+     * smaller field first on a tie, so more of them fit in range) */
+    for (i = 0; i < n; i++) {
+        k = i;
+        if (as->struct_reorder) {
+            for (j = i; j > 0; j--) {
+                const StructField *a = &fields[order[j - 1]];
+                if (a->weight > fields[k].weight) break;
+                if (a->weight == fields[k].weight &&
+                    (a->weight == 0 || a->size <= fields[k].size)) {
+                    break;
+                }
+                order[j] = order[j - 1];
+            }
+            order[j] = k;
+        } else {
+            order[i] = k;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        fields[order[i]].offset = offset;
+        offset += fields[order[i]].size;
+    }
+    
+    /* An empty field names the field declared after it */
+    for (i = n - 1, k = (int)offset; i >= 0; i--) {
+        if (fields[i].size == 0) fields[i].offset = (uint24)k;
+        else k = (int)fields[i].offset;
+    }
+    
+    saved_line = as->line_num;
+    for (i = 0; i < n; i++) {
+        const StructField *f = &fields[i];
+        as->line_num = f->line;
+        if (struct_define_field(as, f) < 0) result = -1;
+        if (as->pass == 2 && f->size > 0 && f->offset > 127) {
+            asm_warning(as, "field '%s.%s' at offset %u is beyond (ix+d) "
+                        "range%s", as->struct_name, f->name,
+                        (unsigned)f->offset,
+                        f->weight && !as->struct_reorder ?
+                        "; STRUCT ..., REORDER lays out HOT fields first" : "");
+        }
+    }
+    as->line_num = saved_line;
+    
+    if (define_constant(as, as->struct_name, offset) < 0) result = -1;
+    
+    struct_free(as);
+    lexer_next(as);
+    return result;
+}
+
+/* A line between STRUCT and ENDS: [field[:]] DB|DW|DL|DS ... [, HOT [n]] */
+static int struct_line(AsmState *as)
+{
+    StructField *f;
+    Token *peek;
+    char name[MAX_LABEL_LEN];
+    int i;
+    
+    name[0] = '\0';
+    
+    /* A field name without a colon is followed by its directive */
+    if (as->current_token.type == TOK_IDENT &&
+        !is_struct_directive(as->current_token.text)) {
+        peek = lexer_peek(as);
+        if (peek->type == TOK_IDENT) {
+            as->current_token.type = TOK_LABEL;
+        }
+    }
+    if (as->current_token.type == TOK_LABEL) {
+        for (i = 0; i < MAX_LABEL_LEN - 1 && as->current_token.text[i]; i++) {
+            name[i] = as->current_token.text[i];
+        }
+        name[i] = '\0';
+        lexer_next(as);
+    }
+    
+    if (as->current_token.type == TOK_IDENT &&
+        (str_casecmp(as->current_token.text, "ends") == 0 ||
+         str_casecmp(as->current_token.text, ".ends") == 0)) {
+        return struct_end(as);
+    }
+    
+    if (name[0] == '\0' && as->current_token.type != TOK_IDENT) {
+        asm_error(as, "expected field in STRUCT");
+        return -1;
+    }
+    if (as->num_struct_fields >= MAX_STRUCT_FIELDS) {
+        asm_error(as, "too many fields in STRUCT '%s'", as->struct_name);
+        return -1;
+    }
+    
+    f = &as->struct_fields[as->num_struct_fields];
+    strcpy(f->name, name);
+    f->size = 0;
+    f->weight = 0;
+    f->line = as->line_num;
+    
+    if (as->current_token.type == TOK_IDENT) {
+        if (struct_field_size(as, as->current_token.text, &f->size,
+                              &f->weight) < 0) {
+            return -1;
+        }
+    } else if (as->current_token.type != TOK_EOL &&
+               as->current_token.type != TOK_EOF) {
+        asm_error(as, "expected field in STRUCT");
+        return -1;
+    }
+    
+    /* An unnamed field is padding */
+    if (name[0] == '\0') {
+        sprintf(f->name, "_pad%d", as->num_struct_fields);
+    }
+    as->num_struct_fields++;
     return 0;
 }
 
@@ -532,6 +1323,7 @@ int asm_line(AsmState *as, const char *line)
     char mangled[MAX_LABEL_LEN];
     char mnemonic[MAX_LABEL_LEN];
     Token *peek;
+    uint24 start;
     int i;
     int is_local;
     int is_equ_line = 0;
@@ -546,6 +1338,11 @@ int asm_line(AsmState *as, const char *line)
         return 0;
     }
     
+    /* Lines between STRUCT and ENDS declare fields */
+    if (as->in_struct) {
+        return struct_line(as);
+    }
+    
     /* Check for label */
     if (as->current_token.type == TOK_LABEL) {
         for (i = 0; i < MAX_LABEL_LEN - 1 && as->current_token.text[i]; i++) {
@@ -556,8 +1353,7 @@ int asm_line(AsmState *as, const char *line)
         
         /* Check if this is an EQU line - if so, don't define at PC */
         if (as->current_token.type == TOK_IDENT &&
-            (str_casecmp(as->current_token.text, "equ") == 0 ||
-             str_casecmp(as->current_token.text, ".equ") == 0)) {
+            is_label_directive(as->current_token.text)) {
             is_equ_line = 1;
         } else if (as->current_token.type == TOK_EQUALS) {
             is_equ_line = 1;
@@ -569,7 +1365,9 @@ int asm_line(AsmState *as, const char *line)
             if (is_local) {
                 symbol_mangle_local(as, label, mangled, MAX_LABEL_LEN);
                 symbol_define(as, mangled, as->pc);
+                cold_local_label(as);
             } else {
+                cold_label(as, label);
                 symbol_define(as, label, as->pc);
                 as->local_scope++;  /* New scope after global label */
             }
@@ -587,8 +1385,7 @@ int asm_line(AsmState *as, const char *line)
             
             /* Check if this is an EQU line - if so, don't define at PC */
             if (as->current_token.type == TOK_IDENT &&
-                (str_casecmp(as->current_token.text, "equ") == 0 ||
-                 str_casecmp(as->current_token.text, ".equ") == 0)) {
+                is_label_directive(as->current_token.text)) {
                 is_equ_line = 1;
             } else if (as->current_token.type == TOK_EQUALS) {
                 is_equ_line = 1;
@@ -600,7 +1397,9 @@ int asm_line(AsmState *as, const char *line)
                 if (is_local) {
                     symbol_mangle_local(as, label, mangled, MAX_LABEL_LEN);
                     symbol_define(as, mangled, as->pc);
+                    cold_local_label(as);
                 } else {
+                    cold_label(as, label);
                     symbol_define(as, label, as->pc);
                     as->local_scope++;  /* New scope after global label */
                 }
@@ -615,10 +1414,8 @@ int asm_line(AsmState *as, const char *line)
             lexer_next(as);  /* move to = */
             /* Don't consume =, let dir_equ handle it */
         }
-        else if (peek->type == TOK_IDENT &&
-                 (str_casecmp(peek->text, "equ") == 0 ||
-                  str_casecmp(peek->text, ".equ") == 0)) {
-            /* label equ value syntax (no colon) */
+        else if (peek->type == TOK_IDENT && is_label_directive(peek->text)) {
+            /* label equ value / label struct syntax (no colon) */
             for (i = 0; i < MAX_LABEL_LEN - 1 && as->current_token.text[i]; i++) {
                 label[i] = as->current_token.text[i];
             }
@@ -656,13 +1453,42 @@ int asm_line(AsmState *as, const char *line)
         return 0;
     }
     
+    if (str_casecmp(mnemonic, "struct") == 0 ||
+        str_casecmp(mnemonic, ".struct") == 0) {
+        return dir_struct(as, label);
+    }
+    
+    /* Packed data defines symbols from the label (ez80pack.c) */
+    if (str_casecmp(mnemonic, "incbin_packed") == 0 ||
+        str_casecmp(mnemonic, ".incbin_packed") == 0) {
+        return pack_incbin(as, label);
+    }
+    if (str_casecmp(mnemonic, "db_packed") == 0 ||
+        str_casecmp(mnemonic, ".db_packed") == 0) {
+        return pack_db(as, label);
+    }
+    
+    /* The module loader defines label.find (ez80mod.c) */
+    if (str_casecmp(mnemonic, "modloader") == 0 ||
+        str_casecmp(mnemonic, ".modloader") == 0) {
+        return mod_loader(as, label);
+    }
+    
+    /* COLD checks what the hot code ends with (ez80cold.c); BRANCH is
+     * the one directive that emits a single instruction.  An ISR body
+     * must not return by itself (ez80isr.c) */
+    start = as->pc;
     if (instr_execute(as, mnemonic) == 0) {
+        cold_track(as, start, 1);
+        isr_instruction(as, mnemonic);
         return 0;
     }
     
     {
         int errors_before = as->errors;
         if (directive_execute(as, mnemonic) == 0) {
+            cold_track(as, start, str_casecmp(mnemonic, "branch") == 0 ||
+                                  str_casecmp(mnemonic, ".branch") == 0);
             return 0;
         }
         /* Only print "unknown" if directive didn't report its own error */
@@ -683,11 +1509,13 @@ int asm_pass(AsmState *as, FILE *fp)
 {
     char line[MAX_LINE_LEN];
     int len;
+    int n = 0;
     
     as->line_num = 0;
     
     while (fgets(line, sizeof(line), fp)) {
-        as->line_num++;
+        n++;
+        as->line_num = n <= as->num_line_map ? as->line_map[n - 1] : n;
         
         len = strlen(line);
         
@@ -704,8 +1532,20 @@ int asm_pass(AsmState *as, FILE *fp)
         }
         
         asm_line(as, line);
+        if (as->store_failed) {
+            break;
+        }
     }
-
+    
+    if (as->in_struct) {
+        as->line_num = as->struct_line;
+        asm_error(as, "STRUCT '%s' without ENDS", as->struct_name);
+        struct_free(as);
+    }
+    cold_finish(as);
+    asset_finish(as);
+    isr_finish(as);
+    
     return as->errors;
 }
 
@@ -725,20 +1565,52 @@ int asm_file(AsmState *as, const char *filename)
     
     as->filename = filename;
     
-    /* Pass 1 */
-    as->pass = 1;
-    as->pc = 0;
-    as->code_size = 0;
-    as->data_size = 0;
-    as->bss_size = 0;
-    as->num_relocs = 0;
-    as->current_section = SECT_CODE;
-    as->local_scope = 0;
-    as->code_pc = 0;
-    as->data_pc = 0;
-    as->bss_pc = 0;
+    /* Profile-guided layout rewrites the source first */
+    if (as->profile) {
+        FILE *laid = layout_file(as, fp);
+        if (!laid) {
+            fclose(fp);
+            return -1;
+        }
+        if (laid != fp) {
+            fclose(fp);
+            fp = laid;
+        }
+    }
     
-    asm_pass(as, fp);
+    /* Pass 1, repeated while variable-size code grows */
+    as->pass = 1;
+    as->relax_pass = 0;
+    do {
+        rewind(fp);
+        as->relax_pass++;
+        as->relax_index = 0;
+        as->isr_index = 0;
+        as->relax_changed = 0;
+        as->relax_moved = 0;
+        as->pc = 0;
+        as->code_size = 0;
+        as->data_size = 0;
+        as->bss_size = 0;
+        as->num_relocs = 0;
+        as->current_section = SECT_CODE;
+        as->local_scope = 0;
+        as->code_pc = 0;
+        as->data_pc = 0;
+        as->bss_pc = 0;
+        as->asset_pc = 0;
+        as->in_cold = 0;
+        as->cold_used = 0;
+        as->hot_tail = 0;
+        as->hot_label = 0;
+        as->cold_pc = as->cold_base;
+        as->routine[0] = '\0';
+        
+        ttrace_begin(as->trace, "pass 1", filename);
+        asm_pass(as, fp);
+        ttrace_end(as->trace);
+    } while (as->relax_changed && as->errors == 0 &&
+             as->relax_pass < MAX_RELAX_PASSES);
     
     if (as->errors > 0) {
         fclose(fp);
@@ -759,6 +1631,8 @@ int asm_file(AsmState *as, const char *filename)
     /* Pass 2 */
     rewind(fp);
     as->pass = 2;
+    as->relax_index = 0;
+    as->isr_index = 0;
     as->pc = 0;
     as->code_size = 0;
     as->data_size = 0;
@@ -768,8 +1642,19 @@ int asm_file(AsmState *as, const char *filename)
     as->code_pc = 0;
     as->data_pc = 0;
     as->bss_pc = 0;
-    
+    as->asset_pc = 0;
+    as->asset_size = 0;
+    as->in_cold = 0;
+    as->cold_used = 0;
+    as->hot_tail = 0;
+    as->hot_label = 0;
+    as->cold_pc = as->cold_base;
+    as->cold_size = 0;
+    as->routine[0] = '\0';
+    
+    ttrace_begin(as->trace, "pass 2", filename);
     asm_pass(as, fp);
+    ttrace_end(as->trace);
     
     fclose(fp);
     return as->errors;
@@ -794,6 +1679,195 @@ static int copy_file_data(FILE *dest, FILE *src, uint24 nbytes)
     return 0;
 }
 
+/* Index in the object's symbol table, which holds exports only */
+static int export_index(AsmState *as, int symbol)
+{
+    int n = 0;
+    int i;
+    
+    for (i = 0; i < symbol; i++) {
+        if (symbol_at(as, i)->flags == SYM_EXPORT) n++;
+    }
+    return n;
+}
+
+/* Case-folded name hash, as the linker computes it */
+static unsigned long name_hash(const char *name)
+{
+    unsigned long h = OBJ_HASH_INIT;
+    
+    while (*name) {
+        h = OBJ_HASH_STEP(h, tolower((unsigned char)*name++));
+    }
+    return h;
+}
+
+/* Write one name hash */
+static void write_hash(FILE *fp, const char *name)
+{
+    uint8 buf[4];
+    unsigned long h = name_hash(name);
+    
+    WRITE32(buf, h);
+    fwrite(buf, 4, 1, fp);
+}
+
+/* Bytes a symbol covers: as given by SIZE, else up to the next
+ * non-local label above it in its section or the section end */
+static uint24 symbol_extent(AsmState *as, const Symbol *sym)
+{
+    const Symbol *other;
+    uint24 end;
+    int i;
+    
+    if (sym->has_size) return sym->size;
+    switch (sym->section) {
+        case SECT_CODE:
+            end = as->cold_used && !sym->cold ? as->cold_base : as->code_size;
+            break;
+        case SECT_DATA: end = as->data_size; break;
+        case SECT_BSS:  end = as->bss_size; break;
+        default:        return 0;
+    }
+    for (i = 0; i < as->num_symbols; i++) {
+        other = symbol_at(as, i);
+        if (other->defined && other->section == sym->section &&
+            other->cold == sym->cold &&
+            other->value > sym->value && other->value < end &&
+            !other->local) {
+            end = other->value;
+        }
+    }
+    return end > sym->value ? end - sym->value : 0;
+}
+
+/* SYMK_* of a symbol: as given by TYPE, else by its section */
+static uint8 symbol_kind(const Symbol *sym)
+{
+    if (sym->kind != SYMK_NONE) return sym->kind;
+    switch (sym->section) {
+        case SECT_CODE: return SYMK_FUNC;
+        case SECT_DATA:
+        case SECT_BSS:  return SYMK_OBJECT;
+        default:        return SYMK_CONST;
+    }
+}
+
+/* Write the extension chunks that follow the string table */
+static void write_extensions(AsmState *as, FILE *fp, int num_obj_symbols)
+{
+    ObjExtHeader ext;
+    ObjSymInfo info;
+    ObjClobber clob;
+    ClobberSummary *cs;
+    Relocation reloc;
+    uint8 addend[OBJ_ADDEND_SIZE];
+    uint8 cold[OBJ_COLD_SIZE];
+    uint8 fixed[OBJ_FIXED_SIZE];
+    uint8 index[2];
+    char name[MAX_LABEL_LEN];
+    uint24 size;
+    int i, j;
+    
+    /* Name hashes for the linker's symbol tables */
+    if (num_obj_symbols + as->num_externs > 0) {
+        ext.type = OBJ_EXT_NAME_HASHES;
+        WRITE24(ext.size, 4 * (num_obj_symbols + as->num_externs));
+        fwrite(&ext, sizeof(ext), 1, fp);
+        for (i = 0; i < as->num_symbols; i++) {
+            if (symbol_at(as, i)->flags == SYM_EXPORT) {
+                write_hash(fp, symbol_name(as, symbol_at(as, i), name));
+            }
+        }
+        for (i = 0; i < as->num_externs; i++) {
+            write_hash(fp, extern_name(as, i, name));
+        }
+    }
+    
+    /* Addends of a version 5 object, whose relocated fields are zero */
+    if (as->explicit_addends && as->num_relocs > 0) {
+        ext.type = OBJ_EXT_ADDENDS;
+        WRITE24(ext.size, as->num_relocs * OBJ_ADDEND_SIZE);
+        fwrite(&ext, sizeof(ext), 1, fp);
+        rewind(as->reloc_tmp);
+        for (i = 0; i < (int)as->num_relocs; i++) {
+            if (fread(&reloc, sizeof(reloc), 1, as->reloc_tmp) != 1) {
+                memset(&reloc, 0, sizeof(reloc));
+            }
+            WRITE24(addend, (uint24)reloc.addend & 0xFFFFFF);
+            fwrite(addend, OBJ_ADDEND_SIZE, 1, fp);
+        }
+    }
+    
+    /* Where the cold part of the code starts */
+    if (as->cold_used) {
+        ext.type = OBJ_EXT_COLD;
+        WRITE24(ext.size, OBJ_COLD_SIZE);
+        fwrite(&ext, sizeof(ext), 1, fp);
+        WRITE24(cold, as->cold_base);
+        fwrite(cold, OBJ_COLD_SIZE, 1, fp);
+    }
+    
+    /* Spans the linker must not shrink */
+    if (as->num_fixed > 0) {
+        ext.type = OBJ_EXT_FIXED;
+        WRITE24(ext.size, as->num_fixed * OBJ_FIXED_SIZE);
+        fwrite(&ext, sizeof(ext), 1, fp);
+        for (i = 0; i < as->num_fixed; i++) {
+            WRITE24(fixed, as->fixed[2 * i]);
+            WRITE24(&fixed[3], as->fixed[2 * i + 1]);
+            fwrite(fixed, OBJ_FIXED_SIZE, 1, fp);
+        }
+    }
+    
+    if (as->num_assets > 0) {
+        asset_write(as, fp);
+    }
+    
+    /* Symbol sizes and kinds */
+    if (num_obj_symbols > 0) {
+        ext.type = OBJ_EXT_SYMBOL_INFO;
+        WRITE24(ext.size, num_obj_symbols * sizeof(ObjSymInfo));
+        fwrite(&ext, sizeof(ext), 1, fp);
+        for (i = 0; i < as->num_symbols; i++) {
+            if (symbol_at(as, i)->flags != SYM_EXPORT) continue;
+            WRITE24(info.size, symbol_extent(as, symbol_at(as, i)));
+            info.kind = symbol_kind(symbol_at(as, i));
+            fwrite(&info, sizeof(info), 1, fp);
+        }
+    }
+    
+    if (as->num_clobbers > 0) {
+        size = 0;
+        for (i = 0; i < as->num_clobbers; i++) {
+            size += sizeof(ObjClobber) + 2 * as->clobbers[i].num_calls;
+        }
+        ext.type = OBJ_EXT_CLOBBERS;
+        WRITE24(ext.size, size);
+        fwrite(&ext, sizeof(ext), 1, fp);
+        
+        for (i = 0; i < as->num_clobbers; i++) {
+            cs = &as->clobbers[i];
+            memset(&clob, 0, sizeof(clob));
+            WRITE24(clob.symbol, export_index(as, cs->symbol));
+            clob.writes[0] = cs->writes & 0xFF;
+            clob.writes[1] = (cs->writes >> 8) & 0xFF;
+            clob.num_calls[0] = cs->num_calls & 0xFF;
+            clob.num_calls[1] = (cs->num_calls >> 8) & 0xFF;
+            fwrite(&clob, sizeof(clob), 1, fp);
+            for (j = 0; j < cs->num_calls; j++) {
+                index[0] = cs->calls[j] & 0xFF;
+                index[1] = (cs->calls[j] >> 8) & 0xFF;
+                fwrite(index, 2, 1, fp);
+            }
+        }
+    }
+    
+    memset(&ext, 0, sizeof(ext));
+    ext.type = OBJ_EXT_END;
+    fwrite(&ext, sizeof(ext), 1, fp);
+}
+
 int asm_output(AsmState *as, const char *filename)
 {
     FILE *fp;
@@ -804,9 +1878,12 @@ int asm_output(AsmState *as, const char *filename)
     ObjExtern obj_ext;
     Relocation reloc;
     int num_obj_symbols;
+    int has_ext;
+    int addends;
     int i;
     uint24 strtab_size;
     uint24 name_off;
+    char name[MAX_LABEL_LEN];
     const char *p;
     
     fp = fopen(filename, "wb");
@@ -825,10 +1902,12 @@ int asm_output(AsmState *as, const char *filename)
     
     strtab_size = 0;
     
+    ttrace_begin(as->trace, "output", filename);
+    
     /* Count exported symbols only */
     num_obj_symbols = 0;
     for (i = 0; i < as->num_symbols; i++) {
-        if (as->symbols[i].flags == SYM_EXPORT) {
+        if (symbol_at(as, i)->flags == SYM_EXPORT) {
             num_obj_symbols++;
         }
     }
@@ -849,14 +1928,14 @@ int asm_output(AsmState *as, const char *filename)
     
     /* Write symbol table - exported symbols only */
     for (i = 0; i < as->num_symbols; i++) {
-        Symbol *sym = &as->symbols[i];
+        Symbol *sym = symbol_at(as, i);
         if (sym->flags != SYM_EXPORT) continue;
         
         memset(&obj_sym, 0, sizeof(obj_sym));
         
         /* Add name to string table */
         name_off = strtab_size;
-        for (p = sym->name; *p; p++) {
+        for (p = symbol_name(as, sym, name); *p; p++) {
             fputc(*p, strtab_tmp);
             strtab_size++;
         }
@@ -898,7 +1977,7 @@ int asm_output(AsmState *as, const char *filename)
         
         /* Add name to string table */
         name_off = strtab_size;
-        for (p = as->externs[i]; *p; p++) {
+        for (p = extern_name(as, i, name); *p; p++) {
             fputc(*p, strtab_tmp);
             strtab_size++;
         }
@@ -917,14 +1996,24 @@ int asm_output(AsmState *as, const char *filename)
     
     fclose(strtab_tmp);
     
+    /* Extensions make it a version 4 object */
+    addends = as->explicit_addends && as->num_relocs > 0;
+    has_ext = as->num_clobbers > 0 || num_obj_symbols + as->num_externs > 0 ||
+              addends || as->cold_used || as->num_assets > 0 ||
+              as->num_fixed > 0;
+    if (has_ext) {
+        write_extensions(as, fp, num_obj_symbols);
+    }
+    
     /* Write final header */
     memset(&header, 0, sizeof(header));
     header.magic[0] = OBJ_MAGIC_0;
     header.magic[1] = OBJ_MAGIC_1;
     header.magic[2] = OBJ_MAGIC_2;
     header.magic[3] = OBJ_MAGIC_3;
-    header.version = OBJ_VERSION;
-    header.flags = 0;
+    header.version = addends ? OBJ_VERSION_ADDENDS
+                   : has_ext ? OBJ_VERSION_EXT : OBJ_VERSION;
+    header.flags = has_ext ? OBJ_FLAG_EXT : 0;
     WRITE24(header.code_size, as->code_size);
     WRITE24(header.data_size, as->data_size);
     WRITE24(header.bss_size, as->bss_size);
@@ -938,14 +2027,27 @@ int asm_output(AsmState *as, const char *filename)
     
     fclose(fp);
     
+    ttrace_end(as->trace);
+    
     if (as->verbose) {
         printf("Output: %s\n", filename);
         printf("  Code: %u bytes\n", (unsigned)as->code_size);
+        if (as->cold_used) {
+            printf("  Cold code: %u bytes\n", (unsigned)as->cold_size);
+        }
         printf("  Data: %u bytes\n", (unsigned)as->data_size);
         printf("  BSS:  %u bytes\n", (unsigned)as->bss_size);
+        if (as->num_assets > 0) {
+            printf("  Assets: %d, %u bytes\n", as->num_assets,
+                   (unsigned)as->asset_size);
+        }
         printf("  Symbols: %d\n", num_obj_symbols);
         printf("  Relocations: %d\n", (int)as->num_relocs);
         printf("  Externals: %d\n", as->num_externs);
+        if (as->num_clobbers > 0) {
+            printf("  Clobber summaries: %d\n", as->num_clobbers);
+        }
+        store_report(as);
     }
     
     return 0;
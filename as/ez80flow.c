@@ -0,0 +1,2071 @@
+/*
+ * eZ80 ADL Mode Assembler - Code Analysis
+ *
+ * Analyses that follow control flow through the assembled code
+ * section.  Instruction start offsets are recorded during pass 2;
+ * after pass 2 the code bytes are read back from the temp file,
+ * decoded and linked into a flow graph using the relocations to
+ * resolve branch and call targets within this file.
+ *
+ * DI regions: from every DI, find the longest path (in cycles) that
+ * runs with interrupts disabled, i.e. until an EI (plus the one
+ * instruction it delays by) or a RETI/RETN.  Calls to routines in
+ * this file are followed; calls through externs, RST and indirect
+ * jumps cannot be costed and are reported as such.  Loops are costed
+ * with the bounds found for --wcet.
+ *
+ * Performance lints (-Wperf): pattern checks over the decoded code
+ * for forms with a shorter or faster equivalent, each reported with
+ * an estimate of the bytes and cycles it would save.
+ *
+ * Clobber summaries (--clobbers): for every exported routine, the
+ * registers any path through it may change before it returns,
+ * following jumps and calls within this file.  Calls to externs are
+ * listed so the linker can add their summaries in turn.
+ *
+ * Worst-case execution time (--wcet): for every routine, the longest
+ * path in cycles from its label to a return.  Loops need a bound,
+ * from a LOOPBOUND inside the loop or an "ld b,n" ahead of a DJNZ
+ * loop; callees in this file are costed in turn.  Wait states are
+ * added per code fetch and per data access.
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+#include "ez80dec.h"
+
+#define COST_NONE       (-1L)   /* No path of this kind */
+#define COST_LIMIT      0x3FFFFFFFL     /* Costs stop growing here */
+
+#define FILE_MAX        128     /* Longest file name quoted in a message */
+#define WHY_MAX         (FILE_MAX + 120)    /* Room for describe_why */
+
+/* Path flags */
+#define PATH_LOOP       0x01    /* Passes round a loop with no bound */
+#define PATH_UNKNOWN    0x02    /* Passes through code that cannot be costed */
+#define PATH_RETURNS    0x04    /* Returns to the caller still disabled */
+
+/* Reasons for PATH_UNKNOWN / PATH_LOOP, for the report */
+#define WHY_NONE        0
+#define WHY_LOOP        1       /* Loop back to the node */
+#define WHY_EXTERN      2       /* Call or jump to an external symbol */
+#define WHY_TARGET      3       /* Call or jump to an address not in this code */
+#define WHY_INDIRECT    4       /* JP (HL) etc. */
+#define WHY_RST         5       /* RST vector */
+#define WHY_DATA        6       /* Falls off the end of the code */
+#define WHY_HALT        7       /* HALT / SLP with interrupts disabled */
+#define WHY_REPEAT      8       /* Block instruction with no bound */
+#define WHY_RECURSE     9       /* Call back into a routine being costed */
+
+#define VISIT_NEW       0
+#define VISIT_ACTIVE    1
+#define VISIT_DONE      2
+
+typedef struct {
+    Ez80Insn d;
+    uint24 offset;
+    int loc;                /* Index into as->insns */
+    int next;               /* Node that follows in memory, or -1 */
+    int target;             /* Branch/call target node, or -1 */
+    int ext;                /* Extern index of the target, or -1 */
+} FlowNode;
+
+/* Worst-case costs from the start of a node with interrupts disabled */
+typedef struct {
+    long to_ei;             /* Cycles until interrupts are enabled */
+    long to_ret;            /* Cycles until it returns to its caller */
+    int exit;               /* EI/RETI node ending the worst to_ei path */
+    int flags;              /* PATH_* */
+    int why;                /* WHY_* for the first flag found */
+    int why_node;
+} DiCost;
+
+/* Worst case of a routine, from its entry node */
+typedef struct {
+    long cycles;            /* Longest path to a return, or COST_NONE */
+    int flags;              /* PATH_LOOP / PATH_UNKNOWN */
+    int why;                /* WHY_* for the first flag found */
+    int why_node;
+    char *path;             /* Critical path, for the report */
+} WcetCost;
+
+typedef struct {
+    AsmState *as;
+    uint8 *code;
+    FlowNode *nodes;
+    int num_nodes;
+    int *node_at;           /* Code offset -> node, -1 if not a start */
+    Relocation *relocs;     /* Code section relocations, by offset */
+    int num_relocs;
+    DiCost *di;
+    uint8 *state;
+    uint8 *entry;           /* Node has a label or is a branch target */
+    WcetCost *wcet;         /* By routine entry node */
+    uint8 *wcet_state;      /* VISIT_* by routine entry node */
+    uint8 *wcet_mark;       /* WCET_* by node */
+    int *local;             /* Node -> index in the routine being costed */
+    long *loop_extra;       /* Bounded loop head -> cycles for all but
+                               the last round trip; -1 elsewhere */
+    int *routines;          /* Routine entry node and symbol, in pairs */
+    int num_routines;
+} FlowGraph;
+
+/* Region found by the DI analysis */
+typedef struct {
+    int node;               /* The DI */
+    long cycles;
+    int flags;
+    int exit;
+    int why;
+    int why_node;
+} DiRegion;
+
+/* ============================================================
+ * Instruction Recording (pass 2)
+ * ============================================================ */
+
+/* Index of the current source file in insn_files, adding it if new */
+static int flow_file_index(AsmState *as)
+{
+    char **files;
+    int i;
+
+    i = as->num_insn_files - 1;
+    if (i >= 0 && strcmp(as->insn_files[i], as->filename) == 0) {
+        return i;
+    }
+    for (i = 0; i < as->num_insn_files; i++) {
+        if (strcmp(as->insn_files[i], as->filename) == 0) return i;
+    }
+
+    files = (char **)realloc(as->insn_files,
+                             (as->num_insn_files + 1) * sizeof(char *));
+    if (!files) return -1;
+    as->insn_files = files;
+    files[as->num_insn_files] = (char *)malloc(strlen(as->filename) + 1);
+    if (!files[as->num_insn_files]) return -1;
+    strcpy(files[as->num_insn_files], as->filename);
+    return as->num_insn_files++;
+}
+
+int flow_record_insn(AsmState *as)
+{
+    InsnLoc *loc;
+    int file;
+
+    if (as->num_insns >= as->max_insns) {
+        int new_max = as->max_insns ? as->max_insns * 2 : 1024;
+        loc = (InsnLoc *)realloc(as->insns, new_max * sizeof(InsnLoc));
+        if (!loc) {
+            asm_error(as, "out of memory for code analysis");
+            return -1;
+        }
+        as->insns = loc;
+        as->max_insns = new_max;
+    }
+
+    file = flow_file_index(as);
+    if (file < 0) {
+        asm_error(as, "out of memory for code analysis");
+        return -1;
+    }
+
+    loc = &as->insns[as->num_insns++];
+    loc->offset = as->code_size;
+    if (as->in_cold) {
+        loc->offset += as->cold_base;   /* Placed after the hot code */
+    }
+    loc->line = as->line_num;
+    loc->file = file;
+    loc->bound = as->loop_bound;
+    as->loop_bound = 0;
+    return 0;
+}
+
+void flow_free(AsmState *as)
+{
+    int i;
+
+    for (i = 0; i < as->num_insn_files; i++) {
+        free(as->insn_files[i]);
+    }
+    if (as->insn_files) free(as->insn_files);
+    if (as->insns) free(as->insns);
+    for (i = 0; i < as->num_clobbers; i++) {
+        if (as->clobbers[i].calls) free(as->clobbers[i].calls);
+    }
+    if (as->clobbers) free(as->clobbers);
+    as->clobbers = NULL;
+    as->num_clobbers = 0;
+    as->insn_files = NULL;
+    as->insns = NULL;
+    as->num_insn_files = 0;
+    as->num_insns = 0;
+    as->max_insns = 0;
+}
+
+/* ============================================================
+ * Flow Graph
+ * ============================================================ */
+
+static void graph_free(FlowGraph *g)
+{
+    int k;
+
+    if (g->code) free(g->code);
+    if (g->nodes) free(g->nodes);
+    if (g->node_at) free(g->node_at);
+    if (g->relocs) free(g->relocs);
+    if (g->di) free(g->di);
+    if (g->state) free(g->state);
+    if (g->entry) free(g->entry);
+    if (g->wcet) {
+        for (k = 0; k < g->num_nodes; k++) {
+            if (g->wcet[k].path) free(g->wcet[k].path);
+        }
+        free(g->wcet);
+    }
+    if (g->wcet_state) free(g->wcet_state);
+    if (g->wcet_mark) free(g->wcet_mark);
+    if (g->local) free(g->local);
+    if (g->loop_extra) free(g->loop_extra);
+    if (g->routines) free(g->routines);
+    memset(g, 0, sizeof(*g));
+}
+
+/* Relocation applied at a code offset, or NULL */
+static Relocation *graph_reloc_at(FlowGraph *g, uint24 offset)
+{
+    int lo = 0;
+    int hi = g->num_relocs - 1;
+    int mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (g->relocs[mid].offset == offset) return &g->relocs[mid];
+        if (g->relocs[mid].offset < offset) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+static int graph_node_at(FlowGraph *g, long offset)
+{
+    if (offset < 0 || offset >= (long)g->as->code_size) return -1;
+    return g->node_at[offset];
+}
+
+/* Resolve the successors of a node */
+static void graph_link(FlowGraph *g, FlowNode *n)
+{
+    Relocation *r;
+    int flow = n->d.flow;
+
+    n->next = graph_node_at(g, (long)n->offset + n->d.len);
+    if (g->as->cold_used && n->offset < g->as->cold_base &&
+        n->offset + n->d.len >= g->as->cold_base) {
+        n->next = -1;               /* The hot code ends; cold follows */
+    }
+    n->target = -1;
+    n->ext = -1;
+
+    if (flow != FLOW_JUMP && flow != FLOW_BRANCH &&
+        flow != FLOW_CALL && flow != FLOW_CALLCC) {
+        return;
+    }
+
+    if (n->d.attr & INSN_REL) {
+        n->target = graph_node_at(g, (long)n->offset + n->d.len + n->d.disp);
+        return;
+    }
+
+    r = graph_reloc_at(g, n->offset + n->d.imm_pos);
+    if (!r) return;                 /* Absolute address */
+    if (r->target_sect == 0) {
+        n->ext = (int)r->ext_index;
+    } else if (r->target_sect == SECT_CODE) {
+        n->target = graph_node_at(g, (long)n->d.imm);
+    }
+}
+
+/* Read back the code and relocations and decode every instruction */
+static int graph_build(AsmState *as, FlowGraph *g)
+{
+    Relocation r;
+    uint24 i;
+    int k;
+
+    memset(g, 0, sizeof(*g));
+    g->as = as;
+
+    g->code = (uint8 *)malloc(as->code_size + 1);
+    g->node_at = (int *)malloc((as->code_size + 1) * sizeof(int));
+    g->nodes = (FlowNode *)malloc((as->num_insns + 1) * sizeof(FlowNode));
+    g->relocs = (Relocation *)malloc((as->num_relocs + 1) * sizeof(Relocation));
+    if (!g->code || !g->node_at || !g->nodes || !g->relocs) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        graph_free(g);
+        return -1;
+    }
+
+    fflush(as->code_tmp);
+    rewind(as->code_tmp);
+    if (fread(g->code, 1, as->code_size, as->code_tmp) != as->code_size) {
+        fprintf(stderr, "error: cannot read back code for analysis\n");
+        graph_free(g);
+        return -1;
+    }
+
+    /* Code relocations are written in offset order */
+    fflush(as->reloc_tmp);
+    rewind(as->reloc_tmp);
+    for (i = 0; i < as->num_relocs; i++) {
+        if (fread(&r, sizeof(r), 1, as->reloc_tmp) != 1) break;
+        if (r.section != SECT_CODE) continue;
+        g->relocs[g->num_relocs++] = r;
+
+        /* Put explicit addends back, so operands decode as written */
+        if (as->explicit_addends && r.offset + 3 <= as->code_size) {
+            g->code[r.offset] = (uint8)(r.addend & 0xFF);
+            g->code[r.offset + 1] = (uint8)((r.addend >> 8) & 0xFF);
+            g->code[r.offset + 2] = (uint8)((r.addend >> 16) & 0xFF);
+        }
+    }
+
+    for (i = 0; i < as->code_size; i++) {
+        g->node_at[i] = -1;
+    }
+
+    for (k = 0; k < as->num_insns; k++) {
+        FlowNode *n = &g->nodes[g->num_nodes];
+        uint24 off = as->insns[k].offset;
+        uint24 end;
+
+        /* Lines that emitted nothing record the same offset twice */
+        if (off >= as->code_size || g->node_at[off] >= 0) continue;
+        end = (k + 1 < as->num_insns) ? as->insns[k + 1].offset
+                                      : as->code_size;
+        if (end > as->code_size) end = as->code_size;
+
+        if (ez80_decode(g->code + off, (int)(end - off), &n->d) == 0) {
+            continue;
+        }
+        n->offset = off;
+        n->loc = k;
+        g->node_at[off] = g->num_nodes++;
+    }
+
+    for (k = 0; k < g->num_nodes; k++) {
+        graph_link(g, &g->nodes[k]);
+    }
+    return 0;
+}
+
+static const char *node_file(FlowGraph *g, int node)
+{
+    return g->as->insn_files[g->as->insns[g->nodes[node].loc].file];
+}
+
+static int node_line(FlowGraph *g, int node)
+{
+    return g->as->insns[g->nodes[node].loc].line;
+}
+
+/* "file:line" of a node into buf (FILE_MAX + 16 bytes); a longer
+ * file name keeps its end */
+static void node_where(FlowGraph *g, int node, char *buf)
+{
+    const char *file = node_file(g, node);
+    size_t len = strlen(file);
+
+    if (len > FILE_MAX) {
+        sprintf(buf, "...%s:%d", file + len - (FILE_MAX - 3),
+                node_line(g, node));
+    } else {
+        sprintf(buf, "%s:%d", file, node_line(g, node));
+    }
+}
+
+/* Sums and products of costs, held at COST_LIMIT */
+static long cost_add(long a, long b)
+{
+    return a > COST_LIMIT - b ? COST_LIMIT : a + b;
+}
+
+static long cost_mul(long n, long a)
+{
+    return a != 0 && n > COST_LIMIT / a ? COST_LIMIT : n * a;
+}
+
+/* Cycles for node i, with wait states for each code byte fetched and
+ * each data access.  A block instruction with a LOOPBOUND is costed
+ * for that many repeats. */
+static long node_cycles(FlowGraph *g, int i, int taken)
+{
+    const Ez80Insn *d = &g->nodes[i].d;
+    AsmState *as = g->as;
+    long cycles = taken ? d->cycles_taken : d->cycles;
+    long accesses = taken ? d->accesses_taken : d->accesses;
+    long bound = as->insns[g->nodes[i].loc].bound;
+
+    cycles += (long)d->len * as->wait_code +
+              (accesses - d->len) * as->wait_data;
+    if ((d->attr & INSN_REPEAT) && bound > 0) {
+        cycles = cost_mul(bound, cycles);
+    }
+    return cycles;
+}
+
+/* Name of the routine containing a code offset, into buf
+ * (MAX_LABEL_LEN bytes): the nearest code label at or before it that
+ * is not a local label */
+static const char *routine_name(AsmState *as, uint24 offset, char *buf)
+{
+    const Symbol *best = NULL;
+    int i;
+
+    for (i = 0; i < as->num_symbols; i++) {
+        const Symbol *s = symbol_at(as, i);
+        if (!s->defined || s->section != SECT_CODE) continue;
+        if (s->flags == SYM_EXTERN || s->local) continue;
+        if (s->value > offset) continue;
+        if (!best || s->value > best->value) best = s;
+    }
+    return best ? symbol_name(as, best, buf) : "?";
+}
+
+/* ============================================================
+ * DI Regions
+ * ============================================================ */
+
+static void di_visit(FlowGraph *g, int i);
+
+static void di_note(DiCost *c, int flag, int why, int node)
+{
+    if (c->why == WHY_NONE) {
+        c->why = why;
+        c->why_node = node;
+    }
+    c->flags |= flag;
+}
+
+/* The path ends at node i for a reason that cannot be costed further */
+static void di_stop(DiCost *c, long cost, int flag, int why, int node)
+{
+    if (cost > c->to_ei) c->to_ei = cost;
+    di_note(c, flag, why, node);
+}
+
+/* Continue the path from node i into successor s after cost cycles */
+static void di_follow(FlowGraph *g, DiCost *c, int i, long cost, int s)
+{
+    DiCost *sc;
+
+    if (s < 0) {
+        di_stop(c, cost, PATH_UNKNOWN, WHY_DATA, i);
+        return;
+    }
+    if (g->state[s] == VISIT_ACTIVE) {
+        /* Round trips of a bounded loop are charged at its head */
+        if (g->loop_extra && g->loop_extra[s] >= 0) return;
+        di_stop(c, cost, PATH_LOOP, WHY_LOOP, s);
+        return;
+    }
+    di_visit(g, s);
+    sc = &g->di[s];
+
+    if (sc->to_ei != COST_NONE && cost_add(cost, sc->to_ei) > c->to_ei) {
+        c->to_ei = cost_add(cost, sc->to_ei);
+        c->exit = sc->exit;
+    }
+    if (sc->to_ret != COST_NONE && cost_add(cost, sc->to_ret) > c->to_ret) {
+        c->to_ret = cost_add(cost, sc->to_ret);
+    }
+    if (sc->flags) di_note(c, sc->flags, sc->why, sc->why_node);
+}
+
+/* A call from node i: the callee either enables interrupts itself or
+ * returns, after which the path carries on at the next instruction */
+static void di_call(FlowGraph *g, DiCost *c, int i, long cost)
+{
+    FlowNode *n = &g->nodes[i];
+    DiCost *tc;
+
+    if (n->d.flow == FLOW_RST) {
+        di_note(c, PATH_UNKNOWN, WHY_RST, i);
+        di_follow(g, c, i, cost, n->next);
+        return;
+    }
+    if (n->target < 0) {
+        di_note(c, PATH_UNKNOWN, n->ext >= 0 ? WHY_EXTERN : WHY_TARGET, i);
+        di_follow(g, c, i, cost, n->next);
+        return;
+    }
+    if (g->state[n->target] == VISIT_ACTIVE) {
+        di_stop(c, cost, PATH_LOOP, WHY_RECURSE, i);
+        return;
+    }
+
+    di_visit(g, n->target);
+    tc = &g->di[n->target];
+    if (tc->to_ei != COST_NONE && cost_add(cost, tc->to_ei) > c->to_ei) {
+        c->to_ei = cost_add(cost, tc->to_ei);
+        c->exit = tc->exit;
+    }
+    if (tc->flags & ~PATH_RETURNS) {
+        di_note(c, tc->flags & ~PATH_RETURNS, tc->why, tc->why_node);
+    }
+    if (tc->to_ret != COST_NONE) {
+        di_follow(g, c, i, cost_add(cost, tc->to_ret), n->next);
+    }
+}
+
+static void di_visit(FlowGraph *g, int i)
+{
+    FlowNode *n = &g->nodes[i];
+    DiCost *c = &g->di[i];
+    long next_cycles;
+
+    if (g->state[i] != VISIT_NEW) return;
+    g->state[i] = VISIT_ACTIVE;
+
+    c->to_ei = COST_NONE;
+    c->to_ret = COST_NONE;
+    c->exit = -1;
+    c->flags = 0;
+    c->why = WHY_NONE;
+    c->why_node = -1;
+
+    if ((n->d.attr & INSN_REPEAT) &&
+        g->as->insns[n->loc].bound <= 0) {
+        di_note(c, PATH_LOOP, WHY_REPEAT, i);
+    }
+
+    if (n->d.attr & INSN_EI) {
+        /* Interrupts are enabled after the following instruction */
+        next_cycles = 0;
+        if (n->next >= 0) {
+            next_cycles = node_cycles(g, n->next, 1);
+            if (node_cycles(g, n->next, 0) > next_cycles) {
+                next_cycles = node_cycles(g, n->next, 0);
+            }
+        }
+        c->to_ei = cost_add(node_cycles(g, i, 0), next_cycles);
+        c->exit = i;
+    } else if (n->d.attr & INSN_HALT) {
+        di_stop(c, node_cycles(g, i, 0), PATH_LOOP, WHY_HALT, i);
+    } else {
+        switch (n->d.flow) {
+        case FLOW_NEXT:
+            di_follow(g, c, i, node_cycles(g, i, 0), n->next);
+            break;
+        case FLOW_JUMP:
+            if (n->target < 0) {
+                di_stop(c, node_cycles(g, i, 1), PATH_UNKNOWN,
+                        n->ext >= 0 ? WHY_EXTERN : WHY_TARGET, i);
+            } else {
+                di_follow(g, c, i, node_cycles(g, i, 1), n->target);
+            }
+            break;
+        case FLOW_BRANCH:
+            if (n->target < 0) {
+                di_stop(c, node_cycles(g, i, 1), PATH_UNKNOWN,
+                        n->ext >= 0 ? WHY_EXTERN : WHY_TARGET, i);
+            } else {
+                di_follow(g, c, i, node_cycles(g, i, 1), n->target);
+            }
+            di_follow(g, c, i, node_cycles(g, i, 0), n->next);
+            break;
+        case FLOW_CALL:
+        case FLOW_RST:
+            di_call(g, c, i, node_cycles(g, i, 1));
+            break;
+        case FLOW_CALLCC:
+            di_call(g, c, i, node_cycles(g, i, 1));
+            di_follow(g, c, i, node_cycles(g, i, 0), n->next);
+            break;
+        case FLOW_RET:
+            c->to_ret = node_cycles(g, i, 1);
+            c->flags |= PATH_RETURNS;
+            break;
+        case FLOW_RETCC:
+            c->to_ret = node_cycles(g, i, 1);
+            c->flags |= PATH_RETURNS;
+            di_follow(g, c, i, node_cycles(g, i, 0), n->next);
+            break;
+        case FLOW_RETI:
+            c->to_ei = node_cycles(g, i, 1);
+            c->exit = i;
+            break;
+        case FLOW_INDIRECT:
+            di_stop(c, node_cycles(g, i, 0), PATH_UNKNOWN, WHY_INDIRECT, i);
+            break;
+        }
+    }
+
+    /* Entering a bounded loop: all but the last round trip */
+    if (g->loop_extra && g->loop_extra[i] > 0) {
+        if (c->to_ei != COST_NONE) {
+            c->to_ei = cost_add(c->to_ei, g->loop_extra[i]);
+        }
+        if (c->to_ret != COST_NONE) {
+            c->to_ret = cost_add(c->to_ret, g->loop_extra[i]);
+        }
+    }
+
+    g->state[i] = VISIT_DONE;
+}
+
+static int di_region_cmp(const void *a, const void *b)
+{
+    const DiRegion *ra = (const DiRegion *)a;
+    const DiRegion *rb = (const DiRegion *)b;
+    int la = (ra->flags & PATH_LOOP) != 0;
+    int lb = (rb->flags & PATH_LOOP) != 0;
+
+    if (la != lb) return lb - la;
+    if (ra->cycles != rb->cycles) return ra->cycles < rb->cycles ? 1 : -1;
+    return ra->node - rb->node;
+}
+
+/* Describe why a path cannot be costed exactly, e.g. "rst at
+ * main.asm:12", in at most size bytes */
+static void describe_why(FlowGraph *g, int why, int node, char *buf,
+                         size_t size)
+{
+    AsmState *as = g->as;
+    char where[FILE_MAX + 16];
+    char text[WHY_MAX];
+    char name[MAX_LABEL_LEN];
+
+    node_where(g, node, where);
+    switch (why) {
+    case WHY_LOOP:
+        sprintf(text, "loop at %s has no bound", where);
+        break;
+    case WHY_HALT:
+        sprintf(text, "halts at %s", where);
+        break;
+    case WHY_EXTERN:
+        sprintf(text, "calls external '%.64s' at %s",
+                extern_name(as, g->nodes[node].ext, name), where);
+        break;
+    case WHY_INDIRECT:
+        sprintf(text, "indirect jump at %s", where);
+        break;
+    case WHY_RST:
+        sprintf(text, "rst at %s", where);
+        break;
+    case WHY_DATA:
+        sprintf(text, "runs off the code at %s", where);
+        break;
+    case WHY_REPEAT:
+        sprintf(text, "block instruction at %s has no bound", where);
+        break;
+    case WHY_RECURSE:
+        sprintf(text, "recursive call at %s", where);
+        break;
+    default:
+        sprintf(text, "unresolved target at %s", where);
+        break;
+    }
+    strncpy(buf, text, size - 1);
+    buf[size - 1] = '\0';
+}
+
+/* Describe how a region ends, e.g. "(until ei at main.asm:20)" */
+static void di_describe(FlowGraph *g, const DiRegion *r, char *buf,
+                        size_t size)
+{
+    char where[FILE_MAX + 16];
+    char text[WHY_MAX];
+
+    if (r->flags & PATH_LOOP) {
+        describe_why(g, r->why == WHY_HALT || r->why == WHY_REPEAT ||
+                     r->why == WHY_RECURSE ? r->why : WHY_LOOP,
+                     r->why_node, buf, size);
+        return;
+    }
+    if (r->flags & PATH_UNKNOWN) {
+        describe_why(g, r->why, r->why_node, buf, size);
+        return;
+    }
+
+    if (r->flags & PATH_RETURNS) {
+        strcpy(text, "returns with interrupts disabled");
+    } else if (r->exit >= 0) {
+        node_where(g, r->exit, where);
+        sprintf(text, "until %s at %s",
+                g->nodes[r->exit].d.flow == FLOW_RETI ? "reti" : "ei", where);
+    } else {
+        strcpy(text, "never re-enabled");
+    }
+    strncpy(buf, text, size - 1);
+    buf[size - 1] = '\0';
+}
+
+static int di_analyse(AsmState *as, FlowGraph *g)
+{
+    DiRegion *regions;
+    int num_regions = 0;
+    int failed = 0;
+    char why[WHY_MAX];
+    char name[MAX_LABEL_LEN];
+    int k;
+
+    g->di = (DiCost *)malloc((g->num_nodes + 1) * sizeof(DiCost));
+    g->state = (uint8 *)calloc(g->num_nodes + 1, 1);
+    regions = (DiRegion *)malloc((g->num_nodes + 1) * sizeof(DiRegion));
+    if (!g->di || !g->state || !regions) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        if (regions) free(regions);
+        return -1;
+    }
+
+    for (k = 0; k < g->num_nodes; k++) {
+        FlowNode *n = &g->nodes[k];
+        DiRegion *r;
+        DiCost *c;
+
+        if (!(n->d.attr & INSN_DI)) continue;
+        di_visit(g, k);
+        c = &g->di[k];
+
+        /* Interrupts are off from the end of the DI itself */
+        r = &regions[num_regions++];
+        r->node = k;
+        r->flags = c->flags;
+        r->exit = c->exit;
+        r->why = c->why;
+        r->why_node = c->why_node;
+        r->cycles = c->to_ei;
+        if (c->to_ret > r->cycles) r->cycles = c->to_ret;
+        else r->flags &= ~PATH_RETURNS;
+        r->cycles -= node_cycles(g, k, 0);
+        if (r->cycles < 0) r->cycles = 0;
+    }
+
+    qsort(regions, num_regions, sizeof(DiRegion), di_region_cmp);
+
+    for (k = 0; k < num_regions; k++) {
+        DiRegion *r = &regions[k];
+        int inexact = (r->flags & (PATH_LOOP | PATH_UNKNOWN | PATH_RETURNS)) != 0;
+        int over = as->di_budget >= 0 &&
+                   ((r->flags & PATH_LOOP) || r->cycles > as->di_budget);
+
+        if (!over && !as->di_report) continue;
+
+        di_describe(g, r, why, sizeof(why));
+        fprintf(over ? stderr : stdout,
+                "%s:%d: %s: interrupts disabled for %s%ld cycles in '%s' (%s)",
+                node_file(g, r->node), node_line(g, r->node),
+                over ? "error" : "note", inexact ? "at least " : "",
+                r->cycles, routine_name(as, g->nodes[r->node].offset, name), why);
+        if (over) {
+            fprintf(stderr, ", over budget of %ld\n", as->di_budget);
+            as->errors++;
+            failed = 1;
+        } else {
+            fprintf(stdout, "\n");
+        }
+    }
+
+    if (as->di_report && num_regions == 0) {
+        printf("%s: no di regions\n", as->filename);
+    }
+
+    free(regions);
+    return failed ? -1 : 0;
+}
+
+/* ============================================================
+ * Performance Lints (-Wperf)
+ * ============================================================ */
+
+static const struct {
+    const char *name;
+    unsigned rule;
+} perf_rules[] = {
+    { "jp-jr",      PERF_JP_JR },
+    { "tail-call",  PERF_TAIL_CALL },
+    { "ld-zero",    PERF_LD_ZERO },
+    { "ix-loop",    PERF_IX_LOOP },
+    { "table-page", PERF_TABLE_PAGE },
+    { "push-pop",   PERF_PUSH_POP },
+    { NULL, 0 }
+};
+
+unsigned flow_perf_rule(const char *name)
+{
+    int i;
+
+    for (i = 0; perf_rules[i].name; i++) {
+        if (strcmp(perf_rules[i].name, name) == 0) return perf_rules[i].rule;
+    }
+    return 0;
+}
+
+static const char *perf_rule_name(unsigned rule)
+{
+    int i;
+
+    for (i = 0; perf_rules[i].name; i++) {
+        if (perf_rules[i].rule == rule) return perf_rules[i].name;
+    }
+    return "?";
+}
+
+/* Print a lint with its estimated saving */
+static void perf_warn(FlowGraph *g, int node, unsigned rule, int bytes,
+                      int cycles, const char *per, const char *msg)
+{
+    fprintf(stderr, "%s:%d: warning: %s (saves %d byte%s, %d cycle%s%s) "
+            "[-Wperf-%s]\n", node_file(g, node), node_line(g, node), msg,
+            bytes, bytes == 1 ? "" : "s", cycles, cycles == 1 ? "" : "s",
+            per, perf_rule_name(rule));
+    g->as->warnings++;
+}
+
+/* Mark nodes that can be entered other than by falling into them:
+ * labelled instructions and branch targets */
+static int perf_mark_entries(FlowGraph *g)
+{
+    AsmState *as = g->as;
+    int i, n;
+
+    g->entry = (uint8 *)calloc(g->num_nodes + 1, 1);
+    if (!g->entry) return -1;
+
+    for (i = 0; i < as->num_symbols; i++) {
+        const Symbol *s = symbol_at(as, i);
+        if (!s->defined || s->section != SECT_CODE) continue;
+        n = graph_node_at(g, (long)s->value);
+        if (n >= 0) g->entry[n] = 1;
+    }
+    for (i = 0; i < g->num_nodes; i++) {
+        if (g->nodes[i].target >= 0) g->entry[g->nodes[i].target] = 1;
+    }
+    return 0;
+}
+
+/* First opcode byte of a node, skipping any DD/FD prefix (*prefix
+ * receives it, or 0) */
+static int node_opcode(FlowGraph *g, int node, int *prefix)
+{
+    const uint8 *p = g->code + g->nodes[node].offset;
+
+    *prefix = 0;
+    if (p[0] == 0xDD || p[0] == 0xFD) {
+        *prefix = p[0];
+        return g->nodes[node].d.len > 1 ? p[1] : -1;
+    }
+    return p[0];
+}
+
+/* jp nn / jp cc,nn (cc = nz/z/nc/c) to a target within jr range */
+static void perf_jp_jr(FlowGraph *g, int i)
+{
+    FlowNode *n = &g->nodes[i];
+    int prefix, op;
+    long disp;
+
+    op = node_opcode(g, i, &prefix);
+    if (prefix || n->d.len != 4 || n->target < 0) return;
+    if (op != 0xC3 && op != 0xC2 && op != 0xCA && op != 0xD2 && op != 0xDA) {
+        return;
+    }
+
+    disp = (long)g->nodes[n->target].offset - ((long)n->offset + 2);
+    if (disp < -128 || disp > 127) return;
+    if (g->as->cold_used && (n->offset < g->as->cold_base) !=
+        (g->nodes[n->target].offset < g->as->cold_base)) {
+        return;                     /* Between the hot and cold parts */
+    }
+
+    perf_warn(g, i, PERF_JP_JR, 2, 2, "", "jp could be jr");
+}
+
+/* call nn followed by ret */
+static void perf_tail_call(FlowGraph *g, int i)
+{
+    FlowNode *n = &g->nodes[i];
+    int prefix, op;
+
+    op = node_opcode(g, i, &prefix);
+    if (prefix || op != 0xCD || n->d.len != 4 || n->next < 0) return;
+    if (g->nodes[n->next].d.flow != FLOW_RET ||
+        g->nodes[n->next].d.len != 1) {
+        return;
+    }
+
+    /* The ret can only go if nothing else reaches it */
+    perf_warn(g, i, PERF_TAIL_CALL, g->entry[n->next] ? 0 : 1, 8, "",
+              "call followed by ret could be jp");
+}
+
+/* ld a,0 */
+static void perf_ld_zero(FlowGraph *g, int i)
+{
+    FlowNode *n = &g->nodes[i];
+    const uint8 *p = g->code + n->offset;
+
+    if (n->d.len != 2 || p[0] != 0x3E || p[1] != 0x00) return;
+
+    /* xor a sets the flags; skip it if the next instruction tests them */
+    if (n->next >= 0 && g->nodes[n->next].d.cond >= 0) return;
+
+    perf_warn(g, i, PERF_LD_ZERO, 1, 1, "",
+              "ld a,0 could be xor a if the flags are not needed");
+}
+
+/* Loads through (ix+d)/(iy+d) inside a short loop that leaves HL alone.
+ * i is the backward branch closing the loop. */
+static void perf_ix_loop(FlowGraph *g, int i, uint8 *reported)
+{
+    FlowNode *n = &g->nodes[i];
+    int first = -1;
+    int loads = 0;
+    int bytes = 0;
+    int k, prefix, op;
+    char where[FILE_MAX + 16];
+    char msg[FILE_MAX + 120];
+
+    if (n->target < 0 || n->target > i || i - n->target >= 32) return;
+
+    for (k = n->target; k <= i; k++) {
+        FlowNode *b = &g->nodes[k];
+        if (b->d.writes & RM_HL) return;
+        if ((b->d.attr & INSN_MEMREAD) && !(b->d.attr & INSN_INDEXED)) {
+            return;                 /* May already be using (HL) */
+        }
+    }
+
+    for (k = n->target; k <= i; k++) {
+        FlowNode *b = &g->nodes[k];
+        if ((b->d.attr & (INSN_INDEXED | INSN_MEMREAD)) !=
+                (INSN_INDEXED | INSN_MEMREAD) || reported[k]) {
+            continue;
+        }
+        /* eZ80 16-bit loads save one byte; the others two */
+        op = node_opcode(g, k, &prefix);
+        if (op == 0x07 || op == 0x17 || op == 0x27 ||
+            op == 0x31 || op == 0x37) {
+            bytes += 1;
+        } else {
+            bytes += 2;
+        }
+        reported[k] = 1;
+        if (first < 0) first = k;
+        loads++;
+    }
+    if (loads == 0) return;
+
+    node_where(g, n->target, where);
+    sprintf(msg, "%d load%s through an index register in the loop at "
+            "%s; HL is free to walk the data instead",
+            loads, loads == 1 ? "" : "s", where);
+    perf_warn(g, first, PERF_IX_LOOP, bytes, bytes, " per iteration", msg);
+}
+
+/* Size of the table at a section offset: up to the next label in the
+ * same section, or the section end.  Copies its label into name
+ * (MAX_LABEL_LEN bytes), "?" if it has none. */
+static long table_extent(AsmState *as, uint8 section, uint24 offset,
+                         char *name)
+{
+    const Symbol *named = NULL;
+    uint24 end;
+    int i;
+
+    if (section == SECT_CODE) end = as->code_size;
+    else if (section == SECT_DATA) end = as->data_size;
+    else end = as->bss_size;
+
+    for (i = 0; i < as->num_symbols; i++) {
+        const Symbol *s = symbol_at(as, i);
+        if (!s->defined || s->section != section) continue;
+        if (s->value == offset && (!named || named->local)) {
+            named = s;
+        }
+        if (s->value > offset && s->value < end) end = s->value;
+    }
+    if (named) symbol_name(as, named, name);
+    else strcpy(name, "?");
+    return (long)end - (long)offset;
+}
+
+/* ld rr,table followed by an 8-bit add into the low byte:
+ *   ld hl,table / add a,l / ld l,a
+ * which only works if the table does not cross a 256-byte page.  The
+ * table's address is not known until ld places the section, so any
+ * table of more than one byte is flagged. */
+static void perf_table_page(FlowGraph *g, int i)
+{
+    AsmState *as = g->as;
+    FlowNode *n = &g->nodes[i];
+    const uint8 *p = g->code + n->offset;
+    Relocation *r;
+    char name[MAX_LABEL_LEN];
+    int add_op, ld_op;
+    int k, j;
+    long size;
+    char where[FILE_MAX + 16];
+    char msg[FILE_MAX + 200];
+
+    if (n->d.len != 4) return;
+    switch (p[0]) {
+    case 0x21: add_op = 0x85; ld_op = 0x6F; break;   /* HL: add a,l / ld l,a */
+    case 0x11: add_op = 0x83; ld_op = 0x5F; break;   /* DE: add a,e / ld e,a */
+    case 0x01: add_op = 0x81; ld_op = 0x4F; break;   /* BC: add a,c / ld c,a */
+    default: return;
+    }
+
+    r = graph_reloc_at(g, n->offset + 1);
+    if (!r || r->target_sect == 0) return;
+
+    /* Look a few instructions ahead for the add / ld pair */
+    j = n->next;
+    for (k = 0; k < 4 && j >= 0; k++) {
+        FlowNode *a = &g->nodes[j];
+        if (a->d.flow != FLOW_NEXT || a->next < 0) return;
+        if (g->code[a->offset] == add_op && a->d.len == 1 &&
+            g->code[g->nodes[a->next].offset] == ld_op) {
+            break;
+        }
+        j = a->next;
+    }
+    if (k == 4 || j < 0) return;
+
+    size = table_extent(as, r->target_sect, n->d.imm, name);
+    if (size <= 1) return;
+
+    node_where(g, j, where);
+    if (size > 256) {
+        sprintf(msg, "table '%.64s' (%ld bytes) is larger than a 256-byte "
+                "page but is indexed with an 8-bit add at %s",
+                name, size, where);
+    } else {
+        sprintf(msg, "table '%.64s' (%ld bytes) is indexed with an 8-bit "
+                "add at %s, which is only correct if it is linked within "
+                "one 256-byte page", name, size, where);
+    }
+    perf_warn(g, i, PERF_TABLE_PAGE, 4, 4, " over a 24-bit add", msg);
+}
+
+/* push rr ... pop rr where nothing in between touches rr or the stack */
+static void perf_push_pop(FlowGraph *g, int i)
+{
+    FlowNode *n = &g->nodes[i];
+    unsigned regs;
+    int prefix, op, pprefix, pop;
+    int j, k;
+
+    op = node_opcode(g, i, &prefix);
+    switch (op) {
+    case 0xC5: regs = RM_BC; break;
+    case 0xD5: regs = RM_DE; break;
+    case 0xE5: regs = prefix == 0xDD ? RM_IX : prefix == 0xFD ? RM_IY : RM_HL;
+        break;
+    case 0xF5: regs = RM_A | RM_F; break;
+    default: return;
+    }
+    if (prefix && op != 0xE5) return;
+
+    j = n->next;
+    for (k = 0; k < 16 && j >= 0 && !g->entry[j]; k++) {
+        FlowNode *b = &g->nodes[j];
+
+        pop = node_opcode(g, j, &pprefix);
+        if (pop == op - 4 && pprefix == prefix) {
+            perf_warn(g, i, PERF_PUSH_POP, n->d.len + b->d.len,
+                      n->d.cycles + b->d.cycles, "",
+                      "push and pop cancel out; nothing between them "
+                      "changes the register");
+            return;
+        }
+        if (b->d.flow != FLOW_NEXT || (b->d.writes & (regs | RM_SP)) ||
+            (b->d.attr & INSN_STACK)) {
+            return;
+        }
+        j = b->next;
+    }
+}
+
+static int perf_analyse(AsmState *as, FlowGraph *g)
+{
+    unsigned rules = as->perf_rules;
+    uint8 *reported;
+    int i;
+
+    reported = (uint8 *)calloc(g->num_nodes + 1, 1);
+    if (!reported || perf_mark_entries(g) < 0) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        if (reported) free(reported);
+        return -1;
+    }
+
+    for (i = 0; i < g->num_nodes; i++) {
+        int flow = g->nodes[i].d.flow;
+
+        if (rules & PERF_JP_JR) perf_jp_jr(g, i);
+        if (rules & PERF_TAIL_CALL) perf_tail_call(g, i);
+        if (rules & PERF_LD_ZERO) perf_ld_zero(g, i);
+        if ((rules & PERF_IX_LOOP) &&
+            (flow == FLOW_JUMP || flow == FLOW_BRANCH)) {
+            perf_ix_loop(g, i, reported);
+        }
+        if (rules & PERF_TABLE_PAGE) perf_table_page(g, i);
+        if (rules & PERF_PUSH_POP) perf_push_pop(g, i);
+    }
+
+    free(reported);
+    return 0;
+}
+
+/* ============================================================
+ * Clobber Summaries
+ * ============================================================ */
+
+/* Add an extern to a summary's call list, once */
+static int clob_add_call(ClobberSummary *cs, int ext)
+{
+    int *calls;
+    int i;
+
+    for (i = 0; i < cs->num_calls; i++) {
+        if (cs->calls[i] == ext) return 0;
+    }
+    calls = (int *)realloc(cs->calls, (cs->num_calls + 1) * sizeof(int));
+    if (!calls) return -1;
+    cs->calls = calls;
+    cs->calls[cs->num_calls++] = ext;
+    return 0;
+}
+
+/* The target of a jump or call from node i: followed if it is in this
+ * file, listed if it is an extern, otherwise unknown */
+static int clob_target(FlowGraph *g, ClobberSummary *cs, int i,
+                       int *stack, int *sp)
+{
+    FlowNode *n = &g->nodes[i];
+
+    if (n->target >= 0) {
+        if (!g->state[n->target]) {
+            g->state[n->target] = 1;
+            stack[(*sp)++] = n->target;
+        }
+        return 0;
+    }
+    if (n->ext >= 0) {
+        return clob_add_call(cs, n->ext);
+    }
+    cs->writes |= CLOB_UNKNOWN;
+    return 0;
+}
+
+/* Registers written on every path from node entry until it returns */
+static int clob_routine(FlowGraph *g, ClobberSummary *cs, int entry,
+                        int *stack)
+{
+    FlowNode *n;
+    int sp = 0;
+    int follow_next;
+    int i;
+
+    memset(g->state, 0, g->num_nodes);
+    g->state[entry] = 1;
+    stack[sp++] = entry;
+
+    while (sp > 0) {
+        i = stack[--sp];
+        n = &g->nodes[i];
+
+        /* SP always comes back balanced; pushes and calls don't count */
+        cs->writes |= n->d.writes & ~RM_SP;
+
+        follow_next = 1;
+        switch (n->d.flow) {
+            case FLOW_JUMP:
+                follow_next = 0;
+                /* fall through */
+            case FLOW_BRANCH:
+            case FLOW_CALL:
+            case FLOW_CALLCC:
+                if (clob_target(g, cs, i, stack, &sp) < 0) return -1;
+                break;
+            case FLOW_RST:
+            case FLOW_INDIRECT:
+                cs->writes |= CLOB_UNKNOWN;
+                follow_next = n->d.flow == FLOW_RST;
+                break;
+            case FLOW_RET:
+            case FLOW_RETI:
+                follow_next = 0;
+                break;
+        }
+
+        if (!follow_next) continue;
+        if (n->next < 0) {
+            cs->writes |= CLOB_UNKNOWN;     /* Runs into data */
+        } else if (!g->state[n->next]) {
+            g->state[n->next] = 1;
+            stack[sp++] = n->next;
+        }
+    }
+    return 0;
+}
+
+/* Summarise every exported code label */
+static int clob_analyse(AsmState *as, FlowGraph *g)
+{
+    ClobberSummary *cs;
+    int *stack;
+    int node;
+    int i;
+
+    as->clobbers = (ClobberSummary *)calloc(as->num_symbols + 1,
+                                            sizeof(ClobberSummary));
+    stack = (int *)malloc((g->num_nodes + 1) * sizeof(int));
+    if (!g->state) g->state = (uint8 *)malloc(g->num_nodes + 1);
+    if (!as->clobbers || !stack || !g->state) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        if (stack) free(stack);
+        return -1;
+    }
+
+    for (i = 0; i < as->num_symbols; i++) {
+        const Symbol *s = symbol_at(as, i);
+        if (s->flags != SYM_EXPORT || s->section != SECT_CODE) continue;
+
+        cs = &as->clobbers[as->num_clobbers++];
+        cs->symbol = i;
+        node = graph_node_at(g, (long)s->value);
+        if (node < 0) {
+            cs->writes = CLOB_UNKNOWN;
+            continue;
+        }
+        if (clob_routine(g, cs, node, stack) < 0) {
+            fprintf(stderr, "error: out of memory for code analysis\n");
+            free(stack);
+            return -1;
+        }
+    }
+
+    free(stack);
+    return 0;
+}
+
+/* ============================================================
+ * Worst-Case Execution Time (--wcet)
+ *
+ * A routine is the code reachable from its label, following jumps
+ * and branches but not calls, up to the label of another routine:
+ * running or jumping into one costs it as a tail call.  A depth-first
+ * walk finds the edges that loop back; the natural loop of each is
+ * then costed innermost first, charging its head with (bound - 1)
+ * times its longest round trip.  What is left is a longest path over
+ * an acyclic graph, from the label to a return, which is the final
+ * pass round every loop.
+ * ============================================================ */
+
+#define WCET_ROUTINE    0x01    /* Node is in a routine that was costed */
+#define WCET_BOUND_USED 0x02    /* Its LOOPBOUND was applied */
+#define WCET_ENTRY      0x04    /* Node starts a routine */
+
+/* Scratch for costing one routine.  Edges are numbered 2 * x + k for
+ * local node x: k = 0 is the fall-through, k = 1 the branch target. */
+typedef struct {
+    int num;
+    int *nodes;             /* Local index -> node */
+    int *succ;              /* Edge -> local index, or -1 */
+    long *weight;           /* Edge -> cycles */
+    uint8 *back;            /* Edge loops back */
+    long *leave;            /* Cycles to return from here, or COST_NONE */
+    int *tail;              /* Routine whose cost is in leave, or -1 */
+    int *order;             /* Reachable local nodes, in reverse postorder */
+    int first;              /* First used entry of order */
+    int *pred_start;        /* Incoming edges of local x are */
+    int *preds;             /* preds[pred_start[x] .. pred_start[x+1]-1] */
+    long *extra;            /* Round trips charged at a loop head */
+    long *bound;            /* Bound of the loop headed here, 0 if none */
+    long *round;            /* Cycles for one round trip of that loop */
+    long *dist;
+    int *from;              /* Previous node on the longest path */
+    int *stack;
+    uint8 *seen;            /* 2 once the walk from the entry reaches it */
+    uint8 *body;
+} WcetRoutine;
+
+static void wcet_routine(FlowGraph *g, int entry);
+
+static void wcet_note(WcetCost *c, int flag, int why, int node)
+{
+    if (c->why == WHY_NONE) {
+        c->why = why;
+        c->why_node = node;
+    }
+    c->flags |= flag;
+}
+
+/* Node that node i passes control to along edge k, or -1.  A call
+ * carries on at the next instruction once the callee returns. */
+static int wcet_succ(FlowGraph *g, int i, int k)
+{
+    FlowNode *n = &g->nodes[i];
+
+    if (n->d.attr & INSN_HALT) return -1;
+    switch (n->d.flow) {
+    case FLOW_NEXT:
+    case FLOW_CALL:
+    case FLOW_CALLCC:
+    case FLOW_RST:
+    case FLOW_RETCC:
+        return k == 0 ? n->next : -1;
+    case FLOW_JUMP:
+        return k == 1 ? n->target : -1;
+    case FLOW_BRANCH:
+        return k == 0 ? n->next : n->target;
+    }
+    return -1;
+}
+
+/* Node s starts a routine other than the one at entry */
+static int wcet_other(FlowGraph *g, int entry, int s)
+{
+    return s != entry && (g->wcet_mark[s] & WCET_ENTRY);
+}
+
+/* Find the nodes of the routine at entry, numbering them in g->local
+ * (entry is 0).  Returns the count, or -1 if out of memory. */
+static int wcet_collect(FlowGraph *g, int entry, WcetRoutine *r)
+{
+    int max = 64;
+    int x, k, s;
+
+    r->nodes = (int *)malloc(max * sizeof(int));
+    if (!r->nodes) return -1;
+    r->nodes[0] = entry;
+    r->num = 1;
+    g->local[entry] = 0;
+    for (x = 0; x < r->num; x++) {
+        for (k = 0; k < 2; k++) {
+            s = wcet_succ(g, r->nodes[x], k);
+            if (s < 0 || g->local[s] >= 0 || wcet_other(g, entry, s)) {
+                continue;
+            }
+            if (r->num >= max) {
+                int *nodes = (int *)realloc(r->nodes, max * 2 * sizeof(int));
+                if (!nodes) return -1;
+                r->nodes = nodes;
+                max *= 2;
+            }
+            g->local[s] = r->num;
+            r->nodes[r->num++] = s;
+        }
+    }
+    return r->num;
+}
+
+static void wcet_routine_free(WcetRoutine *r)
+{
+    if (r->nodes) free(r->nodes);
+    if (r->succ) free(r->succ);
+    if (r->weight) free(r->weight);
+    if (r->back) free(r->back);
+    if (r->leave) free(r->leave);
+    if (r->tail) free(r->tail);
+    if (r->order) free(r->order);
+    if (r->pred_start) free(r->pred_start);
+    if (r->preds) free(r->preds);
+    if (r->extra) free(r->extra);
+    if (r->bound) free(r->bound);
+    if (r->round) free(r->round);
+    if (r->dist) free(r->dist);
+    if (r->from) free(r->from);
+    if (r->stack) free(r->stack);
+    if (r->seen) free(r->seen);
+    if (r->body) free(r->body);
+}
+
+static int wcet_routine_alloc(WcetRoutine *r, int num)
+{
+    r->succ = (int *)malloc(2 * num * sizeof(int));
+    r->weight = (long *)malloc(2 * num * sizeof(long));
+    r->back = (uint8 *)calloc(2 * num, 1);
+    r->leave = (long *)malloc(num * sizeof(long));
+    r->tail = (int *)malloc(num * sizeof(int));
+    r->order = (int *)malloc(num * sizeof(int));
+    r->pred_start = (int *)calloc(num + 1, sizeof(int));
+    r->preds = (int *)malloc(2 * num * sizeof(int));
+    r->extra = (long *)calloc(num, sizeof(long));
+    r->bound = (long *)calloc(num, sizeof(long));
+    r->round = (long *)calloc(num, sizeof(long));
+    r->dist = (long *)malloc(num * sizeof(long));
+    r->from = (int *)malloc(num * sizeof(int));
+    r->stack = (int *)malloc(2 * num * sizeof(int));
+    r->seen = (uint8 *)calloc(num, 1);
+    r->body = (uint8 *)calloc(num, 1);
+    return r->succ && r->weight && r->back && r->leave && r->tail &&
+           r->order &&
+           r->pred_start && r->preds && r->extra && r->bound &&
+           r->round && r->dist && r->from && r->stack && r->seen &&
+           r->body ? 0 : -1;
+}
+
+/* The call at local x: cost the edge to the next instruction with
+ * the callee's worst case */
+static void wcet_call(FlowGraph *g, WcetRoutine *r, WcetCost *c, int x)
+{
+    int i = r->nodes[x];
+    FlowNode *n = &g->nodes[i];
+    WcetCost *tc;
+    long callee;
+
+    if (n->d.flow == FLOW_RST) {
+        wcet_note(c, PATH_UNKNOWN, WHY_RST, i);
+        return;
+    }
+    if (n->target < 0) {
+        wcet_note(c, PATH_UNKNOWN, n->ext >= 0 ? WHY_EXTERN : WHY_TARGET, i);
+        return;
+    }
+    if (g->wcet_state[n->target] == VISIT_ACTIVE) {
+        wcet_note(c, PATH_LOOP, WHY_RECURSE, i);
+        return;
+    }
+
+    tc = &g->wcet[n->target];
+    if (tc->flags) wcet_note(c, tc->flags, tc->why, tc->why_node);
+    callee = tc->cycles;
+
+    if (n->d.flow == FLOW_CALLCC) {
+        /* Not taken costs the weight already there */
+        if (callee != COST_NONE &&
+            cost_add(r->weight[2 * x + 1], callee) > r->weight[2 * x]) {
+            r->weight[2 * x] = cost_add(r->weight[2 * x + 1], callee);
+        }
+    } else if (callee == COST_NONE) {
+        r->succ[2 * x] = -1;        /* Never comes back */
+    } else {
+        r->weight[2 * x] = cost_add(r->weight[2 * x + 1], callee);
+    }
+}
+
+/* Local x runs or jumps along edge k into the routine at node s */
+static void wcet_tail(FlowGraph *g, WcetRoutine *r, WcetCost *c, int x,
+                      int k, int s)
+{
+    WcetCost *tc = &g->wcet[s];
+    long cost;
+
+    cost = r->weight[2 * x + k];
+    if (g->wcet_state[s] == VISIT_ACTIVE) {
+        /* Costed as far as the routine it comes back into */
+        wcet_note(c, PATH_LOOP, WHY_RECURSE, r->nodes[x]);
+        if (cost > r->leave[x]) r->leave[x] = cost;
+        return;
+    }
+    if (tc->flags) wcet_note(c, tc->flags, tc->why, tc->why_node);
+    if (tc->cycles == COST_NONE) return;
+
+    cost = cost_add(cost, tc->cycles);
+    if (cost > r->leave[x]) {
+        r->leave[x] = cost;
+        r->tail[x] = s;
+    }
+}
+
+/* Edges and exits of every node in the routine */
+static void wcet_edges(FlowGraph *g, WcetRoutine *r, WcetCost *c)
+{
+    int x, k, s;
+
+    for (x = 0; x < r->num; x++) {
+        int i = r->nodes[x];
+        FlowNode *n = &g->nodes[i];
+        long bound = g->as->insns[n->loc].bound;
+
+        /* Node numbers until the tail calls are sorted out below */
+        for (k = 0; k < 2; k++) {
+            r->succ[2 * x + k] = wcet_succ(g, i, k);
+            r->weight[2 * x + k] = node_cycles(g, i, k);
+        }
+        r->leave[x] = COST_NONE;
+        r->tail[x] = -1;
+
+        if (n->d.attr & INSN_HALT) {
+            r->leave[x] = r->weight[2 * x];
+            wcet_note(c, PATH_LOOP, WHY_HALT, i);
+            continue;
+        }
+        if (n->d.attr & INSN_REPEAT) {
+            if (bound > 0) {
+                g->wcet_mark[i] |= WCET_BOUND_USED;     /* In the weight */
+            } else {
+                wcet_note(c, PATH_LOOP, WHY_REPEAT, i);
+            }
+        }
+
+        switch (n->d.flow) {
+        case FLOW_JUMP:
+        case FLOW_BRANCH:
+            if (n->target < 0) {
+                r->leave[x] = r->weight[2 * x + 1];
+                wcet_note(c, PATH_UNKNOWN,
+                          n->ext >= 0 ? WHY_EXTERN : WHY_TARGET, i);
+            }
+            break;
+        case FLOW_CALL:
+        case FLOW_CALLCC:
+        case FLOW_RST:
+            wcet_call(g, r, c, x);
+            break;
+        case FLOW_RET:
+        case FLOW_RETCC:
+        case FLOW_RETI:
+            r->leave[x] = r->weight[2 * x + 1];
+            break;
+        case FLOW_INDIRECT:
+            r->leave[x] = r->weight[2 * x];
+            wcet_note(c, PATH_UNKNOWN, WHY_INDIRECT, i);
+            break;
+        }
+
+        /* Running off the end of the code */
+        if (n->next < 0 && (n->d.flow == FLOW_NEXT ||
+                            n->d.flow == FLOW_BRANCH ||
+                            n->d.flow == FLOW_RETCC)) {
+            if (r->weight[2 * x] > r->leave[x]) {
+                r->leave[x] = r->weight[2 * x];
+            }
+            wcet_note(c, PATH_UNKNOWN, WHY_DATA, i);
+        }
+
+        for (k = 0; k < 2; k++) {
+            s = r->succ[2 * x + k];
+            if (s >= 0 && wcet_other(g, r->nodes[0], s)) {
+                wcet_tail(g, r, c, x, k, s);
+                s = -1;
+            }
+            r->succ[2 * x + k] = s >= 0 ? g->local[s] : -1;
+        }
+    }
+
+    /* Incoming edges, for finding loop bodies */
+    for (x = 0; x < 2 * r->num; x++) {
+        if (r->succ[x] >= 0) r->pred_start[r->succ[x] + 1]++;
+    }
+    for (x = 0; x < r->num; x++) {
+        r->pred_start[x + 1] += r->pred_start[x];
+    }
+    for (x = 0; x < r->num; x++) {
+        r->stack[x] = r->pred_start[x];
+    }
+    for (x = 0; x < 2 * r->num; x++) {
+        if (r->succ[x] >= 0) r->preds[r->stack[r->succ[x]]++] = x;
+    }
+}
+
+/* Depth-first walk from the entry: reverse postorder, and the edges
+ * that loop back to a node still being walked */
+static void wcet_order(WcetRoutine *r)
+{
+    int *edge = r->stack + r->num;
+    int sp = 1;
+    int post = r->num;
+    int x, e, y;
+
+    r->stack[0] = 0;
+    edge[0] = 0;
+    r->seen[0] = 1;                 /* 1 = being walked, 2 = done */
+    while (sp > 0) {
+        x = r->stack[sp - 1];
+        if (edge[sp - 1] < 2) {
+            e = 2 * x + edge[sp - 1]++;
+            y = r->succ[e];
+            if (y < 0) continue;
+            if (r->seen[y] == 1) {
+                r->back[e] = 1;
+            } else if (r->seen[y] == 0) {
+                r->seen[y] = 1;
+                r->stack[sp] = y;
+                edge[sp] = 0;
+                sp++;
+            }
+        } else {
+            r->seen[x] = 2;
+            r->order[--post] = x;
+            sp--;
+        }
+    }
+    r->first = post;
+}
+
+/* Bound derived for a DJNZ loop: "ld b,n" falls into the head, the
+ * DJNZ is the only way round, and nothing else in the body changes B.
+ * Returns 0 if the loop does not match. */
+static long wcet_djnz_bound(FlowGraph *g, WcetRoutine *r, int h)
+{
+    FlowNode *n;
+    int djnz = -1;
+    int entry = -1;
+    int j, x, e;
+
+    if (h == 0) return 0;           /* Entered by the caller too */
+    for (j = r->pred_start[h]; j < r->pred_start[h + 1]; j++) {
+        e = r->preds[j];
+        x = e / 2;
+        if (r->back[e]) {
+            if (djnz >= 0) return 0;
+            djnz = x;
+        } else if (!r->body[x]) {
+            if (entry >= 0) return 0;
+            entry = x;
+        }
+    }
+    if (djnz < 0 || entry < 0) return 0;
+
+    n = &g->nodes[r->nodes[djnz]];
+    if (n->d.len != 2 || g->code[n->offset] != 0x10) return 0;
+    n = &g->nodes[r->nodes[entry]];
+    if (n->d.len != 2 || g->code[n->offset] != 0x06) return 0;
+    if (n->next != r->nodes[h]) return 0;
+
+    for (x = 0; x < r->num; x++) {
+        if (r->body[x] && x != djnz &&
+            (g->nodes[r->nodes[x]].d.writes & RM_B)) {
+            return 0;
+        }
+    }
+    return g->code[n->offset + 1] ? g->code[n->offset + 1] : 256;
+}
+
+/* Cost the loop headed by local h: its body, bound and round trip */
+static void wcet_loop(FlowGraph *g, WcetRoutine *r, WcetCost *c, int h)
+{
+    long bound = 0;
+    long round = COST_NONE;
+    int sp = 0;
+    int j, k, x, y, e;
+
+    /* The body: everything that reaches a loop-back edge without
+     * passing through the head */
+    memset(r->body, 0, r->num);
+    r->body[h] = 1;
+    for (j = r->pred_start[h]; j < r->pred_start[h + 1]; j++) {
+        e = r->preds[j];
+        if (r->back[e] && !r->body[e / 2]) {
+            r->body[e / 2] = 1;
+            r->stack[sp++] = e / 2;
+        }
+    }
+    while (sp > 0) {
+        y = r->stack[--sp];
+        for (j = r->pred_start[y]; j < r->pred_start[y + 1]; j++) {
+            x = r->preds[j] / 2;
+            if (!r->body[x] && r->seen[x] == 2) {
+                r->body[x] = 1;
+                r->stack[sp++] = x;
+            }
+        }
+    }
+
+    /* A LOOPBOUND not already taken by an inner loop */
+    for (x = 0; x < r->num; x++) {
+        int i = r->nodes[x];
+        long b = g->as->insns[g->nodes[i].loc].bound;
+
+        if (!r->body[x] || b <= 0) continue;
+        if (g->wcet_mark[i] & WCET_BOUND_USED) continue;
+        g->wcet_mark[i] |= WCET_BOUND_USED;
+        if (b > bound) bound = b;
+    }
+    if (bound == 0) bound = wcet_djnz_bound(g, r, h);
+
+    /* Longest round trip, with inner loops already charged */
+    for (j = r->first; j < r->num; j++) {
+        r->dist[r->order[j]] = COST_NONE;
+    }
+    r->dist[h] = 0;
+    for (j = r->first; j < r->num; j++) {
+        x = r->order[j];
+        if (!r->body[x] || r->dist[x] == COST_NONE) continue;
+        for (k = 0; k < 2; k++) {
+            long cost;
+
+            e = 2 * x + k;
+            y = r->succ[e];
+            if (y < 0) continue;
+            cost = cost_add(r->dist[x], r->weight[e]);
+            if (r->back[e]) {
+                if (y == h && cost > round) round = cost;
+                continue;
+            }
+            if (!r->body[y]) continue;
+            cost = cost_add(cost, r->extra[y]);
+            if (cost > r->dist[y]) r->dist[y] = cost;
+        }
+    }
+
+    if (bound <= 0) {
+        wcet_note(c, PATH_LOOP, WHY_LOOP, r->nodes[h]);
+        return;
+    }
+    if (round == COST_NONE) round = 0;
+    r->bound[h] = bound;
+    r->round[h] = round;
+    r->extra[h] = cost_mul(bound - 1, round);
+}
+
+/* Append text to a report buffer, ending it with "..." when full */
+static void wcet_append(char *buf, size_t size, const char *text)
+{
+    size_t len = strlen(buf);
+
+    if (len >= 3 && strcmp(buf + len - 3, "...") == 0) return;
+    if (len + strlen(text) + 4 > size) {
+        strcpy(buf + len, "...");
+        return;
+    }
+    strcpy(buf + len, text);
+}
+
+/* Describe the critical path ending at local end: the runs of source
+ * lines it covers, then the loops and calls along it */
+static char *wcet_path(FlowGraph *g, WcetRoutine *r, int end)
+{
+    char lines[200];
+    char loops[200];
+    char calls[200];
+    char item[120];
+    char name[MAX_LABEL_LEN];
+    char *path;
+    int count = 0;
+    int start = -1;
+    int j, x, prev;
+
+    for (x = end; x >= 0; x = r->from[x]) {
+        r->stack[count++] = x;
+    }
+
+    lines[0] = loops[0] = calls[0] = '\0';
+    prev = -1;
+    for (j = count - 1; j >= 0; j--) {
+        int i = r->nodes[r->stack[j]];
+        FlowNode *n = &g->nodes[i];
+
+        if (prev >= 0 && (g->nodes[prev].next != i ||
+                          g->as->insns[g->nodes[prev].loc].file !=
+                          g->as->insns[n->loc].file)) {
+            if (node_line(g, prev) != node_line(g, start)) {
+                sprintf(item, "%s%d-%d", lines[0] ? ", " : "",
+                        node_line(g, start), node_line(g, prev));
+            } else {
+                sprintf(item, "%s%d", lines[0] ? ", " : "",
+                        node_line(g, start));
+            }
+            wcet_append(lines, sizeof(lines), item);
+            start = -1;
+        }
+        if (start < 0) start = i;
+        prev = i;
+
+        if (r->bound[r->stack[j]] > 0) {
+            sprintf(item, "%sloop at %d: %ld x %ld",
+                    loops[0] ? ", " : "; ", node_line(g, i),
+                    r->bound[r->stack[j]], r->round[r->stack[j]]);
+            wcet_append(loops, sizeof(loops), item);
+        }
+        if ((n->d.flow == FLOW_CALL || n->d.flow == FLOW_CALLCC) &&
+            n->target >= 0 && g->wcet[n->target].cycles != COST_NONE &&
+            g->wcet_state[n->target] == VISIT_DONE) {
+            sprintf(item, "%scalls '%.64s' %ld", calls[0] ? ", " : "; ",
+                    routine_name(g->as, g->nodes[n->target].offset, name),
+                    g->wcet[n->target].cycles);
+            wcet_append(calls, sizeof(calls), item);
+        }
+    }
+    if (r->tail[end] >= 0) {
+        int t = r->tail[end];
+
+        sprintf(item, "%sthen '%.64s' %ld", calls[0] ? ", " : "; ",
+                routine_name(g->as, g->nodes[t].offset, name),
+                g->wcet[t].cycles);
+        wcet_append(calls, sizeof(calls), item);
+    }
+    if (prev >= 0) {
+        if (node_line(g, prev) != node_line(g, start)) {
+            sprintf(item, "%s%d-%d", lines[0] ? ", " : "",
+                    node_line(g, start), node_line(g, prev));
+        } else {
+            sprintf(item, "%s%d", lines[0] ? ", " : "", node_line(g, start));
+        }
+        wcet_append(lines, sizeof(lines), item);
+    }
+
+    path = (char *)malloc(strlen(lines) + strlen(loops) + strlen(calls) + 8);
+    if (path) {
+        sprintf(path, "line%s %s%s%s", strchr(lines, ',') || strchr(lines, '-')
+                ? "s" : "", lines, loops, calls);
+    }
+    return path;
+}
+
+/* Cost the routine at entry, and every routine it calls first */
+static void wcet_routine(FlowGraph *g, int entry)
+{
+    WcetCost *c = &g->wcet[entry];
+    WcetRoutine r;
+    int j, k, x, y, e;
+    int end = -1;
+
+    if (g->wcet_state[entry] != VISIT_NEW) return;
+    g->wcet_state[entry] = VISIT_ACTIVE;
+    c->cycles = COST_NONE;
+    c->flags = 0;
+    c->why = WHY_NONE;
+    c->why_node = -1;
+
+    memset(&r, 0, sizeof(r));
+    if (wcet_collect(g, entry, &r) < 0) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        for (x = 0; x < r.num; x++) {
+            g->local[r.nodes[x]] = -1;
+        }
+        wcet_note(c, PATH_UNKNOWN, WHY_TARGET, entry);
+        wcet_routine_free(&r);
+        g->wcet_state[entry] = VISIT_DONE;
+        return;
+    }
+
+    /* Callees first; the numbering is rebuilt after they use it */
+    for (x = 0; x < r.num; x++) {
+        g->local[r.nodes[x]] = -1;
+        g->wcet_mark[r.nodes[x]] |= WCET_ROUTINE;
+    }
+    for (x = 0; x < r.num; x++) {
+        int i = r.nodes[x];
+        FlowNode *n = &g->nodes[i];
+
+        if ((n->d.flow == FLOW_CALL || n->d.flow == FLOW_CALLCC) &&
+            n->target >= 0) {
+            wcet_routine(g, n->target);
+        }
+        for (k = 0; k < 2; k++) {
+            y = wcet_succ(g, i, k);
+            if (y >= 0 && wcet_other(g, entry, y)) wcet_routine(g, y);
+        }
+    }
+    for (x = 0; x < r.num; x++) {
+        g->local[r.nodes[x]] = x;
+    }
+
+    if (wcet_routine_alloc(&r, r.num) < 0) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        wcet_note(c, PATH_UNKNOWN, WHY_TARGET, entry);
+    } else {
+        wcet_edges(g, &r, c);
+        wcet_order(&r);
+
+        /* Loops innermost first: an inner head follows its outer one */
+        for (j = r.num - 1; j >= r.first; j--) {
+            x = r.order[j];
+            for (k = r.pred_start[x]; k < r.pred_start[x + 1]; k++) {
+                if (r.back[r.preds[k]]) break;
+            }
+            if (k < r.pred_start[x + 1]) wcet_loop(g, &r, c, x);
+        }
+        for (x = 0; x < r.num; x++) {
+            int i = r.nodes[x];
+            if (r.bound[x] > 0 && r.extra[x] > g->loop_extra[i]) {
+                g->loop_extra[i] = r.extra[x];
+            }
+        }
+
+        /* The longest path to a return */
+        for (j = r.first; j < r.num; j++) {
+            r.dist[r.order[j]] = COST_NONE;
+        }
+        r.dist[0] = r.extra[0];
+        r.from[0] = -1;
+        for (j = r.first; j < r.num; j++) {
+            x = r.order[j];
+            if (r.dist[x] == COST_NONE) continue;
+            if (r.leave[x] != COST_NONE &&
+                cost_add(r.dist[x], r.leave[x]) > c->cycles) {
+                c->cycles = cost_add(r.dist[x], r.leave[x]);
+                end = x;
+            }
+            for (k = 0; k < 2; k++) {
+                long cost;
+
+                e = 2 * x + k;
+                y = r.succ[e];
+                if (y < 0 || r.back[e]) continue;
+                cost = cost_add(cost_add(r.dist[x], r.weight[e]), r.extra[y]);
+                if (r.dist[y] == COST_NONE || cost > r.dist[y]) {
+                    r.dist[y] = cost;
+                    r.from[y] = x;
+                }
+            }
+        }
+        if (end >= 0) c->path = wcet_path(g, &r, end);
+    }
+
+    for (x = 0; x < r.num; x++) {
+        g->local[r.nodes[x]] = -1;
+    }
+    wcet_routine_free(&r);
+    g->wcet_state[entry] = VISIT_DONE;
+}
+
+static int wcet_entry_cmp(const void *a, const void *b)
+{
+    const int *ea = (const int *)a;
+    const int *eb = (const int *)b;
+
+    if (ea[0] != eb[0]) return ea[0] - eb[0];
+    return ea[1] - eb[1];
+}
+
+/* Cost every routine, finding the loop bounds the DI analysis uses
+ * as well */
+static int wcet_cost_all(AsmState *as, FlowGraph *g)
+{
+    int *entries;
+    int num_entries = 0;
+    int i, node;
+
+    g->wcet = (WcetCost *)calloc(g->num_nodes + 1, sizeof(WcetCost));
+    g->wcet_state = (uint8 *)calloc(g->num_nodes + 1, 1);
+    g->wcet_mark = (uint8 *)calloc(g->num_nodes + 1, 1);
+    g->local = (int *)malloc((g->num_nodes + 1) * sizeof(int));
+    g->loop_extra = (long *)malloc((g->num_nodes + 1) * sizeof(long));
+    entries = (int *)malloc((as->num_symbols + 1) * 2 * sizeof(int));
+    if (!g->wcet || !g->wcet_state || !g->wcet_mark || !g->local ||
+        !g->loop_extra || !entries) {
+        fprintf(stderr, "error: out of memory for code analysis\n");
+        if (entries) free(entries);
+        return -1;
+    }
+    for (i = 0; i < g->num_nodes; i++) {
+        g->local[i] = -1;
+        g->loop_extra[i] = -1;
+    }
+
+    /* Routines: code labels that are not local, by node then name */
+    for (i = 0; i < as->num_symbols; i++) {
+        const Symbol *s = symbol_at(as, i);
+        if (!s->defined || s->section != SECT_CODE) continue;
+        if (s->flags == SYM_EXTERN || s->local) continue;
+        node = graph_node_at(g, (long)s->value);
+        if (node < 0) continue;
+        entries[2 * num_entries] = node;
+        entries[2 * num_entries + 1] = i;
+        num_entries++;
+    }
+    qsort(entries, num_entries, 2 * sizeof(int), wcet_entry_cmp);
+    for (i = 0; i < num_entries; i++) {
+        g->wcet_mark[entries[2 * i]] |= WCET_ENTRY;
+    }
+    for (i = 0; i < num_entries; i++) {
+        wcet_routine(g, entries[2 * i]);
+    }
+    g->routines = entries;
+    g->num_routines = num_entries;
+
+    /* Bounds that no loop or block instruction took */
+    for (i = 0; i < g->num_nodes; i++) {
+        if ((g->wcet_mark[i] & (WCET_ROUTINE | WCET_BOUND_USED)) !=
+            WCET_ROUTINE) {
+            continue;
+        }
+        if (as->insns[g->nodes[i].loc].bound <= 0) continue;
+        fprintf(stderr, "%s:%d: warning: LOOPBOUND is not inside a loop\n",
+                node_file(g, i), node_line(g, i));
+        as->warnings++;
+    }
+    return 0;
+}
+
+/* Report the worst case of every routine, in source order */
+static int wcet_analyse(AsmState *as, FlowGraph *g)
+{
+    char text[WHY_MAX];
+    char why[WHY_MAX + 2];
+    int i, node;
+
+    for (i = 0; i < g->num_routines; i++) {
+        WcetCost *c;
+        char name[MAX_LABEL_LEN];
+
+        node = g->routines[2 * i];
+        if (i > 0 && g->routines[2 * i - 2] == node) continue;
+        c = &g->wcet[node];
+        symbol_name(as, symbol_at(as, g->routines[2 * i + 1]), name);
+
+        why[0] = '\0';
+        if (c->flags) {
+            describe_why(g, c->why, c->why_node, text, sizeof(text));
+            sprintf(why, "%s%s", c->path ? "; " : "", text);
+        }
+        if (c->cycles == COST_NONE) {
+            printf("%s:%d: note: '%s' never returns%s%s%s\n",
+                   node_file(g, node), node_line(g, node), name,
+                   why[0] ? " (" : "", why, why[0] ? ")" : "");
+            continue;
+        }
+        printf("%s:%d: note: '%s' takes %s%ld cycles at worst (%s%s)\n",
+               node_file(g, node), node_line(g, node), name,
+               c->flags || c->cycles >= COST_LIMIT ? "at least " : "",
+               c->cycles,
+               c->path ? c->path : "", why);
+    }
+
+    if (g->num_routines == 0) {
+        printf("%s: no routines\n", as->filename);
+    }
+    return 0;
+}
+
+/* ============================================================
+ * Entry Point
+ * ============================================================ */
+
+int flow_analyse(AsmState *as)
+{
+    FlowGraph g;
+    int result = 0;
+
+    if (!as->analyse || !as->code_tmp) return 0;
+
+    ttrace_begin(as->trace, "code analysis", as->filename);
+    if (graph_build(as, &g) < 0) {
+        ttrace_end(as->trace);
+        return -1;
+    }
+
+    if (as->di_report || as->di_budget >= 0 || as->wcet_report) {
+        if (wcet_cost_all(as, &g) < 0) result = -1;
+    }
+    if (result == 0 && (as->di_report || as->di_budget >= 0)) {
+        if (di_analyse(as, &g) < 0) result = -1;
+    }
+    if (as->perf_rules) {
+        if (perf_analyse(as, &g) < 0) result = -1;
+    }
+    if (as->clobber_summary) {
+        if (clob_analyse(as, &g) < 0) result = -1;
+    }
+    if (result == 0 && as->wcet_report) {
+        if (wcet_analyse(as, &g) < 0) result = -1;
+    }
+
+    graph_free(&g);
+    ttrace_end(as->trace);
+    return result;
+}
@@ -855,6 +855,22 @@ static int handle_jp(AsmState *as)
     return -1;
 }
 
+/* Relative jumps cannot cross between the hot and cold parts of the
+ * code, which the linker may place apart */
+static void check_part(AsmState *as, const Operand *op, const char *insn)
+{
+    Symbol *sym;
+    
+    if (!op->has_symbol || as->pass != 2) {
+        return;
+    }
+    sym = symbol_find(as, op->symbol);
+    if (sym && sym->defined && sym->section == SECT_CODE &&
+        sym->cold != as->in_cold) {
+        asm_error(as, "%s cannot reach between hot and cold code", insn);
+    }
+}
+
 static int handle_jr(AsmState *as)
 {
     Operand op, addr;
@@ -885,6 +901,7 @@ static int handle_jr(AsmState *as)
             asm_error(as, "JR cannot use external symbols");
             return -1;
         }
+        check_part(as, &addr, "JR");
         
         emit_byte(as, 0x20 | (cc << 3));
         
@@ -902,6 +919,7 @@ static int handle_jr(AsmState *as)
             asm_error(as, "JR cannot use external symbols");
             return -1;
         }
+        check_part(as, &op, "JR");
         
         emit_byte(as, 0x18);
         offset = op.value - (as->pc + 1);
@@ -933,6 +951,7 @@ static int handle_djnz(AsmState *as)
         asm_error(as, "DJNZ cannot use external symbols");
         return -1;
     }
+    check_part(as, &op, "DJNZ");
     
     emit_byte(as, 0x10);
     offset = op.value - (as->pc + 1);
@@ -1602,6 +1621,11 @@ int instr_execute(AsmState *as, const char *mnemonic)
     if (!ie->mnemonic || strcmp(lower, ie->mnemonic) != 0)
         return -1;
     
+    /* Note where the instruction starts for the code analyses */
+    if (as->analyse && as->pass == 2 && as->current_section == SECT_CODE) {
+        if (flow_record_insn(as) < 0) return -1;
+    }
+    
     /* Emit suffix prefix byte if present */
     if (suffix_byte) emit_byte(as, suffix_byte);
     
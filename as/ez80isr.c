@@ -0,0 +1,576 @@
+/*
+ * eZ80 ADL Mode Assembler - Interrupt Handlers
+ *
+ * An interrupt handler must leave every register as it found it, and
+ * pushing them all costs a short handler more than its work.  ISR and
+ * ENDISR save only what the handler changes:
+ *
+ *     tick:   isr                     push af / push hl
+ *             ld hl,(ticks)
+ *             inc hl
+ *             ld (ticks),hl
+ *             endisr                  pop hl / pop af / ei / reti
+ *
+ * The body is followed from ISR, through jumps and into the calls it
+ * makes to routines in this file, for the registers it writes; a path
+ * that cannot be followed (a call to an extern, RST, an indirect jump)
+ * saves AF, BC, DE, HL, IX and IY.  ISR SHADOW promises that the
+ * shadow registers are kept for interrupts, so EX AF,AF' and EXX save
+ * AF and BC, DE, HL instead of pushes; its body must not use them
+ * itself or enable interrupts.  A body must not return by itself,
+ * which would skip the restores.
+ *
+ * The registers are only known once the body is assembled, so pass 1
+ * keeps a copy of the code it emits and looks at each body at the end
+ * of an iteration.  Forward references in that copy hold the previous
+ * iteration's addresses, so a body is only looked at once an iteration
+ * moves no label; its saves are then replaced, growing or shrinking,
+ * and pass 1 repeats until they settle, as for relaxation.
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+#include "ez80dec.h"
+
+/* Registers saved */
+#define ISR_AF          0x01
+#define ISR_BC          0x02
+#define ISR_DE          0x04
+#define ISR_HL          0x08
+#define ISR_IX          0x10
+#define ISR_IY          0x20
+#define ISR_ALT         0x40    /* The shadow set, which the body uses */
+#define ISR_ALL         0x3F    /* AF to IY: what a full save pushes */
+
+/* Why a body could not be followed */
+#define ISR_WHY_NONE    0
+#define ISR_WHY_EXTERN  1
+#define ISR_WHY_TARGET  2
+#define ISR_WHY_INDIRECT 3
+#define ISR_WHY_RST     4
+#define ISR_WHY_DATA    5
+
+/* Relocations seen at a captured byte (isr_mark) */
+#define MARK_NONE       0
+#define MARK_CODE       1       /* To a label in the code section */
+#define MARK_OTHER      2       /* To an extern or other section */
+
+#define MAX_SEQ         32      /* Bytes of the longest save or restore */
+
+static const char *const why_text[] = {
+    "", "it calls or jumps to an external symbol",
+    "it calls or jumps to an address outside this file's code",
+    "it has an indirect jump", "it uses RST",
+    "its code runs on into data"
+};
+
+/* ============================================================
+ * Code Capture (pass 1)
+ * ============================================================ */
+
+/* Keep a code byte emitted at the PC */
+void isr_capture(AsmState *as, uint8 b)
+{
+    uint24 pc = as->pc;
+    uint24 max;
+    uint8 *code;
+    uint8 *mark;
+
+    if (pc >= as->isr_alloc) {
+        max = as->isr_alloc ? as->isr_alloc : 4096;
+        while (max <= pc) max *= 2;
+        code = (uint8 *)realloc(as->isr_code, max);
+        if (code) as->isr_code = code;
+        mark = code ? (uint8 *)realloc(as->isr_mark, max) : NULL;
+        if (!mark) {
+            asm_error(as, "out of memory for ISR analysis");
+            as->isr_capture = 0;
+            return;
+        }
+        as->isr_mark = mark;
+        as->isr_alloc = max;
+    }
+    as->isr_code[pc] = b;
+    as->isr_mark[pc] = (uint8)as->isr_reloc;
+    as->isr_reloc = MARK_NONE;
+    if (pc >= as->isr_extent) as->isr_extent = pc + 1;
+}
+
+/* A relocation is about to be emitted against symbol (or a section) */
+void isr_reloc(AsmState *as, const char *symbol, uint8 target_sect)
+{
+    const Symbol *sym;
+
+    if (symbol) {
+        target_sect = SECT_CODE;
+        if (symbol_extern_index(as, symbol) >= 0) {
+            target_sect = 0;
+        } else {
+            sym = symbol_find(as, symbol);
+            if (sym && sym->defined) target_sect = sym->section;
+        }
+    }
+    as->isr_reloc = target_sect == SECT_CODE ? MARK_CODE : MARK_OTHER;
+}
+
+/* ============================================================
+ * Body Analysis
+ * ============================================================ */
+
+static int isr_decode(AsmState *as, uint24 pc, Ez80Insn *d)
+{
+    int avail;
+
+    if (pc >= as->isr_extent) return 0;
+    avail = (int)(as->isr_extent - pc);
+    if (avail > MAX_INSN_LEN) avail = MAX_INSN_LEN;
+    return ez80_decode(as->isr_code + pc, avail, d);
+}
+
+/* Target of a jump or call at pc, or -1 with the reason in *why */
+static long isr_target(AsmState *as, uint24 pc, const Ez80Insn *d, int *why)
+{
+    if (d->attr & INSN_REL) {
+        return (long)pc + d->len + d->disp;
+    }
+    switch (as->isr_mark[pc + d->imm_pos]) {
+        case MARK_CODE:
+            return (long)d->imm;
+        case MARK_OTHER:
+            *why = ISR_WHY_EXTERN;
+            return -1;
+    }
+    *why = ISR_WHY_TARGET;
+    return -1;
+}
+
+/* Registers a body writes, following its jumps and calls */
+static void isr_body(AsmState *as, IsrInfo *isr, uint8 *seen, uint24 *stack)
+{
+    Ez80Insn d;
+    uint24 pc;
+    long target;
+    int sp = 0;
+    int follow_next;
+
+    memset(seen, 0, as->isr_extent);
+    isr->writes = 0;
+    isr->why = ISR_WHY_NONE;
+    isr->has_ei = 0;
+    if (isr->body >= isr->end) return;
+    seen[isr->body] = 1;
+    stack[sp++] = isr->body;
+
+    while (sp > 0) {
+        pc = stack[--sp];
+        if (pc == isr->end) continue;           /* The restores */
+        if (!isr_decode(as, pc, &d)) {
+            isr->why = ISR_WHY_DATA;
+            continue;
+        }
+        isr->writes |= d.writes & ~RM_SP;
+        if (d.attr & INSN_EI) isr->has_ei = 1;
+
+        follow_next = 1;
+        target = -1;
+        switch (d.flow) {
+            case FLOW_JUMP:
+                follow_next = 0;
+                /* fall through */
+            case FLOW_BRANCH:
+            case FLOW_CALL:
+            case FLOW_CALLCC:
+                target = isr_target(as, pc, &d, &isr->why);
+                break;
+            case FLOW_INDIRECT:
+                isr->why = ISR_WHY_INDIRECT;
+                follow_next = 0;
+                break;
+            case FLOW_RST:
+                isr->why = ISR_WHY_RST;
+                break;
+            case FLOW_RET:
+            case FLOW_RETI:
+                follow_next = 0;
+                break;
+        }
+
+        if (target >= 0) {
+            if (target >= (long)as->isr_extent) {
+                isr->why = ISR_WHY_TARGET;
+            } else if (!seen[target]) {
+                seen[target] = 1;
+                stack[sp++] = (uint24)target;
+            }
+        }
+        if (follow_next && !seen[pc + d.len]) {
+            if (pc + d.len >= as->isr_extent) {
+                isr->why = ISR_WHY_DATA;
+            } else {
+                seen[pc + d.len] = 1;
+                stack[sp++] = pc + d.len;
+            }
+        }
+    }
+}
+
+/* Saves needed for the registers a body writes */
+static unsigned isr_saves(const IsrInfo *isr)
+{
+    unsigned w = isr->writes;
+    unsigned saves = 0;
+
+    if (w & (RM_A | RM_F)) saves |= ISR_AF;
+    if (w & RM_BC) saves |= ISR_BC;
+    if (w & RM_DE) saves |= ISR_DE;
+    if (w & RM_HL) saves |= ISR_HL;
+    if (w & RM_IX) saves |= ISR_IX;
+    if (w & RM_IY) saves |= ISR_IY;
+    if ((w & RM_ALT) && !isr->shadow) saves |= ISR_ALT;
+    if (isr->why != ISR_WHY_NONE) saves |= ISR_ALL;
+    return saves;
+}
+
+/*
+ * End of a pass.  Pass 1 looks at every body in the code it kept,
+ * replacing the saves and asking for another iteration if any changed.
+ * The first iteration to see an ISR only starts keeping the code, and
+ * one that moved a label asks for another without looking, since its
+ * forward references are stale.
+ */
+int isr_finish(AsmState *as)
+{
+    IsrInfo *isr;
+    uint8 *seen;
+    uint24 *stack;
+    unsigned saves;
+    int changed = 0;
+    int i;
+
+    if (as->in_isr) {
+        as->line_num = as->isrs[as->isr_index - 1].line;
+        asm_error(as, "ISR without ENDISR");
+        as->in_isr = 0;
+        return -1;
+    }
+    if (as->pass != 1 || as->num_isrs == 0 || !as->isr_capture) {
+        return 0;
+    }
+    if (as->isr_partial || as->relax_moved) {
+        as->isr_partial = 0;
+        changed = 1;
+    } else {
+        seen = (uint8 *)malloc(as->isr_extent + 1);
+        stack = (uint24 *)malloc((as->isr_extent + 1) * sizeof(uint24));
+        if (!seen || !stack) {
+            if (seen) free(seen);
+            if (stack) free(stack);
+            asm_error(as, "out of memory for ISR analysis");
+            return -1;
+        }
+        for (i = 0; i < as->num_isrs; i++) {
+            isr = &as->isrs[i];
+            isr_body(as, isr, seen, stack);
+            saves = isr_saves(isr);
+            if (saves != isr->saves) {
+                isr->saves = saves;
+                changed = 1;
+            }
+        }
+        free(seen);
+        free(stack);
+    }
+    as->isr_extent = 0;
+
+    if (changed) {
+        if (as->relax_pass >= MAX_RELAX_PASSES) {
+            as->line_num = as->isrs[0].line;
+            asm_error(as, "ISR saves did not settle in %d passes",
+                      MAX_RELAX_PASSES);
+            return -1;
+        }
+        as->relax_changed = 1;
+    }
+    return 0;
+}
+
+/* ============================================================
+ * Saves and Restores
+ * ============================================================ */
+
+/* The instructions saving or restoring a set of registers */
+static int isr_sequence(unsigned saves, int shadow, int restore, uint8 *out)
+{
+    static const uint8 push[6][2] = {
+        { 0xF5, 0 }, { 0xC5, 0 }, { 0xD5, 0 }, { 0xE5, 0 },
+        { 0xDD, 0xE5 }, { 0xFD, 0xE5 }
+    };
+    int n = 0;
+    int exx = shadow && (saves & (ISR_BC | ISR_DE | ISR_HL));
+    int i, r;
+
+    if (restore) {
+        if (saves & ISR_ALT) {              /* EXX, POP HL/DE/BC, EXX... */
+            out[n++] = 0xD9;
+            out[n++] = 0xE1;
+            out[n++] = 0xD1;
+            out[n++] = 0xC1;
+            out[n++] = 0xD9;
+            out[n++] = 0x08;
+            out[n++] = 0xF1;
+            out[n++] = 0x08;
+        }
+        for (i = 5; i >= 0; i--) {
+            r = 1 << i;
+            if (!(saves & r)) continue;
+            if (shadow && r == ISR_AF) continue;
+            if (exx && (r & (ISR_BC | ISR_DE | ISR_HL))) continue;
+            if (i >= 4) out[n++] = push[i][0];
+            out[n++] = (uint8)(i >= 4 ? 0xE1 : push[i][0] - 4);
+        }
+    } else {
+        for (i = 0; i < 6; i++) {
+            r = 1 << i;
+            if (!(saves & r)) continue;
+            if (shadow && r == ISR_AF) continue;
+            if (exx && (r & (ISR_BC | ISR_DE | ISR_HL))) continue;
+            out[n++] = push[i][0];
+            if (i >= 4) out[n++] = push[i][1];
+        }
+        if (saves & ISR_ALT) {              /* EX AF,AF', PUSH AF... */
+            out[n++] = 0x08;
+            out[n++] = 0xF5;
+            out[n++] = 0x08;
+            out[n++] = 0xD9;
+            out[n++] = 0xC5;
+            out[n++] = 0xD5;
+            out[n++] = 0xE5;
+            out[n++] = 0xD9;
+        }
+    }
+    if (shadow && (saves & ISR_AF)) out[n++] = 0x08;
+    if (exx) out[n++] = 0xD9;
+    return n;
+}
+
+/* Cycles of a run of instructions */
+static long isr_cycles(const uint8 *code, int n)
+{
+    Ez80Insn d;
+    long cycles = 0;
+    int pos = 0;
+
+    while (pos < n && ez80_decode(code + pos, n - pos, &d)) {
+        cycles += d.cycles;
+        pos += d.len;
+    }
+    return cycles;
+}
+
+/* Emit instructions, recording each for the code analyses */
+static void isr_emit(AsmState *as, const uint8 *code, int n)
+{
+    Ez80Insn d;
+    int pos = 0;
+    int len;
+
+    while (pos < n) {
+        len = ez80_decode(code + pos, n - pos, &d);
+        if (len == 0) len = n - pos;
+        if (as->analyse && as->pass == 2) flow_record_insn(as);
+        emit_block(as, code + pos, len);
+        pos += len;
+    }
+}
+
+/*
+ * The note for a handler.  Under ISR SHADOW, AF is saved by EX AF,AF'
+ * and BC, DE and HL together by EXX, in the shadow set; the rest are
+ * pushed.
+ */
+static void isr_report(AsmState *as, const IsrInfo *isr)
+{
+    uint8 seq[MAX_SEQ];
+    static const char *const names[] = {
+        "AF", "BC", "DE", "HL", "IX", "IY", "AF' BC' DE' HL'"
+    };
+    char list[80];
+    char alt[64];
+    long cycles, all;
+    int i;
+
+    cycles = isr_cycles(seq, isr_sequence(isr->saves, isr->shadow, 0, seq)) +
+             isr_cycles(seq, isr_sequence(isr->saves, isr->shadow, 1, seq));
+    all = isr_cycles(seq, isr_sequence(ISR_ALL, 0, 0, seq)) +
+          isr_cycles(seq, isr_sequence(ISR_ALL, 0, 1, seq));
+
+    list[0] = '\0';
+    alt[0] = '\0';
+    for (i = 0; i < 7; i++) {
+        if (!(isr->saves & (1 << i))) continue;
+        if (isr->shadow && (1 << i) == ISR_AF) {
+            strcpy(alt, "AF");
+            continue;
+        }
+        if (isr->shadow && ((1 << i) & (ISR_BC | ISR_DE | ISR_HL))) {
+            continue;
+        }
+        if (list[0]) strcat(list, " ");
+        strcat(list, names[i]);
+    }
+    if (isr->shadow && (isr->saves & (ISR_BC | ISR_DE | ISR_HL))) {
+        strcat(alt, alt[0] ? " BC DE HL" : "BC DE HL");
+    }
+    if (alt[0]) {
+        if (list[0]) strcat(list, " on the stack and ");
+        strcat(list, alt);
+        strcat(list, " in the shadow registers");
+    }
+    printf("%s:%d: note: isr '%s' saves %s: %ld cycles, %ld %s than "
+           "saving AF to IY%s%s\n", as->filename, isr->line, isr->name,
+           list[0] ? list : "nothing", cycles,
+           cycles <= all ? all - cycles : cycles - all,
+           cycles <= all ? "fewer" : "more", isr->why ? "; " : "",
+           why_text[isr->why]);
+}
+
+/* ============================================================
+ * Directives
+ * ============================================================ */
+
+/* ISR [SHADOW]: the saves */
+int isr_begin(AsmState *as)
+{
+    IsrInfo *isrs;
+    IsrInfo *isr;
+    uint8 seq[MAX_SEQ];
+    int shadow = 0;
+    int max;
+
+    lexer_next(as);
+    if (as->current_token.type == TOK_IDENT &&
+        str_casecmp(as->current_token.text, "shadow") == 0) {
+        shadow = 1;
+        lexer_next(as);
+    }
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "ISR expects nothing or SHADOW");
+        return -1;
+    }
+    if (as->current_section != SECT_CODE) {
+        asm_error(as, "ISR must be in the code section");
+        return -1;
+    }
+    if (as->in_isr) {
+        asm_error(as, "ISR inside an ISR");
+        return -1;
+    }
+
+    if (as->isr_index >= as->num_isrs) {
+        if (as->num_isrs >= as->max_isrs) {
+            max = as->max_isrs ? as->max_isrs * 2 : 8;
+            isrs = (IsrInfo *)realloc(as->isrs, max * sizeof(IsrInfo));
+            if (!isrs) {
+                asm_error(as, "out of memory");
+                return -1;
+            }
+            as->isrs = isrs;
+            as->max_isrs = max;
+        }
+        memset(&as->isrs[as->num_isrs++], 0, sizeof(IsrInfo));
+        if (!as->isr_capture) {
+            as->isr_capture = 1;            /* From the next iteration */
+            as->isr_partial = 1;
+        }
+    }
+    isr = &as->isrs[as->isr_index++];
+    isr->shadow = shadow;
+    isr->line = as->line_num;
+    strncpy(isr->name, as->routine[0] ? as->routine : "?", MAX_LABEL_LEN - 1);
+    isr->name[MAX_LABEL_LEN - 1] = '\0';
+    as->in_isr = 1;
+
+    isr_emit(as, seq, isr_sequence(isr->saves, shadow, 0, seq));
+    isr->body = as->pc;
+    return 0;
+}
+
+/* ENDISR: the restores, EI and RETI */
+int isr_end(AsmState *as)
+{
+    static const uint8 ei_reti[] = { 0xFB, 0xED, 0x4D };
+    IsrInfo *isr;
+    uint8 seq[MAX_SEQ];
+
+    lexer_next(as);
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "unexpected operands after ENDISR");
+        return -1;
+    }
+    if (!as->in_isr) {
+        asm_error(as, "ENDISR without ISR");
+        return -1;
+    }
+    as->in_isr = 0;
+    isr = &as->isrs[as->isr_index - 1];
+    if (as->current_section != SECT_CODE) {
+        asm_error(as, "ENDISR must be in the code section");
+        return -1;
+    }
+    isr->end = as->pc;
+
+    if (as->pass == 2 && isr->shadow) {
+        if (isr->writes & RM_ALT) {
+            asm_error(as, "isr '%s' uses the shadow registers, which "
+                      "ISR SHADOW keeps for its saves", isr->name);
+            return -1;
+        }
+        if (isr->has_ei) {
+            asm_error(as, "isr '%s' enables interrupts, so a nested one "
+                      "would change the shadow registers", isr->name);
+            return -1;
+        }
+    }
+    if (as->pass == 2 && as->verbose) {
+        isr_report(as, isr);
+    }
+
+    isr_emit(as, seq, isr_sequence(isr->saves, isr->shadow, 1, seq));
+    isr_emit(as, ei_reti, (int)sizeof(ei_reti));
+    return 0;
+}
+
+/* An instruction of a body: a return there would leave without the
+ * restores, EI and RETI of ENDISR */
+void isr_instruction(AsmState *as, const char *mnemonic)
+{
+    if (!as->in_isr || as->pass != 2) {
+        return;
+    }
+    if (str_casecmp(mnemonic, "ret") == 0 ||
+        str_casecmp(mnemonic, "reti") == 0 ||
+        str_casecmp(mnemonic, "retn") == 0) {
+        asm_error(as, "isr '%s' returns before ENDISR, skipping its "
+                  "restores; jump to a label on the ENDISR line instead",
+                  as->isrs[as->isr_index - 1].name);
+    }
+}
+
+void isr_free(AsmState *as)
+{
+    if (as->isrs) free(as->isrs);
+    if (as->isr_code) free(as->isr_code);
+    if (as->isr_mark) free(as->isr_mark);
+    as->isrs = NULL;
+    as->isr_code = NULL;
+    as->isr_mark = NULL;
+    as->num_isrs = 0;
+    as->max_isrs = 0;
+    as->isr_alloc = 0;
+    as->isr_extent = 0;
+    as->isr_capture = 0;
+}
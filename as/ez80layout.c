@@ -0,0 +1,596 @@
+/*
+ * eZ80 ADL Mode Assembler - Profile-Guided Block Layout
+ *
+ * Taken branches cost a cycle more than branches that fall through,
+ * so code that jumps around rarely run blocks pays on every pass.
+ * Given per-branch taken counts from a profile, this rewrites the
+ * source before pass 1: where a conditional branch is mostly taken,
+ * the block it skips is moved to the end of the routine and the
+ * condition inverted, so the hot path falls through.
+ *
+ *         cp 10                   cp 10
+ *         jr c,ok         =>      branch nc,@cold
+ *         ld a,ERR        ok:     ...
+ *         ret                     ret
+ *     ok: ...                 @cold:
+ *         ...                     ld a,ERR
+ *         ret                     ret
+ *
+ * Distances change, so the rewritten branches use the BRANCH
+ * directive, which picks JR or JP from the final layout.  A block
+ * that fell through to the branch target gets a BRANCH back to it.
+ *
+ * With --split-cold, a block run at most once per COLD_RATIO runs of
+ * its branch goes to the cold part of the code instead (ez80cold.c),
+ * behind a COLD line after the rest of the routine.  Both branches to
+ * and from it become JP, so it is moved whatever the cycle count.
+ *
+ * Only the top-level source file is rewritten, and only between a
+ * global label and the next global label or directive; routines that
+ * use $ are left alone.  A line map keeps diagnostics on the original
+ * source lines.
+ *
+ * Profile format, one branch per line ('#' starts a comment):
+ *
+ *     file.asm:120 9500 500       (line, times taken, not taken)
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ez80asm.h"
+#include "ez80dec.h"
+
+/* Line kinds */
+#define LK_EMPTY        0       /* Blank, comment or label only */
+#define LK_INSN         1       /* Falls through */
+#define LK_BRANCH       2       /* JP cc / JR cc to a label */
+#define LK_JUMP         3       /* Never falls through */
+#define LK_BARRIER      4       /* Directive: nothing moves across it */
+
+#define COLD_RATIO      100     /* Branch runs per block run to go cold */
+
+typedef struct {
+    char *text;
+    int line;               /* Source line */
+    int next;               /* Next line in the layout, -1 = end */
+    int kind;
+    int global;             /* Defines a global label */
+    int uses_pc;            /* Mentions $ */
+    int cold;               /* COLD directive */
+    char label[MAX_LABEL_LEN];
+    int cc;                 /* LK_BRANCH condition */
+    int is_jr;
+    char target[MAX_LABEL_LEN];
+} LayoutLine;
+
+typedef struct {
+    int line;
+    long taken;
+    long not_taken;
+} ProfileEntry;
+
+typedef struct {
+    AsmState *as;
+    LayoutLine *lines;
+    int num_lines;
+    int max_lines;
+    ProfileEntry *profile;
+    int num_profile;
+    int num_labels;         /* Labels generated so far */
+    int num_cold;           /* Blocks moved to the cold part */
+} Layout;
+
+static const char *const cc_names[] = {
+    "nz", "z", "nc", "c", "po", "pe", "p", "m"
+};
+
+static const char *const directives[] = {
+    "org", "db", "defb", "byte", "dw", "defw", "word", "dl", "defl",
+    "long", "dd", "ds", "defs", "rmb", "blkb", "section", "segment",
+    "xdef", "public", "global", "xref", "extrn", "extern", "end",
+    "align", "ascii", "asciz", "asciiz", "assume", "include", "incbin",
+    "struct", "ends", "equ", "size", "type", "cold", "incbin_packed",
+    "db_packed", "unpacker", "modloader", "isr", "endisr",
+    "loopbound", NULL
+};
+
+/* ============================================================
+ * Profile
+ * ============================================================ */
+
+static const char *base_name(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    const char *q = strrchr(path, '\\');
+    
+    if (q && (!p || q > p)) p = q;
+    return p ? p + 1 : path;
+}
+
+static int profile_cmp(const void *a, const void *b)
+{
+    const ProfileEntry *pa = (const ProfileEntry *)a;
+    const ProfileEntry *pb = (const ProfileEntry *)b;
+    
+    return pa->line < pb->line ? -1 : pa->line > pb->line;
+}
+
+/* Load the counts for the file being assembled */
+static int profile_load(Layout *lay, const char *filename)
+{
+    AsmState *as = lay->as;
+    FILE *fp;
+    char buf[MAX_LINE_LEN];
+    char *colon, *end;
+    int max = 0;
+    long line, taken, not_taken;
+    ProfileEntry *grown;
+    
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "error: cannot open profile '%s'\n", filename);
+        return -1;
+    }
+    
+    while (fgets(buf, sizeof(buf), fp)) {
+        end = buf + strspn(buf, " \t");
+        if (*end == '#' || *end == '\n' || *end == '\0') continue;
+        
+        colon = strchr(end, ' ');
+        if (colon) *colon = '\0';
+        colon = strrchr(end, ':');
+        if (!colon || sscanf(colon + 1, "%ld", &line) != 1 ||
+            sscanf(end + strlen(end) + 1, "%ld %ld", &taken, &not_taken) != 2) {
+            fprintf(stderr, "error: %s: expected 'file:line taken not-taken'\n",
+                    filename);
+            fclose(fp);
+            return -1;
+        }
+        *colon = '\0';
+        if (strcmp(end, as->filename) != 0 &&
+            strcmp(base_name(end), base_name(as->filename)) != 0) {
+            continue;
+        }
+        
+        if (lay->num_profile >= max) {
+            max = max ? max * 2 : 256;
+            grown = (ProfileEntry *)realloc(lay->profile,
+                                            max * sizeof(ProfileEntry));
+            if (!grown) {
+                fprintf(stderr, "error: out of memory for profile\n");
+                fclose(fp);
+                return -1;
+            }
+            lay->profile = grown;
+        }
+        lay->profile[lay->num_profile].line = (int)line;
+        lay->profile[lay->num_profile].taken = taken;
+        lay->profile[lay->num_profile].not_taken = not_taken;
+        lay->num_profile++;
+    }
+    fclose(fp);
+    
+    if (lay->num_profile > 0) {
+        qsort(lay->profile, lay->num_profile, sizeof(ProfileEntry),
+              profile_cmp);
+    }
+    return 0;
+}
+
+static const ProfileEntry *profile_find(Layout *lay, int line)
+{
+    ProfileEntry key;
+    
+    if (lay->num_profile == 0) return NULL;
+    key.line = line;
+    return (const ProfileEntry *)bsearch(&key, lay->profile, lay->num_profile,
+                                         sizeof(ProfileEntry), profile_cmp);
+}
+
+/* ============================================================
+ * Source Lines
+ * ============================================================ */
+
+/* Whether the text refers to the location counter */
+static int mentions_pc(const char *p)
+{
+    char quote = 0;
+    
+    for (; *p; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == ';') {
+            break;
+        } else if (*p == '$' && !isxdigit((unsigned char)p[1])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Classify a line with the assembler's lexer */
+static void classify(AsmState *as, LayoutLine *l)
+{
+    char mnemonic[MAX_LABEL_LEN];
+    Token *tok, *peek;
+    int i;
+    
+    l->kind = LK_EMPTY;
+    l->uses_pc = mentions_pc(l->text);
+    
+    lexer_init(as, l->text);
+    tok = lexer_next(as);
+    
+    if (tok->type == TOK_LABEL) {
+        strcpy(l->label, tok->text);
+        tok = lexer_next(as);
+    } else if (tok->type == TOK_IDENT) {
+        peek = lexer_peek(as);
+        if (peek->type == TOK_EQUALS ||
+            (peek->type == TOK_IDENT && is_label_directive(peek->text))) {
+            l->kind = LK_BARRIER;
+            return;
+        }
+    }
+    l->global = l->label[0] && !symbol_is_local(l->label);
+    
+    if (tok->type == TOK_EOL || tok->type == TOK_EOF) return;
+    if (tok->type != TOK_IDENT) {
+        l->kind = LK_BARRIER;
+        return;
+    }
+    
+    strcpy(mnemonic, tok->text[0] == '.' ? tok->text + 1 : tok->text);
+    for (i = 0; directives[i]; i++) {
+        if (str_casecmp(mnemonic, directives[i]) == 0) {
+            l->kind = LK_BARRIER;
+            l->cold = str_casecmp(mnemonic, "cold") == 0;
+            return;
+        }
+    }
+    if (str_casecmp(mnemonic, "jumptable") == 0 ||
+        str_casecmp(mnemonic, "reti") == 0 ||
+        str_casecmp(mnemonic, "retn") == 0) {
+        l->kind = LK_JUMP;
+        return;
+    }
+    
+    l->kind = LK_INSN;
+    if (str_casecmp(mnemonic, "ret") == 0) {
+        tok = lexer_next(as);
+        if (tok->type == TOK_EOL || tok->type == TOK_EOF) l->kind = LK_JUMP;
+        return;
+    }
+    if (str_casecmp(mnemonic, "jp") != 0 && str_casecmp(mnemonic, "jr") != 0 &&
+        str_casecmp(mnemonic, "branch") != 0) {
+        return;
+    }
+    
+    /* jp/jr [cc,]target */
+    l->is_jr = str_casecmp(mnemonic, "jr") == 0;
+    l->cc = CC_NONE;
+    tok = lexer_next(as);
+    if (tok->type == TOK_IDENT && lexer_peek(as)->type == TOK_COMMA) {
+        l->cc = parse_condition(tok->text);
+        lexer_next(as);
+        tok = lexer_next(as);
+    }
+    if (l->cc == CC_NONE) {
+        l->kind = LK_JUMP;
+        return;
+    }
+    if (tok->type != TOK_IDENT) return;
+    strcpy(l->target, tok->text);
+    tok = lexer_next(as);
+    if (tok->type == TOK_EOL || tok->type == TOK_EOF) l->kind = LK_BRANCH;
+}
+
+/* Append a line; returns its index or -1 */
+static int add_line(Layout *lay, const char *text, int line)
+{
+    LayoutLine *grown;
+    LayoutLine *l;
+    int max;
+    
+    if (lay->num_lines >= lay->max_lines) {
+        max = lay->max_lines ? lay->max_lines * 2 : 1024;
+        grown = (LayoutLine *)realloc(lay->lines, max * sizeof(LayoutLine));
+        if (!grown) return -1;
+        lay->lines = grown;
+        lay->max_lines = max;
+    }
+    
+    l = &lay->lines[lay->num_lines];
+    memset(l, 0, sizeof(*l));
+    l->text = (char *)malloc(strlen(text) + 1);
+    if (!l->text) return -1;
+    strcpy(l->text, text);
+    l->line = line;
+    l->next = -1;
+    classify(lay->as, l);
+    return lay->num_lines++;
+}
+
+static int read_source(Layout *lay, FILE *fp)
+{
+    char buf[MAX_LINE_LEN];
+    int len;
+    int line = 0;
+    
+    while (fgets(buf, sizeof(buf), fp)) {
+        line++;
+        len = strlen(buf);
+        if (len == MAX_LINE_LEN - 1 && buf[len - 1] != '\n') {
+            return 1;       /* Too long: left for pass 1 to report */
+        }
+        if (len > 0 && buf[len - 1] == '\n') buf[--len] = '\0';
+        if (add_line(lay, buf, line) < 0) return -1;
+        if (line > 1) lay->lines[lay->num_lines - 2].next = lay->num_lines - 1;
+    }
+    return 0;
+}
+
+/* ============================================================
+ * Layout
+ * ============================================================ */
+
+/* Cycles of a branch taken and not taken, from the decoder */
+static void branch_cost(int is_jr, int cc, long *taken, long *not_taken)
+{
+    uint8 code[4];
+    Ez80Insn d;
+    
+    memset(code, 0, sizeof(code));
+    if (cc == CC_NONE) code[0] = is_jr ? 0x18 : 0xC3;
+    else code[0] = (uint8)(is_jr ? 0x20 | (cc << 3) : 0xC2 | (cc << 3));
+    ez80_decode(code, sizeof(code), &d);
+    *taken = d.cycles_taken;
+    *not_taken = d.cycles;
+}
+
+/*
+ * Try to move the block skipped by branch b to the end of its
+ * routine, or to the cold part.  Sets *saved to the estimated cycles
+ * saved (negative if a cold block costs cycles).  Returns 1 if moved,
+ * 0 if not worth it or not possible, or -1 if out of memory.
+ */
+static int move_block(Layout *lay, int b, const ProfileEntry *p, long *saved)
+{
+    AsmState *as = lay->as;
+    LayoutLine *lines = lay->lines;
+    LayoutLine *br = &lines[b];
+    char text[MAX_LINE_LEN];
+    char cold[MAX_LABEL_LEN];
+    int first, last, after, end, tail, i, n;
+    int falls, back, is_jr;
+    int icc = br->cc ^ 1;
+    int to_cold = as->split_cold &&
+                  p->not_taken * COLD_RATIO <= p->taken + p->not_taken;
+    long t, nt, jt, jn, before, now;
+    
+    /* The block runs from after the branch to the last statement
+     * before the target label */
+    first = br->next;
+    last = -1;
+    for (i = first; i >= 0; i = lines[i].next) {
+        if (strcmp(lines[i].label, br->target) == 0) break;
+        if (lines[i].kind == LK_BARRIER || lines[i].global || lines[i].uses_pc) {
+            return 0;
+        }
+        if (lines[i].kind != LK_EMPTY) last = i;
+    }
+    if (i < 0 || last < 0) return 0;
+    falls = lines[last].kind != LK_JUMP;
+    
+    /* The routine must end with a jump or return for the block to go
+     * after it; a cold block goes after any earlier cold blocks */
+    end = -1;
+    tail = b;
+    for (i = lines[last].next; i >= 0; i = lines[i].next) {
+        if (lines[i].global) break;
+        if (lines[i].kind == LK_BARRIER && (!to_cold || !lines[i].cold)) break;
+        if (lines[i].uses_pc) return 0;
+        if (lines[i].kind != LK_EMPTY && !lines[i].cold) end = i;
+        tail = i;
+    }
+    if (!to_cold && (end < 0 || lines[end].kind != LK_JUMP)) return 0;
+    
+    /* Cycles for the profiled path counts, before and after; branches
+     * to and from the cold part are JP */
+    is_jr = to_cold ? 0 : br->is_jr;
+    branch_cost(br->is_jr, br->cc, &t, &nt);
+    before = p->taken * t + p->not_taken * nt;
+    branch_cost(is_jr, icc, &t, &nt);
+    now = p->taken * nt + p->not_taken * t;
+    if (falls) {
+        branch_cost(is_jr, CC_NONE, &jt, &jn);
+        now += p->not_taken * jt;
+    }
+    if (now >= before && !to_cold) return 0;
+    
+    /* Label the block */
+    if (lines[first].label[0] && lines[first].kind != LK_BARRIER) {
+        strcpy(cold, lines[first].label);
+    } else {
+        sprintf(cold, "@__cold%d", ++lay->num_labels);
+        sprintf(text, "%s:", cold);
+        n = add_line(lay, text, lines[first].line);
+        if (n < 0) return -1;
+        lines = lay->lines;
+        br = &lines[b];
+        lines[n].next = first;
+        first = n;
+    }
+    
+    /* A block that fell through to the target branches back to it */
+    if (falls) {
+        sprintf(text, "\tbranch %s", br->target);
+        n = add_line(lay, text, lines[last].line);
+        if (n < 0) return -1;
+        lines = lay->lines;
+        br = &lines[b];
+        lines[n].next = lines[last].next;
+        lines[last].next = n;
+        last = n;
+    }
+    
+    /* Unlink the block and put it after the routine's last statement,
+     * or behind a COLD line at the very end of the routine */
+    after = lines[last].next;
+    br->next = after;
+    if (to_cold) {
+        n = add_line(lay, "\tcold", lines[first].line);
+        if (n < 0) return -1;
+        lines = lay->lines;
+        br = &lines[b];
+        lines[n].next = first;
+        lines[last].next = lines[tail].next;
+        lines[tail].next = n;
+    } else {
+        lines[last].next = lines[end].next;
+        lines[end].next = first;
+    }
+    
+    /* Invert the branch to the block */
+    if (br->label[0]) {
+        sprintf(text, "%s:\tbranch %s,%s", br->label, cc_names[icc], cold);
+    } else {
+        sprintf(text, "\tbranch %s,%s", cc_names[icc], cold);
+    }
+    back = br->line;
+    free(br->text);
+    br->text = (char *)malloc(strlen(text) + 1);
+    if (!br->text) return -1;
+    strcpy(br->text, text);
+    br->kind = LK_INSN;
+    
+    if (as->verbose && to_cold) {
+        printf("%s:%d: note: moved block at line %d to the cold part, "
+               "%+ld cycles\n", as->filename, back, lines[first].line,
+               now - before);
+    } else if (as->verbose) {
+        printf("%s:%d: note: moved block at line %d after line %d, "
+               "saving %ld cycles\n", as->filename, back, lines[first].line,
+               lines[end].line, before - now);
+    }
+    if (to_cold) lay->num_cold++;
+    *saved = before - now;
+    return 1;
+}
+
+static void layout_free(Layout *lay)
+{
+    int i;
+    
+    for (i = 0; i < lay->num_lines; i++) {
+        free(lay->lines[i].text);
+    }
+    if (lay->lines) free(lay->lines);
+    if (lay->profile) free(lay->profile);
+}
+
+/* ============================================================
+ * Entry Point
+ * ============================================================ */
+
+/*
+ * Rewrite the source for the profile in as->profile.  Returns a temp
+ * file with the new source (as->line_map holding the source line of
+ * each of its lines), fp itself (rewound) if nothing moved, or NULL
+ * on error.
+ */
+FILE *layout_file(AsmState *as, FILE *fp)
+{
+    Layout lay;
+    FILE *out;
+    long cycles = 0;
+    long saved = 0;
+    long t, nt, s;
+    int moved = 0;
+    int m;
+    int count, i, r;
+    const ProfileEntry *p;
+    
+    memset(&lay, 0, sizeof(lay));
+    lay.as = as;
+    
+    ttrace_begin(as->trace, "profile layout", as->filename);
+    
+    if (profile_load(&lay, as->profile) < 0) {
+        layout_free(&lay);
+        ttrace_end(as->trace);
+        return NULL;
+    }
+    r = read_source(&lay, fp);
+    if (r < 0) {
+        fprintf(stderr, "error: out of memory for profile layout\n");
+        layout_free(&lay);
+        ttrace_end(as->trace);
+        return NULL;
+    }
+    
+    /* Branches in source order; the lines added while moving blocks
+     * are not candidates */
+    count = r == 0 ? lay.num_lines : 0;
+    for (i = 0; i < count; i++) {
+        if (lay.lines[i].kind != LK_BRANCH) continue;
+        p = profile_find(&lay, lay.lines[i].line);
+        if (!p) continue;
+        branch_cost(lay.lines[i].is_jr, lay.lines[i].cc, &t, &nt);
+        cycles += p->taken * t + p->not_taken * nt;
+        if (p->taken <= p->not_taken) continue;
+        
+        m = move_block(&lay, i, p, &s);
+        if (m < 0) {
+            fprintf(stderr, "error: out of memory for profile layout\n");
+            layout_free(&lay);
+            ttrace_end(as->trace);
+            return NULL;
+        }
+        if (m > 0) {
+            saved += s;
+            moved++;
+        }
+    }
+    
+    printf("%s: note: profile layout moved %d block%s", as->filename, moved,
+           moved == 1 ? "" : "s");
+    if (as->split_cold) {
+        printf(" (%d to the cold part)", lay.num_cold);
+    }
+    printf(", branch cycles %ld -> %ld (%+ld)\n", cycles, cycles - saved,
+           -saved);
+    
+    rewind(fp);
+    if (moved == 0) {
+        layout_free(&lay);
+        ttrace_end(as->trace);
+        return fp;
+    }
+    
+    out = tmpfile();
+    as->line_map = (int *)malloc(lay.num_lines * sizeof(int));
+    if (!out || !as->line_map) {
+        fprintf(stderr, "error: cannot create temporary files\n");
+        if (out) fclose(out);
+        layout_free(&lay);
+        ttrace_end(as->trace);
+        return NULL;
+    }
+    as->num_line_map = 0;
+    for (i = 0; i >= 0 && as->num_line_map < lay.num_lines; i = lay.lines[i].next) {
+        fprintf(out, "%s\n", lay.lines[i].text);
+        as->line_map[as->num_line_map++] = lay.lines[i].line;
+    }
+    rewind(out);
+    
+    layout_free(&lay);
+    ttrace_end(as->trace);
+    return out;
+}
@@ -0,0 +1,354 @@
+/*
+ * eZ80 ADL Mode Assembler - Module Loader
+ *
+ * MODLOADER emits the routine that loads a module made by the linker
+ * with --module (see ld/ldmod.c), binding its imports to the program's
+ * export table (ld --exports, at __exports):
+ *
+ *     modload: modloader
+ *
+ *             ld hl,module            ; read into memory[5] bytes
+ *             ld de,__exports
+ *             call modload            ; NC: HL = the module's exports
+ *
+ * The module must be read into a block of the size in its header (the
+ * 24-bit field at 5), which the loader turns into the running module:
+ * it adds the image's address to each fixup, adds each import's value
+ * to its fields, and clears the BSS.  It returns C with HL = 0 for a
+ * bad header, or with HL = the name of an import the program does not
+ * export.  modload.find looks a name up in an export table, such as
+ * the one a module returns:
+ *
+ *             ld hl,exports           ; HL = table, DE = name, NUL ended
+ *             ld de,name
+ *             call modload.find       ; NC: HL = its value
+ *
+ * Names match whatever their case, as the linker resolves them.  Both
+ * change AF, BC, DE and HL.  The loader is assembled from source, so
+ * it is relocated and checked like any other code (412 bytes).
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+
+#define MOD_PREFIX      "@__ml_" /* Its local labels */
+
+/*
+ * The loader, label first; "@" labels are given MOD_PREFIX.  The
+ * module starts with "EZ8M", version 1, memory, then 24-bit fields:
+ * image size at 8, BSS size at 11, exports at 14, fixup count at 17,
+ * import count at 20 and the image at 23.
+ */
+static const char *const loader_src[] = {
+    /* IX = module header; check the magic and version */
+    "\tpush ix",
+    "\tpush iy",
+    "\tpush de",
+    "\tpush hl",
+    "\tpop ix",
+    "\tld a,(ix+0)",
+    "\tcp 'E'",
+    "\tjr nz,@bad",
+    "\tld a,(ix+1)",
+    "\tcp 'Z'",
+    "\tjr nz,@bad",
+    "\tld a,(ix+2)",
+    "\tcp '8'",
+    "\tjr nz,@bad",
+    "\tld a,(ix+3)",
+    "\tcp 'M'",
+    "\tjr nz,@bad",
+    "\tld a,(ix+4)",
+    "\tcp 1",
+    "\tjr z,@ok",
+    "@bad:\tld hl,0",
+    "\tpop de",
+    "\tpop iy",
+    "\tpop ix",
+    "\tscf",
+    "\tret",
+
+    /* Add the image address to each fixup, IY walking the tables */
+    "@ok:\tlea iy,ix+23",
+    "\tld de,(ix+8)",
+    "\tadd iy,de",
+    "\tld bc,(ix+17)",
+    "@fix:\tld hl,0",
+    "\tor a",
+    "\tsbc hl,bc",
+    "\tjr z,@imports",
+    "\tdec bc",
+    "\tpush bc",
+    "\tlea de,ix+23",
+    "\tld hl,(iy+0)",
+    "\tlea iy,iy+3",
+    "\tadd hl,de",
+    "\tpush hl",
+    "\tld hl,(hl)",
+    "\tadd hl,de",
+    "\tex de,hl",
+    "\tpop hl",
+    "\tld (hl),de",
+    "\tpop bc",
+    "\tjr @fix",
+
+    /* Find each import in the program's table and add it to its fields */
+    "@imports:\tld bc,(ix+20)",
+    "@import:\tld hl,0",
+    "\tor a",
+    "\tsbc hl,bc",
+    "\tjr z,@bss",
+    "\tdec bc",
+    "\tpop hl",
+    "\tpush hl",
+    "\tpush bc",
+    "\tpush iy",
+    "\tpop de",
+    "\tcall @find",
+    "\tjr c,@missing",
+    "\tex de,hl",
+    "@name:\tld a,(iy+0)",
+    "\tinc iy",
+    "\tor a",
+    "\tjr nz,@name",
+    "\tld bc,(iy+0)",
+    "\tlea iy,iy+3",
+    "@site:\tld hl,0",
+    "\tor a",
+    "\tsbc hl,bc",
+    "\tjr z,@sited",
+    "\tdec bc",
+    "\tpush bc",
+    "\tpush de",
+    "\tlea de,ix+23",
+    "\tld hl,(iy+0)",
+    "\tlea iy,iy+3",
+    "\tadd hl,de",
+    "\tpop de",
+    "\tpush hl",
+    "\tld hl,(hl)",
+    "\tadd hl,de",
+    "\tex (sp),hl",
+    "\tpop bc",
+    "\tld (hl),bc",
+    "\tpop bc",
+    "\tjr @site",
+    "@sited:\tpop bc",
+    "\tjr @import",
+
+    /* Not found: C, HL = its name */
+    "@missing:\tpop bc",
+    "\tpush iy",
+    "\tpop hl",
+    "\tpop de",
+    "\tpop iy",
+    "\tpop ix",
+    "\tret",
+
+    /* Clear the BSS after the image */
+    "@bss:\tlea hl,ix+23",
+    "\tld de,(ix+8)",
+    "\tadd hl,de",
+    "\tld bc,(ix+11)",
+    "\tpush hl",
+    "\tld hl,0",
+    "\tor a",
+    "\tsbc hl,bc",
+    "\tpop hl",
+    "\tjr z,@done",
+    "\tld (hl),0",
+    "\tdec bc",
+    "\tpush hl",
+    "\tld hl,0",
+    "\tor a",
+    "\tsbc hl,bc",
+    "\tpop hl",
+    "\tjr z,@done",
+    "\tpush hl",
+    "\tpop de",
+    "\tinc de",
+    "\tldir",
+
+    /* NC, HL = the module's export table */
+    "@done:\tlea hl,ix+23",
+    "\tld de,(ix+14)",
+    "\tadd hl,de",
+    "\tpop de",
+    "\tpop iy",
+    "\tpop ix",
+    "\tor a",
+    "\tret",
+
+    /* FIND: hash the name at DE, then search its bucket in the table at
+     * HL.  Names match whatever their case, as they do in the linker. */
+    "@find:\tpush ix",
+    "\tpush iy",
+    "\tpush hl",
+    "\tpop ix",
+    "\tpush de",
+    "\tld hl,5381",
+    "@hash:\tld a,(de)",
+    "\tor a",
+    "\tjr z,@bucket",
+    "\tcall @lower",
+    "\tpush hl",
+    "\tpop bc",
+    "\tadd hl,hl",
+    "\tadd hl,hl",
+    "\tadd hl,hl",
+    "\tadd hl,hl",
+    "\tadd hl,hl",
+    "\tadd hl,bc",
+    "\txor l",
+    "\tld l,a",
+    "\tinc de",
+    "\tjr @hash",
+
+    /* Read the bucket's offset, then the next bucket's */
+    "@bucket:\tld bc,0",
+    "\tld a,l",
+    "\tand (ix+0)",
+    "\tld c,a",
+    "\tld a,h",
+    "\tand (ix+1)",
+    "\tld b,a",
+    "\tex de,hl",
+    "\tlea hl,ix+2",
+    "\tadd hl,bc",
+    "\tadd hl,bc",
+    "\tld bc,0",
+    "\tld c,(hl)",
+    "\tinc hl",
+    "\tld b,(hl)",
+    "\tinc hl",
+    "\tpush bc",
+    "\tld bc,0",
+    "\tld c,(hl)",
+    "\tinc hl",
+    "\tld b,(hl)",
+
+    /* (SP) = the end of the bucket, where the next one starts */
+    "\tpush ix",
+    "\tpop hl",
+    "\tadd hl,bc",
+    "\tpop bc",
+    "\tpush hl",
+
+    /* IY = the bucket's first entry */
+    "\tpush ix",
+    "\tpop iy",
+    "\tadd iy,bc",
+
+    /* Entries: the hash, then the name */
+    "@entry:\tpop hl",
+    "\tpush hl",
+    "\tpush de",
+    "\tpush iy",
+    "\tpop de",
+    "\tor a",
+    "\tsbc hl,de",
+    "\tpop de",
+    "\tjr z,@none",
+    "\tld a,(iy+0)",
+    "\tcp e",
+    "\tjr nz,@next",
+    "\tld a,(iy+1)",
+    "\tcp d",
+    "\tjr nz,@next",
+    "\tpop bc",
+    "\tpop hl",
+    "\tpush hl",
+    "\tpush bc",
+    "\tpush de",
+    "\tlea bc,iy+5",
+    "@cmp:\tld a,(hl)",
+    "\tcall @lower",
+    "\tld e,a",
+    "\tld a,(bc)",
+    "\tcall @lower",
+    "\tcp e",
+    "\tjr nz,@differ",
+    "\tinc bc",
+    "\tinc hl",
+    "\tor a",
+    "\tjr nz,@cmp",
+    "\tpop de",
+    "\tld hl,(iy+2)",
+    "\tpop bc",
+    "\tpop bc",
+    "\tpop iy",
+    "\tpop ix",
+    "\tret",
+    "@differ:\tpop de",
+    "@next:\tlea iy,iy+5",
+    "@skip:\tld a,(iy+0)",
+    "\tinc iy",
+    "\tor a",
+    "\tjr nz,@skip",
+    "\tjr @entry",
+    "@none:\tpop bc",
+    "\tpop bc",
+    "\tpop iy",
+    "\tpop ix",
+    "\tscf",
+    "\tret",
+
+    /* A to lower case */
+    "@lower:\tcp 'A'",
+    "\tret c",
+    "\tcp 'Z'+1",
+    "\tret nc",
+    "\tor 32",
+    "\tret"
+};
+
+int mod_loader(AsmState *as, const char *label)
+{
+    char line[64];
+    char name[MAX_LABEL_LEN];
+    const char *s;
+    int i, n;
+
+    lexer_next(as);
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "unexpected operands after MODLOADER");
+        return -1;
+    }
+    if (label[0] == '\0' || symbol_is_local(label)) {
+        asm_error(as, "MODLOADER requires a global label");
+        return -1;
+    }
+    if (as->current_section != SECT_CODE) {
+        asm_error(as, "MODLOADER must be in the code section");
+        return -1;
+    }
+    if (strlen(label) + 5 >= MAX_LABEL_LEN) {
+        asm_error(as, "label '%s' is too long for MODLOADER", label);
+        return -1;
+    }
+
+    for (i = 0; i < (int)(sizeof(loader_src) / sizeof(loader_src[0])); i++) {
+        if (strncmp(loader_src[i], "@find:", 6) == 0) {
+            sprintf(name, "%s.find", label);
+            symbol_define(as, name, as->pc);
+        }
+        n = 0;
+        for (s = loader_src[i]; *s; s++) {
+            if (*s == '@') {
+                strcpy(line + n, MOD_PREFIX);
+                n += (int)strlen(MOD_PREFIX);
+            } else {
+                line[n++] = *s;
+            }
+        }
+        line[n] = '\0';
+        if (asm_line(as, line) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
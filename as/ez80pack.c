@@ -0,0 +1,715 @@
+/*
+ * eZ80 ADL Mode Assembler - Packed Data
+ *
+ * Pictures, maps and text pack well, and unpacking them when needed
+ * costs less than the room they take whole.  INCBIN_PACKED and
+ * DB_PACKED pack their data as it is assembled:
+ *
+ *     title:  incbin_packed "title.bin", lz
+ *     font:   db_packed rle, 0,0,0,0,18h,3Ch,7Eh,7Eh
+ *     unlz:   unpacker lz
+ *
+ * A label on the line also gets title.size, the unpacked size, and
+ * title.packed, the bytes the packed data takes.  UNPACKER emits the
+ * routine for a codec, which unpacks from HL to DE and changes AF, BC,
+ * DE and HL:
+ *
+ *             ld hl,title
+ *             ld de,screen
+ *             call unlz               ; DE = screen + title.size
+ *
+ * Both codecs are streams of control bytes, ended by a 0:
+ *
+ *     1 to 127          that many bytes follow, to be copied
+ *     rle 128 to 255    the next byte, (control - 126) times
+ *     lz 128 to 255     (control - 125) bytes copied from earlier
+ *                       output, a 16-bit offset back from DE after
+ *
+ * so both unpackers are short loops round LDIR (28 and 46 bytes).
+ *
+ * Every pass assembles the data again, and packing a large file takes
+ * a while.  Results are kept by the CRC-32 and FNV-1a hashes, codec
+ * and size of their data, so each is packed once a run; with
+ * --pack-cache=<dir> they are also kept in files there for later runs.
+ * DB_PACKED values can change while pass 1 repeats (differences of
+ * labels), so packed data is sized by relaxation, zeros after the end
+ * filling out any bytes it no longer needs.
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+
+#define PACK_RLE        1
+#define PACK_LZ         2
+
+#define PACK_LITERALS   127     /* Most bytes one control byte copies */
+#define RLE_MIN         3       /* Shortest run worth a control byte */
+#define RLE_MAX         129
+#define LZ_MIN          4       /* Shortest match shorter than its copy */
+#define LZ_MAX          130
+#define LZ_WINDOW       8192    /* How far back matches are looked for */
+#define LZ_HASH         4096
+#define LZ_CHAIN        32      /* Earlier positions tried per match */
+#define CACHE_HEADER    6       /* "PK", codec, unpacked size */
+
+/* Reference unpackers, HL = packed data, DE = destination; only
+ * relative jumps, so they need no relocations */
+static const uint8 unrle_code[] = {
+    0x7E,                       /* @top:  ld a,(hl)   */
+    0x23,                       /*        inc hl      */
+    0xB7,                       /*        or a        */
+    0xC8,                       /*        ret z       */
+    0x01, 0x00, 0x00, 0x00,     /*        ld bc,0     */
+    0xCB, 0x7F,                 /*        bit 7,a     */
+    0x20, 0x05,                 /*        jr nz,@run  */
+    0x4F,                       /*        ld c,a      */
+    0xED, 0xB0,                 /*        ldir        */
+    0x18, 0xEF,                 /*        jr @top     */
+    0xD6, 0x7E,                 /* @run:  sub 126     */
+    0x47,                       /*        ld b,a      */
+    0x7E,                       /*        ld a,(hl)   */
+    0x23,                       /*        inc hl      */
+    0x12,                       /* @fill: ld (de),a   */
+    0x13,                       /*        inc de      */
+    0x10, 0xFC,                 /*        djnz @fill  */
+    0x18, 0xE4                  /*        jr @top     */
+};
+static const uint8 unrle_insns[] = {
+    1, 1, 1, 1, 4, 2, 2, 1, 2, 2, 2, 1, 1, 1, 1, 1, 2, 2
+};
+
+static const uint8 unlz_code[] = {
+    0x7E,                       /* @top:  ld a,(hl)     */
+    0x23,                       /*        inc hl        */
+    0xB7,                       /*        or a          */
+    0xC8,                       /*        ret z         */
+    0x01, 0x00, 0x00, 0x00,     /*        ld bc,0       */
+    0xCB, 0x7F,                 /*        bit 7,a       */
+    0x20, 0x05,                 /*        jr nz,@match  */
+    0x4F,                       /*        ld c,a        */
+    0xED, 0xB0,                 /*        ldir          */
+    0x18, 0xEF,                 /*        jr @top       */
+    0xE6, 0x7F,                 /* @match: and 7Fh      */
+    0xC6, 0x03,                 /*        add a,3       */
+    0x4F,                       /*        ld c,a        */
+    0x7E,                       /*        ld a,(hl)     */
+    0x23,                       /*        inc hl        */
+    0xE5,                       /*        push hl       */
+    0x21, 0x00, 0x00, 0x00,     /*        ld hl,0       */
+    0x6F,                       /*        ld l,a        */
+    0xE3,                       /*        ex (sp),hl    */
+    0x7E,                       /*        ld a,(hl)     */
+    0x23,                       /*        inc hl        */
+    0xE3,                       /*        ex (sp),hl    */
+    0x67,                       /*        ld h,a        */
+    0xEB,                       /*        ex de,hl      */
+    0xE5,                       /*        push hl       */
+    0xB7,                       /*        or a          */
+    0xED, 0x52,                 /*        sbc hl,de     */
+    0xD1,                       /*        pop de        */
+    0xED, 0xB0,                 /*        ldir          */
+    0xE1,                       /*        pop hl        */
+    0x18, 0xD2                  /*        jr @top       */
+};
+static const uint8 unlz_insns[] = {
+    1, 1, 1, 1, 4, 2, 2, 1, 2, 2, 2, 2, 1, 1, 1, 1,
+    4, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 2, 1, 2
+};
+
+static int pack_codec(const char *name)
+{
+    if (str_casecmp(name, "rle") == 0) return PACK_RLE;
+    if (str_casecmp(name, "lz") == 0) return PACK_LZ;
+    return 0;
+}
+
+static const char *codec_name(int codec)
+{
+    return codec == PACK_RLE ? "rle" : "lz";
+}
+
+/* ============================================================
+ * Codecs
+ * ============================================================ */
+
+/* Bytes the packed form can take at most: all literals, and the end */
+static long pack_bound(long size)
+{
+    return size + size / PACK_LITERALS + 2;
+}
+
+/* Literals, PACK_LITERALS to a control byte */
+static long put_literals(uint8 *out, long o, const uint8 *src, long n)
+{
+    long k;
+
+    while (n > 0) {
+        k = n < PACK_LITERALS ? n : PACK_LITERALS;
+        out[o++] = (uint8)k;
+        memcpy(out + o, src, (size_t)k);
+        o += k;
+        src += k;
+        n -= k;
+    }
+    return o;
+}
+
+static long pack_rle(const uint8 *src, long n, uint8 *out)
+{
+    long lit = 0;               /* First literal not yet written */
+    long i = 0;
+    long o = 0;
+    long run;
+
+    while (i < n) {
+        for (run = 1; i + run < n && run < RLE_MAX &&
+             src[i + run] == src[i]; run++)
+            ;
+        if (run < RLE_MIN) {
+            i += run;
+            continue;
+        }
+        o = put_literals(out, o, src + lit, i - lit);
+        out[o++] = (uint8)(run + 126);
+        out[o++] = src[i];
+        i += run;
+        lit = i;
+    }
+    o = put_literals(out, o, src + lit, n - lit);
+    out[o++] = 0;
+    return o;
+}
+
+/* Hash chains of earlier positions with the same first three bytes */
+typedef struct {
+    long head[LZ_HASH];
+    long prev[LZ_WINDOW];
+} LzChains;
+
+static unsigned lz_hash(const uint8 *p)
+{
+    return (((unsigned)p[0] << 7) ^ ((unsigned)p[1] << 3) ^ p[2]) &
+           (LZ_HASH - 1);
+}
+
+static void lz_insert(LzChains *lc, const uint8 *src, long n, long pos)
+{
+    unsigned h;
+
+    if (pos + 3 > n) {
+        return;
+    }
+    h = lz_hash(src + pos);
+    lc->prev[pos % LZ_WINDOW] = lc->head[h];
+    lc->head[h] = pos;
+}
+
+/* Longest earlier match for the bytes at pos, and its offset */
+static long lz_match(LzChains *lc, const uint8 *src, long n, long pos,
+                     long *offset)
+{
+    long limit = n - pos < LZ_MAX ? n - pos : LZ_MAX;
+    long best = 0;
+    long cand, len;
+    int chain = 0;
+
+    *offset = 0;
+    if (limit < LZ_MIN) {
+        return 0;
+    }
+    for (cand = lc->head[lz_hash(src + pos)];
+         cand >= 0 && pos - cand <= LZ_WINDOW && chain < LZ_CHAIN;
+         cand = lc->prev[cand % LZ_WINDOW], chain++) {
+        for (len = 0; len < limit && src[cand + len] == src[pos + len]; len++)
+            ;
+        if (len > best) {
+            best = len;
+            *offset = pos - cand;
+            if (len == limit) break;
+        }
+    }
+    return best >= LZ_MIN ? best : 0;
+}
+
+/* Greedy matching, deferred by a byte when the next match is longer */
+static long pack_lz(const uint8 *src, long n, uint8 *out, LzChains *lc)
+{
+    long lit = 0;
+    long i = 0;
+    long o = 0;
+    long len, next, offset, next_offset;
+    int h;
+
+    for (h = 0; h < LZ_HASH; h++) {
+        lc->head[h] = -1;
+    }
+    while (i < n) {
+        len = lz_match(lc, src, n, i, &offset);
+        lz_insert(lc, src, n, i);
+        if (len > 0 && len < LZ_MAX) {
+            next = lz_match(lc, src, n, i + 1, &next_offset);
+            if (next > len) len = 0;
+        }
+        if (len == 0) {
+            i++;
+            continue;
+        }
+
+        o = put_literals(out, o, src + lit, i - lit);
+        out[o++] = (uint8)(0x80 | (len - 3));
+        out[o++] = (uint8)(offset & 0xFF);
+        out[o++] = (uint8)(offset >> 8);
+        for (next = 1; next < len; next++) {
+            lz_insert(lc, src, n, i + next);
+        }
+        i += len;
+        lit = i;
+    }
+    o = put_literals(out, o, src + lit, n - lit);
+    out[o++] = 0;
+    return o;
+}
+
+/* Unpack as the UNPACKER routines do, checking the data; the size, or
+ * -1 if it is not exactly max bytes of sound packed data */
+static long unpack(int codec, const uint8 *src, long n, uint8 *out,
+                   long max)
+{
+    long i = 0;
+    long o = 0;
+    long len, offset;
+    int c;
+
+    while (i < n) {
+        c = src[i++];
+        if (c == 0) {
+            return i == n && o == max ? o : -1;
+        }
+        if (c < 0x80) {
+            if (i + c > n || o + c > max) return -1;
+            memcpy(out + o, src + i, (size_t)c);
+            i += c;
+            o += c;
+        } else if (codec == PACK_RLE) {
+            len = c - 126;
+            if (i >= n || o + len > max) return -1;
+            memset(out + o, src[i++], (size_t)len);
+            o += len;
+        } else {
+            len = c - 125;
+            if (i + 2 > n) return -1;
+            offset = src[i] | ((long)src[i + 1] << 8);
+            i += 2;
+            if (offset == 0 || offset > o || o + len > max) return -1;
+            for (; len > 0; len--, o++) {
+                out[o] = out[o - offset];
+            }
+        }
+    }
+    return -1;
+}
+
+/* ============================================================
+ * Cache
+ * ============================================================ */
+
+static unsigned long crc32_of(const uint8 *p, long n)
+{
+    unsigned long crc = 0xFFFFFFFFUL;
+    int k;
+
+    while (n-- > 0) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320UL : 0);
+        }
+    }
+    return ~crc & 0xFFFFFFFFUL;
+}
+
+static unsigned long fnv_of(const uint8 *p, long n)
+{
+    unsigned long h = 2166136261UL;
+
+    while (n-- > 0) {
+        h = ((h ^ *p++) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return h;
+}
+
+/* File of a result in the --pack-cache directory */
+static int cache_path(AsmState *as, const PackEntry *e, char *path, int max)
+{
+    if ((int)strlen(as->pack_cache) + 22 > max) {
+        return -1;
+    }
+    sprintf(path, "%s/%08lx%08lx.%s", as->pack_cache, e->crc, e->fnv,
+            codec_name(e->codec));
+    return 0;
+}
+
+/* A result from an earlier run, used only if it unpacks to the data */
+static int cache_read(AsmState *as, PackEntry *e, const uint8 *data,
+                      uint8 *check)
+{
+    uint8 header[CACHE_HEADER];
+    char path[300];
+    FILE *fp;
+    long n;
+
+    if (!as->pack_cache || cache_path(as, e, path, sizeof(path)) < 0 ||
+        !(fp = fopen(path, "rb"))) {
+        return -1;
+    }
+    n = 0;
+    if (fread(header, 1, CACHE_HEADER, fp) == CACHE_HEADER &&
+        header[0] == 'P' && header[1] == 'K' && header[2] == e->codec &&
+        (long)READ24(header + 3) == e->size) {
+        n = (long)fread(e->packed, 1, (size_t)pack_bound(e->size), fp);
+    }
+    fclose(fp);
+
+    if (n == 0 || unpack(e->codec, e->packed, n, check, e->size) < 0 ||
+        memcmp(check, data, (size_t)e->size) != 0) {
+        return -1;
+    }
+    e->packed_size = n;
+    return 0;
+}
+
+static void cache_write(AsmState *as, const PackEntry *e)
+{
+    uint8 header[CACHE_HEADER];
+    char path[300];
+    FILE *fp;
+    int ok;
+
+    if (!as->pack_cache || cache_path(as, e, path, sizeof(path)) < 0) {
+        return;
+    }
+    header[0] = 'P';
+    header[1] = 'K';
+    header[2] = (uint8)e->codec;
+    WRITE24(header + 3, e->size);
+    fp = fopen(path, "wb");
+    ok = fp && fwrite(header, 1, CACHE_HEADER, fp) == CACHE_HEADER &&
+         fwrite(e->packed, 1, (size_t)e->packed_size, fp) ==
+         (size_t)e->packed_size;
+    if (fp && fclose(fp) != 0) ok = 0;
+    if (!ok) {
+        asm_warning(as, "cannot write pack cache '%s'", path);
+        remove(path);
+    }
+}
+
+/* Packed form of data: from this run, the cache, or packed now */
+static PackEntry *pack_data(AsmState *as, int codec, const uint8 *data,
+                            long size)
+{
+    unsigned long crc = crc32_of(data, size);
+    unsigned long fnv = fnv_of(data, size);
+    PackEntry *e;
+    LzChains *lc = NULL;
+    uint8 *check;
+
+    for (e = as->packs; e; e = e->next) {
+        if (e->codec == codec && e->size == size && e->crc == crc &&
+            e->fnv == fnv) {
+            return e;
+        }
+    }
+
+    e = (PackEntry *)malloc(sizeof(PackEntry));
+    check = (uint8 *)malloc((size_t)size + 1);
+    if (e) e->packed = (uint8 *)malloc((size_t)pack_bound(size));
+    if (codec == PACK_LZ) lc = (LzChains *)malloc(sizeof(LzChains));
+    if (!e || !check || !e->packed || (codec == PACK_LZ && !lc)) {
+        if (e && e->packed) free(e->packed);
+        if (e) free(e);
+        if (check) free(check);
+        if (lc) free(lc);
+        asm_error(as, "out of memory for packed data");
+        return NULL;
+    }
+    e->codec = codec;
+    e->size = size;
+    e->crc = crc;
+    e->fnv = fnv;
+    e->cached = 1;
+
+    if (cache_read(as, e, data, check) < 0) {
+        e->cached = 0;
+        if (codec == PACK_RLE) {
+            e->packed_size = pack_rle(data, size, e->packed);
+        } else {
+            e->packed_size = pack_lz(data, size, e->packed, lc);
+        }
+        if (unpack(codec, e->packed, e->packed_size, check, size) < 0 ||
+            memcmp(check, data, (size_t)size) != 0) {
+            asm_error(as, "internal error: %s data does not unpack",
+                      codec_name(codec));
+            free(e->packed);
+            free(e);
+            free(check);
+            if (lc) free(lc);
+            return NULL;
+        }
+        cache_write(as, e);
+    }
+    free(check);
+    if (lc) free(lc);
+
+    e->next = as->packs;
+    as->packs = e;
+    return e;
+}
+
+/* ============================================================
+ * Directives
+ * ============================================================ */
+
+/* label.size or label.packed, as a constant */
+static int pack_symbol(AsmState *as, const char *label, const char *suffix,
+                       long value)
+{
+    char name[MAX_LABEL_LEN];
+    char mangled[MAX_LABEL_LEN];
+
+    if (strlen(label) + strlen(suffix) >= MAX_LABEL_LEN) {
+        asm_error(as, "label '%s' too long for %s%s", label, label, suffix);
+        return -1;
+    }
+    sprintf(name, "%s%s", label, suffix);
+    if (symbol_is_local(name)) {
+        symbol_mangle_local(as, name, mangled, MAX_LABEL_LEN);
+        return define_constant(as, mangled, (int24)value);
+    }
+    return define_constant(as, name, (int24)value);
+}
+
+/* Emit data packed, with the symbols of its label */
+static int pack_emit(AsmState *as, const char *label, int codec,
+                     const uint8 *data, long size)
+{
+    PackEntry *e;
+    long room;
+
+    e = pack_data(as, codec, data, size);
+    if (!e) {
+        return -1;
+    }
+    room = asm_relax(as, (int)e->packed_size);
+    if (as->pass == 2 && e->packed_size > room) {
+        asm_error(as, "packed data grew after sizing");
+        return -1;
+    }
+    emit_block(as, e->packed, (int)e->packed_size);
+    for (; room > e->packed_size; room--) {
+        emit_byte(as, 0);
+    }
+
+    if (label && label[0] &&
+        (pack_symbol(as, label, ".size", size) < 0 ||
+         pack_symbol(as, label, ".packed", e->packed_size) < 0)) {
+        return -1;
+    }
+    if (as->verbose && as->pass == 2) {
+        printf("%s:%d: note: packed %ld bytes to %ld with %s (%ld%%)%s\n",
+               as->filename, as->line_num, size, e->packed_size,
+               codec_name(codec),
+               size > 0 ? e->packed_size * 100 / size : 100L,
+               e->cached ? ", from the cache" : "");
+    }
+    return 0;
+}
+
+/* Optional ", codec" after the operands; LZ if none */
+static int pack_trailing_codec(AsmState *as, const char *directive)
+{
+    int codec = PACK_LZ;
+
+    if (as->current_token.type == TOK_COMMA) {
+        lexer_next(as);
+        codec = as->current_token.type == TOK_IDENT ?
+                pack_codec(as->current_token.text) : 0;
+        if (!codec) {
+            asm_error(as, "%s expects codec rle or lz", directive);
+            return 0;
+        }
+        lexer_next(as);
+    }
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "unexpected operands after %s", directive);
+        return 0;
+    }
+    return codec;
+}
+
+/* INCBIN_PACKED "file"[, codec] */
+int pack_incbin(AsmState *as, const char *label)
+{
+    char filename[256];
+    uint8 *data;
+    FILE *fp;
+    long size;
+    int codec;
+    int result;
+
+    lexer_next(as);
+    if (as->current_token.type != TOK_STRING) {
+        asm_error(as, "INCBIN_PACKED requires filename string");
+        return -1;
+    }
+    strncpy(filename, as->current_token.text, sizeof(filename) - 1);
+    filename[sizeof(filename) - 1] = '\0';
+    lexer_next(as);
+    codec = pack_trailing_codec(as, "INCBIN_PACKED");
+    if (!codec) {
+        return -1;
+    }
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        asm_error(as, "cannot open binary file '%s'", filename);
+        return -1;
+    }
+    size = -1;
+    if (fseek(fp, 0L, SEEK_END) == 0) {
+        size = ftell(fp);
+        rewind(fp);
+    }
+    if (size < 0 || size > 0xFFFFFFL) {
+        fclose(fp);
+        asm_error(as, "cannot read binary file '%s'", filename);
+        return -1;
+    }
+    data = (uint8 *)malloc((size_t)size + 1);
+    if (!data) {
+        fclose(fp);
+        asm_error(as, "out of memory for '%s'", filename);
+        return -1;
+    }
+    if (fread(data, 1, (size_t)size, fp) != (size_t)size) {
+        fclose(fp);
+        free(data);
+        asm_error(as, "cannot read binary file '%s'", filename);
+        return -1;
+    }
+    fclose(fp);
+
+    ttrace_begin(as->trace, "incbin_packed", filename);
+    result = pack_emit(as, label, codec, data, size);
+    ttrace_end(as->trace);
+    free(data);
+    return result;
+}
+
+/* DB_PACKED codec, values: the values as DB would store them */
+int pack_db(AsmState *as, const char *label)
+{
+    uint8 data[MAX_LINE_LEN];
+    int24 value;
+    char symbol[MAX_LABEL_LEN];
+    const char *p;
+    int codec;
+    int n = 0;
+    int k;
+
+    lexer_next(as);
+    codec = as->current_token.type == TOK_IDENT ?
+            pack_codec(as->current_token.text) : 0;
+    if (!codec || lexer_next(as)->type != TOK_COMMA) {
+        asm_error(as, "DB_PACKED expects codec rle or lz, then the values");
+        return -1;
+    }
+    lexer_next(as);
+
+    /* Every value takes at least a character of the line */
+    while (1) {
+        if (as->current_token.type == TOK_STRING) {
+            for (p = as->current_token.text; *p; p++) {
+                data[n++] = (uint8)*p;
+            }
+            lexer_next(as);
+        } else if ((k = lexer_data_run(as, data + n,
+                                       MAX_LINE_LEN - n < DATA_RUN ?
+                                       MAX_LINE_LEN - n : DATA_RUN,
+                                       1)) > 0) {
+            n += k;
+        } else {
+            if (parse_expression(as, &value, symbol)) {
+                asm_error(as, "DB_PACKED cannot use relocatable symbols");
+                return -1;
+            }
+            data[n++] = (uint8)(value & 0xFF);
+        }
+
+        if (as->current_token.type != TOK_COMMA) break;
+        lexer_next(as);
+    }
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "unexpected operands after DB_PACKED");
+        return -1;
+    }
+    return pack_emit(as, label, codec, data, n);
+}
+
+/* UNPACKER codec: the routine that unpacks it */
+int pack_unpacker(AsmState *as)
+{
+    const uint8 *code;
+    const uint8 *insns;
+    int num_insns;
+    int codec;
+    int i, k;
+
+    lexer_next(as);
+    codec = as->current_token.type == TOK_IDENT ?
+            pack_codec(as->current_token.text) : 0;
+    if (!codec) {
+        asm_error(as, "UNPACKER expects codec rle or lz");
+        return -1;
+    }
+    lexer_next(as);
+    if (as->current_token.type != TOK_EOL && as->current_token.type != TOK_EOF) {
+        asm_error(as, "unexpected operands after UNPACKER");
+        return -1;
+    }
+    if (as->current_section != SECT_CODE) {
+        asm_error(as, "UNPACKER must be in the code section");
+        return -1;
+    }
+
+    if (codec == PACK_RLE) {
+        code = unrle_code;
+        insns = unrle_insns;
+        num_insns = (int)sizeof(unrle_insns);
+    } else {
+        code = unlz_code;
+        insns = unlz_insns;
+        num_insns = (int)sizeof(unlz_insns);
+    }
+    for (i = 0; i < num_insns; i++) {
+        if (as->analyse && as->pass == 2) flow_record_insn(as);
+        for (k = 0; k < insns[i]; k++) {
+            emit_byte(as, *code++);
+        }
+    }
+    return 0;
+}
+
+void pack_free(AsmState *as)
+{
+    PackEntry *e;
+
+    while (as->packs) {
+        e = as->packs;
+        as->packs = e->next;
+        free(e->packed);
+        free(e);
+    }
+}
@@ -0,0 +1,337 @@
+/*
+ * eZ80 ADL Mode Assembler - Symbol Store
+ *
+ * The assembler is meant to run on the eZ80 itself, where a 512 KB
+ * machine with MOS loaded has no room for tables sized for the largest
+ * source.  Symbols are kept in pages of SYM_PAGE entries, allocated as
+ * the table grows, and refer to each other by 16-bit index.  Names are
+ * kept apart, in a pool of NAME_PAGE-byte pages, each name taking only
+ * its own length.
+ *
+ * With --mem-budget the store never holds more than the budget.  When
+ * a page would not fit, the name page used least recently is written
+ * to a temp file and its memory reused; a name on a spilled page is
+ * read back when asked for.  Since any lookup may spill a page, names
+ * are only compared in place (symbol_name_is) or copied out to the
+ * caller (symbol_name); no pointer into a page leaves the store.  Only
+ * when symbol pages alone outgrow the budget is it an error, reported
+ * once and ending the pass.
+ *
+ * C89 compatible, 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ez80asm.h"
+
+/* ============================================================
+ * Memory Budget
+ * ============================================================ */
+
+/* Least recently used name page in memory, other than the one being
+ * filled, if more than keep pages are in memory; else -1 */
+static int lru_page(AsmState *as, int keep)
+{
+    int best = -1;
+    int resident = 0;
+    int i;
+
+    for (i = 0; i < as->num_name_pages; i++) {
+        if (!as->name_pages[i].text) continue;
+        resident++;
+        if (i == as->num_name_pages - 1) continue;
+        if (best < 0 || as->name_pages[i].stamp < as->name_pages[best].stamp) {
+            best = i;
+        }
+    }
+    return resident > keep ? best : -1;
+}
+
+/* Write a name page out, returning its memory */
+static char *spill_page(AsmState *as, int page)
+{
+    NamePage *np = &as->name_pages[page];
+    char *text = np->text;
+
+    if (!np->on_disk) {
+        if (!as->name_spill) as->name_spill = tmpfile();
+        if (!as->name_spill ||
+            fseek(as->name_spill, (long)page * NAME_PAGE, SEEK_SET) != 0 ||
+            fwrite(text, 1, NAME_PAGE, as->name_spill) != NAME_PAGE) {
+            return NULL;
+        }
+        np->on_disk = 1;
+    }
+    np->text = NULL;
+    return text;
+}
+
+/* Take bytes from the budget, spilling name pages to make room */
+static int store_reserve(AsmState *as, long bytes)
+{
+    char *text;
+    int page;
+
+    while (as->mem_budget > 0 && as->mem_used + bytes > as->mem_budget) {
+        page = lru_page(as, NAME_MIN_PAGES);
+        if (page < 0 || !(text = spill_page(as, page))) {
+            return -1;
+        }
+        free(text);
+        as->mem_used -= NAME_PAGE;
+    }
+    as->mem_used += bytes;
+    if (as->mem_used > as->mem_peak) as->mem_peak = as->mem_used;
+    return 0;
+}
+
+/* Grow an array of the store to at least n items */
+static void *store_grow(AsmState *as, void *array, int *max, int n,
+                        size_t size)
+{
+    void *grown;
+    int new_max;
+
+    if (n <= *max) {
+        return array;
+    }
+    new_max = *max ? *max * 2 : 16;
+    if (store_reserve(as, (long)(new_max - *max) * (long)size) < 0) {
+        return NULL;
+    }
+    grown = realloc(array, new_max * size);
+    if (!grown) {
+        as->mem_used -= (long)(new_max - *max) * (long)size;
+        return NULL;
+    }
+    *max = new_max;
+    return grown;
+}
+
+/* Memory for a name page: new if the budget allows, else that of the
+ * page used least recently */
+static char *take_page(AsmState *as)
+{
+    char *text;
+    int page;
+
+    if (as->mem_budget == 0 || as->mem_used + NAME_PAGE <= as->mem_budget) {
+        text = (char *)malloc(NAME_PAGE);
+        if (text && store_reserve(as, NAME_PAGE) < 0) {
+            free(text);
+            text = NULL;
+        }
+        return text;
+    }
+    page = lru_page(as, NAME_MIN_PAGES - 1);
+    return page < 0 ? NULL : spill_page(as, page);
+}
+
+/* Report the store running out; the pass stops after this line */
+static void store_error(AsmState *as)
+{
+    if (as->store_failed) {
+        return;
+    }
+    as->store_failed = 1;
+    if (as->mem_budget > 0) {
+        asm_error(as, "symbol table does not fit in --mem-budget (%ld KB)",
+                  as->mem_budget / 1024);
+    } else {
+        asm_error(as, "out of memory for symbols");
+    }
+}
+
+/* ============================================================
+ * Symbols and Names
+ * ============================================================ */
+
+Symbol *symbol_at(AsmState *as, int index)
+{
+    return &as->sym_pages[index / SYM_PAGE][index % SYM_PAGE];
+}
+
+/* Room for the next symbol, at index num_symbols */
+Symbol *store_symbol(AsmState *as)
+{
+    Symbol **pages;
+    Symbol *page;
+    int n = as->num_symbols / SYM_PAGE;
+
+    if (as->num_symbols >= MAX_SYMBOLS) {
+        asm_error(as, "symbol table full");
+        return NULL;
+    }
+    if (n == as->num_sym_pages) {
+        pages = (Symbol **)store_grow(as, as->sym_pages, &as->max_sym_pages,
+                                      n + 1, sizeof(Symbol *));
+        if (!pages) {
+            store_error(as);
+            return NULL;
+        }
+        as->sym_pages = pages;
+        page = NULL;
+        if (store_reserve(as, (long)(SYM_PAGE * sizeof(Symbol))) == 0) {
+            page = (Symbol *)malloc(SYM_PAGE * sizeof(Symbol));
+        }
+        if (!page) {
+            store_error(as);
+            return NULL;
+        }
+        as->sym_pages[as->num_sym_pages++] = page;
+    }
+    return symbol_at(as, as->num_symbols);
+}
+
+/* Add a name to the pool, returning its offset or -1 */
+long store_name(AsmState *as, const char *name)
+{
+    NamePage *pages;
+    char *text;
+    int len = (int)strlen(name);
+
+    if (len > MAX_LABEL_LEN - 1) len = MAX_LABEL_LEN - 1;
+    if (as->num_name_pages == 0 || as->name_fill + len + 1 > NAME_PAGE) {
+        pages = (NamePage *)store_grow(as, as->name_pages,
+                                       &as->max_name_pages,
+                                       as->num_name_pages + 1,
+                                       sizeof(NamePage));
+        if (!pages) {
+            store_error(as);
+            return -1;
+        }
+        as->name_pages = pages;
+        text = take_page(as);
+        if (!text) {
+            store_error(as);
+            return -1;
+        }
+        pages[as->num_name_pages].text = text;
+        pages[as->num_name_pages].stamp = ++as->name_clock;
+        pages[as->num_name_pages].on_disk = 0;
+        as->num_name_pages++;
+        as->name_fill = 0;
+    }
+
+    text = as->name_pages[as->num_name_pages - 1].text + as->name_fill;
+    memcpy(text, name, len);
+    text[len] = '\0';
+    as->name_fill += len + 1;
+    as->name_bytes += len + 1;
+    return (long)(as->num_name_pages - 1) * NAME_PAGE + as->name_fill -
+           (len + 1);
+}
+
+/* Text of a symbol's name, read back from disk if its page was
+ * spilled; valid until the store next takes a page */
+static const char *name_text(AsmState *as, const Symbol *sym)
+{
+    NamePage *np = &as->name_pages[sym->name_off / NAME_PAGE];
+    char *text;
+
+    if (!np->text) {
+        text = take_page(as);
+        if (!text ||
+            fseek(as->name_spill, (long)(np - as->name_pages) * NAME_PAGE,
+                  SEEK_SET) != 0 ||
+            fread(text, 1, NAME_PAGE, as->name_spill) != NAME_PAGE) {
+            if (text) {
+                free(text);
+                as->mem_used -= NAME_PAGE;
+            }
+            asm_error(as, "cannot read back spilled symbol names");
+            return "?";
+        }
+        np->text = text;
+        as->spill_reads++;
+    }
+    np->stamp = ++as->name_clock;
+    return np->text + sym->name_off % NAME_PAGE;
+}
+
+/* Copy a symbol's name into buf (MAX_LABEL_LEN bytes), returning buf */
+char *symbol_name(AsmState *as, const Symbol *sym, char *buf)
+{
+    strcpy(buf, name_text(as, sym));
+    return buf;
+}
+
+/* Is name the name of sym? */
+int symbol_name_is(AsmState *as, const Symbol *sym, const char *name)
+{
+    return strcmp(name_text(as, sym), name) == 0;
+}
+
+/* ============================================================
+ * External References
+ * ============================================================ */
+
+int store_extern(AsmState *as, int index)
+{
+    uint16 *externs;
+
+    externs = (uint16 *)store_grow(as, as->externs, &as->max_externs,
+                                   as->num_externs + 1, sizeof(uint16));
+    if (!externs) {
+        store_error(as);
+        return -1;
+    }
+    as->externs = externs;
+    as->externs[as->num_externs++] = (uint16)index;
+    return 0;
+}
+
+char *extern_name(AsmState *as, int index, char *buf)
+{
+    return symbol_name(as, symbol_at(as, as->externs[index]), buf);
+}
+
+/* ============================================================
+ * Report and Cleanup
+ * ============================================================ */
+
+void store_report(AsmState *as)
+{
+    int spilled = 0;
+    int i;
+
+    printf("  Symbol store: %d symbols, %ld bytes of names, peak %ld bytes",
+           as->num_symbols, as->name_bytes, as->mem_peak);
+    if (as->mem_budget > 0) {
+        printf(" (budget %ld)", as->mem_budget);
+    }
+    printf("\n");
+
+    for (i = 0; i < as->num_name_pages; i++) {
+        if (as->name_pages[i].on_disk) spilled++;
+    }
+    if (spilled > 0) {
+        printf("  Names spilled: %d of %d pages, %ld read back\n",
+               spilled, as->num_name_pages, as->spill_reads);
+    }
+}
+
+void store_free(AsmState *as)
+{
+    int i;
+
+    for (i = 0; i < as->num_sym_pages; i++) {
+        free(as->sym_pages[i]);
+    }
+    for (i = 0; i < as->num_name_pages; i++) {
+        if (as->name_pages[i].text) free(as->name_pages[i].text);
+    }
+    if (as->sym_pages) free(as->sym_pages);
+    if (as->name_pages) free(as->name_pages);
+    if (as->externs) free(as->externs);
+    if (as->name_spill) fclose(as->name_spill);
+    as->sym_pages = NULL;
+    as->name_pages = NULL;
+    as->externs = NULL;
+    as->name_spill = NULL;
+    as->num_sym_pages = 0;
+    as->num_name_pages = 0;
+    as->num_externs = 0;
+    as->num_symbols = 0;
+}
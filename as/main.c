@@ -3,6 +3,8 @@
  * C89 compatible, 24-bit integers
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +16,21 @@ static void usage(const char *prog)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -o file    Output object file (default: input.o)\n");
     fprintf(stderr, "  -v         Verbose output\n");
+    fprintf(stderr, "  --time-trace=file  Write Chrome trace-event timeline\n");
+    fprintf(stderr, "  --di-report        Report interrupts-disabled regions\n");
+    fprintf(stderr, "  --di-budget=N      Fail if a region exceeds N cycles\n");
+    fprintf(stderr, "  --profile=file     Lay out blocks for branch counts in file\n");
+    fprintf(stderr, "  --split-cold       Move rarely run blocks to the cold part\n");
+    fprintf(stderr, "  --clobbers         Record the registers each routine changes\n");
+    fprintf(stderr, "  --wcet             Report each routine's worst-case cycles\n");
+    fprintf(stderr, "  --wait-states=C[,D] Wait states per code fetch and data access\n");
+    fprintf(stderr, "  --explicit-addends Keep relocation addends out of the code\n");
+    fprintf(stderr, "  --mem-budget=KB    Keep the symbol table within KB kilobytes\n");
+    fprintf(stderr, "  --pack-cache=dir   Keep packed data in dir for later runs\n");
+    fprintf(stderr, "  -Wperf             Warn about slow or oversized code\n");
+    fprintf(stderr, "  -Wperf-<rule>      Enable one rule (jp-jr, tail-call, ld-zero,\n");
+    fprintf(stderr, "                     ix-loop, table-page, push-pop)\n");
+    fprintf(stderr, "  -Wno-perf-<rule>   Disable one rule\n");
     fprintf(stderr, "  -h         Show this help\n");
 }
 
@@ -55,14 +72,42 @@ int main(int argc, char **argv)
 {
     AsmState as;
     const char *input_file;
+    const char *trace_file;
+    const char *profile;
+    const char *pack_cache;
     char output_file[256];
     int verbose;
+    int di_report;
+    int clobbers;
+    int explicit_addends;
+    int split_cold;
+    int wcet;
+    int wait_code;
+    int wait_data;
+    long di_budget;
+    long mem_budget;
+    unsigned perf_rules;
+    unsigned rule;
+    char *end;
     int i;
     int result;
     
     input_file = NULL;
+    trace_file = NULL;
+    profile = NULL;
+    pack_cache = NULL;
     output_file[0] = '\0';
     verbose = 0;
+    di_report = 0;
+    clobbers = 0;
+    explicit_addends = 0;
+    split_cold = 0;
+    wcet = 0;
+    wait_code = 0;
+    wait_data = 0;
+    di_budget = -1;
+    mem_budget = 0;
+    perf_rules = 0;
     
     /* Parse arguments */
     for (i = 1; i < argc; i++) {
@@ -79,6 +124,78 @@ int main(int argc, char **argv)
             else if (strcmp(argv[i], "-v") == 0) {
                 verbose = 1;
             }
+            else if (strncmp(argv[i], "--time-trace=", 13) == 0) {
+                trace_file = argv[i] + 13;
+            }
+            else if (strncmp(argv[i], "--profile=", 10) == 0) {
+                profile = argv[i] + 10;
+            }
+            else if (strncmp(argv[i], "--pack-cache=", 13) == 0) {
+                pack_cache = argv[i] + 13;
+            }
+            else if (strcmp(argv[i], "--split-cold") == 0) {
+                split_cold = 1;
+            }
+            else if (strcmp(argv[i], "--di-report") == 0) {
+                di_report = 1;
+            }
+            else if (strcmp(argv[i], "--clobbers") == 0) {
+                clobbers = 1;
+            }
+            else if (strcmp(argv[i], "--wcet") == 0) {
+                wcet = 1;
+            }
+            else if (strncmp(argv[i], "--wait-states=", 14) == 0) {
+                const char *num = argv[i] + 14;
+                wait_code = (int)strtol(num, &end, 10);
+                wait_data = wait_code;
+                if (end != num && *end == ',') {
+                    num = end + 1;
+                    wait_data = (int)strtol(num, &end, 10);
+                }
+                if (end == num || *end != '\0' ||
+                    wait_code < 0 || wait_data < 0) {
+                    fprintf(stderr, "error: invalid --wait-states\n");
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--explicit-addends") == 0) {
+                explicit_addends = 1;
+            }
+            else if (strncmp(argv[i], "--di-budget=", 12) == 0) {
+                const char *num = argv[i] + 12;
+                errno = 0;
+                di_budget = strtol(num, &end, 10);
+                if (end == num || *end != '\0' || errno == ERANGE ||
+                    di_budget < 0) {
+                    fprintf(stderr, "error: invalid --di-budget\n");
+                    return 1;
+                }
+            }
+            else if (strncmp(argv[i], "--mem-budget=", 13) == 0) {
+                const char *num = argv[i] + 13;
+                errno = 0;
+                mem_budget = strtol(num, &end, 10);
+                if (end == num || *end != '\0' || errno == ERANGE ||
+                    mem_budget <= 0 || mem_budget > LONG_MAX / 1024) {
+                    fprintf(stderr, "error: invalid --mem-budget\n");
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "-Wperf") == 0) {
+                perf_rules = PERF_ALL;
+            }
+            else if (strncmp(argv[i], "-Wperf-", 7) == 0 ||
+                     strncmp(argv[i], "-Wno-perf-", 10) == 0) {
+                int enable = argv[i][2] != 'n';
+                rule = flow_perf_rule(argv[i] + (enable ? 7 : 10));
+                if (!rule) {
+                    fprintf(stderr, "error: unknown warning '%s'\n", argv[i]);
+                    return 1;
+                }
+                if (enable) perf_rules |= rule;
+                else perf_rules &= ~rule;
+            }
             else if (strcmp(argv[i], "-h") == 0) {
                 usage(argv[0]);
                 return 0;
@@ -98,6 +215,11 @@ int main(int argc, char **argv)
         }
     }
     
+    if (split_cold && !profile) {
+        fprintf(stderr, "error: --split-cold needs --profile\n");
+        return 1;
+    }
+    
     if (!input_file) {
         fprintf(stderr, "error: no input file\n");
         usage(argv[0]);
@@ -116,13 +238,46 @@ int main(int argc, char **argv)
     }
     
     as.verbose = verbose;
+    as.di_report = di_report;
+    as.di_budget = di_budget;
+    as.perf_rules = perf_rules;
+    as.profile = profile;
+    as.pack_cache = pack_cache;
+    as.split_cold = split_cold;
+    as.clobber_summary = clobbers;
+    as.explicit_addends = explicit_addends;
+    as.wcet_report = wcet;
+    as.wait_code = wait_code;
+    as.wait_data = wait_data;
+    as.mem_budget = mem_budget * 1024L;
+    as.analyse = di_report || di_budget >= 0 || perf_rules != 0 ||
+                 clobbers || wcet;
+    
+    if (trace_file) {
+        as.trace = ttrace_open(trace_file, "as");
+        if (!as.trace) {
+            asm_free(&as);
+            return 1;
+        }
+    }
     
     /* Assemble file */
+    ttrace_begin(as.trace, "assemble", input_file);
     result = asm_file(&as, input_file);
     
+    if (result == 0) {
+        result = flow_analyse(&as);
+    }
+    
     if (result == 0) {
         result = asm_output(&as, output_file);
     }
+    ttrace_end(as.trace);
+    
+    if (ttrace_close(as.trace) < 0 && result == 0) {
+        result = 1;
+    }
+    as.trace = NULL;
     
     if (result != 0) {
         fprintf(stderr, "Assembly failed with %d error(s)\n", as.errors);
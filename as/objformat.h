@@ -29,6 +29,11 @@ typedef signed int     int24;
 
 /* Object file version */
 #define OBJ_VERSION     3
+#define OBJ_VERSION_EXT 4       /* Version 3 plus extension chunks */
+#define OBJ_VERSION_ADDENDS 5   /* Version 4 with explicit addends */
+
+/* Header flags */
+#define OBJ_FLAG_EXT    0x01    /* Extension chunks follow the string table */
 
 /* Section types */
 #define SECT_CODE       0x01
@@ -49,7 +54,7 @@ typedef signed int     int24;
 typedef struct {
     uint8 magic[4];         /* OBJ_MAGIC bytes */
     uint8 version;          /* OBJ_VERSION */
-    uint8 flags;            /* Reserved for future use */
+    uint8 flags;            /* OBJ_FLAG_* */
     uint8 code_size[3];     /* Size of code section (24-bit LE) */
     uint8 data_size[3];     /* Size of data section (24-bit LE) */
     uint8 bss_size[3];      /* Size of BSS section (24-bit LE) */
@@ -75,6 +80,10 @@ typedef struct {
  * 
  * For local references: target_sect = CODE/DATA/BSS, value at offset already correct
  * For external refs: target_sect = 0, ext_index contains external symbol index
+ *
+ * The addend (the offset into the target section, or from the external
+ * symbol) is held in the field being patched.  Version 5 objects hold
+ * zeros there instead and carry the addends in an OBJ_EXT_ADDENDS chunk.
  */
 typedef struct {
     uint8 offset[3];        /* Offset in section where reloc applies (24-bit LE) */
@@ -92,6 +101,121 @@ typedef struct {
     uint8 symbol_index[3];  /* Index assigned to this external (24-bit LE) */
 } ObjExtern;
 
+/*
+ * Extension Chunk Header (4 bytes)
+ *
+ * Version 4 and 5 objects with OBJ_FLAG_EXT set carry a list of chunks
+ * after the string table, ended by an OBJ_EXT_END chunk.  Each header
+ * is followed by size bytes of payload; readers skip types they do not
+ * know.  Objects without extensions are written as version 3.
+ */
+typedef struct {
+    uint8 type;             /* OBJ_EXT_* */
+    uint8 size[3];          /* Payload size (24-bit LE) */
+} ObjExtHeader;
+
+#define OBJ_EXT_END         0x00
+#define OBJ_EXT_CLOBBERS    0x01    /* Register clobber summaries */
+#define OBJ_EXT_NAME_HASHES 0x02    /* Hashes of symbol and extern names */
+#define OBJ_EXT_SYMBOL_INFO 0x03    /* Symbol sizes and kinds */
+#define OBJ_EXT_ADDENDS     0x04    /* Relocation addends (version 5) */
+#define OBJ_EXT_COLD        0x05    /* Start of the cold part of the code */
+#define OBJ_EXT_ASSETS      0x06    /* Blobs for the asset file */
+#define OBJ_EXT_FIXED       0x07    /* Code spans that must keep their size */
+
+/*
+ * Clobber Summary (8 bytes, OBJ_EXT_CLOBBERS)
+ *
+ * The registers an exported routine may change, as RM_* bits (see
+ * ez80dec.h), counting only code in this object.  Followed by
+ * num_calls 16-bit extern indices: the external routines it calls or
+ * jumps to, whose own summaries have to be added at link time.
+ */
+typedef struct {
+    uint8 symbol[3];        /* Index into the symbol table (24-bit LE) */
+    uint8 writes[2];        /* RM_* bits, plus CLOB_UNKNOWN (16-bit LE) */
+    uint8 num_calls[2];     /* External callees that follow (16-bit LE) */
+    uint8 reserved;
+} ObjClobber;
+
+#define CLOB_UNKNOWN    0x8000  /* Reaches code that cannot be followed */
+
+/*
+ * Name Hashes (OBJ_EXT_NAME_HASHES)
+ *
+ * A 32-bit LE hash of each symbol table name, in table order, then of
+ * each extern name, so the linker can fill and probe its hash tables
+ * without reading the names.  Names are folded to lower case, since
+ * the linker matches them case-insensitively:
+ *
+ *     h = OBJ_HASH_INIT;
+ *     for each character c: h = OBJ_HASH_STEP(h, tolower(c));
+ */
+#define OBJ_HASH_INIT       5381UL
+#define OBJ_HASH_STEP(h, c) \
+    (((((h) << 5) + (h)) ^ (unsigned long)(c)) & 0xFFFFFFFFUL)
+
+/*
+ * Symbol Info (4 bytes, OBJ_EXT_SYMBOL_INFO)
+ *
+ * One per symbol table entry, in table order: how many bytes the
+ * symbol covers (up to the next non-local label in its section, or as
+ * given by a SIZE directive) and what it names.
+ */
+typedef struct {
+    uint8 size[3];          /* Extent in bytes (24-bit LE) */
+    uint8 kind;             /* SYMK_* */
+} ObjSymInfo;
+
+#define SYMK_NONE       0x00
+#define SYMK_FUNC       0x01    /* Code */
+#define SYMK_OBJECT     0x02    /* Data, BSS or a table in code */
+#define SYMK_CONST      0x03    /* Absolute value (EQU) */
+
+/*
+ * Relocation Addends (OBJ_EXT_ADDENDS)
+ *
+ * A signed 24-bit LE addend for each relocation, in table order.  Only
+ * version 5 objects have them, and must: their relocated fields hold
+ * zeros, so the linker can write each field without reading it.
+ */
+#define OBJ_ADDEND_SIZE     3
+
+/*
+ * Cold Code (OBJ_EXT_COLD)
+ *
+ * A 24-bit LE code section offset: the code from there to the end of
+ * the section is the cold part, split from its routines by the COLD
+ * directive.  No instruction runs on from one part into the other and
+ * no relative jump crosses between them, so the linker may place the
+ * two parts apart.  Without the chunk the whole section is hot.
+ */
+#define OBJ_COLD_SIZE       3
+
+/*
+ * Fixed Spans (OBJ_EXT_FIXED)
+ *
+ * Pairs of 24-bit LE code section offsets, start then end, of spans
+ * whose length the code depends on without a relocation to show it:
+ * the targets of a JUMPTABLE with 8-bit or 16-bit offsets.  A linker
+ * that deletes bytes must leave start..end-1 alone.
+ */
+#define OBJ_FIXED_SIZE      6
+
+/*
+ * Asset (OBJ_EXT_ASSETS)
+ *
+ * Read-only data kept out of the program image, from the assembler's
+ * asset section.  For each blob, in source order: an ObjAsset, the
+ * name (name_len bytes, no terminator), then size bytes of data.  The
+ * linker writes the blobs to an asset file and defines
+ * __asset_<name>_off and __asset_<name>_len; they have no address.
+ */
+typedef struct {
+    uint8 size[3];          /* Data bytes (24-bit LE) */
+    uint8 name_len;
+} ObjAsset;
+
 /*
  * Helper macros for multi-byte values
  */
@@ -103,4 +227,16 @@ typedef struct {
 #define READ24(arr) \
     ((uint24)(arr)[0] | ((uint24)(arr)[1] << 8) | ((uint24)(arr)[2] << 16))
 
+#define READ16(arr) ((unsigned)(arr)[0] | ((unsigned)(arr)[1] << 8))
+
+#define WRITE32(arr, val) \
+    (arr)[0] = (uint8)((val) & 0xFF), \
+    (arr)[1] = (uint8)(((val) >> 8) & 0xFF), \
+    (arr)[2] = (uint8)(((val) >> 16) & 0xFF), \
+    (arr)[3] = (uint8)(((val) >> 24) & 0xFF)
+
+#define READ32(arr) \
+    ((unsigned long)(arr)[0] | ((unsigned long)(arr)[1] << 8) | \
+     ((unsigned long)(arr)[2] << 16) | ((unsigned long)(arr)[3] << 24))
+
 #endif /* OBJFORMAT_H */
@@ -0,0 +1,215 @@
+/*
+ * Chrome Trace-Event Timeline Writer
+ *
+ * Output is a single JSON object holding a "traceEvents" array of
+ * "B" (begin) and "E" (end) events.  Timestamps are microseconds
+ * since the trace was opened.
+ *
+ * C89 compatible.  Wall-clock time is used where the platform has
+ * gettimeofday(); otherwise clock() is used, which only counts CPU
+ * time and so will not show time spent waiting for the disk.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define TT_HAVE_GETTIMEOFDAY
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef TT_HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#endif
+#include "timetrace.h"
+
+#define TT_BUF_SIZE     8192    /* Output buffer, flushed when nearly full */
+#define TT_MAX_EVENT    600     /* Largest single formatted event */
+#define TT_MAX_DEPTH    64      /* Maximum span nesting */
+
+struct TimeTrace {
+    FILE *fp;
+    char buf[TT_BUF_SIZE];
+    int len;                    /* Bytes pending in buf */
+    int depth;                  /* Currently open spans */
+    int num_events;
+    const char *names[TT_MAX_DEPTH];   /* Open span names (for "E" events) */
+    unsigned long start_sec;
+    unsigned long start_usec;
+    int failed;
+};
+
+/* Current time in seconds and microseconds */
+static void tt_now(unsigned long *sec, unsigned long *usec)
+{
+#ifdef TT_HAVE_GETTIMEOFDAY
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    *sec = (unsigned long)tv.tv_sec;
+    *usec = (unsigned long)tv.tv_usec;
+#else
+    clock_t c = clock();
+    *sec = (unsigned long)(c / CLOCKS_PER_SEC);
+    *usec = (unsigned long)((c % CLOCKS_PER_SEC) * 1000000L / CLOCKS_PER_SEC);
+#endif
+}
+
+/* Microseconds since the trace was opened */
+static unsigned long tt_elapsed(TimeTrace *tt)
+{
+    unsigned long sec, usec;
+    tt_now(&sec, &usec);
+    if (usec < tt->start_usec) {
+        usec += 1000000L;
+        sec--;
+    }
+    return (sec - tt->start_sec) * 1000000L + (usec - tt->start_usec);
+}
+
+static void tt_flush(TimeTrace *tt)
+{
+    if (tt->len > 0) {
+        if (fwrite(tt->buf, 1, tt->len, tt->fp) != (size_t)tt->len) {
+            tt->failed = 1;
+        }
+        tt->len = 0;
+    }
+}
+
+/* Make room for one event */
+static void tt_reserve(TimeTrace *tt)
+{
+    if (tt->len + TT_MAX_EVENT >= TT_BUF_SIZE) {
+        tt_flush(tt);
+    }
+}
+
+static void tt_put(TimeTrace *tt, const char *s)
+{
+    while (*s) {
+        tt->buf[tt->len++] = *s++;
+    }
+}
+
+/* Append a JSON string literal, escaped and truncated to fit an event */
+static void tt_put_string(TimeTrace *tt, const char *s)
+{
+    int n = 0;
+
+    tt->buf[tt->len++] = '"';
+    for (; *s && n < 240; s++, n++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            tt->buf[tt->len++] = '\\';
+            tt->buf[tt->len++] = (char)c;
+        } else if (c < 0x20) {
+            tt->buf[tt->len++] = ' ';
+        } else {
+            tt->buf[tt->len++] = (char)c;
+        }
+    }
+    tt->buf[tt->len++] = '"';
+}
+
+/* Emit the common head of an event: separator, name, phase, timestamp */
+static void tt_event_head(TimeTrace *tt, const char *name, const char *ph)
+{
+    char num[32];
+
+    tt_reserve(tt);
+    tt_put(tt, tt->num_events > 0 ? ",\n{\"name\":" : "\n{\"name\":");
+    tt_put_string(tt, name);
+    tt_put(tt, ",\"ph\":\"");
+    tt_put(tt, ph);
+    sprintf(num, "\",\"ts\":%lu", tt_elapsed(tt));
+    tt_put(tt, num);
+    tt_put(tt, ",\"pid\":1,\"tid\":1");
+    tt->num_events++;
+}
+
+TimeTrace *ttrace_open(const char *filename, const char *process)
+{
+    TimeTrace *tt;
+
+    tt = (TimeTrace *)malloc(sizeof(TimeTrace));
+    if (!tt) {
+        fprintf(stderr, "error: out of memory for time trace\n");
+        return NULL;
+    }
+    memset(tt, 0, sizeof(*tt));
+
+    tt->fp = fopen(filename, "w");
+    if (!tt->fp) {
+        fprintf(stderr, "error: cannot create trace file '%s'\n", filename);
+        free(tt);
+        return NULL;
+    }
+
+    tt_now(&tt->start_sec, &tt->start_usec);
+
+    tt_put(tt, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    /* Metadata event naming the process row in the viewer */
+    tt_event_head(tt, "process_name", "M");
+    tt_put(tt, ",\"args\":{\"name\":");
+    tt_put_string(tt, process);
+    tt_put(tt, "}}");
+
+    return tt;
+}
+
+void ttrace_begin(TimeTrace *tt, const char *name, const char *detail)
+{
+    if (!tt) return;
+
+    if (tt->depth >= TT_MAX_DEPTH) {
+        tt->depth++;            /* Count it so ends still balance */
+        return;
+    }
+    tt->names[tt->depth++] = name;
+
+    tt_event_head(tt, name, "B");
+    if (detail) {
+        tt_put(tt, ",\"args\":{\"detail\":");
+        tt_put_string(tt, detail);
+        tt_put(tt, "}");
+    }
+    tt_put(tt, "}");
+}
+
+void ttrace_end(TimeTrace *tt)
+{
+    if (!tt || tt->depth == 0) return;
+
+    tt->depth--;
+    if (tt->depth >= TT_MAX_DEPTH) return;
+
+    tt_event_head(tt, tt->names[tt->depth], "E");
+    tt_put(tt, "}");
+}
+
+int ttrace_close(TimeTrace *tt)
+{
+    int result;
+
+    if (!tt) return 0;
+
+    while (tt->depth > 0) {
+        ttrace_end(tt);
+    }
+
+    tt_reserve(tt);
+    tt_put(tt, "\n]}\n");
+    tt_flush(tt);
+
+    result = tt->failed ? -1 : 0;
+    if (fclose(tt->fp) != 0) result = -1;
+    if (result < 0) {
+        fprintf(stderr, "error: writing time trace failed\n");
+    }
+    free(tt);
+    return result;
+}
@@ -0,0 +1,223 @@
+/*
+ * eZ80 Linker - Asset Files
+ *
+ * Objects carry the blobs of their asset sections in an OBJ_EXT_ASSETS
+ * chunk.  They are not part of the image: the linker collects them,
+ * in link order, into an asset file for the program to read from when
+ * it needs them:
+ *
+ *     count                   24-bit LE
+ *     offset, length          24-bit LE each, per blob
+ *     data                    each blob in turn
+ *
+ * and defines __asset_<name>_off and __asset_<name>_len, the position
+ * of each blob in the file and its size, so the program can seek
+ * straight to one and read it without the table.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ldint.h"
+
+#define ASSET_ENTRY     6       /* Table entry: offset and length */
+#define MAX_ASSET_NAME  (MAX_SYM_NAME - 13) /* Room for "__asset_", "_off" */
+
+/* ============================================================
+ * Loading
+ * ============================================================ */
+
+void asset_free(LinkerState *ls)
+{
+    if (ls->assets) free(ls->assets);
+    if (ls->asset_file) free(ls->asset_file);
+    ls->assets = NULL;
+    ls->asset_file = NULL;
+    ls->num_assets = 0;
+    ls->max_assets = 0;
+    ls->total_assets = 0;
+    ls->asset_size = 0;
+}
+
+/* Read the blobs of an object's OBJ_EXT_ASSETS chunk; the data stays
+ * in the file until the asset file is built */
+int asset_load(LinkerState *ls, LdFile *f, ObjectInfo *obj, long pos,
+               uint24 size)
+{
+    ObjAsset blob;
+    LdAsset *assets;
+    LdAsset *a;
+    char name[256];
+    long end = pos + (long)size;
+    int new_max;
+    
+    while (pos < end) {
+        if (pos + (long)sizeof(blob) > end ||
+            lf_read(ls, f, pos, &blob, sizeof(blob)) < 0 ||
+            lf_read(ls, f, pos + (long)sizeof(blob), name,
+                    blob.name_len) < 0) {
+            ld_error(ls, "cannot read assets from '%s'", obj->filename);
+            return -1;
+        }
+        name[blob.name_len] = '\0';
+        pos += sizeof(blob) + blob.name_len;
+        if (pos + (long)READ24(blob.size) > end) {
+            ld_error(ls, "cannot read assets from '%s'", obj->filename);
+            return -1;
+        }
+        if (blob.name_len == 0 || blob.name_len > MAX_ASSET_NAME) {
+            ld_error(ls, "%s: asset name '%s' is not 1 to %d characters",
+                     obj->filename, name, MAX_ASSET_NAME);
+            return -1;
+        }
+        
+        if (ls->num_assets >= ls->max_assets) {
+            new_max = ls->max_assets ? ls->max_assets * 2 : 16;
+            assets = (LdAsset *)realloc(ls->assets,
+                                        new_max * sizeof(LdAsset));
+            if (!assets) {
+                ld_error(ls, "out of memory");
+                return -1;
+            }
+            ls->assets = assets;
+            ls->max_assets = new_max;
+        }
+        a = &ls->assets[ls->num_assets++];
+        str_copy(a->name, name, MAX_SYM_NAME);
+        a->obj = (int)(obj - ls->objects);
+        a->pos = pos;
+        a->size = READ24(blob.size);
+        a->offset = 0;
+        pos += a->size;
+    }
+    return 0;
+}
+
+/* ============================================================
+ * Layout
+ * ============================================================ */
+
+/* Place the blobs after the table and define their symbols */
+int asset_layout(LinkerState *ls)
+{
+    char sym[MAX_SYM_NAME];
+    unsigned long offset;
+    LdAsset *a;
+    int i, j;
+    
+    if (ls->num_assets == 0) {
+        return 0;
+    }
+    offset = LD_ASSET_HEADER + (unsigned long)ls->num_assets * ASSET_ENTRY;
+    for (i = 0; i < ls->num_assets; i++) {
+        a = &ls->assets[i];
+        for (j = 0; j < i; j++) {
+            if (str_casecmp(ls->assets[j].name, a->name) == 0) {
+                ld_error(ls, "asset '%s' in both '%s' and '%s'", a->name,
+                         ls->objects[ls->assets[j].obj].filename,
+                         ls->objects[a->obj].filename);
+                return -1;
+            }
+        }
+        a->offset = (uint24)offset;
+        offset += a->size;
+        if (offset > 0xFFFFFFUL) {
+            ld_error(ls, "asset file is over 16 MB");
+            return -1;
+        }
+        
+        sprintf(sym, "__asset_%.*s_off", MAX_ASSET_NAME, a->name);
+        add_defined(ls, sym, a->offset);
+        sprintf(sym, "__asset_%.*s_len", MAX_ASSET_NAME, a->name);
+        add_defined(ls, sym, a->size);
+    }
+    ls->total_assets = (uint24)offset;
+    
+    if (ls->verbose) {
+        ld_note(ls, "Assets: %d blob(s), %u bytes", ls->num_assets,
+                (unsigned)ls->total_assets);
+    }
+    return 0;
+}
+
+/* Assets section of the map */
+int asset_map(LinkerState *ls, LdText *t)
+{
+    LdAsset *a;
+    int fail = 0;
+    int i;
+    
+    if (ls->num_assets == 0) {
+        return 0;
+    }
+    fail |= text_printf(t, "Assets (%u bytes, not loaded):\n",
+                        (unsigned)ls->total_assets);
+    for (i = 0; i < ls->num_assets; i++) {
+        a = &ls->assets[i];
+        fail |= text_printf(t, "  %-24s %06X   %-6u %s\n", a->name,
+                            (unsigned)a->offset, (unsigned)a->size,
+                            ls->objects[a->obj].filename);
+    }
+    fail |= text_printf(t, "\n");
+    return fail;
+}
+
+/* ============================================================
+ * Asset File
+ * ============================================================ */
+
+static int build_assets(LinkerState *ls)
+{
+    uint8 *buf;
+    LdAsset *a;
+    LdFile f;
+    long size = ls->num_assets > 0 ? (long)ls->total_assets
+                                   : LD_ASSET_HEADER;
+    int i;
+    
+    buf = (uint8 *)malloc(size);
+    if (!buf) {
+        ld_error(ls, "out of memory for asset file");
+        return -1;
+    }
+    WRITE24(buf, ls->num_assets);
+    for (i = 0; i < ls->num_assets; i++) {
+        a = &ls->assets[i];
+        WRITE24(buf + LD_ASSET_HEADER + i * ASSET_ENTRY, a->offset);
+        WRITE24(buf + LD_ASSET_HEADER + i * ASSET_ENTRY + 3, a->size);
+        if (a->size == 0) continue;
+        
+        if (lf_open(ls, ls->objects[a->obj].filename, &f) < 0) {
+            ld_error(ls, "cannot reopen '%s'", ls->objects[a->obj].filename);
+            free(buf);
+            return -1;
+        }
+        if (lf_read(ls, &f, a->pos, buf + a->offset, a->size) < 0) {
+            ld_error(ls, "cannot read asset '%s' from '%s'", a->name,
+                     ls->objects[a->obj].filename);
+            lf_close(ls, &f);
+            free(buf);
+            return -1;
+        }
+        lf_close(ls, &f);
+    }
+    ls->asset_file = buf;
+    ls->asset_size = size;
+    return 0;
+}
+
+/* The asset file is built on first request */
+const uint8 *ld_assets(LinkerState *ls, long *size)
+{
+    *size = 0;
+    if (!ls->image) {
+        return NULL;
+    }
+    if (!ls->asset_file && build_assets(ls) < 0) {
+        return NULL;
+    }
+    *size = ls->asset_size;
+    return ls->asset_file;
+}
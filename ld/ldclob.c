@@ -0,0 +1,252 @@
+/*
+ * eZ80 Linker - Register Clobber Summaries
+ *
+ * Objects assembled with `as --clobbers` carry, for each exported
+ * routine, the registers it changes within its own object and the
+ * external routines it calls.  The linker follows those calls across
+ * objects until nothing changes and reports the full set for every
+ * routine, so a compiler can drop the saves around calls that cannot
+ * touch a register.
+ *
+ * A routine that calls something with no summary (an object assembled
+ * without --clobbers, an absolute symbol) may change anything.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ldint.h"
+#include "ez80dec.h"
+
+/* ============================================================
+ * Loading
+ * ============================================================ */
+
+/* Make room for one more summary and n more callee names */
+static int clob_grow(LinkerState *ls, int n)
+{
+    LdClobber *clobbers;
+    char (*calls)[MAX_SYM_NAME];
+    int new_max;
+    
+    if (ls->num_clobbers >= ls->max_clobbers) {
+        new_max = ls->max_clobbers ? ls->max_clobbers * 2 : 64;
+        clobbers = (LdClobber *)realloc(ls->clobbers,
+                                        new_max * sizeof(LdClobber));
+        if (!clobbers) return -1;
+        ls->clobbers = clobbers;
+        ls->max_clobbers = new_max;
+    }
+    if (ls->num_clob_calls + n > ls->max_clob_calls) {
+        new_max = ls->max_clob_calls ? ls->max_clob_calls * 2 : 64;
+        while (new_max < ls->num_clob_calls + n) new_max *= 2;
+        calls = (char (*)[MAX_SYM_NAME])realloc(ls->clob_calls,
+                                                new_max * MAX_SYM_NAME);
+        if (!calls) return -1;
+        ls->clob_calls = calls;
+        ls->max_clob_calls = new_max;
+    }
+    return 0;
+}
+
+/* Read an OBJ_EXT_CLOBBERS chunk of size bytes at pos */
+int clob_load(LinkerState *ls, LdFile *f, ObjectInfo *obj, long pos,
+              uint24 size, const ObjSymbol *syms, const char *strtab)
+{
+    ObjClobber *entry;
+    ObjExtern *ext_tab;
+    LdClobber *c;
+    uint8 *buf;
+    uint8 *index;
+    uint24 off, sym, name_off;
+    unsigned ext;
+    int num_calls;
+    int result = 0;
+    int i;
+    
+    buf = (uint8 *)malloc(size ? size : 1);
+    ext_tab = NULL;
+    if (obj->num_externs > 0) {
+        ext_tab = (ObjExtern *)malloc(obj->num_externs * sizeof(ObjExtern));
+    }
+    if (!buf || (obj->num_externs > 0 && !ext_tab)) {
+        ld_error(ls, "out of memory");
+        if (buf) free(buf);
+        if (ext_tab) free(ext_tab);
+        return -1;
+    }
+    if (lf_read(ls, f, pos, buf, size) < 0 ||
+        (ext_tab && lf_read(ls, f, obj->extern_pos, ext_tab,
+                            obj->num_externs * sizeof(ObjExtern)) < 0)) {
+        ld_error(ls, "cannot read clobber summaries from '%s'",
+                 obj->filename);
+        free(buf);
+        if (ext_tab) free(ext_tab);
+        return -1;
+    }
+    
+    off = 0;
+    while (off + sizeof(ObjClobber) <= size) {
+        entry = (ObjClobber *)&buf[off];
+        sym = READ24(entry->symbol);
+        num_calls = (int)READ16(entry->num_calls);
+        index = &buf[off + sizeof(ObjClobber)];
+        off += sizeof(ObjClobber) + 2 * num_calls;
+        
+        if (off > size || sym >= obj->num_symbols || !strtab) {
+            ld_error(ls, "bad clobber summary in '%s'", obj->filename);
+            result = -1;
+            break;
+        }
+        if (clob_grow(ls, num_calls) < 0) {
+            ld_error(ls, "out of memory");
+            result = -1;
+            break;
+        }
+        
+        c = &ls->clobbers[ls->num_clobbers++];
+        name_off = READ24(syms[sym].name_offset);
+        str_copy(c->name, name_off < obj->strtab_size ? &strtab[name_off]
+                                                      : "?", MAX_SYM_NAME);
+        c->writes = READ16(entry->writes);
+        c->first_call = ls->num_clob_calls;
+        c->num_calls = num_calls;
+        
+        for (i = 0; i < num_calls; i++) {
+            ext = READ16(&index[2 * i]);
+            name_off = ext < obj->num_externs
+                       ? READ24(ext_tab[ext].name_offset) : obj->strtab_size;
+            str_copy(ls->clob_calls[ls->num_clob_calls++],
+                     name_off < obj->strtab_size ? &strtab[name_off] : "?",
+                     MAX_SYM_NAME);
+        }
+    }
+    
+    free(buf);
+    if (ext_tab) free(ext_tab);
+    return result;
+}
+
+void clob_free(LinkerState *ls)
+{
+    if (ls->clobbers) free(ls->clobbers);
+    if (ls->clob_calls) free(ls->clob_calls);
+    ls->clobbers = NULL;
+    ls->clob_calls = NULL;
+    ls->num_clobbers = 0;
+    ls->max_clobbers = 0;
+    ls->num_clob_calls = 0;
+    ls->max_clob_calls = 0;
+    text_free(&ls->clob_text);
+}
+
+/* ============================================================
+ * Report
+ * ============================================================ */
+
+/* Summary of the routine with a name, or -1 */
+static int clob_find(LinkerState *ls, const char *name)
+{
+    int i;
+    
+    for (i = 0; i < ls->num_clobbers; i++) {
+        if (strcmp(ls->clobbers[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Register list for a report line: "a f bc h ix", "*" or "-" */
+static void clob_names(unsigned writes, char *buf)
+{
+    static const struct {
+        unsigned mask;
+        const char *name;
+    } regs[] = {
+        { RM_A, "a" }, { RM_F, "f" },
+        { RM_BC, "bc" }, { RM_B, "b" }, { RM_C, "c" },
+        { RM_DE, "de" }, { RM_D, "d" }, { RM_E, "e" },
+        { RM_HL, "hl" }, { RM_H, "h" }, { RM_L, "l" },
+        { RM_IX, "ix" }, { RM_IY, "iy" }, { RM_I, "i" },
+        { RM_MB, "mb" }, { RM_ALT, "alt" }
+    };
+    unsigned left = writes;
+    int i;
+    
+    buf[0] = '\0';
+    if (writes & CLOB_UNKNOWN) {
+        strcpy(buf, "*");
+        return;
+    }
+    for (i = 0; i < (int)(sizeof(regs) / sizeof(regs[0])); i++) {
+        if ((left & regs[i].mask) != regs[i].mask) continue;
+        if (buf[0]) strcat(buf, " ");
+        strcat(buf, regs[i].name);
+        left &= ~regs[i].mask;
+    }
+    if (!buf[0]) strcpy(buf, "-");
+}
+
+/* Add the callees' summaries to each routine's until nothing changes */
+static int clob_report(LinkerState *ls)
+{
+    unsigned *writes;
+    unsigned w;
+    char regs[64];
+    int changed;
+    int i, j, k;
+    int fail = 0;
+    
+    writes = (unsigned *)malloc((ls->num_clobbers + 1) * sizeof(unsigned));
+    if (!writes) return -1;
+    for (i = 0; i < ls->num_clobbers; i++) {
+        writes[i] = ls->clobbers[i].writes;
+    }
+    
+    do {
+        changed = 0;
+        for (i = 0; i < ls->num_clobbers; i++) {
+            LdClobber *c = &ls->clobbers[i];
+            w = writes[i];
+            for (j = 0; j < c->num_calls; j++) {
+                k = clob_find(ls, ls->clob_calls[c->first_call + j]);
+                w |= k >= 0 ? writes[k] : CLOB_UNKNOWN;
+            }
+            if (w != writes[i]) {
+                writes[i] = w;
+                changed = 1;
+            }
+        }
+    } while (changed);
+    
+    fail |= text_printf(&ls->clob_text,
+                        "; Registers each routine may change, "
+                        "including through its calls\n");
+    fail |= text_printf(&ls->clob_text,
+                        "; (* = anything, - = nothing but SP)\n");
+    for (i = 0; i < ls->num_clobbers; i++) {
+        clob_names(writes[i], regs);
+        fail |= text_printf(&ls->clob_text, "%-24s %s\n",
+                            ls->clobbers[i].name, regs);
+    }
+    
+    free(writes);
+    return fail ? -1 : 0;
+}
+
+/* The report is built on first request */
+const char *ld_clobbers(LinkerState *ls, long *size)
+{
+    *size = 0;
+    if (!ls->image) {
+        return NULL;
+    }
+    if (!ls->clob_text.text && clob_report(ls) < 0) {
+        ld_error(ls, "out of memory for clobber report");
+        text_free(&ls->clob_text);
+        return NULL;
+    }
+    *size = ls->clob_text.len;
+    return ls->clob_text.text;
+}
@@ -0,0 +1,189 @@
+/*
+ * eZ80 Linker - Dependency Files
+ *
+ * Writes a make-compatible depfile for the last link (-MD): the output
+ * depends on every object, every library searched (as found through
+ * -L, not the directories themselves) and the resident symbol list.
+ *
+ * With hashes requested, comment lines after the rule give a CRC-32 of
+ * every library member that was linked in, named by its library,
+ * position and first exported symbol:
+ *
+ *     # member ./libc.a[3] strlen 1A2B3C4D
+ *
+ * make ignores them; a build system can compare them with the members
+ * of a rebuilt library and skip the relink if the ones used are
+ * unchanged.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ldint.h"
+
+#define DEP_LINE_LEN    72      /* Wrap the prerequisite list here */
+
+/* CRC-32 (IEEE 802.3) of a buffer */
+static unsigned long crc32(const uint8 *data, long len)
+{
+    unsigned long crc = 0xFFFFFFFFUL;
+    long i;
+    int bit;
+    
+    for (i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1)));
+        }
+    }
+    return (crc ^ 0xFFFFFFFFUL) & 0xFFFFFFFFUL;
+}
+
+/* Escape a file name for make into buf[MAX_FILENAME * 2]; returns
+ * its length */
+static int dep_escape(const char *name, char *buf)
+{
+    int n = 0;
+    
+    for (; *name && n < MAX_FILENAME * 2 - 2; name++) {
+        if (*name == ' ' || *name == '#') {
+            buf[n++] = '\\';
+        } else if (*name == '$') {
+            buf[n++] = '$';
+        }
+        buf[n++] = *name;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* Append a prerequisite, wrapping long lines */
+static int dep_name(LdText *t, const char *name, int *col)
+{
+    char buf[MAX_FILENAME * 2];
+    int n = dep_escape(name, buf);
+    int fail = 0;
+    
+    if (*col + n + 1 > DEP_LINE_LEN) {
+        fail |= text_printf(t, " \\\n");
+        *col = 0;
+    }
+    fail |= text_printf(t, " %s", buf);
+    *col += n + 1;
+    return fail;
+}
+
+/* Has a name already been listed among the first n objects? */
+static int dep_seen(LinkerState *ls, int n, const char *name)
+{
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        if (strcmp(ls->objects[i].filename, name) == 0) return 1;
+    }
+    return 0;
+}
+
+/* First exported symbol of a library member, from the index */
+static const char *member_name(LinkerState *ls, int lib, int obj)
+{
+    LibSymIndex *idx = &ls->lib_index;
+    int i;
+    
+    for (i = 0; i < idx->num_entries; i++) {
+        if (idx->entries[i].lib_idx == lib && idx->entries[i].obj_idx == obj) {
+            return idx->entries[i].name;
+        }
+    }
+    return "-";
+}
+
+/* Hash lines for the members linked in from one library */
+static int dep_hashes(LinkerState *ls, LdText *t, int lib)
+{
+    LibraryInfo *info = &ls->libraries[lib];
+    LibObject *member;
+    LdFile f;
+    uint8 *buf;
+    int fail = 0;
+    int j;
+    
+    if (lf_open(ls, info->filename, &f) < 0) {
+        ld_error(ls, "cannot reopen '%s'", info->filename);
+        return -1;
+    }
+    for (j = 0; j < info->num_objects; j++) {
+        member = &info->objects[j];
+        if (!member->loaded) continue;
+        
+        buf = (uint8 *)malloc(member->obj_size ? member->obj_size : 1);
+        if (!buf || lf_read(ls, &f, member->offset, buf,
+                            (long)member->obj_size) < 0) {
+            ld_error(ls, "cannot read member %d of '%s'", j, info->filename);
+            if (buf) free(buf);
+            lf_close(ls, &f);
+            return -1;
+        }
+        fail |= text_printf(t, "# member %s[%d] %s %08lX\n", info->filename,
+                            j, member_name(ls, lib, j),
+                            crc32(buf, (long)member->obj_size));
+        free(buf);
+    }
+    lf_close(ls, &f);
+    return fail;
+}
+
+/* Build the depfile text */
+static int build_depfile(LinkerState *ls, const char *target, int hashes)
+{
+    LdText *t = &ls->dep_text;
+    char buf[MAX_FILENAME * 2];
+    int col;
+    int fail = 0;
+    int i;
+    
+    col = dep_escape(target, buf) + 1;
+    fail |= text_printf(t, "%s:", buf);
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        const char *name = ls->objects[i].filename;
+        if (dep_seen(ls, i, name)) continue;
+        fail |= dep_name(t, name, &col);
+    }
+    for (i = 0; i < ls->num_libraries; i++) {
+        if (dep_seen(ls, ls->num_objects, ls->libraries[i].filename)) continue;
+        fail |= dep_name(t, ls->libraries[i].filename, &col);
+    }
+    if (ls->res_symbols) {
+        fail |= dep_name(t, ls->res_file, &col);
+    }
+    fail |= text_printf(t, "\n");
+    
+    if (hashes) {
+        for (i = 0; i < ls->num_libraries; i++) {
+            if (dep_hashes(ls, t, i) < 0) return -1;
+        }
+    }
+    return fail ? -1 : 0;
+}
+
+/* Depfile for the last link, rebuilt on every request since the target
+ * name and hash option may differ */
+const char *ld_depfile(LinkerState *ls, const char *target, int hashes,
+                       long *size)
+{
+    *size = 0;
+    if (!ls->image) {
+        return NULL;
+    }
+    text_free(&ls->dep_text);
+    if (build_depfile(ls, target, hashes) < 0) {
+        if (ls->errors == 0) ld_error(ls, "out of memory for depfile");
+        text_free(&ls->dep_text);
+        return NULL;
+    }
+    *size = ls->dep_text.len;
+    return ls->dep_text.text;
+}
@@ -0,0 +1,354 @@
+/*
+ * eZ80 Linker Library - Internal Definitions
+ *
+ * Types and helpers shared by the files of the linker library.  Not
+ * part of the public interface (ldlib.h).
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#ifndef LDINT_H
+#define LDINT_H
+
+#include "ldlib.h"
+
+/* Maximum limits */
+#define MAX_OBJECTS     128
+#define MAX_SYMBOLS     2048
+#define MAX_EXTERNS     1024
+#define MAX_FILENAME    256
+#define MAX_LIBRARIES   16
+#define MAX_LIB_OBJECTS 256
+#define MAX_LIBDIRS     16  /* Library search directories */
+#define MAX_OBJ_EXTERNS 256 /* Max externals per single object */
+#define HASH_SIZE       256 /* Symbol hash table buckets (power of 2) */
+#define LIB_HASH_SIZE   256 /* Library index hash buckets (power of 2) */
+#define MAX_LIB_SYMS    1024 /* Max exported symbols across all libraries */
+#define MAX_SYM_NAME    64  /* Symbol name length (including '\0') */
+#define MAX_LIBSYM_NAME 32  /* Library index name length (including '\0') */
+#define MAX_MEM_FILES   (MAX_OBJECTS + MAX_LIBRARIES)
+#define MAX_DIAG_LEN    640 /* Longest formatted diagnostic */
+
+#define LINKER_DEFINED  -1  /* obj_index for linker-defined symbols */
+#define RESIDENT_DEFINED -2 /* obj_index for resident image symbols */
+
+/*
+ * Library symbol index entry.
+ * Maps an exported symbol name to the library object that defines it.
+ *
+ * Memory: 41 bytes per entry on eZ80 (int=3 bytes, long=4).
+ * At MAX_LIB_SYMS=1024: ~41KB total (dynamically allocated, kept
+ * with the libraries until the context is destroyed).
+ */
+typedef struct {
+    char name[MAX_LIBSYM_NAME];    /* Symbol name (truncated) */
+    unsigned long hash;         /* name_hash() of the full name */
+    uint8 lib_idx;              /* Index into ls->libraries[] (max 16) */
+    uint8 obj_idx;              /* Index into lib->objects[] (max 256) */
+    int hash_next;              /* Next entry in hash chain (-1 = end) */
+} LibSymEntry;
+
+/*
+ * Library symbol index.
+ * Built the first time libraries are processed; maps every exported
+ * symbol in every library object to its location.  Rebuilt only when
+ * libraries are added, so repeated links reuse it.
+ */
+typedef struct {
+    LibSymEntry *entries;
+    int num_entries;
+    int max_entries;
+    int num_libraries;          /* Libraries covered by the index */
+    int hash_buckets[LIB_HASH_SIZE];
+} LibSymIndex;
+
+/* Library object entry (for scanning libraries) */
+typedef struct {
+    long offset;            /* File offset to this object */
+    uint24 obj_size;        /* Size of object in file */
+    int loaded;             /* Already loaded? */
+} LibObject;
+
+/* Library info */
+typedef struct {
+    char filename[MAX_FILENAME];
+    LibObject objects[MAX_LIB_OBJECTS];
+    int num_objects;
+} LibraryInfo;
+
+/* Global symbol entry */
+typedef struct {
+    char name[MAX_SYM_NAME];
+    uint24 value;           /* Absolute address after linking */
+    uint8 section;          /* Original section */
+    int obj_index;          /* Which object file it came from */
+    uint24 size;            /* Bytes it covers, 0 if not known */
+    uint8 kind;             /* SYMK_*, SYMK_NONE if not known */
+    unsigned long hash;     /* name_hash() of the name */
+    int hash_next;          /* Next symbol index in hash chain (-1 = end) */
+} GlobalSymbol;
+
+/* Object file info */
+typedef struct {
+    char filename[MAX_FILENAME];
+    uint24 code_size;
+    uint24 hot_size;        /* Code before the cold part (OBJ_EXT_COLD) */
+    uint24 data_size;
+    uint24 bss_size;
+    uint24 num_symbols;
+    uint24 num_relocs;
+    uint24 num_externs;
+    uint24 strtab_size;
+    
+    /* Base addresses assigned during linking */
+    uint24 code_base;
+    uint24 cold_base;       /* Cold part of the code, after all hot code */
+    uint24 data_base;
+    uint24 bss_base;
+    
+    /* File positions for reading sections */
+    long code_pos;
+    long data_pos;
+    long sym_pos;
+    long reloc_pos;
+    long extern_pos;
+    long strtab_pos;
+    long ext_pos;           /* Extension chunks, 0 if none */
+    int library;            /* Index into libraries, -1 if listed */
+    int member;             /* Its index in the library */
+    int addends;            /* Addends in OBJ_EXT_ADDENDS, fields zeroed */
+    unsigned long *name_hashes; /* name_hash() of each symbol, then extern */
+    int num_fixed;          /* Spans in OBJ_EXT_FIXED */
+    
+    /* Held in memory by the optimiser (-O); NULL when reading the file */
+    uint8 *code;
+    uint8 *data;
+    ObjReloc *relocs;       /* Sorted by section, then offset */
+    char *strtab;
+    ObjExtern *ext_tab;
+    uint24 *fixed;          /* Start and end of each fixed span */
+} ObjectInfo;
+
+/* Memory buffer standing in for a file of the same name */
+typedef struct {
+    char name[MAX_FILENAME];
+    const uint8 *data;
+    long size;
+    int is_library;         /* Kept across ld_reset() */
+} MemFile;
+
+/* Open input: either a memory buffer or a handle from the file ops */
+typedef struct {
+    const MemFile *mem;
+    void *handle;
+} LdFile;
+
+/* Register clobber summary of an exported routine (ldclob.c) */
+typedef struct {
+    char name[MAX_SYM_NAME];
+    unsigned writes;        /* RM_* bits in its own object, CLOB_UNKNOWN */
+    int first_call;         /* Its external callees in clob_calls[] */
+    int num_calls;
+} LdClobber;
+
+/* Reference from one object to a symbol another defines (ldwhy.c) */
+typedef struct {
+    int from;               /* Objects */
+    int to;
+    int symbol;             /* Index into symbols */
+    int used;               /* A relocation is against it */
+} LdRef;
+
+/* Blob of an object's asset section (ldasset.c) */
+typedef struct {
+    char name[MAX_SYM_NAME];
+    int obj;                /* Index into objects */
+    long pos;               /* Its data in the object's file */
+    uint24 size;
+    uint24 offset;          /* In the asset file */
+} LdAsset;
+
+/* Symbol a module imports (ldmod.c), with a list of its fields */
+typedef struct {
+    char name[MAX_SYM_NAME];
+    unsigned long hash;     /* name_hash() of the name */
+    int first_site;         /* Index into sites, -1 if none */
+    int last_site;
+    int num_sites;
+} LdImport;
+
+typedef struct {
+    uint24 offset;          /* Field in the image */
+    int next;               /* Next field of the import, -1 = end */
+} LdImportSite;
+
+/* Growable text buffer for the map and reports */
+typedef struct {
+    char *text;
+    long len;
+    long max;
+} LdText;
+
+/* Linker state */
+struct LinkerState {
+    ObjectInfo objects[MAX_OBJECTS];
+    int num_objects;
+    
+    GlobalSymbol symbols[MAX_SYMBOLS];
+    int num_symbols;
+    int hash_buckets[HASH_SIZE]; /* Hash table: each bucket holds index into
+                                    symbols[] or -1 if empty */
+    
+    LibraryInfo libraries[MAX_LIBRARIES];
+    int num_libraries;
+    LibSymIndex lib_index;
+    
+    char libdirs[MAX_LIBDIRS][MAX_FILENAME];
+    int num_libdirs;
+    
+    MemFile mem_files[MAX_MEM_FILES];
+    int num_mem_files;
+    
+    uint24 base_addr;
+    uint24 total_code;
+    uint24 total_cold;      /* Cold part, at the end of the code */
+    uint24 total_data;
+    uint24 total_bss;
+    
+    /* Results */
+    uint8 *image;           /* Code followed by data */
+    long image_size;
+    LdText map;
+    char out_file[MAX_FILENAME];  /* Output to map the image into, or "" */
+    int out_mapped;         /* Image is a mapping of out_tmp (ldout.c) */
+    char out_tmp[MAX_FILENAME + 8]; /* Renamed to out_file on success */
+    int out_fd;
+    
+    /* Register clobber summaries read from the objects */
+    LdClobber *clobbers;
+    int num_clobbers;
+    int max_clobbers;
+    char (*clob_calls)[MAX_SYM_NAME];
+    int num_clob_calls;
+    int max_clob_calls;
+    LdText clob_text;
+    
+    /* Resident image linked against (ldres.c); kept across links */
+    char res_file[MAX_FILENAME];
+    GlobalSymbol *res_symbols;
+    int num_res_symbols;
+    int res_buckets[HASH_SIZE];
+    uint24 res_base;        /* Address range it occupies, BSS included */
+    uint24 res_len;
+    uint24 res_crc;         /* CRC-24 of its image */
+    LdText sym_text;        /* Symbol list of this link */
+    LdText dep_text;        /* Depfile of this link */
+    
+    /* References between the objects of this link (ldwhy.c) */
+    LdRef *refs;
+    int num_refs;
+    int max_refs;
+    int refs_built;
+    LdText why_text;
+    LdText unused_text;
+    
+    /* Asset blobs of the objects, in link order (ldasset.c) */
+    LdAsset *assets;
+    int num_assets;
+    int max_assets;
+    uint24 total_assets;    /* Asset file size, table included */
+    uint8 *asset_file;      /* Built on first request */
+    long asset_size;
+    
+    /* Loadable module and export table (ldmod.c) */
+    int module;             /* Link a module (--module), at 0 */
+    int exports;            /* Give the image an export table (--exports) */
+    uint24 export_addr;     /* Export table, after the objects' data */
+    uint24 export_size;
+    uint24 *fixups;         /* Fields holding an address in the module */
+    int num_fixups;
+    int max_fixups;
+    LdImport *imports;
+    int num_imports;
+    int max_imports;
+    LdImportSite *sites;
+    int num_sites;
+    int max_sites;
+    uint8 *module_file;     /* Built on first request */
+    long module_size;
+    
+    LdFileOps ops;
+    LdDiagFn diag;
+    void *diag_user;
+    int verbose;
+    int optimise;           /* -O level, 0 = off */
+    int errors;
+    TimeTrace *trace;       /* --time-trace timeline, NULL if off */
+};
+
+/* Diagnostics (ldlib.c) */
+void ld_error(LinkerState *ls, const char *fmt, ...);
+void ld_note(LinkerState *ls, const char *fmt, ...);
+
+/* File access (ldlib.c) */
+int lf_open(LinkerState *ls, const char *name, LdFile *f);
+int lf_read(LinkerState *ls, LdFile *f, long pos, void *buf, long len);
+long lf_size(LinkerState *ls, LdFile *f);
+void lf_close(LinkerState *ls, LdFile *f);
+uint8 *read_chunk(LinkerState *ls, LdFile *f, long pos, int type, long size);
+
+/* Report text (ldlib.c) */
+int text_printf(LdText *t, const char *fmt, ...);
+void text_free(LdText *t);
+
+/* Layout (ldlib.c) */
+uint24 code_address(const ObjectInfo *obj, uint24 offset);
+
+/* Symbols (ldlib.c) */
+GlobalSymbol *find_global(LinkerState *ls, const char *name);
+GlobalSymbol *find_hashed(LinkerState *ls, const char *name,
+                          unsigned long hash);
+void add_defined(LinkerState *ls, const char *name, uint24 value);
+void str_copy(char *dest, const char *src, int max);
+int str_casecmp(const char *a, const char *b);
+unsigned long name_hash(const char *name);
+
+/* Mapped output (ldout.c) */
+uint8 *out_map(LinkerState *ls, long size);
+int out_unmap(LinkerState *ls, int keep);
+
+/* Register clobber summaries (ldclob.c) */
+int clob_load(LinkerState *ls, LdFile *f, ObjectInfo *obj, long pos,
+              uint24 size, const ObjSymbol *syms, const char *strtab);
+void clob_free(LinkerState *ls);
+
+/* Resident images (ldres.c) */
+GlobalSymbol *resident_find(LinkerState *ls, const char *name,
+                            unsigned long hash);
+int resident_check(LinkerState *ls);
+void res_free(LinkerState *ls);
+
+/* Asset files (ldasset.c) */
+int asset_load(LinkerState *ls, LdFile *f, ObjectInfo *obj, long pos,
+               uint24 size);
+int asset_layout(LinkerState *ls);
+int asset_map(LinkerState *ls, LdText *t);
+void asset_free(LinkerState *ls);
+
+/* Loadable modules and export tables (ldmod.c) */
+uint24 export_layout(LinkerState *ls, uint24 addr);
+int export_build(LinkerState *ls, uint8 *table);
+int mod_fixup(LinkerState *ls, long offset);
+int mod_import(LinkerState *ls, const char *name, unsigned long hash,
+               long offset);
+int mod_map(LinkerState *ls, LdText *t);
+void mod_free(LinkerState *ls);
+
+/* Link explanations (ldwhy.c) */
+void why_free(LinkerState *ls);
+
+/* Link-time optimisation (ldopt.c) */
+int opt_run(LinkerState *ls);
+void opt_free(LinkerState *ls);
+
+#endif /* LDINT_H */
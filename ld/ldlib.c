@@ -0,0 +1,1939 @@
+/*
+ * eZ80 Linker Library
+ *
+ * Links eZ80 object files into a flat binary image.
+ * C89 compatible with 24-bit integers.
+ *
+ * Optimised to reduce file I/O: string tables and extern tables
+ * are cached in memory, tables are read in single block reads, and
+ * file opens are merged where possible.
+ *
+ * All file access goes through the context's LdFileOps (or a memory
+ * buffer registered under the file's name), so the linker can be
+ * driven entirely from memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include "ldint.h"
+
+/* Function prototypes */
+static int load_object_at(LinkerState *ls, const char *filename, long offset);
+static int scan_library(LinkerState *ls, const char *filename);
+static int process_libraries(LinkerState *ls);
+static int resolve_symbols(LinkerState *ls);
+static int link_output(LinkerState *ls);
+static int add_global(LinkerState *ls, const char *name, unsigned long hash,
+                      uint24 value, uint8 section, int obj_index);
+
+/* Case-insensitive string compare */
+int str_casecmp(const char *a, const char *b)
+{
+    while (*a && *b) {
+        unsigned char ca = tolower((unsigned char)*a);
+        unsigned char cb = tolower((unsigned char)*b);
+        if (ca != cb) return ca - cb;
+        a++; b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+/* String copy with length limit */
+void str_copy(char *dest, const char *src, int max)
+{
+    int i;
+    for (i = 0; i < max - 1 && src[i]; i++) {
+        dest[i] = src[i];
+    }
+    dest[i] = '\0';
+}
+
+/* Case-insensitive hash (djb2 variant), the one objects carry in
+ * OBJ_EXT_NAME_HASHES; tables use its low bits as the bucket */
+unsigned long name_hash(const char *name)
+{
+    unsigned long h = OBJ_HASH_INIT;
+    while (*name) {
+        h = OBJ_HASH_STEP(h, tolower((unsigned char)*name++));
+    }
+    return h;
+}
+
+/* ============================================================
+ * Diagnostics
+ * ============================================================ */
+
+static void ld_vdiag(LinkerState *ls, int severity, const char *fmt,
+                     va_list args)
+{
+    char msg[MAX_DIAG_LEN];
+    
+    vsprintf(msg, fmt, args);
+    
+    if (ls->diag) {
+        ls->diag(ls->diag_user, severity, msg);
+    } else if (severity == LD_NOTE) {
+        printf("%s\n", msg);
+    } else {
+        fprintf(stderr, "%s: %s\n",
+                severity == LD_ERROR ? "error" : "warning", msg);
+    }
+}
+
+/* Report an error; every error makes the link fail */
+void ld_error(LinkerState *ls, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    ld_vdiag(ls, LD_ERROR, fmt, args);
+    va_end(args);
+    ls->errors++;
+}
+
+/* Report progress (callers check ls->verbose) */
+void ld_note(LinkerState *ls, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    ld_vdiag(ls, LD_NOTE, fmt, args);
+    va_end(args);
+}
+
+/* ============================================================
+ * File Access
+ * ============================================================ */
+
+static void *stdio_open(void *user, const char *name)
+{
+    (void)user;
+    return fopen(name, "rb");
+}
+
+static long stdio_read(void *user, void *file, long pos, void *buf, long len)
+{
+    (void)user;
+    if (fseek((FILE *)file, pos, SEEK_SET) != 0) return 0;
+    return (long)fread(buf, 1, (size_t)len, (FILE *)file);
+}
+
+static long stdio_size(void *user, void *file)
+{
+    (void)user;
+    fseek((FILE *)file, 0, SEEK_END);
+    return ftell((FILE *)file);
+}
+
+static void stdio_close(void *user, void *file)
+{
+    (void)user;
+    fclose((FILE *)file);
+}
+
+/* Open an input file; a memory buffer of the same name takes priority */
+int lf_open(LinkerState *ls, const char *name, LdFile *f)
+{
+    int i;
+    
+    f->mem = NULL;
+    f->handle = NULL;
+    for (i = ls->num_mem_files - 1; i >= 0; i--) {
+        if (strcmp(ls->mem_files[i].name, name) == 0) {
+            f->mem = &ls->mem_files[i];
+            return 0;
+        }
+    }
+    f->handle = ls->ops.open(ls->ops.user, name);
+    return f->handle ? 0 : -1;
+}
+
+/* Read len bytes at pos; returns 0 only if all of them were read */
+int lf_read(LinkerState *ls, LdFile *f, long pos, void *buf, long len)
+{
+    if (len <= 0) return 0;
+    if (f->mem) {
+        if (pos < 0 || pos + len > f->mem->size) return -1;
+        memcpy(buf, f->mem->data + pos, (size_t)len);
+        return 0;
+    }
+    return ls->ops.read(ls->ops.user, f->handle, pos, buf, len) == len ? 0 : -1;
+}
+
+long lf_size(LinkerState *ls, LdFile *f)
+{
+    if (f->mem) return f->mem->size;
+    return ls->ops.size(ls->ops.user, f->handle);
+}
+
+void lf_close(LinkerState *ls, LdFile *f)
+{
+    if (f->handle) ls->ops.close(ls->ops.user, f->handle);
+    f->handle = NULL;
+    f->mem = NULL;
+}
+
+/* Register a memory buffer under a file name */
+static int add_mem_file(LinkerState *ls, const char *name, const uint8 *data,
+                        long size, int is_library)
+{
+    MemFile *mf;
+    
+    if (ls->num_mem_files >= MAX_MEM_FILES) {
+        ld_error(ls, "too many memory buffers");
+        return -1;
+    }
+    mf = &ls->mem_files[ls->num_mem_files++];
+    str_copy(mf->name, name, MAX_FILENAME);
+    mf->data = data;
+    mf->size = size;
+    mf->is_library = is_library;
+    return 0;
+}
+
+/* ============================================================
+ * Symbols
+ * ============================================================ */
+
+/* Find a symbol defined by the objects being linked; names are only
+ * compared when the hashes match */
+static GlobalSymbol *find_linked(LinkerState *ls, const char *name,
+                                 unsigned long hash)
+{
+    GlobalSymbol *sym;
+    int idx = ls->hash_buckets[hash & (HASH_SIZE - 1)];
+    while (idx >= 0) {
+        sym = &ls->symbols[idx];
+        if (sym->hash == hash && str_casecmp(sym->name, name) == 0) {
+            return sym;
+        }
+        idx = sym->hash_next;
+    }
+    return NULL;
+}
+
+/* Find a global symbol by name and name_hash(); the objects' own
+ * definitions take priority over the resident image's */
+GlobalSymbol *find_hashed(LinkerState *ls, const char *name,
+                          unsigned long hash)
+{
+    GlobalSymbol *sym = find_linked(ls, name, hash);
+    
+    if (!sym && ls->num_res_symbols > 0) {
+        sym = resident_find(ls, name, hash);
+    }
+    return sym;
+}
+
+/* Find a global symbol by name */
+GlobalSymbol *find_global(LinkerState *ls, const char *name)
+{
+    return find_hashed(ls, name, name_hash(name));
+}
+
+/* Add a global symbol (with hash table insertion) */
+static int add_global(LinkerState *ls, const char *name, unsigned long hash,
+                      uint24 value, uint8 section, int obj_index)
+{
+    GlobalSymbol *existing;
+    unsigned bucket;
+    
+    existing = find_linked(ls, name, hash);
+    if (existing) {
+        ld_error(ls, "duplicate symbol '%s' in '%s' and '%s'",
+                 name, ls->objects[existing->obj_index].filename,
+                 ls->objects[obj_index].filename);
+        return -1;
+    }
+    
+    if (ls->num_symbols >= MAX_SYMBOLS) {
+        ld_error(ls, "too many symbols");
+        return -1;
+    }
+    
+    str_copy(ls->symbols[ls->num_symbols].name, name, MAX_SYM_NAME);
+    ls->symbols[ls->num_symbols].value = value;
+    ls->symbols[ls->num_symbols].section = section;
+    ls->symbols[ls->num_symbols].obj_index = obj_index;
+    ls->symbols[ls->num_symbols].hash = hash;
+    ls->symbols[ls->num_symbols].size = 0;
+    ls->symbols[ls->num_symbols].kind = obj_index == LINKER_DEFINED
+                                        ? SYMK_CONST : SYMK_NONE;
+    
+    /* Insert at head of hash chain */
+    bucket = (unsigned)(hash & (HASH_SIZE - 1));
+    ls->symbols[ls->num_symbols].hash_next = ls->hash_buckets[bucket];
+    ls->hash_buckets[bucket] = ls->num_symbols;
+    
+    ls->num_symbols++;
+    
+    return 0;
+}
+
+/* Add a linker-defined symbol */
+void add_defined(LinkerState *ls, const char *name, uint24 value)
+{
+    add_global(ls, name, name_hash(name), value, 0, LINKER_DEFINED);
+}
+
+/* Add a linker-defined address in a section, which a module relocates */
+static void add_address(LinkerState *ls, const char *name, uint24 value,
+                        uint8 section)
+{
+    add_global(ls, name, name_hash(name), value, section, LINKER_DEFINED);
+}
+
+/* ============================================================
+ * Objects
+ * ============================================================ */
+
+/* Bytes taken by the extension chunks at pos, or -1 if unreadable */
+static long ext_size(LinkerState *ls, LdFile *f, long pos)
+{
+    ObjExtHeader ext;
+    long start = pos;
+    
+    for (;;) {
+        if (lf_read(ls, f, pos, &ext, sizeof(ext)) < 0) return -1;
+        pos += sizeof(ext);
+        if (ext.type == OBJ_EXT_END) return pos - start;
+        pos += READ24(ext.size);
+    }
+}
+
+/* Read the payload of the first chunk of a type among the extensions
+ * at pos (0 if none), if it is size bytes.  Returns a buffer to free,
+ * or NULL if there is no such chunk (objects from older assemblers). */
+uint8 *read_chunk(LinkerState *ls, LdFile *f, long pos, int type, long size)
+{
+    ObjExtHeader ext;
+    uint8 *buf;
+    
+    while (pos) {
+        if (lf_read(ls, f, pos, &ext, sizeof(ext)) < 0) return NULL;
+        pos += sizeof(ext);
+        if (ext.type == OBJ_EXT_END) return NULL;
+        if (ext.type == type) {
+            if ((long)READ24(ext.size) != size) return NULL;
+            buf = (uint8 *)malloc(size > 0 ? size : 1);
+            if (buf && lf_read(ls, f, pos, buf, size) < 0) {
+                free(buf);
+                buf = NULL;
+            }
+            return buf;
+        }
+        pos += READ24(ext.size);
+    }
+    return NULL;
+}
+
+/* Fill hashes[count] from the OBJ_EXT_NAME_HASHES chunk; -1 if none */
+static int read_hashes(LinkerState *ls, LdFile *f, long pos,
+                       unsigned long *hashes, long count)
+{
+    uint8 *buf;
+    long i;
+    
+    buf = read_chunk(ls, f, pos, OBJ_EXT_NAME_HASHES, 4 * count);
+    if (!buf) return -1;
+    for (i = 0; i < count; i++) {
+        hashes[i] = READ32(&buf[4 * i]);
+    }
+    free(buf);
+    return 0;
+}
+
+/* Name hashes of an object's symbols then externs, from the object if
+ * it has them, else computed.  NULL if out of memory. */
+static unsigned long *object_hashes(LinkerState *ls, LdFile *f,
+                                    ObjectInfo *obj, const ObjSymbol *syms,
+                                    const char *strtab)
+{
+    unsigned long *hashes;
+    ObjExtern *ext_tab;
+    long count = (long)obj->num_symbols + (long)obj->num_externs;
+    uint24 name_off;
+    long i;
+    
+    hashes = (unsigned long *)malloc((count + 1) * sizeof(unsigned long));
+    if (!hashes) return NULL;
+    if (read_hashes(ls, f, obj->ext_pos, hashes, count) == 0) {
+        return hashes;
+    }
+    
+    for (i = 0; i < (long)obj->num_symbols; i++) {
+        name_off = READ24(syms[i].name_offset);
+        hashes[i] = strtab && name_off < obj->strtab_size
+                    ? name_hash(&strtab[name_off]) : 0;
+    }
+    ext_tab = NULL;
+    if (obj->num_externs > 0) {
+        ext_tab = (ObjExtern *)malloc(obj->num_externs * sizeof(ObjExtern));
+        if (!ext_tab) {
+            free(hashes);
+            return NULL;
+        }
+        if (lf_read(ls, f, obj->extern_pos, ext_tab,
+                    obj->num_externs * sizeof(ObjExtern)) < 0) {
+            memset(ext_tab, 0xFF, obj->num_externs * sizeof(ObjExtern));
+        }
+    }
+    for (i = 0; i < (long)obj->num_externs; i++) {
+        name_off = READ24(ext_tab[i].name_offset);
+        hashes[obj->num_symbols + i] = strtab && name_off < obj->strtab_size
+                                       ? name_hash(&strtab[name_off]) : 0;
+    }
+    if (ext_tab) free(ext_tab);
+    return hashes;
+}
+
+/* Read the extension chunks of an object, skipping unknown types */
+static int read_extensions(LinkerState *ls, LdFile *f, ObjectInfo *obj,
+                           const ObjSymbol *syms, const char *strtab)
+{
+    ObjExtHeader ext;
+    uint8 hot[OBJ_COLD_SIZE];
+    long pos = obj->ext_pos;
+    uint24 size;
+    
+    for (;;) {
+        if (lf_read(ls, f, pos, &ext, sizeof(ext)) < 0) {
+            ld_error(ls, "cannot read extensions from '%s'", obj->filename);
+            return -1;
+        }
+        pos += sizeof(ext);
+        size = READ24(ext.size);
+        
+        switch (ext.type) {
+            case OBJ_EXT_END:
+                return 0;
+            
+            case OBJ_EXT_CLOBBERS:
+                if (clob_load(ls, f, obj, pos, size, syms, strtab) < 0) {
+                    return -1;
+                }
+                break;
+            
+            case OBJ_EXT_COLD:
+                if (size < OBJ_COLD_SIZE ||
+                    lf_read(ls, f, pos, hot, OBJ_COLD_SIZE) < 0) {
+                    ld_error(ls, "cannot read cold code offset from '%s'",
+                             obj->filename);
+                    return -1;
+                }
+                if (READ24(hot) <= obj->code_size) {
+                    obj->hot_size = READ24(hot);
+                }
+                break;
+            
+            case OBJ_EXT_ASSETS:
+                if (asset_load(ls, f, obj, pos, size) < 0) {
+                    return -1;
+                }
+                break;
+            
+            case OBJ_EXT_FIXED:
+                obj->num_fixed = (int)(size / OBJ_FIXED_SIZE);
+                break;
+        }
+        pos += size;
+    }
+}
+
+/* Load an object file from a specific offset (for library support) */
+static int load_object_at(LinkerState *ls, const char *filename, long offset)
+{
+    LdFile f;
+    ObjHeader header;
+    ObjSymbol *sym_buf;
+    ObjSymInfo *info;
+    ObjectInfo *obj;
+    char *strtab;
+    uint24 name_off;
+    uint24 value;
+    int result;
+    int i;
+    
+    if (ls->num_objects >= MAX_OBJECTS) {
+        ld_error(ls, "too many object files");
+        return -1;
+    }
+    
+    if (lf_open(ls, filename, &f) < 0) {
+        ld_error(ls, "cannot open '%s'", filename);
+        return -1;
+    }
+    
+    /* Read header (at offset for library members) */
+    if (lf_read(ls, &f, offset, &header, sizeof(header)) < 0) {
+        ld_error(ls, "cannot read header from '%s'", filename);
+        lf_close(ls, &f);
+        return -1;
+    }
+    
+    /* Verify magic */
+    if (header.magic[0] != 'E' || header.magic[1] != 'Z' ||
+        header.magic[2] != '8' || header.magic[3] != 'O') {
+        ld_error(ls, "'%s' is not a valid object file", filename);
+        lf_close(ls, &f);
+        return -1;
+    }
+    
+    /* Check version */
+    if (header.version != OBJ_VERSION && header.version != OBJ_VERSION_EXT &&
+        header.version != OBJ_VERSION_ADDENDS) {
+        ld_error(ls, "'%s' has unsupported version %d",
+                 filename, header.version);
+        lf_close(ls, &f);
+        return -1;
+    }
+    
+    obj = &ls->objects[ls->num_objects];
+    str_copy(obj->filename, filename, MAX_FILENAME);
+    obj->code = NULL;
+    obj->data = NULL;
+    obj->relocs = NULL;
+    obj->strtab = NULL;
+    obj->ext_tab = NULL;
+    obj->fixed = NULL;
+    obj->name_hashes = NULL;
+    obj->num_fixed = 0;
+    
+    obj->code_size = READ24(header.code_size);
+    obj->hot_size = obj->code_size;
+    obj->data_size = READ24(header.data_size);
+    obj->bss_size = READ24(header.bss_size);
+    obj->num_symbols = READ24(header.num_symbols);
+    obj->num_relocs = READ24(header.num_relocs);
+    obj->num_externs = READ24(header.num_externs);
+    obj->strtab_size = READ24(header.strtab_size);
+    
+    /* Record file positions (relative to offset for libraries) */
+    obj->code_pos = offset + sizeof(header);
+    obj->data_pos = obj->code_pos + obj->code_size;
+    obj->sym_pos = obj->data_pos + obj->data_size;
+    obj->reloc_pos = obj->sym_pos + (obj->num_symbols * sizeof(ObjSymbol));
+    obj->extern_pos = obj->reloc_pos + (obj->num_relocs * sizeof(ObjReloc));
+    obj->strtab_pos = obj->extern_pos + (obj->num_externs * sizeof(ObjExtern));
+    obj->library = -1;
+    obj->member = -1;
+    obj->ext_pos = 0;
+    if (header.version >= OBJ_VERSION_EXT && (header.flags & OBJ_FLAG_EXT)) {
+        obj->ext_pos = obj->strtab_pos + obj->strtab_size;
+    }
+    obj->addends = header.version == OBJ_VERSION_ADDENDS &&
+                   obj->num_relocs > 0;
+    
+    /* Read string table */
+    strtab = NULL;
+    if (obj->strtab_size > 0) {
+        strtab = (char *)malloc(obj->strtab_size);
+        if (!strtab) {
+            ld_error(ls, "out of memory");
+            lf_close(ls, &f);
+            return -1;
+        }
+        if (lf_read(ls, &f, obj->strtab_pos, strtab, obj->strtab_size) < 0) {
+            ld_error(ls, "cannot read string table from '%s'", filename);
+            free(strtab);
+            lf_close(ls, &f);
+            return -1;
+        }
+    }
+    
+    /* Read the symbol table in one block */
+    sym_buf = NULL;
+    if (obj->num_symbols > 0) {
+        sym_buf = (ObjSymbol *)malloc(obj->num_symbols * sizeof(ObjSymbol));
+        if (!sym_buf) {
+            ld_error(ls, "out of memory");
+            if (strtab) free(strtab);
+            lf_close(ls, &f);
+            return -1;
+        }
+        if (lf_read(ls, &f, obj->sym_pos, sym_buf,
+                    obj->num_symbols * sizeof(ObjSymbol)) < 0) {
+            ld_error(ls, "cannot read symbol from '%s'", filename);
+            free(sym_buf);
+            if (strtab) free(strtab);
+            lf_close(ls, &f);
+            return -1;
+        }
+    }
+    
+    /* Name hashes for the symbol tables, kept for the externs */
+    obj->name_hashes = object_hashes(ls, &f, obj, sym_buf, strtab);
+    if (!obj->name_hashes) {
+        ld_error(ls, "out of memory");
+        if (sym_buf) free(sym_buf);
+        if (strtab) free(strtab);
+        lf_close(ls, &f);
+        return -1;
+    }
+    
+    /* Sizes and kinds, if the assembler recorded them */
+    info = (ObjSymInfo *)read_chunk(ls, &f, obj->ext_pos, OBJ_EXT_SYMBOL_INFO,
+                                    obj->num_symbols * sizeof(ObjSymInfo));
+    
+    /* Register exported symbols */
+    for (i = 0; i < (int)obj->num_symbols; i++) {
+        name_off = READ24(sym_buf[i].name_offset);
+        value = READ24(sym_buf[i].value);
+        
+        /* Value is section-relative; we'll make it absolute later */
+        if (strtab && name_off < obj->strtab_size &&
+            add_global(ls, &strtab[name_off], obj->name_hashes[i], value,
+                       sym_buf[i].section, ls->num_objects) == 0 && info) {
+            ls->symbols[ls->num_symbols - 1].size = READ24(info[i].size);
+            ls->symbols[ls->num_symbols - 1].kind = info[i].kind;
+        }
+    }
+    if (info) free(info);
+    
+    /* Extensions may refer to the symbols just read */
+    result = 0;
+    if (obj->ext_pos) {
+        result = read_extensions(ls, &f, obj, sym_buf, strtab);
+    }
+    
+    if (sym_buf) free(sym_buf);
+    if (strtab) free(strtab);
+    lf_close(ls, &f);
+    if (result < 0) {
+        free(obj->name_hashes);
+        obj->name_hashes = NULL;
+        return -1;
+    }
+    
+    ls->num_objects++;
+    
+    if (ls->verbose) {
+        ld_note(ls, "Loaded '%s': code=%u, data=%u, bss=%u",
+                filename, (unsigned)obj->code_size, (unsigned)obj->data_size,
+                (unsigned)obj->bss_size);
+    }
+    
+    return 0;
+}
+
+/* Load an object file */
+int ld_add_object(LinkerState *ls, const char *filename)
+{
+    int result;
+    
+    ttrace_begin(ls->trace, "load_object", filename);
+    result = load_object_at(ls, filename, 0);
+    ttrace_end(ls->trace);
+    return result;
+}
+
+/* Load an object from memory */
+int ld_add_object_mem(LinkerState *ls, const char *name,
+                      const uint8 *data, long size)
+{
+    if (add_mem_file(ls, name, data, size, 0) < 0) return -1;
+    return ld_add_object(ls, name);
+}
+
+/* ============================================================
+ * Libraries
+ * ============================================================ */
+
+/* Add a library search directory */
+int ld_add_libdir(LinkerState *ls, const char *dir)
+{
+    if (ls->num_libdirs >= MAX_LIBDIRS) {
+        ld_error(ls, "too many library directories");
+        return -1;
+    }
+    str_copy(ls->libdirs[ls->num_libdirs], dir, MAX_FILENAME);
+    ls->num_libdirs++;
+    return 0;
+}
+
+/* Check whether an input file can be opened */
+static int file_exists(LinkerState *ls, const char *name)
+{
+    LdFile f;
+    
+    if (lf_open(ls, name, &f) < 0) return 0;
+    lf_close(ls, &f);
+    return 1;
+}
+
+/*
+ * Search for a library by short name.
+ * Given name "foo", searches each -L directory for "libfoo.a".
+ * If found, calls ld_add_library with the full path.
+ * Also accepts a plain filename/path as a fallback.
+ */
+int ld_find_library(LinkerState *ls, const char *name)
+{
+    char path[MAX_FILENAME];
+    int i;
+    
+    /* Search -L directories for lib<name>.a */
+    for (i = 0; i < ls->num_libdirs; i++) {
+        int len = 0;
+        const char *dir = ls->libdirs[i];
+        
+        /* Build path: dir/lib<name>.a */
+        while (dir[len] && len < MAX_FILENAME - 1) {
+            path[len] = dir[len];
+            len++;
+        }
+        /* Ensure trailing separator */
+        if (len > 0 && path[len - 1] != '/' && path[len - 1] != '\\') {
+            if (len < MAX_FILENAME - 1) path[len++] = '/';
+        }
+        /* Append "lib" */
+        if (len + 3 < MAX_FILENAME) {
+            path[len++] = 'l';
+            path[len++] = 'i';
+            path[len++] = 'b';
+        }
+        /* Append name */
+        {
+            const char *p = name;
+            while (*p && len < MAX_FILENAME - 1) {
+                path[len++] = *p++;
+            }
+        }
+        /* Append ".a" */
+        if (len + 2 < MAX_FILENAME) {
+            path[len++] = '.';
+            path[len++] = 'a';
+        }
+        path[len] = '\0';
+        
+        /* Check if file exists */
+        if (file_exists(ls, path)) {
+            if (ls->verbose) {
+                ld_note(ls, "Found library '%s' as '%s'", name, path);
+            }
+            return ld_add_library(ls, path);
+        }
+    }
+    
+    /* Fallback: try the name as a direct path */
+    if (file_exists(ls, name)) {
+        return ld_add_library(ls, name);
+    }
+    
+    ld_error(ls, "cannot find library '%s'", name);
+    return -1;
+}
+
+/* Scan a library and record its objects (without loading them) */
+static int scan_library(LinkerState *ls, const char *filename)
+{
+    LdFile f;
+    ObjHeader header;
+    LibraryInfo *lib;
+    long file_size;
+    long pos;
+    long ext_len;
+    uint24 code_size, data_size;
+    uint24 num_symbols, num_relocs, num_externs, strtab_size;
+    uint24 obj_size;
+    int i;
+    
+    /* Libraries are kept across links; adding one again is a no-op */
+    for (i = 0; i < ls->num_libraries; i++) {
+        if (strcmp(ls->libraries[i].filename, filename) == 0) return 0;
+    }
+    
+    if (ls->num_libraries >= MAX_LIBRARIES) {
+        ld_error(ls, "too many libraries");
+        return -1;
+    }
+    
+    if (lf_open(ls, filename, &f) < 0) {
+        ld_error(ls, "cannot open library '%s'", filename);
+        return -1;
+    }
+    
+    lib = &ls->libraries[ls->num_libraries];
+    str_copy(lib->filename, filename, MAX_FILENAME);
+    lib->num_objects = 0;
+    
+    file_size = lf_size(ls, &f);
+    
+    /* Scan through library and record object positions */
+    pos = 0;
+    while (pos < file_size) {
+        if (lf_read(ls, &f, pos, &header, sizeof(header)) < 0) {
+            break;
+        }
+        
+        /* Verify magic */
+        if (header.magic[0] != 'E' || header.magic[1] != 'Z' ||
+            header.magic[2] != '8' || header.magic[3] != 'O') {
+            ld_error(ls, "invalid object at offset %ld in '%s'",
+                     pos, filename);
+            lf_close(ls, &f);
+            return -1;
+        }
+        
+        if (lib->num_objects >= MAX_LIB_OBJECTS) {
+            ld_error(ls, "too many objects in library '%s'", filename);
+            lf_close(ls, &f);
+            return -1;
+        }
+        
+        /* Calculate object size (BSS doesn't take file space) */
+        code_size = READ24(header.code_size);
+        data_size = READ24(header.data_size);
+        num_symbols = READ24(header.num_symbols);
+        num_relocs = READ24(header.num_relocs);
+        num_externs = READ24(header.num_externs);
+        strtab_size = READ24(header.strtab_size);
+        
+        obj_size = sizeof(header) + code_size + data_size +
+                   (num_symbols * sizeof(ObjSymbol)) +
+                   (num_relocs * sizeof(ObjReloc)) +
+                   (num_externs * sizeof(ObjExtern)) +
+                   strtab_size;
+        
+        /* Version 4 objects end with extension chunks */
+        if (header.version >= OBJ_VERSION_EXT &&
+            (header.flags & OBJ_FLAG_EXT)) {
+            ext_len = ext_size(ls, &f, pos + (long)obj_size);
+            if (ext_len < 0) {
+                ld_error(ls, "bad extensions at offset %ld in '%s'",
+                         pos, filename);
+                lf_close(ls, &f);
+                return -1;
+            }
+            obj_size += (uint24)ext_len;
+        }
+        
+        /* Record this object */
+        lib->objects[lib->num_objects].offset = pos;
+        lib->objects[lib->num_objects].obj_size = obj_size;
+        lib->objects[lib->num_objects].loaded = 0;
+        lib->num_objects++;
+        
+        pos += obj_size;
+    }
+    
+    lf_close(ls, &f);
+    
+    ls->num_libraries++;
+    
+    if (ls->verbose) {
+        ld_note(ls, "Scanned library '%s': %d object(s)", filename,
+                lib->num_objects);
+    }
+    
+    return 0;
+}
+
+/* Scan a library, recording the time taken in the trace */
+int ld_add_library(LinkerState *ls, const char *filename)
+{
+    int result;
+    
+    ttrace_begin(ls->trace, "add_library", filename);
+    result = scan_library(ls, filename);
+    ttrace_end(ls->trace);
+    return result;
+}
+
+/* Add a library held in memory */
+int ld_add_library_mem(LinkerState *ls, const char *name,
+                       const uint8 *data, long size)
+{
+    if (add_mem_file(ls, name, data, size, 1) < 0) return -1;
+    return ld_add_library(ls, name);
+}
+
+/*
+ * Collect undefined externals from an object file.
+ * Uses an already-open file to avoid repeated open/close.
+ */
+static int get_object_externals(LinkerState *ls, LdFile *f, ObjectInfo *obj,
+                                char externals[][MAX_SYM_NAME],
+                                unsigned long *hashes, int max_ext)
+{
+    ObjExtern *ext_tab;
+    char *strtab;
+    uint24 name_off;
+    int i, count = 0;
+    
+    if (obj->strtab_size == 0 || obj->num_externs == 0) {
+        return 0;
+    }
+    
+    /* Read string table and extern table */
+    strtab = (char *)malloc(obj->strtab_size);
+    ext_tab = (ObjExtern *)malloc(obj->num_externs * sizeof(ObjExtern));
+    if (!strtab || !ext_tab ||
+        lf_read(ls, f, obj->strtab_pos, strtab, obj->strtab_size) < 0 ||
+        lf_read(ls, f, obj->extern_pos, ext_tab,
+                obj->num_externs * sizeof(ObjExtern)) < 0) {
+        if (strtab) free(strtab);
+        if (ext_tab) free(ext_tab);
+        return 0;
+    }
+    
+    for (i = 0; i < (int)obj->num_externs && count < max_ext; i++) {
+        name_off = READ24(ext_tab[i].name_offset);
+        if (name_off < obj->strtab_size) {
+            str_copy(externals[count], &strtab[name_off], MAX_SYM_NAME);
+            hashes[count] = obj->name_hashes[obj->num_symbols + i];
+            count++;
+        }
+    }
+    
+    free(ext_tab);
+    free(strtab);
+    return count;
+}
+
+/* Initialise a library symbol index */
+static int lib_index_init(LibSymIndex *idx)
+{
+    int i;
+    idx->entries = (LibSymEntry *)malloc(MAX_LIB_SYMS * sizeof(LibSymEntry));
+    if (!idx->entries) return -1;
+    idx->num_entries = 0;
+    idx->max_entries = MAX_LIB_SYMS;
+    idx->num_libraries = 0;
+    for (i = 0; i < LIB_HASH_SIZE; i++) {
+        idx->hash_buckets[i] = -1;
+    }
+    return 0;
+}
+
+/* Free a library symbol index */
+static void lib_index_free(LibSymIndex *idx)
+{
+    if (idx->entries) {
+        free(idx->entries);
+        idx->entries = NULL;
+    }
+    idx->num_entries = 0;
+    idx->num_libraries = 0;
+}
+
+/* Add a symbol to the library index */
+static int lib_index_add(LibSymIndex *idx, const char *name,
+                         unsigned long hash, int lib_idx, int obj_idx)
+{
+    unsigned bucket;
+    LibSymEntry *e;
+    
+    if (idx->num_entries >= idx->max_entries) {
+        return -1; /* Full */
+    }
+    
+    e = &idx->entries[idx->num_entries];
+    str_copy(e->name, name, MAX_LIBSYM_NAME);
+    e->lib_idx = (uint8)lib_idx;
+    e->obj_idx = (uint8)obj_idx;
+    e->hash = hash;
+    
+    bucket = (unsigned)(hash & (LIB_HASH_SIZE - 1));
+    e->hash_next = idx->hash_buckets[bucket];
+    idx->hash_buckets[bucket] = idx->num_entries;
+    idx->num_entries++;
+    
+    return 0;
+}
+
+/*
+ * Look up a symbol in the library index.
+ * Returns a pointer to the matching entry whose library object has
+ * not yet been loaded, or NULL if not found.
+ */
+static LibSymEntry *lib_index_find(LibSymIndex *idx, const char *name,
+                                   unsigned long hash, LinkerState *ls)
+{
+    int i = idx->hash_buckets[hash & (LIB_HASH_SIZE - 1)];
+    while (i >= 0) {
+        LibSymEntry *e = &idx->entries[i];
+        if (e->hash == hash && str_casecmp(e->name, name) == 0) {
+            /* Check if this object is not yet loaded */
+            if (!ls->libraries[e->lib_idx].objects[e->obj_idx].loaded) {
+                return e;
+            }
+        }
+        i = e->hash_next;
+    }
+    return NULL;
+}
+
+/*
+ * Add the libraries not yet in the index by scanning all their
+ * objects and recording their exported symbols.  Each library file
+ * is opened once and all its objects' symbol/string tables are read
+ * in a single pass.  Every object is indexed, loaded or not, so the
+ * index stays valid for later links.
+ */
+static int build_lib_index(LinkerState *ls, LibSymIndex *idx)
+{
+    int lib_idx, obj_idx;
+    
+    for (lib_idx = idx->num_libraries; lib_idx < ls->num_libraries; lib_idx++) {
+        LibraryInfo *lib = &ls->libraries[lib_idx];
+        LdFile f;
+        
+        if (lf_open(ls, lib->filename, &f) < 0) continue;
+        
+        ttrace_begin(ls->trace, "build_lib_index", lib->filename);
+        
+        for (obj_idx = 0; obj_idx < lib->num_objects; obj_idx++) {
+            ObjHeader header;
+            ObjSymbol *sym_buf;
+            char *strtab;
+            unsigned long *hashes;
+            uint24 code_size, data_size;
+            uint24 num_symbols, num_relocs, num_externs, strtab_size;
+            long sym_pos, strtab_pos, ext_pos;
+            uint24 name_off;
+            int s;
+            
+            /* Read header */
+            if (lf_read(ls, &f, lib->objects[obj_idx].offset, &header,
+                        sizeof(header)) < 0) continue;
+            
+            code_size = READ24(header.code_size);
+            data_size = READ24(header.data_size);
+            num_symbols = READ24(header.num_symbols);
+            num_relocs = READ24(header.num_relocs);
+            num_externs = READ24(header.num_externs);
+            strtab_size = READ24(header.strtab_size);
+            
+            if (num_symbols == 0 || strtab_size == 0) continue;
+            
+            sym_pos = lib->objects[obj_idx].offset + sizeof(header) +
+                      code_size + data_size;
+            strtab_pos = sym_pos +
+                         (num_symbols * sizeof(ObjSymbol)) +
+                         (num_relocs * sizeof(ObjReloc)) +
+                         (num_externs * sizeof(ObjExtern));
+            
+            /* Read string table */
+            strtab = (char *)malloc(strtab_size);
+            if (!strtab) continue;
+            
+            if (lf_read(ls, &f, strtab_pos, strtab, strtab_size) < 0) {
+                free(strtab);
+                continue;
+            }
+            
+            /* Read all symbol entries */
+            sym_buf = (ObjSymbol *)malloc(num_symbols * sizeof(ObjSymbol));
+            if (!sym_buf) {
+                free(strtab);
+                continue;
+            }
+            
+            if (lf_read(ls, &f, sym_pos, sym_buf,
+                        num_symbols * sizeof(ObjSymbol)) < 0) {
+                free(sym_buf);
+                free(strtab);
+                continue;
+            }
+            
+            /* Name hashes from the object if it has them */
+            ext_pos = 0;
+            if (header.version >= OBJ_VERSION_EXT &&
+                (header.flags & OBJ_FLAG_EXT)) {
+                ext_pos = strtab_pos + strtab_size;
+            }
+            hashes = (unsigned long *)malloc((num_symbols + num_externs) *
+                                             sizeof(unsigned long));
+            if (hashes && read_hashes(ls, &f, ext_pos, hashes,
+                                      (long)num_symbols +
+                                      (long)num_externs) < 0) {
+                free(hashes);
+                hashes = NULL;
+            }
+            
+            /* Add each exported symbol to the index */
+            for (s = 0; s < (int)num_symbols; s++) {
+                name_off = READ24(sym_buf[s].name_offset);
+                if (name_off < strtab_size) {
+                    lib_index_add(idx, &strtab[name_off],
+                                  hashes ? hashes[s]
+                                         : name_hash(&strtab[name_off]),
+                                  lib_idx, obj_idx);
+                }
+            }
+            
+            if (hashes) free(hashes);
+            free(sym_buf);
+            free(strtab);
+        }
+        
+        lf_close(ls, &f);
+        ttrace_end(ls->trace);
+    }
+    
+    idx->num_libraries = ls->num_libraries;
+    return 0;
+}
+
+/*
+ * Process libraries - selectively load objects that satisfy undefined
+ * references.
+ *
+ * Uses a hash index of all exported library symbols, built once and
+ * kept with the libraries, so undefined references are resolved with
+ * O(1) hash lookups instead of scanning every library object from disk.
+ */
+static int process_libraries(LinkerState *ls)
+{
+    LibSymIndex *idx = &ls->lib_index;
+    char (*undefined)[MAX_SYM_NAME];
+    char (*obj_ext)[MAX_SYM_NAME];
+    unsigned long *undef_hash;
+    unsigned long *ext_hash;
+    int num_undefined;
+    int i, j, k;
+    int loaded_any;
+    int total_loaded = 0;
+    int iteration = 0;
+    char detail[32];
+    
+    if (ls->num_libraries == 0) {
+        return 0;  /* No libraries to process */
+    }
+    
+    /* Bring the library symbol index up to date */
+    if (!idx->entries && lib_index_init(idx) < 0) {
+        ld_error(ls, "out of memory for library index");
+        return -1;
+    }
+    if (idx->num_libraries < ls->num_libraries) {
+        build_lib_index(ls, idx);
+        
+        if (ls->verbose) {
+            ld_note(ls, "Library index: %d symbols from %d library(s)",
+                    idx->num_entries, ls->num_libraries);
+        }
+    }
+    
+    undefined = (char (*)[MAX_SYM_NAME])malloc(MAX_EXTERNS * MAX_SYM_NAME);
+    if (!undefined) {
+        ld_error(ls, "out of memory");
+        return -1;
+    }
+    
+    /* Allocate scratch buffer for per-object externals once */
+    obj_ext = (char (*)[MAX_SYM_NAME])malloc(MAX_OBJ_EXTERNS * MAX_SYM_NAME);
+    undef_hash = (unsigned long *)malloc((MAX_EXTERNS + MAX_OBJ_EXTERNS) *
+                                         sizeof(unsigned long));
+    if (!obj_ext || !undef_hash) {
+        ld_error(ls, "out of memory");
+        if (obj_ext) free(obj_ext);
+        if (undef_hash) free(undef_hash);
+        free(undefined);
+        return -1;
+    }
+    ext_hash = undef_hash + MAX_EXTERNS;
+    
+    /* Iterate until no more symbols are resolved */
+    do {
+        loaded_any = 0;
+        num_undefined = 0;
+        
+        sprintf(detail, "iteration %d", ++iteration);
+        ttrace_begin(ls->trace, "process_libraries", detail);
+        
+        /* Collect all undefined externals from loaded objects.
+         * Open each object file once, read its externals, close it. */
+        for (i = 0; i < ls->num_objects && num_undefined < MAX_EXTERNS; i++) {
+            int ext_count;
+            LdFile f;
+            
+            if (lf_open(ls, ls->objects[i].filename, &f) < 0) continue;
+            
+            ext_count = get_object_externals(ls, &f, &ls->objects[i],
+                                             obj_ext, ext_hash,
+                                             MAX_OBJ_EXTERNS);
+            lf_close(ls, &f);
+            
+            for (j = 0; j < ext_count && num_undefined < MAX_EXTERNS; j++) {
+                /* Check if already defined */
+                if (find_hashed(ls, obj_ext[j], ext_hash[j]) != NULL) {
+                    continue;  /* Already satisfied */
+                }
+                
+                /* Check if already in undefined list */
+                for (k = 0; k < num_undefined; k++) {
+                    if (undef_hash[k] == ext_hash[j] &&
+                        str_casecmp(undefined[k], obj_ext[j]) == 0) break;
+                }
+                if (k == num_undefined) {
+                    /* Add to undefined list */
+                    str_copy(undefined[num_undefined], obj_ext[j], MAX_SYM_NAME);
+                    undef_hash[num_undefined] = ext_hash[j];
+                    num_undefined++;
+                }
+            }
+        }
+        
+        if (num_undefined == 0) {
+            ttrace_end(ls->trace);
+            break;  /* All symbols resolved */
+        }
+        
+        /* Resolve each undefined symbol via the library index.
+         * Each lookup is O(1) via the hash table. */
+        for (i = 0; i < num_undefined; i++) {
+            LibSymEntry *entry;
+            LibraryInfo *lib;
+            
+            /* Skip if another library object already defined it
+             * earlier in this iteration */
+            if (find_hashed(ls, undefined[i], undef_hash[i]) != NULL) {
+                continue;
+            }
+            
+            entry = lib_index_find(idx, undefined[i], undef_hash[i], ls);
+            if (!entry) continue;
+            
+            lib = &ls->libraries[entry->lib_idx];
+            
+            if (ls->verbose) {
+                ld_note(ls, "Loading from library '%s' for symbol '%s'",
+                        lib->filename, undefined[i]);
+            }
+            
+            ttrace_begin(ls->trace, "load_member", undefined[i]);
+            if (load_object_at(ls, lib->filename,
+                               lib->objects[entry->obj_idx].offset) == 0) {
+                lib->objects[entry->obj_idx].loaded = 1;
+                ls->objects[ls->num_objects - 1].library = entry->lib_idx;
+                ls->objects[ls->num_objects - 1].member = entry->obj_idx;
+                loaded_any = 1;
+                total_loaded++;
+            }
+            ttrace_end(ls->trace);
+        }
+        
+        ttrace_end(ls->trace);
+    } while (loaded_any);
+    
+    free(undef_hash);
+    free(obj_ext);
+    free(undefined);
+    
+    if (ls->verbose && total_loaded > 0) {
+        ld_note(ls, "Loaded %d object(s) from libraries", total_loaded);
+    }
+    
+    return 0;
+}
+
+/* ============================================================
+ * Layout and Relocation
+ * ============================================================ */
+
+/* Address of a code offset of an object: its hot part is at code_base
+ * and its cold part, if any, at cold_base */
+uint24 code_address(const ObjectInfo *obj, uint24 offset)
+{
+    if (offset < obj->hot_size) {
+        return obj->code_base + offset;
+    }
+    return obj->cold_base + (offset - obj->hot_size);
+}
+
+/* Assign base addresses to all sections */
+static int resolve_symbols(LinkerState *ls)
+{
+    int i;
+    uint24 code_addr, cold_addr, data_addr, bss_addr;
+    GlobalSymbol *sym;
+    
+    /* Calculate section layout: the hot code of every object, then the
+     * cold parts */
+    code_addr = ls->base_addr;
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        ls->objects[i].code_base = code_addr;
+        code_addr += ls->objects[i].hot_size;
+    }
+    cold_addr = code_addr;
+    for (i = 0; i < ls->num_objects; i++) {
+        ls->objects[i].cold_base = code_addr;
+        code_addr += ls->objects[i].code_size - ls->objects[i].hot_size;
+    }
+    ls->total_code = code_addr - ls->base_addr;
+    ls->total_cold = code_addr - cold_addr;
+    
+    data_addr = code_addr;
+    for (i = 0; i < ls->num_objects; i++) {
+        ls->objects[i].data_base = data_addr;
+        data_addr += ls->objects[i].data_size;
+    }
+    data_addr += export_layout(ls, data_addr);
+    ls->total_data = data_addr - code_addr;
+    
+    bss_addr = data_addr;
+    for (i = 0; i < ls->num_objects; i++) {
+        ls->objects[i].bss_base = bss_addr;
+        bss_addr += ls->objects[i].bss_size;
+    }
+    ls->total_bss = bss_addr - data_addr;
+    
+    /* Update all global symbols to absolute addresses */
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        switch (sym->section) {
+            case SECT_CODE:
+                sym->value = code_address(&ls->objects[sym->obj_index],
+                                          sym->value);
+                break;
+            case SECT_DATA:
+                sym->value += ls->objects[sym->obj_index].data_base;
+                break;
+            case SECT_BSS:
+                sym->value += ls->objects[sym->obj_index].bss_base;
+                break;
+        }
+    }
+    
+    /* Add linker-defined symbols for C runtime initialization */
+    add_address(ls, "__low_code", ls->base_addr, SECT_CODE);
+    add_defined(ls, "__len_code", ls->total_code);
+    add_address(ls, "__low_data", ls->base_addr + ls->total_code, SECT_DATA);
+    add_defined(ls, "__len_data", ls->total_data);
+    add_address(ls, "__low_bss", ls->base_addr + ls->total_code + ls->total_data,
+                SECT_BSS);
+    add_defined(ls, "__len_bss", ls->total_bss);
+    if (ls->total_cold > 0) {
+        add_address(ls, "__low_cold", cold_addr, SECT_CODE);
+        add_defined(ls, "__len_cold", ls->total_cold);
+    }
+    if (ls->export_size > 0) {
+        add_address(ls, "__exports", ls->export_addr, SECT_DATA);
+    }
+    if (ls->res_symbols) {
+        add_defined(ls, "__resident_crc", ls->res_crc);
+    }
+    asset_layout(ls);
+    
+    if (ls->verbose) {
+        ld_note(ls, "Layout: CODE=%06X-%06X, DATA=%06X-%06X, BSS=%06X-%06X",
+                (unsigned)ls->base_addr,
+                (unsigned)(ls->base_addr + ls->total_code - 1),
+                (unsigned)(ls->base_addr + ls->total_code),
+                (unsigned)(ls->base_addr + ls->total_code + ls->total_data - 1),
+                (unsigned)(ls->base_addr + ls->total_code + ls->total_data),
+                (unsigned)(ls->base_addr + ls->total_code + ls->total_data + ls->total_bss - 1));
+        if (ls->total_cold > 0) {
+            ld_note(ls, "Cold code: %06X-%06X (%u bytes), hot code %u bytes",
+                    (unsigned)cold_addr,
+                    (unsigned)(cold_addr + ls->total_cold - 1),
+                    (unsigned)ls->total_cold,
+                    (unsigned)(ls->total_code - ls->total_cold));
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Build the output image.
+ *
+ * Each object file is opened once, code/data sections and the
+ * relocation table are read with single block reads, and the string
+ * table and extern table are read into memory once per object so that
+ * external name lookups during relocation don't need any further I/O.
+ */
+static int link_output(LinkerState *ls)
+{
+    LdFile f;
+    ObjectInfo *obj;
+    ObjReloc *relocs;
+    uint24 offset, target_addr;
+    uint8 section, target_sect;
+    unsigned ext_index;
+    char ext_name[MAX_SYM_NAME];
+    GlobalSymbol *sym;
+    unsigned char *code_buf;
+    unsigned char *data_buf;
+    unsigned char *buf;
+    uint8 *addends;
+    uint24 i, j;
+    long patch_pos;
+    long limit;
+    uint24 existing;
+    uint24 cold;
+    int moves;
+    
+    /* Cached per-object tables */
+    char *strtab;
+    ObjExtern *ext_tab;
+    uint24 name_off;
+    
+    /* One buffer for the entire output: code followed by data, mapped
+     * from the output file if possible (already zero-filled); a module
+     * is written with its header, so its image is never mapped */
+    ls->image_size = (long)ls->total_code + (long)ls->total_data;
+    ls->image = ls->module ? NULL : out_map(ls, ls->image_size);
+    if (!ls->image) {
+        ls->image = (uint8 *)malloc(ls->image_size ? ls->image_size : 1);
+        if (!ls->image) {
+            ld_error(ls, "out of memory");
+            return -1;
+        }
+        memset(ls->image, 0, ls->image_size ? ls->image_size : 1);
+    }
+    code_buf = ls->image;
+    data_buf = ls->image + ls->total_code;
+    
+    /*
+     * Single pass per object file: open once, read code + data,
+     * cache string table and extern table, apply relocations,
+     * then close.
+     */
+    for (i = 0; i < (uint24)ls->num_objects; i++) {
+        obj = &ls->objects[i];
+        strtab = NULL;
+        ext_tab = NULL;
+        relocs = NULL;
+        
+        if (lf_open(ls, obj->filename, &f) < 0) {
+            ld_error(ls, "cannot reopen '%s'", obj->filename);
+            return -1;
+        }
+        
+        ttrace_begin(ls->trace, "link_output", obj->filename);
+        
+        /* --- Read code and data sections (already in memory after -O) --- */
+        cold = obj->code_size - obj->hot_size;
+        if (obj->code) {
+            memcpy(&code_buf[obj->code_base - ls->base_addr], obj->code,
+                   obj->hot_size);
+            memcpy(&code_buf[obj->cold_base - ls->base_addr],
+                   obj->code + obj->hot_size, cold);
+        } else {
+            lf_read(ls, &f, obj->code_pos,
+                    &code_buf[obj->code_base - ls->base_addr], obj->hot_size);
+            lf_read(ls, &f, obj->code_pos + obj->hot_size,
+                    &code_buf[obj->cold_base - ls->base_addr], cold);
+        }
+        if (obj->data) {
+            memcpy(&data_buf[obj->data_base - ls->base_addr - ls->total_code],
+                   obj->data, obj->data_size);
+        } else {
+            lf_read(ls, &f, obj->data_pos,
+                    &data_buf[obj->data_base - ls->base_addr - ls->total_code],
+                    obj->data_size);
+        }
+        
+        /* --- Cache string table for relocation lookups --- */
+        if (obj->strtab_size > 0) {
+            strtab = (char *)malloc(obj->strtab_size);
+            if (strtab && lf_read(ls, &f, obj->strtab_pos, strtab,
+                                  obj->strtab_size) < 0) {
+                free(strtab);
+                strtab = NULL;
+            }
+        }
+        
+        /* --- Cache extern table for relocation lookups --- */
+        if (obj->num_externs > 0) {
+            ext_tab = (ObjExtern *)malloc(obj->num_externs * sizeof(ObjExtern));
+            if (ext_tab && lf_read(ls, &f, obj->extern_pos, ext_tab,
+                                   obj->num_externs * sizeof(ObjExtern)) < 0) {
+                free(ext_tab);
+                ext_tab = NULL;
+            }
+        }
+        
+        /* --- Read the relocation table --- */
+        if (obj->relocs) {
+            relocs = obj->relocs;
+        } else if (obj->num_relocs > 0) {
+            relocs = (ObjReloc *)malloc(obj->num_relocs * sizeof(ObjReloc));
+            if (!relocs || lf_read(ls, &f, obj->reloc_pos, relocs,
+                                   obj->num_relocs * sizeof(ObjReloc)) < 0) {
+                ld_error(ls, "cannot read relocations from '%s'",
+                         obj->filename);
+                if (relocs) free(relocs);
+                relocs = NULL;
+            }
+        }
+        
+        /* --- Addends kept apart from the fields they apply to --- */
+        addends = NULL;
+        if (relocs && obj->addends) {
+            addends = read_chunk(ls, &f, obj->ext_pos, OBJ_EXT_ADDENDS,
+                                 (long)obj->num_relocs * OBJ_ADDEND_SIZE);
+            if (!addends) {
+                ld_error(ls, "cannot read relocation addends from '%s'",
+                         obj->filename);
+                if (relocs != obj->relocs) free(relocs);
+                relocs = NULL;
+            }
+        }
+        
+        /* --- Apply relocations using cached tables (no more I/O) --- */
+        for (j = 0; relocs && j < obj->num_relocs; j++) {
+            ObjReloc *reloc = &relocs[j];
+            
+            offset = READ24(reloc->offset);
+            section = reloc->section;
+            target_sect = reloc->target_sect;
+            ext_index = READ16(reloc->ext_index);
+            
+            /* Find patch location */
+            if (section == SECT_CODE) {
+                buf = code_buf;
+                patch_pos = (long)code_address(obj, offset) - ls->base_addr;
+                limit = (long)ls->total_code;
+            } else if (section == SECT_DATA) {
+                buf = data_buf;
+                patch_pos = obj->data_base - ls->base_addr - ls->total_code +
+                            offset;
+                limit = (long)ls->total_data;
+            } else {
+                continue;
+            }
+            if (patch_pos + 2 >= limit) {
+                continue;
+            }
+            
+            /* The section-relative offset, from the chunk or from the
+             * field itself */
+            if (addends) {
+                existing = READ24(&addends[j * OBJ_ADDEND_SIZE]);
+            } else {
+                existing = buf[patch_pos] |
+                           ((uint24)buf[patch_pos + 1] << 8) |
+                           ((uint24)buf[patch_pos + 2] << 16);
+            }
+            
+            /* Determine target address */
+            if (target_sect == 0) {
+                /* External reference - look up from cached tables */
+                if (!ext_tab || !strtab ||
+                    ext_index >= (unsigned)obj->num_externs) {
+                    ld_error(ls, "cannot resolve external %u in '%s'",
+                             ext_index, obj->filename);
+                    continue;
+                }
+                
+                name_off = READ24(ext_tab[ext_index].name_offset);
+                if (name_off >= obj->strtab_size) {
+                    ld_error(ls, "bad extern name offset %u in '%s'",
+                             (unsigned)name_off, obj->filename);
+                    continue;
+                }
+                str_copy(ext_name, &strtab[name_off], MAX_SYM_NAME);
+                
+                sym = find_hashed(ls, ext_name,
+                                  obj->name_hashes[obj->num_symbols +
+                                                   ext_index]);
+                if (!sym && ls->module) {
+                    /* Imported: the loader adds its value to the addend */
+                    if (mod_import(ls, ext_name,
+                                   obj->name_hashes[obj->num_symbols +
+                                                    ext_index],
+                                   (long)(buf - ls->image) + patch_pos) < 0) {
+                        continue;
+                    }
+                    target_addr = existing;
+                    moves = 0;
+                } else if (!sym) {
+                    ld_error(ls, "undefined symbol '%s' referenced in '%s'",
+                             ext_name, obj->filename);
+                    continue;
+                } else {
+                    target_addr = sym->value + existing;
+                    moves = sym->section != 0;
+                }
+            } else {
+                moves = 1;
+                /* Local section reference - from the section base */
+                switch (target_sect) {
+                    case SECT_CODE:
+                        target_addr = code_address(obj, existing);
+                        break;
+                    case SECT_DATA:
+                        target_addr = obj->data_base + existing;
+                        break;
+                    case SECT_BSS:
+                        target_addr = obj->bss_base + existing;
+                        break;
+                    default:
+                        ld_error(ls, "invalid target section %d",
+                                 target_sect);
+                        continue;
+                }
+            }
+            
+            /* A module moves the addresses in it when it is loaded */
+            if (ls->module && moves &&
+                mod_fixup(ls, (long)(buf - ls->image) + patch_pos) < 0) {
+                continue;
+            }
+            
+            /* Write absolute address */
+            buf[patch_pos] = target_addr & 0xFF;
+            buf[patch_pos + 1] = (target_addr >> 8) & 0xFF;
+            buf[patch_pos + 2] = (target_addr >> 16) & 0xFF;
+        }
+        
+        /* Free cached tables and close the single file handle */
+        if (relocs && relocs != obj->relocs) free(relocs);
+        if (addends) free(addends);
+        if (ext_tab) free(ext_tab);
+        if (strtab) free(strtab);
+        lf_close(ls, &f);
+        ttrace_end(ls->trace);
+    }
+    
+    export_build(ls, ls->image + (ls->export_addr - ls->base_addr));
+    
+    return ls->errors > 0 ? -1 : 0;
+}
+
+/* Release the image; a mapped one that was not committed is unmapped
+ * and its file removed */
+static void image_free(LinkerState *ls)
+{
+    if (ls->out_mapped) {
+        out_unmap(ls, 0);
+    } else if (ls->image) {
+        free(ls->image);
+    }
+    ls->image = NULL;
+    ls->image_size = 0;
+}
+
+/* ============================================================
+ * Map
+ * ============================================================ */
+
+/* Append formatted text to a report buffer */
+int text_printf(LdText *t, const char *fmt, ...)
+{
+    char line[MAX_DIAG_LEN];
+    va_list args;
+    long len;
+    
+    va_start(args, fmt);
+    vsprintf(line, fmt, args);
+    va_end(args);
+    len = (long)strlen(line);
+    
+    if (t->len + len + 1 > t->max) {
+        long new_max = t->max ? t->max * 2 : 4096;
+        char *p;
+        while (new_max < t->len + len + 1) new_max *= 2;
+        p = (char *)realloc(t->text, new_max);
+        if (!p) return -1;
+        t->text = p;
+        t->max = new_max;
+    }
+    memcpy(t->text + t->len, line, (size_t)len + 1);
+    t->len += len;
+    return 0;
+}
+
+void text_free(LdText *t)
+{
+    if (t->text) free(t->text);
+    t->text = NULL;
+    t->len = 0;
+    t->max = 0;
+}
+
+/* Build the map text */
+static int build_map(LinkerState *ls)
+{
+    static const char *const kind_names[] = {
+        "-", "func", "object", "const"
+    };
+    GlobalSymbol *sym;
+    char size[16];
+    int i;
+    int fail = 0;
+    
+    fail |= text_printf(&ls->map, "eZ80 Linker Map File\n");
+    fail |= text_printf(&ls->map, "====================\n\n");
+    
+    fail |= text_printf(&ls->map, "Memory Layout:\n");
+    fail |= text_printf(&ls->map, "  CODE: %06X - %06X (%u bytes)\n",
+            (unsigned)ls->base_addr,
+            (unsigned)(ls->base_addr + ls->total_code - 1),
+            (unsigned)ls->total_code);
+    if (ls->total_cold > 0) {
+        fail |= text_printf(&ls->map, "  COLD: %06X - %06X (%u bytes, "
+                "in CODE)\n",
+                (unsigned)(ls->base_addr + ls->total_code - ls->total_cold),
+                (unsigned)(ls->base_addr + ls->total_code - 1),
+                (unsigned)ls->total_cold);
+    }
+    fail |= text_printf(&ls->map, "  DATA: %06X - %06X (%u bytes)\n",
+            (unsigned)(ls->base_addr + ls->total_code),
+            (unsigned)(ls->base_addr + ls->total_code + ls->total_data - 1),
+            (unsigned)ls->total_data);
+    fail |= text_printf(&ls->map, "  BSS:  %06X - %06X (%u bytes)\n\n",
+            (unsigned)(ls->base_addr + ls->total_code + ls->total_data),
+            (unsigned)(ls->base_addr + ls->total_code + ls->total_data + ls->total_bss - 1),
+            (unsigned)ls->total_bss);
+    if (ls->res_symbols) {
+        fail |= text_printf(&ls->map, "Resident Image:\n");
+        fail |= text_printf(&ls->map, "  %s: %06X - %06X (CRC %06X)\n\n",
+                ls->res_file, (unsigned)ls->res_base,
+                (unsigned)(ls->res_base + ls->res_len - 1),
+                (unsigned)ls->res_crc);
+    }
+    fail |= asset_map(ls, &ls->map);
+    fail |= mod_map(ls, &ls->map);
+    
+    fail |= text_printf(&ls->map, "Object Files:\n");
+    for (i = 0; i < ls->num_objects; i++) {
+        fail |= text_printf(&ls->map, "  %s\n", ls->objects[i].filename);
+        fail |= text_printf(&ls->map, "    CODE: %06X (%u bytes)\n",
+                (unsigned)ls->objects[i].code_base,
+                (unsigned)ls->objects[i].hot_size);
+        if (ls->objects[i].hot_size < ls->objects[i].code_size) {
+            fail |= text_printf(&ls->map, "    COLD: %06X (%u bytes)\n",
+                    (unsigned)ls->objects[i].cold_base,
+                    (unsigned)(ls->objects[i].code_size -
+                               ls->objects[i].hot_size));
+        }
+        fail |= text_printf(&ls->map, "    DATA: %06X (%u bytes)\n",
+                (unsigned)ls->objects[i].data_base,
+                (unsigned)ls->objects[i].data_size);
+        fail |= text_printf(&ls->map, "    BSS:  %06X (%u bytes)\n",
+                (unsigned)ls->objects[i].bss_base,
+                (unsigned)ls->objects[i].bss_size);
+    }
+    fail |= text_printf(&ls->map, "\n");
+    
+    fail |= text_printf(&ls->map, "Symbols:\n");
+    fail |= text_printf(&ls->map, "  %-24s %-8s %-6s %-6s %s\n",
+                        "Name", "Address", "Size", "Kind", "Object");
+    fail |= text_printf(&ls->map, "  %-24s %-8s %-6s %-6s %s\n",
+                        "----", "-------", "----", "----", "------");
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        if (sym->kind == SYMK_NONE || sym->kind == SYMK_CONST) {
+            strcpy(size, "-");
+        } else {
+            sprintf(size, "%u", (unsigned)sym->size);
+        }
+        fail |= text_printf(&ls->map, "  %-24s %06X   %-6s %-6s %s\n",
+                sym->name, (unsigned)sym->value, size,
+                kind_names[sym->kind < 4 ? sym->kind : 0],
+                sym->obj_index == LINKER_DEFINED ? "(linker)" :
+                ls->objects[sym->obj_index].filename);
+    }
+    
+    if (fail) {
+        ld_error(ls, "out of memory for map");
+        return -1;
+    }
+    return 0;
+}
+
+/* ============================================================
+ * Context
+ * ============================================================ */
+
+LinkerState *ld_create(const LdFileOps *ops)
+{
+    LinkerState *ls;
+    int i;
+    
+    ls = (LinkerState *)malloc(sizeof(LinkerState));
+    if (!ls) return NULL;
+    memset(ls, 0, sizeof(*ls));
+    ls->out_fd = -1;
+    
+    if (ops) {
+        ls->ops = *ops;
+    } else {
+        ls->ops.open = stdio_open;
+        ls->ops.read = stdio_read;
+        ls->ops.size = stdio_size;
+        ls->ops.close = stdio_close;
+    }
+    
+    /* Initialise hash table buckets to empty (-1) */
+    for (i = 0; i < HASH_SIZE; i++) {
+        ls->hash_buckets[i] = -1;
+    }
+    
+    return ls;
+}
+
+void ld_reset(LinkerState *ls)
+{
+    int i, j, n;
+    
+    opt_free(ls);
+    for (i = 0; i < ls->num_objects; i++) {
+        if (ls->objects[i].name_hashes) free(ls->objects[i].name_hashes);
+        ls->objects[i].name_hashes = NULL;
+    }
+    ls->num_objects = 0;
+    ls->num_symbols = 0;
+    for (i = 0; i < HASH_SIZE; i++) {
+        ls->hash_buckets[i] = -1;
+    }
+    
+    /* Keep the libraries and their index; just mark members unloaded */
+    for (i = 0; i < ls->num_libraries; i++) {
+        for (j = 0; j < ls->libraries[i].num_objects; j++) {
+            ls->libraries[i].objects[j].loaded = 0;
+        }
+    }
+    
+    /* Drop object buffers, keep library buffers */
+    n = 0;
+    for (i = 0; i < ls->num_mem_files; i++) {
+        if (ls->mem_files[i].is_library) {
+            ls->mem_files[n++] = ls->mem_files[i];
+        }
+    }
+    ls->num_mem_files = n;
+    
+    image_free(ls);
+    text_free(&ls->map);
+    text_free(&ls->sym_text);
+    text_free(&ls->dep_text);
+    clob_free(ls);
+    why_free(ls);
+    asset_free(ls);
+    mod_free(ls);
+    
+    ls->total_code = 0;
+    ls->total_data = 0;
+    ls->total_bss = 0;
+    ls->errors = 0;
+}
+
+void ld_destroy(LinkerState *ls)
+{
+    if (!ls) return;
+    ld_reset(ls);
+    lib_index_free(&ls->lib_index);
+    res_free(ls);
+    free(ls);
+}
+
+void ld_set_diag(LinkerState *ls, LdDiagFn fn, void *user)
+{
+    ls->diag = fn;
+    ls->diag_user = user;
+}
+
+void ld_set_trace(LinkerState *ls, TimeTrace *trace)
+{
+    ls->trace = trace;
+}
+
+void ld_set_base(LinkerState *ls, uint24 base_addr)
+{
+    ls->base_addr = base_addr;
+}
+
+void ld_set_verbose(LinkerState *ls, int verbose)
+{
+    ls->verbose = verbose;
+}
+
+void ld_set_optimise(LinkerState *ls, int level)
+{
+    ls->optimise = level;
+}
+
+void ld_set_module(LinkerState *ls, int module)
+{
+    ls->module = module;
+}
+
+void ld_set_exports(LinkerState *ls, int exports)
+{
+    ls->exports = exports;
+}
+
+int ld_link(LinkerState *ls)
+{
+    int result;
+    
+    if (ls->num_objects == 0) {
+        ld_error(ls, "no input files");
+        return -1;
+    }
+    if (ls->module && ls->base_addr != 0) {
+        ld_error(ls, "a module is linked at 0; it cannot have a base "
+                 "address");
+        return -1;
+    }
+    
+    /* Process libraries - selectively load needed objects */
+    if (process_libraries(ls) < 0) {
+        return -1;
+    }
+    
+    /* Rewrite branches before layout fixes the addresses */
+    if (ls->optimise > 0) {
+        ttrace_begin(ls->trace, "optimise", NULL);
+        result = opt_run(ls);
+        ttrace_end(ls->trace);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    
+    /* Resolve symbols and assign addresses */
+    ttrace_begin(ls->trace, "resolve_symbols", NULL);
+    resolve_symbols(ls);
+    if (!ls->module) {
+        resident_check(ls);     /* A module is loaded anywhere */
+    }
+    ttrace_end(ls->trace);
+    
+    if (ls->errors > 0) {
+        return -1;
+    }
+    
+    /* Generate output */
+    if (link_output(ls) < 0) {
+        image_free(ls);
+        return -1;
+    }
+    
+    return 0;
+}
+
+const uint8 *ld_image(LinkerState *ls, long *size)
+{
+    *size = ls->image_size;
+    return ls->image;
+}
+
+/* The map is built on first request */
+const char *ld_map(LinkerState *ls, long *size)
+{
+    if (!ls->image) {
+        *size = 0;
+        return NULL;
+    }
+    if (!ls->map.text && build_map(ls) < 0) {
+        text_free(&ls->map);
+        *size = 0;
+        return NULL;
+    }
+    *size = ls->map.len;
+    return ls->map.text;
+}
+
+int ld_error_count(LinkerState *ls)
+{
+    return ls->errors;
+}
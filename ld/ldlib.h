@@ -0,0 +1,155 @@
+/*
+ * eZ80 Linker Library
+ *
+ * The linker as a reentrant library, for build drivers and IDEs that
+ * link in-process.  All state lives in a LinkerState context; there
+ * are no globals, so any number of contexts can be used at once.
+ *
+ * Inputs are object and library files read through a pluggable set
+ * of file operations (stdio by default), or memory buffers.  Results
+ * (the image and the map) are returned as buffers owned by the
+ * context, and diagnostics are passed to a callback.  The library
+ * never writes files itself, except that it can build the image
+ * straight into its output file (ld_set_output, ld_commit_output).
+ *
+ * A context can link several times: ld_reset() drops the objects and
+ * symbols of the last link but keeps the libraries, so their symbol
+ * index is only built once.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#ifndef LDLIB_H
+#define LDLIB_H
+
+#include "objformat.h"
+#include "timetrace.h"
+
+typedef struct LinkerState LinkerState;
+
+/* Diagnostic severities */
+#define LD_NOTE         0       /* Progress messages (verbose mode) */
+#define LD_WARNING      1
+#define LD_ERROR        2
+
+/* Diagnostic callback; msg has no prefix or trailing newline */
+typedef void (*LdDiagFn)(void *user, int severity, const char *msg);
+
+/*
+ * File access.  Files are only ever opened for reading, and read at
+ * explicit positions.  open returns NULL if the file cannot be opened;
+ * read returns the number of bytes read.
+ */
+typedef struct {
+    void *(*open)(void *user, const char *name);
+    long (*read)(void *user, void *file, long pos, void *buf, long len);
+    long (*size)(void *user, void *file);
+    void (*close)(void *user, void *file);
+    void *user;
+} LdFileOps;
+
+/* Create a context; ops may be NULL to use stdio.  Returns NULL if
+ * out of memory. */
+LinkerState *ld_create(const LdFileOps *ops);
+void ld_destroy(LinkerState *ls);
+
+/* Forget the objects, symbols and results of the last link.  The
+ * libraries, library directories and settings are kept. */
+void ld_reset(LinkerState *ls);
+
+/* Settings */
+void ld_set_diag(LinkerState *ls, LdDiagFn fn, void *user);
+void ld_set_trace(LinkerState *ls, TimeTrace *trace);
+void ld_set_base(LinkerState *ls, uint24 base_addr);
+void ld_set_verbose(LinkerState *ls, int verbose);
+
+/* Link a loadable module instead of an image (see ldmod.c): at 0,
+ * with its fixups, imports and an export table.  Symbols no input
+ * defines are imported rather than errors. */
+void ld_set_module(LinkerState *ls, int module);
+
+/* Give the image an export table at __exports, after its data, for
+ * modules loaded at run time to import from */
+void ld_set_exports(LinkerState *ls, int exports);
+
+/* Link-time optimisation: 0 off, 1 rewrite branches in place, 2 also
+ * delete the RETs left dead by tail calls, 3 also inline tiny leaf
+ * routines and drop those no longer called (see ldopt.c) */
+void ld_set_optimise(LinkerState *ls, int level);
+
+/* Build the image in a memory mapping of filename where possible
+ * (NULL or "" to always use a buffer).  After ld_link, check
+ * ld_output_written(): if it is 0, the image is only in memory and the
+ * caller must still write it out.  If it is 1, the image is in a file
+ * beside the output until ld_commit_output() renames it over the
+ * output; call that last, once everything else the build writes has
+ * succeeded.  An image not committed by ld_reset or ld_destroy is
+ * discarded, leaving the previous output alone.
+ * ld_commit_output returns 0 on success or if nothing was mapped, and
+ * -1 after reporting an error; the image is no longer available
+ * afterwards. */
+void ld_set_output(LinkerState *ls, const char *filename);
+int ld_output_written(LinkerState *ls);
+int ld_commit_output(LinkerState *ls);
+
+/* Inputs; each returns 0 on success or -1 after reporting an error.
+ * Memory buffers are used in place and must stay valid until the
+ * context is reset (objects) or destroyed (libraries). */
+int ld_add_object(LinkerState *ls, const char *filename);
+int ld_add_object_mem(LinkerState *ls, const char *name,
+                      const uint8 *data, long size);
+int ld_add_libdir(LinkerState *ls, const char *dir);
+int ld_find_library(LinkerState *ls, const char *name);  /* -l<name> */
+int ld_add_library(LinkerState *ls, const char *filename);
+int ld_add_library_mem(LinkerState *ls, const char *name,
+                       const uint8 *data, long size);
+
+/* Link against a resident image, given the symbol list written by
+ * ld_symbols() when it was linked.  Kept until replaced or the
+ * context is destroyed. */
+int ld_add_resident(LinkerState *ls, const char *filename);
+
+/* Resolve libraries and symbols and build the image.  Returns 0 on
+ * success, -1 if any error was reported. */
+int ld_link(LinkerState *ls);
+
+/* Results of the last successful ld_link, owned by the context */
+const uint8 *ld_image(LinkerState *ls, long *size);
+const char *ld_map(LinkerState *ls, long *size);
+
+/* Asset file of the blobs from the objects' asset sections: a 24-bit
+ * LE count, a 24-bit offset and length per blob, then the blobs.  Only
+ * the count (LD_ASSET_HEADER bytes) if the link has none. */
+#define LD_ASSET_HEADER 3
+const uint8 *ld_assets(LinkerState *ls, long *size);
+
+/* Module file of the last link with ld_set_module, NULL otherwise;
+ * LD_MOD_HEADER bytes of header, then the image, fixups and imports */
+#define LD_MOD_HEADER   23
+const uint8 *ld_module(LinkerState *ls, long *size);
+
+/* Symbol list of the image, for linking others against it:
+ * "symbol name address" per line after an "image" header line */
+const char *ld_symbols(LinkerState *ls, long *size);
+
+/* Make-compatible dependencies of target on the inputs of the last
+ * link; with hashes, a CRC-32 of each library member used follows as
+ * "# member lib[n] symbol crc" comment lines */
+const char *ld_depfile(LinkerState *ls, const char *target, int hashes,
+                       long *size);
+
+/* Registers each exported routine may change, for routines in objects
+ * assembled with --clobbers, as text: "name  a f bc hl" per line */
+const char *ld_clobbers(LinkerState *ls, long *size);
+
+/* Why an object is in the link: the chain of references to the one
+ * defining a symbol, or to an object or member ("lib.a[n]") by name,
+ * from the entry object (the first listed) */
+const char *ld_why_live(LinkerState *ls, const char *name, long *size);
+
+/* Listed objects and libraries that the entry object does not use,
+ * as "object name" and "library name" lines */
+const char *ld_unused(LinkerState *ls, long *size);
+int ld_error_count(LinkerState *ls);
+
+#endif /* LDLIB_H */
@@ -0,0 +1,381 @@
+/*
+ * eZ80 Linker - Loadable Modules
+ *
+ * With --module the link makes a module, for a program to load while
+ * it runs, instead of an image for a fixed address.  A module is
+ * linked at 0; each relocated field holding an address in the module
+ * is listed as a fixup, and each symbol that no object or library
+ * defines becomes an import rather than an error.  The module file:
+ *
+ *     "EZ8M", version         4 bytes, 1 byte
+ *     memory                  24-bit LE: bytes to load it into
+ *     image size, BSS size    24-bit LE each
+ *     exports                 24-bit LE: its export table in the image
+ *     fixups, imports         24-bit LE counts
+ *     image                   code, data and export table
+ *     fixups                  24-bit offset of each field in the image
+ *     imports                 per import: name, NUL, a 24-bit count of
+ *                             its fields and their offsets
+ *
+ * The loader (the assembler's MODLOADER) adds the image's address to
+ * each fixup and the import's value, found in the program's export
+ * table, to each of its fields, which hold the addend; then it clears
+ * the BSS after the image.
+ *
+ * --exports gives an image an export table, at __exports after its
+ * data, for modules to import from; a module always has one.  It lists
+ * the symbols of the objects linked, by hash, so the loader finds one
+ * with a few compares:
+ *
+ *     mask                    16-bit: buckets - 1, buckets a power of 2
+ *     bucket offsets          16-bit, from the table; buckets + 1 of them
+ *     entries, by bucket      16-bit hash, 24-bit value, name, NUL
+ *
+ * The hash is h = h * 33 ^ c over the name in lower case, from 5381,
+ * to 16 bits, and the loader compares names whatever their case, as
+ * the linker resolves them.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ldint.h"
+
+#define MOD_VERSION     1
+#define EXPORT_ENTRY    5       /* Hash and value, before the name */
+#define EXPORT_MAX      0xFFFFUL /* Bucket offsets are 16-bit */
+
+/* ============================================================
+ * Export Tables
+ * ============================================================ */
+
+static unsigned export_hash(const char *name)
+{
+    unsigned h = 5381;
+    
+    while (*name) {
+        h = ((h * 33) ^ (uint8)tolower((uint8)*name++)) & 0xFFFF;
+    }
+    return h;
+}
+
+/* Symbols the table lists: those of the objects linked */
+static int exported(const GlobalSymbol *sym)
+{
+    return sym->obj_index >= 0;
+}
+
+/* Bucket count: a power of 2, about two entries to a bucket */
+static unsigned export_buckets(LinkerState *ls)
+{
+    unsigned n = 1;
+    int count = 0;
+    int i;
+    
+    for (i = 0; i < ls->num_symbols; i++) {
+        if (exported(&ls->symbols[i])) count++;
+    }
+    while (n < 1024 && (long)n * 2 < count) {
+        n *= 2;
+    }
+    return n;
+}
+
+/* Place the export table at addr, returning its size (0 if none) */
+uint24 export_layout(LinkerState *ls, uint24 addr)
+{
+    unsigned long size;
+    int i;
+    
+    ls->export_addr = addr;
+    ls->export_size = 0;
+    if (!ls->exports && !ls->module) {
+        return 0;
+    }
+    
+    size = 2 + 2UL * (export_buckets(ls) + 1);
+    for (i = 0; i < ls->num_symbols; i++) {
+        if (exported(&ls->symbols[i])) {
+            size += EXPORT_ENTRY + strlen(ls->symbols[i].name) + 1;
+        }
+    }
+    if (size > EXPORT_MAX) {
+        ld_error(ls, "export table is over 64 KB (%lu bytes)", size);
+        return 0;
+    }
+    ls->export_size = (uint24)size;
+    return ls->export_size;
+}
+
+/* Write the export table; in a module, each address in it is a fixup */
+int export_build(LinkerState *ls, uint8 *table)
+{
+    unsigned n = export_buckets(ls);
+    unsigned *fill;
+    unsigned h, b, pos;
+    GlobalSymbol *sym;
+    int len;
+    int i;
+    
+    if (ls->export_size == 0) {
+        return 0;
+    }
+    fill = (unsigned *)malloc((n + 1) * sizeof(unsigned));
+    if (!fill) {
+        ld_error(ls, "out of memory for export table");
+        return -1;
+    }
+    
+    /* Bucket offsets from the bytes of each bucket */
+    for (b = 0; b <= n; b++) {
+        fill[b] = 0;
+    }
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        if (!exported(sym)) continue;
+        b = export_hash(sym->name) & (n - 1);
+        fill[b + 1] += EXPORT_ENTRY + strlen(sym->name) + 1;
+    }
+    fill[0] = 2 + 2 * (n + 1);
+    for (b = 1; b <= n; b++) {
+        fill[b] += fill[b - 1];
+    }
+    table[0] = (uint8)((n - 1) & 0xFF);
+    table[1] = (uint8)((n - 1) >> 8);
+    for (b = 0; b <= n; b++) {
+        table[2 + 2 * b] = (uint8)(fill[b] & 0xFF);
+        table[3 + 2 * b] = (uint8)(fill[b] >> 8);
+    }
+    
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        if (!exported(sym)) continue;
+        h = export_hash(sym->name);
+        pos = fill[h & (n - 1)];
+        len = (int)strlen(sym->name) + 1;
+        fill[h & (n - 1)] += EXPORT_ENTRY + len;
+        
+        table[pos] = (uint8)(h & 0xFF);
+        table[pos + 1] = (uint8)(h >> 8);
+        WRITE24(table + pos + 2, sym->value);
+        memcpy(table + pos + EXPORT_ENTRY, sym->name, len);
+        if (ls->module && sym->section != 0 &&
+            mod_fixup(ls, (long)(ls->export_addr - ls->base_addr) + pos + 2)
+            < 0) {
+            free(fill);
+            return -1;
+        }
+    }
+    free(fill);
+    return 0;
+}
+
+/* ============================================================
+ * Fixups and Imports
+ * ============================================================ */
+
+/* A field at offset in the image that holds an address in the module */
+int mod_fixup(LinkerState *ls, long offset)
+{
+    uint24 *grown;
+    int new_max;
+    
+    if (ls->num_fixups >= ls->max_fixups) {
+        new_max = ls->max_fixups ? ls->max_fixups * 2 : 64;
+        grown = (uint24 *)realloc(ls->fixups, new_max * sizeof(uint24));
+        if (!grown) {
+            ld_error(ls, "out of memory for fixups");
+            return -1;
+        }
+        ls->fixups = grown;
+        ls->max_fixups = new_max;
+    }
+    ls->fixups[ls->num_fixups++] = (uint24)offset;
+    return 0;
+}
+
+/* A field at offset in the image that takes the value of an import */
+int mod_import(LinkerState *ls, const char *name, unsigned long hash,
+               long offset)
+{
+    LdImport *imports;
+    LdImportSite *sites;
+    LdImport *imp;
+    int new_max;
+    int i;
+    
+    for (i = 0; i < ls->num_imports; i++) {
+        if (ls->imports[i].hash == hash &&
+            str_casecmp(ls->imports[i].name, name) == 0) break;
+    }
+    if (i == ls->num_imports) {
+        if (ls->num_imports >= ls->max_imports) {
+            new_max = ls->max_imports ? ls->max_imports * 2 : 16;
+            imports = (LdImport *)realloc(ls->imports,
+                                          new_max * sizeof(LdImport));
+            if (!imports) {
+                ld_error(ls, "out of memory for imports");
+                return -1;
+            }
+            ls->imports = imports;
+            ls->max_imports = new_max;
+        }
+        imp = &ls->imports[ls->num_imports++];
+        str_copy(imp->name, name, MAX_SYM_NAME);
+        imp->hash = hash;
+        imp->first_site = -1;
+        imp->last_site = -1;
+        imp->num_sites = 0;
+    }
+    imp = &ls->imports[i];
+    
+    if (ls->num_sites >= ls->max_sites) {
+        new_max = ls->max_sites ? ls->max_sites * 2 : 64;
+        sites = (LdImportSite *)realloc(ls->sites,
+                                        new_max * sizeof(LdImportSite));
+        if (!sites) {
+            ld_error(ls, "out of memory for imports");
+            return -1;
+        }
+        ls->sites = sites;
+        ls->max_sites = new_max;
+    }
+    ls->sites[ls->num_sites].offset = (uint24)offset;
+    ls->sites[ls->num_sites].next = -1;
+    if (imp->last_site >= 0) {
+        ls->sites[imp->last_site].next = ls->num_sites;
+    } else {
+        imp->first_site = ls->num_sites;
+    }
+    imp->last_site = ls->num_sites++;
+    imp->num_sites++;
+    return 0;
+}
+
+/* Module section of the map */
+int mod_map(LinkerState *ls, LdText *t)
+{
+    int fail = 0;
+    int i;
+    
+    if (ls->export_size > 0) {
+        fail |= text_printf(t, "Export Table: %06X (%u bytes)\n\n",
+                            (unsigned)ls->export_addr,
+                            (unsigned)ls->export_size);
+    }
+    if (!ls->module) {
+        return fail;
+    }
+    fail |= text_printf(t, "Module: %d fixups, %d imports\n",
+                        ls->num_fixups, ls->num_imports);
+    for (i = 0; i < ls->num_imports; i++) {
+        fail |= text_printf(t, "  %-24s %d field%s\n", ls->imports[i].name,
+                            ls->imports[i].num_sites,
+                            ls->imports[i].num_sites == 1 ? "" : "s");
+    }
+    fail |= text_printf(t, "\n");
+    return fail;
+}
+
+/* ============================================================
+ * Module File
+ * ============================================================ */
+
+static int build_module(LinkerState *ls)
+{
+    unsigned long size, memory;
+    uint8 *buf;
+    uint8 *p;
+    LdImport *imp;
+    int i, s;
+    
+    size = LD_MOD_HEADER + (unsigned long)ls->image_size +
+           3UL * ls->num_fixups;
+    for (i = 0; i < ls->num_imports; i++) {
+        size += strlen(ls->imports[i].name) + 1 + 3 +
+                3UL * ls->imports[i].num_sites;
+    }
+    memory = LD_MOD_HEADER + (unsigned long)ls->image_size + ls->total_bss;
+    if (memory < size) memory = size;
+    if (memory > 0xFFFFFFUL) {
+        ld_error(ls, "module is over 16 MB");
+        return -1;
+    }
+    
+    buf = (uint8 *)malloc(size);
+    if (!buf) {
+        ld_error(ls, "out of memory for module");
+        return -1;
+    }
+    memcpy(buf, "EZ8M", 4);
+    buf[4] = MOD_VERSION;
+    WRITE24(buf + 5, memory);
+    WRITE24(buf + 8, ls->image_size);
+    WRITE24(buf + 11, ls->total_bss);
+    WRITE24(buf + 14, ls->export_addr);
+    WRITE24(buf + 17, ls->num_fixups);
+    WRITE24(buf + 20, ls->num_imports);
+    memcpy(buf + LD_MOD_HEADER, ls->image, ls->image_size);
+    
+    p = buf + LD_MOD_HEADER + ls->image_size;
+    for (i = 0; i < ls->num_fixups; i++, p += 3) {
+        WRITE24(p, ls->fixups[i]);
+    }
+    for (i = 0; i < ls->num_imports; i++) {
+        imp = &ls->imports[i];
+        strcpy((char *)p, imp->name);
+        p += strlen(imp->name) + 1;
+        WRITE24(p, imp->num_sites);
+        p += 3;
+        for (s = imp->first_site; s >= 0; s = ls->sites[s].next, p += 3) {
+            WRITE24(p, ls->sites[s].offset);
+        }
+    }
+    
+    if (ls->verbose) {
+        ld_note(ls, "Module: %lu bytes, loads into %lu; %d fixups, "
+                "%d imports", size, memory, ls->num_fixups,
+                ls->num_imports);
+    }
+    ls->module_file = buf;
+    ls->module_size = (long)size;
+    return 0;
+}
+
+/* The module file is built on first request */
+const uint8 *ld_module(LinkerState *ls, long *size)
+{
+    *size = 0;
+    if (!ls->image || !ls->module) {
+        return NULL;
+    }
+    if (!ls->module_file && build_module(ls) < 0) {
+        return NULL;
+    }
+    *size = ls->module_size;
+    return ls->module_file;
+}
+
+void mod_free(LinkerState *ls)
+{
+    if (ls->fixups) free(ls->fixups);
+    if (ls->imports) free(ls->imports);
+    if (ls->sites) free(ls->sites);
+    if (ls->module_file) free(ls->module_file);
+    ls->fixups = NULL;
+    ls->imports = NULL;
+    ls->sites = NULL;
+    ls->module_file = NULL;
+    ls->num_fixups = 0;
+    ls->max_fixups = 0;
+    ls->num_imports = 0;
+    ls->max_imports = 0;
+    ls->num_sites = 0;
+    ls->max_sites = 0;
+    ls->module_size = 0;
+    ls->export_addr = 0;
+    ls->export_size = 0;
+}
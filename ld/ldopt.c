@@ -0,0 +1,989 @@
+/*
+ * eZ80 Linker - Link-Time Optimisation
+ *
+ * With -O the code of every object is held in memory between library
+ * resolution and layout, and rewritten at its relocations:
+ *
+ * - Jump threading: a JP, JP cc, CALL or CALL cc whose target is an
+ *   unconditional JP nn is pointed at that jump's target instead.
+ * - Tail calls: CALL nn followed by RET becomes JP nn (and CALL cc
+ *   followed by RET becomes JP cc).
+ * - At level 2 the RET after a tail call is deleted when nothing else
+ *   can reach it.  The rest of the object moves down a byte, and the
+ *   relocations, addends and symbols past it are adjusted to match.
+ * - At level 3 a CALL nn to straight-line code of up to INLINE_MAX
+ *   bytes before a RET is replaced by that code, and the bytes left
+ *   over are deleted (or filled with NOPs).  The code may not touch SP
+ *   or the stack, and may hold one relocation, which the call's own is
+ *   reused for.  Exported routines whose calls were all inlined, and
+ *   that nothing else refers to, are deleted after the passes.
+ *
+ * The passes repeat until nothing changes, then layout runs on the
+ * new section sizes.
+ *
+ * Only relocated (absolute) references are visible here, so deleting
+ * bytes assumes code does not depend on the distance between its own
+ * labels (ALIGN, label differences).  JR and DJNZ carry no relocation;
+ * a RET is kept if any byte that could be a relative jump spans it.
+ * Nothing is deleted from a span the object marks fixed (the targets
+ * of a JUMPTABLE held as offsets).
+ * An object's cold code is placed apart from its hot code, so nothing
+ * is taken to follow on from the end of either part.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ldint.h"
+#include "ez80dec.h"
+
+#define MAX_THREAD_HOPS 8       /* Longest chain of jumps followed */
+#define MAX_OPT_PASSES  16      /* Give up rewriting after this many */
+#define JR_REACH        130     /* Furthest a relative jump can span */
+#define INLINE_MAX      4       /* Longest body inlined: a call's size */
+#define MAX_INLINED     64      /* Routines considered for dropping */
+
+/* A location: object, section and section-relative offset */
+typedef struct {
+    int obj;
+    int sect;
+    uint24 offset;
+} OptLoc;
+
+/* Rewrite counts for the verbose summary */
+typedef struct {
+    int threaded;
+    int tail_calls;
+    int deleted;
+    int inlined;
+    int dropped;            /* Routines deleted once all inlined */
+    long cycles;            /* Cycles saved on the rewritten paths */
+    int routines[MAX_INLINED];  /* Symbols of the routines inlined */
+    int num_routines;
+} OptStats;
+
+/* ============================================================
+ * Loading
+ * ============================================================ */
+
+/* Order relocations by section, then offset */
+static int reloc_cmp(const void *a, const void *b)
+{
+    const ObjReloc *ra = (const ObjReloc *)a;
+    const ObjReloc *rb = (const ObjReloc *)b;
+    uint24 oa, ob;
+    
+    if (ra->section != rb->section) {
+        return ra->section < rb->section ? -1 : 1;
+    }
+    oa = READ24(ra->offset);
+    ob = READ24(rb->offset);
+    return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+/* Read a block of an object into a new buffer; NULL if empty */
+static void *load_block(LinkerState *ls, LdFile *f, long pos, long size,
+                        int *failed)
+{
+    void *buf;
+    
+    if (size <= 0) {
+        return NULL;
+    }
+    buf = malloc(size);
+    if (!buf || lf_read(ls, f, pos, buf, size) < 0) {
+        if (buf) free(buf);
+        *failed = 1;
+        return NULL;
+    }
+    return buf;
+}
+
+/* Write explicit addends into the fields they apply to: the rewrites
+ * decode operands from the code and move relocations about */
+static void place_addends(ObjectInfo *obj, const uint8 *addends)
+{
+    ObjReloc *r;
+    uint8 *field;
+    uint24 offset;
+    uint24 j;
+    
+    for (j = 0; j < obj->num_relocs; j++) {
+        r = &obj->relocs[j];
+        offset = READ24(r->offset);
+        field = NULL;
+        if (r->section == SECT_CODE && offset + 3 <= obj->code_size) {
+            field = &obj->code[offset];
+        } else if (r->section == SECT_DATA && offset + 3 <= obj->data_size) {
+            field = &obj->data[offset];
+        }
+        if (field) {
+            field[0] = addends[j * OBJ_ADDEND_SIZE];
+            field[1] = addends[j * OBJ_ADDEND_SIZE + 1];
+            field[2] = addends[j * OBJ_ADDEND_SIZE + 2];
+        }
+    }
+    obj->addends = 0;
+}
+
+/* Fixed spans of an object from its OBJ_EXT_FIXED chunk */
+static uint24 *load_fixed(LinkerState *ls, LdFile *f, ObjectInfo *obj)
+{
+    uint8 *buf;
+    uint24 *fixed;
+    int j;
+    
+    buf = read_chunk(ls, f, obj->ext_pos, OBJ_EXT_FIXED,
+                     (long)obj->num_fixed * OBJ_FIXED_SIZE);
+    if (!buf) {
+        return NULL;
+    }
+    fixed = (uint24 *)malloc(obj->num_fixed * 2 * sizeof(uint24));
+    for (j = 0; fixed && j < obj->num_fixed; j++) {
+        fixed[2 * j] = READ24(&buf[j * OBJ_FIXED_SIZE]);
+        fixed[2 * j + 1] = READ24(&buf[j * OBJ_FIXED_SIZE + 3]);
+    }
+    free(buf);
+    return fixed;
+}
+
+/* Hold the sections and tables of every object in memory */
+static int opt_load(LinkerState *ls)
+{
+    LdFile f;
+    ObjectInfo *obj;
+    uint8 *addends;
+    int failed;
+    int i;
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        obj = &ls->objects[i];
+        if (lf_open(ls, obj->filename, &f) < 0) {
+            ld_error(ls, "cannot reopen '%s'", obj->filename);
+            return -1;
+        }
+        
+        failed = 0;
+        obj->code = (uint8 *)load_block(ls, &f, obj->code_pos,
+                                        (long)obj->code_size, &failed);
+        obj->data = (uint8 *)load_block(ls, &f, obj->data_pos,
+                                        (long)obj->data_size, &failed);
+        obj->relocs = (ObjReloc *)load_block(ls, &f, obj->reloc_pos,
+                (long)(obj->num_relocs * sizeof(ObjReloc)), &failed);
+        obj->ext_tab = (ObjExtern *)load_block(ls, &f, obj->extern_pos,
+                (long)(obj->num_externs * sizeof(ObjExtern)), &failed);
+        obj->strtab = (char *)load_block(ls, &f, obj->strtab_pos,
+                                         (long)obj->strtab_size, &failed);
+        addends = NULL;
+        if (obj->addends) {
+            addends = read_chunk(ls, &f, obj->ext_pos, OBJ_EXT_ADDENDS,
+                                 (long)obj->num_relocs * OBJ_ADDEND_SIZE);
+            if (!addends) failed = 1;
+        }
+        if (obj->num_fixed > 0) {
+            obj->fixed = load_fixed(ls, &f, obj);
+            if (!obj->fixed) failed = 1;
+        }
+        lf_close(ls, &f);
+        
+        if (failed) {
+            ld_error(ls, "cannot read '%s' for optimisation", obj->filename);
+            if (addends) free(addends);
+            return -1;
+        }
+        if (addends) {
+            place_addends(obj, addends);
+            free(addends);
+        }
+        if (obj->relocs) {
+            qsort(obj->relocs, obj->num_relocs, sizeof(ObjReloc), reloc_cmp);
+        }
+    }
+    
+    return 0;
+}
+
+/* Release the buffers of every object */
+void opt_free(LinkerState *ls)
+{
+    ObjectInfo *obj;
+    int i;
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        obj = &ls->objects[i];
+        if (obj->code) free(obj->code);
+        if (obj->data) free(obj->data);
+        if (obj->relocs) free(obj->relocs);
+        if (obj->ext_tab) free(obj->ext_tab);
+        if (obj->strtab) free(obj->strtab);
+        if (obj->fixed) free(obj->fixed);
+        obj->code = NULL;
+        obj->data = NULL;
+        obj->relocs = NULL;
+        obj->ext_tab = NULL;
+        obj->strtab = NULL;
+        obj->fixed = NULL;
+    }
+}
+
+/* ============================================================
+ * Relocations
+ * ============================================================ */
+
+/* The 24-bit field a relocation patches, or NULL if out of range */
+static uint8 *reloc_field(ObjectInfo *obj, const ObjReloc *r)
+{
+    uint24 offset = READ24(r->offset);
+    
+    if (r->section == SECT_CODE && obj->code &&
+        offset + 3 <= obj->code_size) {
+        return &obj->code[offset];
+    }
+    if (r->section == SECT_DATA && obj->data &&
+        offset + 3 <= obj->data_size) {
+        return &obj->data[offset];
+    }
+    return NULL;
+}
+
+/* The code relocation of an object at an offset, or NULL */
+static ObjReloc *find_reloc(ObjectInfo *obj, uint24 offset)
+{
+    ObjReloc key;
+    
+    if (!obj->relocs) {
+        return NULL;
+    }
+    key.section = SECT_CODE;
+    WRITE24(key.offset, offset);
+    return (ObjReloc *)bsearch(&key, obj->relocs, obj->num_relocs,
+                               sizeof(ObjReloc), reloc_cmp);
+}
+
+/* Name of an object's external; returns 0 if the tables are bad */
+static int extern_name(ObjectInfo *obj, unsigned index, char *name)
+{
+    uint24 name_off;
+    
+    if (!obj->ext_tab || !obj->strtab || index >= obj->num_externs) {
+        return 0;
+    }
+    name_off = READ24(obj->ext_tab[index].name_offset);
+    if (name_off >= obj->strtab_size) {
+        return 0;
+    }
+    str_copy(name, &obj->strtab[name_off], MAX_SYM_NAME);
+    return 1;
+}
+
+/* Symbol named by an external relocation, or NULL */
+static GlobalSymbol *extern_symbol(LinkerState *ls, ObjectInfo *obj,
+                                   const ObjReloc *r)
+{
+    char name[MAX_SYM_NAME];
+    
+    unsigned index = READ16(r->ext_index);
+    
+    if (!extern_name(obj, index, name)) {
+        return NULL;
+    }
+    return find_hashed(ls, name, obj->name_hashes[obj->num_symbols + index]);
+}
+
+/* Where a relocation of object oi points.  Returns -1 if it cannot be
+ * followed: undefined, absolute or linker-defined symbols. */
+static int reloc_target(LinkerState *ls, int oi, const ObjReloc *r,
+                        OptLoc *loc)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    GlobalSymbol *sym;
+    uint8 *field;
+    uint24 addend;
+    
+    field = reloc_field(obj, r);
+    if (!field) {
+        return -1;
+    }
+    addend = READ24(field);
+    
+    if (r->target_sect != 0) {
+        loc->obj = oi;
+        loc->sect = r->target_sect;
+        loc->offset = addend;
+        return 0;
+    }
+    
+    sym = extern_symbol(ls, obj, r);
+    if (!sym || sym->obj_index < 0 ||
+        sym->section < SECT_CODE || sym->section > SECT_BSS) {
+        return -1;
+    }
+    loc->obj = sym->obj_index;
+    loc->sect = sym->section;
+    loc->offset = (sym->value + addend) & 0xFFFFFF;
+    return 0;
+}
+
+/* Point a relocation of object oi at a location.  The object can name
+ * its own sections directly, and others through any of its externals
+ * defined in the same section (preferring one at the location itself).
+ * Returns -1 if it cannot name the location. */
+static int retarget(LinkerState *ls, int oi, ObjReloc *r, const OptLoc *loc)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    GlobalSymbol *sym;
+    GlobalSymbol *best = NULL;
+    char name[MAX_SYM_NAME];
+    unsigned best_index = 0;
+    uint8 *field;
+    uint24 addend;
+    unsigned i;
+    
+    field = reloc_field(obj, r);
+    if (!field) {
+        return -1;
+    }
+    
+    if (loc->obj == oi) {
+        r->target_sect = (uint8)loc->sect;
+        r->ext_index[0] = 0;
+        r->ext_index[1] = 0;
+        WRITE24(field, loc->offset);
+        return 0;
+    }
+    
+    for (i = 0; i < obj->num_externs; i++) {
+        if (!extern_name(obj, i, name)) {
+            continue;
+        }
+        sym = find_hashed(ls, name, obj->name_hashes[obj->num_symbols + i]);
+        if (!sym || sym->obj_index != loc->obj || sym->section != loc->sect) {
+            continue;
+        }
+        if (!best || sym->value == loc->offset) {
+            best = sym;
+            best_index = i;
+        }
+    }
+    if (!best) {
+        return -1;
+    }
+    
+    addend = (loc->offset - best->value) & 0xFFFFFF;
+    r->target_sect = 0;
+    r->ext_index[0] = (uint8)(best_index & 0xFF);
+    r->ext_index[1] = (uint8)((best_index >> 8) & 0xFF);
+    WRITE24(field, addend);
+    return 0;
+}
+
+/* ============================================================
+ * Rewrites
+ * ============================================================ */
+
+/* ADL suffix bytes (.SIS, .LIS, .SIL, .LIL) */
+static int is_suffix(uint8 op)
+{
+    return op == 0x40 || op == 0x49 || op == 0x52 || op == 0x5B;
+}
+
+/* Decode the JP/CALL whose address a code relocation patches.
+ * Returns the offset of its opcode, or -1 if the relocation is not
+ * the operand of an unsuffixed JP nn, JP cc, CALL nn or CALL cc. */
+static long branch_site(ObjectInfo *obj, const ObjReloc *r, Ez80Insn *insn)
+{
+    uint24 offset = READ24(r->offset);
+    uint24 p;
+    
+    if (r->section != SECT_CODE || !obj->code || offset < 1 ||
+        offset + 3 > obj->code_size) {
+        return -1;
+    }
+    p = offset - 1;
+    if (p > 0 && is_suffix(obj->code[p - 1])) {
+        return -1;
+    }
+    if (ez80_decode(&obj->code[p], 4, insn) != 4 || insn->imm_pos != 1) {
+        return -1;
+    }
+    if (insn->flow != FLOW_JUMP && insn->flow != FLOW_BRANCH &&
+        insn->flow != FLOW_CALL && insn->flow != FLOW_CALLCC) {
+        return -1;
+    }
+    
+    /* An opcode byte inside another relocated field is data (dl tables) */
+    if (find_reloc(obj, p) || (p >= 1 && find_reloc(obj, p - 1)) ||
+        (p >= 2 && find_reloc(obj, p - 2))) {
+        return -1;
+    }
+    return (long)p;
+}
+
+/* If a location holds JP nn, its cycle cost and the relocation of its
+ * operand; otherwise NULL */
+static ObjReloc *jump_at(LinkerState *ls, const OptLoc *loc, int *cycles)
+{
+    ObjectInfo *obj;
+    Ez80Insn insn;
+    
+    if (loc->sect != SECT_CODE) {
+        return NULL;
+    }
+    obj = &ls->objects[loc->obj];
+    if (!obj->code || loc->offset + 4 > obj->code_size ||
+        obj->code[loc->offset] != 0xC3) {
+        return NULL;
+    }
+    ez80_decode(&obj->code[loc->offset], 4, &insn);
+    *cycles = insn.cycles_taken;
+    return find_reloc(obj, loc->offset + 1);
+}
+
+/* Redirect the branch at code offset p of object oi past any chain of
+ * jumps at its target.  Chains that loop are left alone.  Returns 1 if
+ * the branch was changed. */
+static int thread_site(LinkerState *ls, int oi, ObjReloc *r, uint24 p,
+                       OptStats *st)
+{
+    OptLoc chain[MAX_THREAD_HOPS + 1];
+    int cycles[MAX_THREAD_HOPS];
+    ObjReloc *hop;
+    int n, k, j;
+    long saved;
+    
+    if (reloc_target(ls, oi, r, &chain[0]) < 0) {
+        return 0;
+    }
+    
+    for (n = 0; n < MAX_THREAD_HOPS; n++) {
+        hop = jump_at(ls, &chain[n], &cycles[n]);
+        if (!hop || reloc_target(ls, chain[n].obj, hop, &chain[n + 1]) < 0) {
+            break;
+        }
+        if (chain[n + 1].obj == oi && chain[n + 1].sect == SECT_CODE &&
+            chain[n + 1].offset == p) {
+            return 0;
+        }
+        for (j = 0; j <= n; j++) {
+            if (chain[j].obj == chain[n + 1].obj &&
+                chain[j].sect == chain[n + 1].sect &&
+                chain[j].offset == chain[n + 1].offset) {
+                return 0;
+            }
+        }
+    }
+    
+    /* Go as far down the chain as this object can name */
+    for (k = n; k > 0; k--) {
+        if (retarget(ls, oi, r, &chain[k]) == 0) {
+            saved = 0;
+            for (j = 0; j < k; j++) {
+                saved += cycles[j];
+            }
+            st->threaded++;
+            st->cycles += saved;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Is there any DJNZ/JR/JR cc pattern, real or not, that spans a byte
+ * of code offsets first..last? */
+static int jr_spans(ObjectInfo *obj, uint24 first, uint24 last)
+{
+    long p, lo, hi, target, disp;
+    uint8 op;
+    
+    for (p = (long)first - JR_REACH; p <= (long)last + JR_REACH; p++) {
+        if (p < 0 || p + 1 >= (long)obj->code_size) {
+            continue;
+        }
+        op = obj->code[p];
+        if (op != 0x10 && op != 0x18 && (op & 0xE7) != 0x20) {
+            continue;
+        }
+        disp = obj->code[p + 1];
+        if (disp >= 0x80) {
+            disp -= 0x100;
+        }
+        target = p + 2 + disp;
+        lo = target < p + 2 ? target : p + 2;
+        hi = target < p + 2 ? p + 2 : target;
+        if (lo <= (long)last && (long)first <= hi) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Does a fixed span of the object overlap code offsets first..last? */
+static int in_fixed(const ObjectInfo *obj, uint24 first, uint24 last)
+{
+    int j;
+    
+    for (j = 0; obj->fixed && j < obj->num_fixed; j++) {
+        if (first < obj->fixed[2 * j + 1] && obj->fixed[2 * j] <= last) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Can the byte at code offset pos of object oi be deleted?  Not if a
+ * relocation or symbol refers to it, a relative jump could reach or
+ * cross it, or it is in a fixed span. */
+static int can_delete(LinkerState *ls, int oi, uint24 pos)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    ObjectInfo *other;
+    OptLoc loc;
+    uint24 j;
+    int i;
+    
+    if (find_reloc(obj, pos) || in_fixed(obj, pos, pos)) {
+        return 0;
+    }
+    
+    for (i = 0; i < ls->num_symbols; i++) {
+        if (ls->symbols[i].obj_index == oi &&
+            ls->symbols[i].section == SECT_CODE &&
+            ls->symbols[i].value == pos) {
+            return 0;
+        }
+    }
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        other = &ls->objects[i];
+        for (j = 0; other->relocs && j < other->num_relocs; j++) {
+            if (reloc_target(ls, i, &other->relocs[j], &loc) == 0 &&
+                loc.obj == oi && loc.sect == SECT_CODE &&
+                loc.offset == pos) {
+                return 0;
+            }
+        }
+    }
+    
+    return !jr_spans(obj, pos, pos);
+}
+
+/* Delete the byte at code offset pos of object oi */
+static void delete_byte(LinkerState *ls, int oi, uint24 pos)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    ObjectInfo *other;
+    ObjReloc *r;
+    GlobalSymbol *sym;
+    OptLoc loc;
+    uint8 *field;
+    uint24 offset;
+    uint24 j;
+    int i;
+    
+    /*
+     * References past the byte move down with it.  Local ones carry
+     * the offset in their addend; external ones only need the addend
+     * changed when the symbol itself stays put.  This uses the symbol
+     * values from before the move.
+     */
+    for (i = 0; i < ls->num_objects; i++) {
+        other = &ls->objects[i];
+        for (j = 0; other->relocs && j < other->num_relocs; j++) {
+            r = &other->relocs[j];
+            if (reloc_target(ls, i, r, &loc) < 0 || loc.obj != oi ||
+                loc.sect != SECT_CODE || loc.offset <= pos) {
+                continue;
+            }
+            if (r->target_sect == 0) {
+                sym = extern_symbol(ls, other, r);
+                if (!sym || sym->value > pos) {
+                    continue;
+                }
+            }
+            field = reloc_field(other, r);
+            offset = (READ24(field) - 1) & 0xFFFFFF;
+            WRITE24(field, offset);
+        }
+    }
+    
+    memmove(&obj->code[pos], &obj->code[pos + 1], obj->code_size - pos - 1);
+    obj->code_size--;
+    if (pos < obj->hot_size) {
+        obj->hot_size--;
+    }
+    
+    for (j = 0; obj->relocs && j < obj->num_relocs; j++) {
+        r = &obj->relocs[j];
+        offset = READ24(r->offset);
+        if (r->section == SECT_CODE && offset > pos) {
+            WRITE24(r->offset, offset - 1);
+        }
+    }
+    
+    for (i = 0; obj->fixed && i < 2 * obj->num_fixed; i++) {
+        if (obj->fixed[i] > pos) {
+            obj->fixed[i]--;
+        }
+    }
+    
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        if (sym->obj_index != oi || sym->section != SECT_CODE) {
+            continue;
+        }
+        if (sym->value > pos) {
+            sym->value--;
+        } else if (sym->value + sym->size > pos) {
+            sym->size--;
+        }
+    }
+}
+
+/* End of the hot or cold part of the code holding offset p: code
+ * never runs on from one part into the other */
+static uint24 part_end(const ObjectInfo *obj, uint24 p)
+{
+    return p < obj->hot_size ? obj->hot_size : obj->code_size;
+}
+
+/* Turn CALL [cc,]nn at code offset p of object oi into JP [cc,]nn if a
+ * RET follows it, deleting the RET at level 2 when nothing else can
+ * reach it.  Returns 1 if the call was changed. */
+static int tail_call(LinkerState *ls, int oi, uint24 p, OptStats *st)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    Ez80Insn call, ret, jp;
+    uint24 q = p + 4;
+    
+    if (q >= part_end(obj, p) || obj->code[q] != 0xC9) {
+        return 0;
+    }
+    
+    ez80_decode(&obj->code[p], 4, &call);
+    ez80_decode(&obj->code[q], 1, &ret);
+    obj->code[p] = (uint8)(call.flow == FLOW_CALL ? 0xC3 : obj->code[p] - 2);
+    ez80_decode(&obj->code[p], 4, &jp);
+    st->tail_calls++;
+    st->cycles += call.cycles_taken + ret.cycles_taken - jp.cycles_taken;
+    
+    /* CALL cc falls through to the RET when not taken, so it stays */
+    if (ls->optimise >= 2 && call.flow == FLOW_CALL &&
+        can_delete(ls, oi, q)) {
+        delete_byte(ls, oi, q);
+        st->deleted++;
+    }
+    return 1;
+}
+
+/* Does an instruction read SP (ADD HL/IX/IY,SP, ADC/SBC HL,SP,
+ * LD (nn),SP)?  Writes and stack accesses are in the decoded insn. */
+static int reads_sp(const uint8 *code, const Ez80Insn *insn)
+{
+    int i = is_suffix(code[0]) ? 1 : 0;
+    
+    if (code[i] == 0xDD || code[i] == 0xFD) {
+        i++;
+    }
+    if (code[i] == 0x39) {
+        return 1;
+    }
+    return code[i] == 0xED && i + 1 < insn->len &&
+           (code[i + 1] == 0x72 || code[i + 1] == 0x7A || code[i + 1] == 0x73);
+}
+
+/*
+ * Length of the code at loc that can stand in for a call to it:
+ * straight-line instructions up to INLINE_MAX bytes, then RET.  Sets
+ * *reloc to the one relocation inside it, if any.  -1 if the code
+ * branches, uses the stack or cannot be inlined for another reason.
+ */
+static int inline_body(LinkerState *ls, const OptLoc *loc, ObjReloc **reloc)
+{
+    ObjectInfo *obj;
+    Ez80Insn insn;
+    ObjReloc *r;
+    uint24 start, end, off, limit;
+    uint24 j;
+    int len;
+    
+    if (loc->sect != SECT_CODE) {
+        return -1;
+    }
+    obj = &ls->objects[loc->obj];
+    start = loc->offset;
+    if (!obj->code || start >= obj->code_size) {
+        return -1;
+    }
+    limit = part_end(obj, start);
+    
+    for (end = start; end < start + INLINE_MAX + 1; end += insn.len) {
+        if (end >= limit) {
+            return -1;
+        }
+        len = ez80_decode(&obj->code[end], (int)(limit - end), &insn);
+        if (len == 0) {
+            return -1;
+        }
+        if (insn.flow == FLOW_RET && insn.len == 1) {
+            break;
+        }
+        if (insn.flow != FLOW_NEXT ||
+            (insn.attr & (INSN_STACK | INSN_INVALID | INSN_HALT)) ||
+            (insn.writes & RM_SP) || reads_sp(&obj->code[end], &insn)) {
+            return -1;
+        }
+    }
+    if (end > start + INLINE_MAX) {
+        return -1;
+    }
+    
+    /* At most one relocation, wholly inside, and not on the RET */
+    *reloc = NULL;
+    for (j = 0; obj->relocs && j < obj->num_relocs; j++) {
+        r = &obj->relocs[j];
+        off = READ24(r->offset);
+        if (r->section != SECT_CODE || off + 3 <= start || off > end) {
+            continue;
+        }
+        if (*reloc || off < start || off + 3 > end) {
+            return -1;
+        }
+        *reloc = r;
+    }
+    return (int)(end - start);
+}
+
+/* Note the exported routine at loc for dropping after the passes */
+static void note_routine(LinkerState *ls, const OptLoc *loc, int len,
+                         OptStats *st)
+{
+    GlobalSymbol *sym;
+    int i, k;
+    
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        if (sym->obj_index != loc->obj || sym->section != SECT_CODE ||
+            sym->value != loc->offset || sym->size != (uint24)len + 1) {
+            continue;
+        }
+        for (k = 0; k < st->num_routines; k++) {
+            if (st->routines[k] == i) return;
+        }
+        if (st->num_routines < MAX_INLINED) {
+            st->routines[st->num_routines++] = i;
+        }
+        return;
+    }
+}
+
+/* Replace CALL nn at code offset p of object oi, whose operand
+ * relocation is r, with the routine it calls.  Returns 1 if done. */
+static int inline_call(LinkerState *ls, int oi, ObjReloc *r, uint24 p,
+                       OptStats *st)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    ObjReloc *body_reloc;
+    ObjReloc saved_reloc;
+    OptLoc loc, body_target;
+    Ez80Insn call, ret, nop;
+    uint8 saved[4];
+    int len, k;
+    
+    if (obj->code[p] != 0xCD || reloc_target(ls, oi, r, &loc) < 0) {
+        return 0;
+    }
+    len = inline_body(ls, &loc, &body_reloc);
+    if (len < 0 || (loc.obj == oi && loc.offset <= p + 3 &&
+                    loc.offset + len >= p)) {
+        return 0;
+    }
+    if (body_reloc &&
+        reloc_target(ls, loc.obj, body_reloc, &body_target) < 0) {
+        return 0;
+    }
+    
+    ez80_decode(&obj->code[p], 4, &call);
+    ez80_decode(&ls->objects[loc.obj].code[loc.offset + len], 1, &ret);
+    memcpy(saved, &obj->code[p], 4);
+    saved_reloc = *r;
+    
+    /* Copy the body over the call, NOPs after it */
+    memset(&obj->code[p], 0x00, 4);
+    memcpy(&obj->code[p], &ls->objects[loc.obj].code[loc.offset], len);
+    
+    if (body_reloc) {
+        /* The operand of a 4-byte body is where the call's was */
+        WRITE24(r->offset, p + READ24(body_reloc->offset) - loc.offset);
+        r->section = SECT_CODE;
+        if (retarget(ls, oi, r, &body_target) < 0) {
+            memcpy(&obj->code[p], saved, 4);
+            *r = saved_reloc;
+            return 0;
+        }
+    } else {
+        k = (int)(r - obj->relocs);
+        memmove(r, r + 1, (obj->num_relocs - k - 1) * sizeof(ObjReloc));
+        obj->num_relocs--;
+    }
+    
+    note_routine(ls, &loc, len, st);
+    st->inlined++;
+    st->cycles += call.cycles_taken + ret.cycles_taken;
+    
+    /* Delete the padding where possible */
+    ez80_decode(&obj->code[p + len], 1, &nop);
+    for (k = len; k < 4; k++) {
+        if (can_delete(ls, oi, p + len)) {
+            delete_byte(ls, oi, p + len);
+            st->deleted++;
+        } else {
+            st->cycles -= nop.cycles;
+        }
+    }
+    return 1;
+}
+
+/* Delete an inlined routine that nothing refers to any more.  Returns
+ * its size, or 0 if it has to stay. */
+static int drop_routine(LinkerState *ls, GlobalSymbol *sym)
+{
+    int oi = sym->obj_index;
+    ObjectInfo *obj = &ls->objects[oi];
+    ObjectInfo *other;
+    uint24 start = sym->value;
+    uint24 size = sym->size;
+    uint24 end = start + size;
+    uint24 j, off;
+    OptLoc loc;
+    int i;
+    
+    if ((oi == 0 && start == 0) || size == 0 || end > part_end(obj, start) ||
+        obj->code[end - 1] != 0xC9) {
+        return 0;
+    }
+    
+    /* No other symbol inside it, no relocation in it or to it */
+    for (i = 0; i < ls->num_symbols; i++) {
+        if (ls->symbols[i].obj_index == oi &&
+            ls->symbols[i].section == SECT_CODE &&
+            ls->symbols[i].value > start && ls->symbols[i].value < end) {
+            return 0;
+        }
+    }
+    for (j = 0; obj->relocs && j < obj->num_relocs; j++) {
+        off = READ24(obj->relocs[j].offset);
+        if (obj->relocs[j].section == SECT_CODE && off + 3 > start &&
+            off < end) {
+            return 0;
+        }
+    }
+    for (i = 0; i < ls->num_objects; i++) {
+        other = &ls->objects[i];
+        for (j = 0; other->relocs && j < other->num_relocs; j++) {
+            if (reloc_target(ls, i, &other->relocs[j], &loc) == 0 &&
+                loc.obj == oi && loc.sect == SECT_CODE &&
+                loc.offset >= start && loc.offset < end) {
+                return 0;
+            }
+        }
+    }
+    if (jr_spans(obj, start, end - 1) || in_fixed(obj, start, end - 1)) {
+        return 0;
+    }
+    
+    for (j = 0; j < size; j++) {
+        delete_byte(ls, oi, start);
+    }
+    return (int)size;
+}
+
+/* One pass over every relocated branch; returns the number changed */
+static int opt_pass(LinkerState *ls, OptStats *st)
+{
+    ObjectInfo *obj;
+    Ez80Insn insn;
+    ObjReloc *r;
+    long p;
+    uint24 j;
+    int changes = 0;
+    int i;
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        obj = &ls->objects[i];
+        for (j = 0; obj->relocs && j < obj->num_relocs; j++) {
+            r = &obj->relocs[j];
+            p = branch_site(obj, r, &insn);
+            if (p < 0) {
+                continue;
+            }
+            if (ls->optimise >= 3 && insn.flow == FLOW_CALL &&
+                inline_call(ls, i, r, (uint24)p, st)) {
+                changes++;
+                continue;
+            }
+            changes += thread_site(ls, i, r, (uint24)p, st);
+            if (insn.flow == FLOW_CALL || insn.flow == FLOW_CALLCC) {
+                changes += tail_call(ls, i, (uint24)p, st);
+            }
+        }
+    }
+    
+    return changes;
+}
+
+/* ============================================================
+ * Entry Point
+ * ============================================================ */
+
+/* Optimise the loaded objects in place before layout */
+int opt_run(LinkerState *ls)
+{
+    OptStats st;
+    uint24 before = 0;
+    uint24 after = 0;
+    int pass;
+    int size;
+    int i;
+    
+    if (opt_load(ls) < 0) {
+        return -1;
+    }
+    
+    memset(&st, 0, sizeof(st));
+    for (i = 0; i < ls->num_objects; i++) {
+        before += ls->objects[i].code_size;
+    }
+    
+    for (pass = 0; pass < MAX_OPT_PASSES; pass++) {
+        if (opt_pass(ls, &st) == 0) {
+            break;
+        }
+    }
+    
+    for (i = 0; i < st.num_routines; i++) {
+        size = drop_routine(ls, &ls->symbols[st.routines[i]]);
+        if (size > 0) {
+            st.dropped++;
+            st.deleted += size;
+        }
+    }
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        after += ls->objects[i].code_size;
+    }
+    
+    if (ls->verbose) {
+        ld_note(ls, "Optimised: %d jumps threaded, %d tail calls, "
+                "%d bytes removed (code %u -> %u), %ld cycles saved",
+                st.threaded, st.tail_calls, st.deleted,
+                (unsigned)before, (unsigned)after, st.cycles);
+        if (ls->optimise >= 3) {
+            ld_note(ls, "Inlined %d calls, %d routines dropped",
+                    st.inlined, st.dropped);
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * eZ80 Linker - Mapped Output
+ *
+ * When the caller names the output file (ld_set_output), the image is
+ * built straight into a file beside it: "<output>.tmp" is created at
+ * its final size and memory-mapped, and link_output reads and
+ * relocates the sections in the mapping.  That saves a copy of the
+ * whole image and the write that would follow.  The file is renamed
+ * over the output only when the caller commits it, after the link and
+ * everything else it writes have succeeded, so a failed build leaves
+ * the previous output alone.
+ *
+ * Mapping is only tried for regular files on platforms with mmap();
+ * pipes, devices and anything that fails along the way fall back to
+ * the buffered image, which the caller writes out as before.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define LD_HAVE_MMAP
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef LD_HAVE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "ldint.h"
+
+void ld_set_output(LinkerState *ls, const char *filename)
+{
+    str_copy(ls->out_file, filename ? filename : "", MAX_FILENAME);
+}
+
+int ld_output_written(LinkerState *ls)
+{
+    return ls->image && ls->out_mapped;
+}
+
+int ld_commit_output(LinkerState *ls)
+{
+    int result;
+    
+    if (!ls->out_mapped) {
+        return 0;
+    }
+    result = out_unmap(ls, 1);
+    ls->image = NULL;
+    ls->image_size = 0;
+    return result;
+}
+
+#ifdef LD_HAVE_MMAP
+
+/* Create the temporary output file at size bytes and map it; NULL to
+ * fall back to a buffer */
+uint8 *out_map(LinkerState *ls, long size)
+{
+    struct stat st;
+    void *map;
+    int fd;
+    
+    if (!ls->out_file[0] || size <= 0) {
+        return NULL;
+    }
+    /* A link is written through by the buffered path, not replaced */
+    if (lstat(ls->out_file, &st) == 0 && !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    
+    sprintf(ls->out_tmp, "%s.tmp", ls->out_file);
+    fd = open(ls->out_tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    /* Reserve the blocks now: a full disk found later through the
+     * mapping would be a SIGBUS rather than an error */
+    if (posix_fallocate(fd, 0, (off_t)size) != 0) {
+        close(fd);
+        remove(ls->out_tmp);
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        remove(ls->out_tmp);
+        return NULL;
+    }
+    
+    ls->out_fd = fd;
+    ls->out_mapped = 1;
+    if (ls->verbose) {
+        ld_note(ls, "Mapped output '%s' (%ld bytes)", ls->out_file, size);
+    }
+    return (uint8 *)map;
+}
+
+/* Unmap the image and rename it to the output; without keep, the
+ * half-written file is removed instead.  Returns -1 after reporting
+ * an error if it could not be kept. */
+int out_unmap(LinkerState *ls, int keep)
+{
+    int err = 0;
+    
+    if (!ls->out_mapped) {
+        return 0;
+    }
+    if (ls->image && munmap(ls->image, (size_t)ls->image_size) != 0) {
+        err = errno;
+    }
+    if (close(ls->out_fd) != 0 && !err) {
+        err = errno;
+    }
+    if (keep && !err && rename(ls->out_tmp, ls->out_file) != 0) {
+        err = errno;
+    }
+    if (keep && err) {
+        ld_error(ls, "cannot write '%s': %s", ls->out_file, strerror(err));
+    }
+    if (!keep || err) {
+        remove(ls->out_tmp);
+    }
+    ls->out_fd = -1;
+    ls->out_mapped = 0;
+    return keep && err ? -1 : 0;
+}
+
+#else
+
+uint8 *out_map(LinkerState *ls, long size)
+{
+    (void)ls;
+    (void)size;
+    return NULL;
+}
+
+int out_unmap(LinkerState *ls, int keep)
+{
+    (void)ls;
+    (void)keep;
+    return 0;
+}
+
+#endif
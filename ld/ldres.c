@@ -0,0 +1,287 @@
+/*
+ * eZ80 Linker - Resident Images
+ *
+ * A resident image is a program (typically libc and the runtime)
+ * linked once, loaded at a fixed address and shared by the
+ * applications run on top of it.  Linking it with --symbols writes a
+ * symbol list:
+ *
+ *     ; eZ80 linked image symbols
+ *     resident 1
+ *     image 040000 0012AB 5C3D1F      base, length incl. BSS, CRC-24
+ *     symbol strlen 040010
+ *
+ * An application linked with --resident=<list> resolves references to
+ * those symbols to their fixed addresses instead of pulling library
+ * members in.  Its own definitions still take priority.  The linker
+ * checks that the application does not overlap the resident image,
+ * and defines __resident_crc so a loader can check that the image in
+ * memory is the one the application was linked against.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ldint.h"
+
+#define RESIDENT_FORMAT 1       /* "resident" line of the symbol list */
+#define CRC24_INIT      0xB704CEUL
+#define CRC24_POLY      0x864CFBUL
+
+/* ============================================================
+ * Symbol List
+ * ============================================================ */
+
+/* CRC-24 (as in OpenPGP) of a buffer */
+static uint24 crc24(const uint8 *data, long len)
+{
+    unsigned long crc = CRC24_INIT;
+    long i;
+    int bit;
+    
+    for (i = 0; i < len; i++) {
+        crc ^= (unsigned long)data[i] << 16;
+        for (bit = 0; bit < 8; bit++) {
+            crc <<= 1;
+            if (crc & 0x1000000UL) crc ^= CRC24_POLY;
+        }
+    }
+    return (uint24)(crc & 0xFFFFFFUL);
+}
+
+/* Build the symbol list of the last link */
+static int build_symbols(LinkerState *ls)
+{
+    GlobalSymbol *sym;
+    int fail = 0;
+    int i;
+    
+    fail |= text_printf(&ls->sym_text, "; eZ80 linked image symbols\n");
+    fail |= text_printf(&ls->sym_text, "resident %d\n", RESIDENT_FORMAT);
+    fail |= text_printf(&ls->sym_text, "image %06X %06X %06X\n",
+                        (unsigned)ls->base_addr,
+                        (unsigned)(ls->total_code + ls->total_data +
+                                   ls->total_bss),
+                        (unsigned)crc24(ls->image, ls->image_size));
+    for (i = 0; i < ls->num_symbols; i++) {
+        sym = &ls->symbols[i];
+        if (sym->obj_index < 0) continue;
+        fail |= text_printf(&ls->sym_text, "symbol %s %06X\n",
+                            sym->name, (unsigned)sym->value);
+    }
+    return fail ? -1 : 0;
+}
+
+/* The symbol list is built on first request */
+const char *ld_symbols(LinkerState *ls, long *size)
+{
+    *size = 0;
+    if (!ls->image) {
+        return NULL;
+    }
+    if (!ls->sym_text.text && build_symbols(ls) < 0) {
+        ld_error(ls, "out of memory for symbol list");
+        text_free(&ls->sym_text);
+        return NULL;
+    }
+    *size = ls->sym_text.len;
+    return ls->sym_text.text;
+}
+
+/* ============================================================
+ * Linking Against a Resident Image
+ * ============================================================ */
+
+void res_free(LinkerState *ls)
+{
+    if (ls->res_symbols) free(ls->res_symbols);
+    ls->res_symbols = NULL;
+    ls->num_res_symbols = 0;
+    ls->res_file[0] = '\0';
+}
+
+/* Add one symbol of the resident image */
+static int res_add(LinkerState *ls, const char *name, uint24 value, int *max)
+{
+    GlobalSymbol *syms;
+    GlobalSymbol *sym;
+    unsigned long hash = name_hash(name);
+    unsigned bucket;
+    
+    if (resident_find(ls, name, hash)) {
+        return 0;
+    }
+    if (ls->num_res_symbols >= *max) {
+        int new_max = *max ? *max * 2 : 256;
+        syms = (GlobalSymbol *)realloc(ls->res_symbols,
+                                       new_max * sizeof(GlobalSymbol));
+        if (!syms) return -1;
+        ls->res_symbols = syms;
+        *max = new_max;
+    }
+    
+    sym = &ls->res_symbols[ls->num_res_symbols];
+    str_copy(sym->name, name, MAX_SYM_NAME);
+    sym->value = value;
+    sym->section = 0;
+    sym->obj_index = RESIDENT_DEFINED;
+    sym->size = 0;
+    sym->kind = SYMK_NONE;
+    sym->hash = hash;
+    bucket = (unsigned)(hash & (HASH_SIZE - 1));
+    sym->hash_next = ls->res_buckets[bucket];
+    ls->res_buckets[bucket] = ls->num_res_symbols++;
+    return 0;
+}
+
+/* Parse a symbol list held in text[0..len-1] */
+static int res_parse(LinkerState *ls, const char *filename, char *text,
+                     long len)
+{
+    char name[MAX_SYM_NAME];
+    char word[16];
+    char *line;
+    char *end;
+    unsigned long base, size, crc, value;
+    int format = 0;
+    int have_image = 0;
+    int max = 0;
+    int line_num = 0;
+    
+    text[len] = '\0';
+    for (line = text; *line; line = end) {
+        end = strchr(line, '\n');
+        if (end) {
+            *end++ = '\0';
+        } else {
+            end = line + strlen(line);
+        }
+        line_num++;
+        
+        if (sscanf(line, "%15s", word) != 1 || word[0] == ';') {
+            continue;
+        }
+        if (strcmp(word, "resident") == 0 &&
+            sscanf(line, "%*s %d", &format) == 1) {
+            if (format != RESIDENT_FORMAT) {
+                ld_error(ls, "'%s' is resident format %d, expected %d",
+                         filename, format, RESIDENT_FORMAT);
+                return -1;
+            }
+        } else if (format && strcmp(word, "image") == 0 &&
+                   sscanf(line, "%*s %lx %lx %lx", &base, &size, &crc) == 3) {
+            ls->res_base = (uint24)base;
+            ls->res_len = (uint24)size;
+            ls->res_crc = (uint24)crc;
+            have_image = 1;
+        } else if (format && strcmp(word, "symbol") == 0 &&
+                   sscanf(line, "%*s %63s %lx", name, &value) == 2) {
+            if (res_add(ls, name, (uint24)value, &max) < 0) {
+                ld_error(ls, "out of memory");
+                return -1;
+            }
+        } else {
+            ld_error(ls, "%s:%d: not a resident symbol list", filename,
+                     line_num);
+            return -1;
+        }
+    }
+    
+    if (!have_image) {
+        ld_error(ls, "'%s' has no image line", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int ld_add_resident(LinkerState *ls, const char *filename)
+{
+    LdFile f;
+    char *text;
+    long len;
+    int result;
+    int i;
+    
+    if (lf_open(ls, filename, &f) < 0) {
+        ld_error(ls, "cannot open resident symbols '%s'", filename);
+        return -1;
+    }
+    len = lf_size(ls, &f);
+    text = (char *)malloc(len > 0 ? len + 1 : 1);
+    if (!text) {
+        ld_error(ls, "out of memory");
+        lf_close(ls, &f);
+        return -1;
+    }
+    if (len < 0 || lf_read(ls, &f, 0, text, len) < 0) {
+        ld_error(ls, "cannot read resident symbols '%s'", filename);
+        free(text);
+        lf_close(ls, &f);
+        return -1;
+    }
+    lf_close(ls, &f);
+    
+    /* Replaces any resident image given before */
+    res_free(ls);
+    for (i = 0; i < HASH_SIZE; i++) {
+        ls->res_buckets[i] = -1;
+    }
+    result = res_parse(ls, filename, text, len > 0 ? len : 0);
+    free(text);
+    if (result < 0) {
+        res_free(ls);
+        return -1;
+    }
+    str_copy(ls->res_file, filename, MAX_FILENAME);
+    
+    if (ls->verbose) {
+        ld_note(ls, "Resident image '%s': %d symbols at %06X-%06X",
+                filename, ls->num_res_symbols, (unsigned)ls->res_base,
+                (unsigned)(ls->res_base + ls->res_len - 1));
+    }
+    return 0;
+}
+
+/* Find a symbol of the resident image */
+GlobalSymbol *resident_find(LinkerState *ls, const char *name,
+                            unsigned long hash)
+{
+    GlobalSymbol *sym;
+    int idx;
+    
+    if (!ls->res_symbols) {
+        return NULL;
+    }
+    idx = ls->res_buckets[hash & (HASH_SIZE - 1)];
+    while (idx >= 0) {
+        sym = &ls->res_symbols[idx];
+        if (sym->hash == hash && str_casecmp(sym->name, name) == 0) {
+            return sym;
+        }
+        idx = sym->hash_next;
+    }
+    return NULL;
+}
+
+/* After layout: the application must not overlap the resident image */
+int resident_check(LinkerState *ls)
+{
+    unsigned long start = ls->base_addr;
+    unsigned long end = start + ls->total_code + ls->total_data +
+                        ls->total_bss;
+    unsigned long res_start = ls->res_base;
+    unsigned long res_end = res_start + ls->res_len;
+    
+    if (!ls->res_symbols || start == end || res_start == res_end) {
+        return 0;
+    }
+    if (start < res_end && res_start < end) {
+        ld_error(ls, "image %06lX-%06lX overlaps resident image '%s' "
+                 "at %06lX-%06lX", start, end - 1, ls->res_file,
+                 res_start, res_end - 1);
+        return -1;
+    }
+    return 0;
+}
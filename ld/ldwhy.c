@@ -0,0 +1,370 @@
+/*
+ * eZ80 Linker - Link Explanations
+ *
+ * The objects of a link and the references between them form a graph:
+ * an object refers to another if one of its externs is a symbol the
+ * other defines.  The reference is used if a relocation is against it;
+ * an extern that is declared but never used still pulls a library
+ * member in.  The first object listed is the entry, placed at the base
+ * address, so everything linked should be reachable from it.
+ *
+ * ld_why_live() gives the chain of references from the entry to the
+ * object defining a symbol, or to an object or library member by name,
+ * preferring used references:
+ *
+ *     ; Why 'putc' is linked: defined in ./libc.a[1]
+ *     main.o (entry)
+ *       refers to strlen in ./libc.a[0]
+ *       refers to putc in ./libc.a[1]
+ *
+ * ld_unused() lists the objects given on the command line that the
+ * entry cannot reach through used references, and the libraries none
+ * of whose members it can reach.
+ *
+ * C89 compatible with 24-bit integers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ldint.h"
+
+/* ============================================================
+ * Reference Graph
+ * ============================================================ */
+
+void why_free(LinkerState *ls)
+{
+    if (ls->refs) free(ls->refs);
+    ls->refs = NULL;
+    ls->num_refs = 0;
+    ls->max_refs = 0;
+    ls->refs_built = 0;
+    text_free(&ls->why_text);
+    text_free(&ls->unused_text);
+}
+
+/* Name of an object for reports: the file, or "library[member]" */
+static void obj_name(LinkerState *ls, int i, char *buf)
+{
+    ObjectInfo *obj = &ls->objects[i];
+    
+    if (obj->library < 0) {
+        str_copy(buf, obj->filename, MAX_FILENAME);
+    } else {
+        sprintf(buf, "%.*s[%d]", MAX_FILENAME - 8, obj->filename,
+                obj->member);
+    }
+}
+
+static int add_ref(LinkerState *ls, int from, int to, int symbol, int used)
+{
+    LdRef *refs;
+    int new_max;
+    
+    if (ls->num_refs >= ls->max_refs) {
+        new_max = ls->max_refs ? ls->max_refs * 2 : 64;
+        refs = (LdRef *)realloc(ls->refs, new_max * sizeof(LdRef));
+        if (!refs) return -1;
+        ls->refs = refs;
+        ls->max_refs = new_max;
+    }
+    ls->refs[ls->num_refs].from = from;
+    ls->refs[ls->num_refs].to = to;
+    ls->refs[ls->num_refs].symbol = symbol;
+    ls->refs[ls->num_refs].used = used;
+    ls->num_refs++;
+    return 0;
+}
+
+/* Add the references of one object, from its extern and relocation
+ * tables */
+static int object_refs(LinkerState *ls, int oi)
+{
+    ObjectInfo *obj = &ls->objects[oi];
+    ObjExtern *ext_tab;
+    ObjReloc *relocs;
+    GlobalSymbol *sym;
+    char *strtab;
+    int *used;
+    LdFile f;
+    uint24 name_off;
+    unsigned ext;
+    uint24 i;
+    int result = 0;
+    
+    if (obj->num_externs == 0) {
+        return 0;
+    }
+    if (lf_open(ls, obj->filename, &f) < 0) {
+        ld_error(ls, "cannot reopen '%s'", obj->filename);
+        return -1;
+    }
+    
+    ext_tab = (ObjExtern *)malloc(obj->num_externs * sizeof(ObjExtern));
+    strtab = (char *)malloc(obj->strtab_size ? obj->strtab_size : 1);
+    relocs = obj->relocs;
+    if (!relocs && obj->num_relocs > 0) {
+        relocs = (ObjReloc *)malloc(obj->num_relocs * sizeof(ObjReloc));
+    }
+    used = (int *)malloc(obj->num_externs * sizeof(int));
+    if (!ext_tab || !strtab || !used || (obj->num_relocs > 0 && !relocs)) {
+        ld_error(ls, "out of memory");
+        result = -1;
+    } else if (lf_read(ls, &f, obj->extern_pos, ext_tab,
+                       obj->num_externs * sizeof(ObjExtern)) < 0 ||
+               lf_read(ls, &f, obj->strtab_pos, strtab,
+                       obj->strtab_size) < 0 ||
+               (relocs != obj->relocs &&
+                lf_read(ls, &f, obj->reloc_pos, relocs,
+                        obj->num_relocs * sizeof(ObjReloc)) < 0)) {
+        ld_error(ls, "cannot read references from '%s'", obj->filename);
+        result = -1;
+    }
+    
+    if (result == 0) {
+        memset(used, 0, obj->num_externs * sizeof(int));
+        for (i = 0; i < obj->num_relocs; i++) {
+            ext = READ16(relocs[i].ext_index);
+            if (relocs[i].target_sect == 0 && ext < obj->num_externs) {
+                used[ext] = 1;
+            }
+        }
+        for (i = 0; i < obj->num_externs && result == 0; i++) {
+            name_off = READ24(ext_tab[i].name_offset);
+            if (name_off >= obj->strtab_size) continue;
+            sym = find_hashed(ls, &strtab[name_off],
+                              obj->name_hashes[obj->num_symbols + i]);
+            if (!sym || sym->obj_index < 0 || sym->obj_index == oi) continue;
+            if (add_ref(ls, oi, sym->obj_index, (int)(sym - ls->symbols),
+                        used[i]) < 0) {
+                ld_error(ls, "out of memory");
+                result = -1;
+            }
+        }
+    }
+    
+    if (ext_tab) free(ext_tab);
+    if (strtab) free(strtab);
+    if (relocs && relocs != obj->relocs) free(relocs);
+    if (used) free(used);
+    lf_close(ls, &f);
+    return result;
+}
+
+/* The graph is built on first request; references come out grouped
+ * by the object they are from */
+static int build_refs(LinkerState *ls)
+{
+    int i;
+    
+    if (ls->refs_built) {
+        return 0;
+    }
+    for (i = 0; i < ls->num_objects; i++) {
+        if (object_refs(ls, i) < 0) {
+            why_free(ls);
+            return -1;
+        }
+    }
+    ls->refs_built = 1;
+    return 0;
+}
+
+/*
+ * Breadth-first search from the entry object, or from every listed
+ * object if from_listed, over used references or all of them.  via[i]
+ * is the reference that first reached object i, -1 for the roots and
+ * -2 for objects not reached; via[num_objects..] is the queue.
+ */
+static void search(LinkerState *ls, int from_listed, int used_only, int *via)
+{
+    int *queue = via + ls->num_objects;
+    int head = 0;
+    int tail = 0;
+    int i, r;
+    
+    for (i = 0; i < ls->num_objects; i++) {
+        via[i] = -2;
+        if (i == 0 || (from_listed && ls->objects[i].library < 0)) {
+            via[i] = -1;
+            queue[tail++] = i;
+        }
+    }
+    while (head < tail) {
+        i = queue[head++];
+        for (r = 0; r < ls->num_refs; r++) {
+            LdRef *ref = &ls->refs[r];
+            if (ref->from != i || via[ref->to] != -2) continue;
+            if (used_only && !ref->used) continue;
+            via[ref->to] = r;
+            queue[tail++] = ref->to;
+        }
+    }
+}
+
+/* ============================================================
+ * Reports
+ * ============================================================ */
+
+/* Print the chain of references that reached object target, using
+ * chain[num_objects] */
+static int print_chain(LinkerState *ls, LdText *t, const int *via,
+                       int *chain, int target)
+{
+    char name[MAX_FILENAME];
+    int n = 0;
+    int i = target;
+    int fail = 0;
+    LdRef *ref;
+    
+    while (via[i] >= 0) {
+        chain[n++] = via[i];
+        i = ls->refs[via[i]].from;
+    }
+    obj_name(ls, i, name);
+    fail |= text_printf(t, "%s (%s)\n", name, i == 0 ? "entry" : "listed");
+    while (n > 0) {
+        ref = &ls->refs[chain[--n]];
+        obj_name(ls, ref->to, name);
+        fail |= text_printf(t, "  %s %s in %s\n",
+                            ref->used ? "refers to" : "declares",
+                            ls->symbols[ref->symbol].name, name);
+    }
+    return fail;
+}
+
+/* Object a name stands for: the one defining a symbol, else the object
+ * or member of that name; -1 if none (with a line saying why) */
+static int find_target(LinkerState *ls, LdText *t, const char *name)
+{
+    char buf[MAX_FILENAME];
+    GlobalSymbol *sym;
+    int i;
+    
+    sym = find_global(ls, name);
+    if (sym && sym->obj_index >= 0) {
+        obj_name(ls, sym->obj_index, buf);
+        text_printf(t, "; Why '%s' is linked: defined in %s\n", name, buf);
+        return sym->obj_index;
+    }
+    if (sym) {
+        text_printf(t, "; '%s' is %s\n", name,
+                    sym->obj_index == LINKER_DEFINED
+                    ? "defined by the linker" : "in the resident image");
+        return -1;
+    }
+    for (i = 0; i < ls->num_objects; i++) {
+        obj_name(ls, i, buf);
+        if (strcmp(buf, name) == 0) {
+            text_printf(t, "; Why %s is linked\n", name);
+            return i;
+        }
+    }
+    text_printf(t, "; '%s' is not a symbol or object of this link\n", name);
+    return -1;
+}
+
+static int build_why(LinkerState *ls, const char *name)
+{
+    LdText *t = &ls->why_text;
+    int *via;
+    int target;
+    int pass;
+    int fail = 0;
+    
+    if (build_refs(ls) < 0) {
+        return -1;
+    }
+    target = find_target(ls, t, name);
+    if (target < 0) {
+        return t->text ? 0 : -1;
+    }
+    
+    via = (int *)malloc(3 * (ls->num_objects + 1) * sizeof(int));
+    if (!via) return -1;
+    
+    /* From the entry if possible, and through used references */
+    for (pass = 0; pass < 4; pass++) {
+        search(ls, pass >= 2, !(pass & 1), via);
+        if (via[target] != -2) break;
+    }
+    fail |= print_chain(ls, t, via, via + 2 * ls->num_objects, target);
+    
+    free(via);
+    return fail ? -1 : 0;
+}
+
+/* Reference chain to a name, rebuilt on every request */
+const char *ld_why_live(LinkerState *ls, const char *name, long *size)
+{
+    *size = 0;
+    if (!ls->image) {
+        return NULL;
+    }
+    text_free(&ls->why_text);
+    if (build_why(ls, name) < 0) {
+        if (ls->errors == 0) ld_error(ls, "out of memory for --why-live");
+        text_free(&ls->why_text);
+        return NULL;
+    }
+    *size = ls->why_text.len;
+    return ls->why_text.text;
+}
+
+static int build_unused(LinkerState *ls)
+{
+    LdText *t = &ls->unused_text;
+    char name[MAX_FILENAME];
+    int *via;
+    int live;
+    int count = 0;
+    int fail = 0;
+    int i, j;
+    
+    if (build_refs(ls) < 0) {
+        return -1;
+    }
+    via = (int *)malloc(3 * (ls->num_objects + 1) * sizeof(int));
+    if (!via) return -1;
+    search(ls, 0, 1, via);
+    
+    obj_name(ls, 0, name);
+    fail |= text_printf(t, "; Inputs %s does not use\n", name);
+    for (i = 1; i < ls->num_objects; i++) {
+        if (ls->objects[i].library >= 0 || via[i] != -2) continue;
+        fail |= text_printf(t, "object  %s\n", ls->objects[i].filename);
+        count++;
+    }
+    for (j = 0; j < ls->num_libraries; j++) {
+        live = 0;
+        for (i = 0; i < ls->num_objects; i++) {
+            if (ls->objects[i].library == j && via[i] != -2) live = 1;
+        }
+        if (live) continue;
+        fail |= text_printf(t, "library %s\n", ls->libraries[j].filename);
+        count++;
+    }
+    if (count == 0) {
+        fail |= text_printf(t, "; (none)\n");
+    }
+    
+    free(via);
+    return fail ? -1 : 0;
+}
+
+/* The report is built on first request */
+const char *ld_unused(LinkerState *ls, long *size)
+{
+    *size = 0;
+    if (!ls->image) {
+        return NULL;
+    }
+    if (!ls->unused_text.text && build_unused(ls) < 0) {
+        if (ls->errors == 0) ld_error(ls, "out of memory for unused report");
+        text_free(&ls->unused_text);
+        return NULL;
+    }
+    *size = ls->unused_text.len;
+    return ls->unused_text.text;
+}
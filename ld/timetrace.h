@@ -0,0 +1,33 @@
+/*
+ * Chrome Trace-Event Timeline Writer
+ *
+ * Records nested begin/end spans as Chrome trace-event JSON, which
+ * can be loaded into chrome://tracing or https://ui.perfetto.dev.
+ * Events are collected in a memory buffer and written out in large
+ * blocks, so tracing adds very little to the times it measures.
+ *
+ * Every function accepts a NULL writer and then does nothing, so
+ * call sites do not need to check whether tracing is enabled.
+ *
+ * C89 compatible.
+ */
+
+#ifndef TIMETRACE_H
+#define TIMETRACE_H
+
+typedef struct TimeTrace TimeTrace;
+
+/* Create the trace file; returns NULL (with a message) on failure */
+TimeTrace *ttrace_open(const char *filename, const char *process);
+
+/* Open a span; detail may be NULL.  Spans nest and must be closed in
+ * order.  The name is kept until the span ends, so pass a literal. */
+void ttrace_begin(TimeTrace *tt, const char *name, const char *detail);
+
+/* Close the innermost open span */
+void ttrace_end(TimeTrace *tt);
+
+/* Close any open spans, flush and free; returns 0 on success */
+int ttrace_close(TimeTrace *tt);
+
+#endif /* TIMETRACE_H */
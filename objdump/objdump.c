@@ -81,6 +81,162 @@ static void dump_hex(FILE *fp, uint24 size)
     }
 }
 
+/* Name of symbol number index, read from the symbol table */
+static const char *symbol_name(FILE *fp, long sym_offset, uint24 index,
+                               const char *strtab, uint24 strtab_size)
+{
+    ObjSymbol sym;
+    uint24 name_off;
+    
+    fseek(fp, sym_offset + (long)(index * sizeof(ObjSymbol)), SEEK_SET);
+    if (fread(&sym, sizeof(sym), 1, fp) != 1) return "???";
+    name_off = READ24(sym.name_offset);
+    return (strtab && name_off < strtab_size) ? &strtab[name_off] : "???";
+}
+
+/* Dump the extension chunks of a version 4 or 5 object */
+static void dump_extensions(FILE *fp, long ext_offset, long sym_offset,
+                            const char *strtab, uint24 strtab_size)
+{
+    static const char *const kinds[] = { "-", "func", "object", "const" };
+    ObjExtHeader ext;
+    ObjClobber clob;
+    uint8 index[2];
+    uint8 hash[4];
+    uint8 addend[OBJ_ADDEND_SIZE];
+    uint8 cold[OBJ_COLD_SIZE];
+    uint8 fixed[OBJ_FIXED_SIZE];
+    char name[256];
+    ObjSymInfo info;
+    ObjAsset asset;
+    long value;
+    long pos;
+    uint24 size, off;
+    unsigned i, num_calls;
+    
+    printf("Extensions:\n");
+    pos = ext_offset;
+    for (;;) {
+        fseek(fp, pos, SEEK_SET);
+        if (fread(&ext, sizeof(ext), 1, fp) != 1) {
+            printf("  (truncated)\n");
+            break;
+        }
+        if (ext.type == OBJ_EXT_END) break;
+        size = READ24(ext.size);
+        pos += sizeof(ext);
+        
+        switch (ext.type) {
+            case OBJ_EXT_CLOBBERS:
+                printf("  CLOBBERS (%u bytes)\n", (unsigned)size);
+                printf("    %-24s %-6s %s\n", "Routine", "Writes", "Calls");
+                printf("    %-24s %-6s %s\n", "-------", "------", "-----");
+                off = 0;
+                while (off + sizeof(clob) <= size) {
+                    fseek(fp, pos + (long)off, SEEK_SET);
+                    if (fread(&clob, sizeof(clob), 1, fp) != 1) break;
+                    num_calls = READ16(clob.num_calls);
+                    printf("    %-24s %04X   ",
+                           symbol_name(fp, sym_offset, READ24(clob.symbol),
+                                       strtab, strtab_size),
+                           READ16(clob.writes));
+                    fseek(fp, pos + (long)off + (long)sizeof(clob), SEEK_SET);
+                    for (i = 0; i < num_calls; i++) {
+                        if (fread(index, 2, 1, fp) != 1) break;
+                        printf("%sEXT:%u", i ? " " : "", READ16(index));
+                    }
+                    printf("\n");
+                    off += sizeof(clob) + 2 * num_calls;
+                }
+                break;
+            
+            case OBJ_EXT_NAME_HASHES:
+                printf("  NAME_HASHES (%u bytes)\n", (unsigned)size);
+                fseek(fp, pos, SEEK_SET);
+                for (off = 0; off + 4 <= size; off += 4) {
+                    if (fread(hash, 4, 1, fp) != 1) break;
+                    printf("    [%u] %08lX\n", (unsigned)(off / 4),
+                           READ32(hash));
+                }
+                break;
+            
+            case OBJ_EXT_SYMBOL_INFO:
+                printf("  SYMBOL_INFO (%u bytes)\n", (unsigned)size);
+                printf("    %-24s %-6s %s\n", "Symbol", "Size", "Kind");
+                printf("    %-24s %-6s %s\n", "------", "----", "----");
+                for (off = 0; off + sizeof(info) <= size; off += sizeof(info)) {
+                    fseek(fp, pos + (long)off, SEEK_SET);
+                    if (fread(&info, sizeof(info), 1, fp) != 1) break;
+                    printf("    %-24s %-6u %s\n",
+                           symbol_name(fp, sym_offset,
+                                       off / (uint24)sizeof(info),
+                                       strtab, strtab_size),
+                           (unsigned)READ24(info.size),
+                           info.kind < 4 ? kinds[info.kind] : "?");
+                }
+                break;
+            
+            case OBJ_EXT_ADDENDS:
+                printf("  ADDENDS (%u bytes)\n", (unsigned)size);
+                fseek(fp, pos, SEEK_SET);
+                for (off = 0; off + OBJ_ADDEND_SIZE <= size;
+                     off += OBJ_ADDEND_SIZE) {
+                    if (fread(addend, OBJ_ADDEND_SIZE, 1, fp) != 1) break;
+                    value = (long)READ24(addend);
+                    if (value & 0x800000L) value -= 0x1000000L;
+                    printf("    [%u] %+ld\n", (unsigned)(off / OBJ_ADDEND_SIZE),
+                           value);
+                }
+                break;
+            
+            case OBJ_EXT_COLD:
+                fseek(fp, pos, SEEK_SET);
+                if (size < OBJ_COLD_SIZE ||
+                    fread(cold, OBJ_COLD_SIZE, 1, fp) != 1) {
+                    printf("  COLD (%u bytes)\n", (unsigned)size);
+                    break;
+                }
+                printf("  COLD: cold code from offset %06X\n",
+                       (unsigned)READ24(cold));
+                break;
+            
+            case OBJ_EXT_FIXED:
+                printf("  FIXED (%u spans)\n",
+                       (unsigned)(size / OBJ_FIXED_SIZE));
+                fseek(fp, pos, SEEK_SET);
+                for (off = 0; off + OBJ_FIXED_SIZE <= size;
+                     off += OBJ_FIXED_SIZE) {
+                    if (fread(fixed, OBJ_FIXED_SIZE, 1, fp) != 1) break;
+                    printf("    %06X-%06X\n", (unsigned)READ24(fixed),
+                           (unsigned)READ24(&fixed[3]));
+                }
+                break;
+            
+            case OBJ_EXT_ASSETS:
+                printf("  ASSETS (%u bytes)\n", (unsigned)size);
+                off = 0;
+                while (off + sizeof(asset) <= size) {
+                    fseek(fp, pos + (long)off, SEEK_SET);
+                    if (fread(&asset, sizeof(asset), 1, fp) != 1 ||
+                        fread(name, 1, asset.name_len, fp) != asset.name_len) {
+                        break;
+                    }
+                    name[asset.name_len] = '\0';
+                    printf("    %-24s %u bytes\n", name,
+                           (unsigned)READ24(asset.size));
+                    off += sizeof(asset) + asset.name_len + READ24(asset.size);
+                }
+                break;
+            
+            default:
+                printf("  type 0x%02X (%u bytes)\n", ext.type, (unsigned)size);
+                break;
+        }
+        pos += size;
+    }
+    printf("\n");
+}
+
 static int dump_object(const char *filename)
 {
     FILE *fp;
@@ -272,6 +428,12 @@ static int dump_object(const char *filename)
     }
     printf("\n");
     
+    if (header.version >= OBJ_VERSION_EXT && (header.flags & OBJ_FLAG_EXT)) {
+        dump_extensions(fp, strtab_offset + (long)strtab_size,
+                        (long)(sizeof(header) + code_size + data_size),
+                        strtab, strtab_size);
+    }
+    
     if (strtab) free(strtab);
     fclose(fp);
     
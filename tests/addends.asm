@@ -0,0 +1,9 @@
+; Relocated fields with addends, in code and data
+        assume adl=1
+        xref ext
+        section code
+start:  ld hl,tab+3
+        jp ext+1
+        section data
+tab:    db 1,2,3,4
+ptr:    dl start+2
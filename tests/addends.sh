@@ -0,0 +1,54 @@
+#!/bin/sh
+# Assemble relocated fields with addends as a version 5 object: the
+# fields hold zeros and the addends go in their chunk.  It must link
+# to the same image as the version 4 object, beside a version 4 one.
+#
+# Usage: tests/addends.sh [as] [ld] [objdump]
+#        (default: as/as, ld/ld, objdump/objdump)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+OBJDUMP=${3:-$dir/../objdump/objdump}
+tmp=${TMPDIR:-/tmp}/addends.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+bytes() {
+    od -An -tx1 -v "$1" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//'
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: addends: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" --explicit-addends -o "$tmp/v5.o" "$dir/addends.asm" || exit 1
+"$AS" -o "$tmp/v4.o" "$dir/addends.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+
+got=$("$OBJDUMP" "$tmp/v5.o" | grep -E 'Version|^  000000: [0-9A-F][0-9A-F] ' |
+      sed 's/  *|.*//')
+check "fields" "  Version:     5
+  000000: 21 00 00 00 C3 00 00 00
+  000000: 01 02 03 04 00 00 00" "$got"
+got=$("$OBJDUMP" "$tmp/v5.o" | sed -n '/ADDENDS/,$p')
+check "addends" "  ADDENDS (9 bytes)
+    [0] +3
+    [1] +1
+    [2] +2" "$got"
+
+"$LD" -b 40000 -o "$tmp/v5.bin" "$tmp/v5.o" "$tmp/ext.o" || exit 1
+"$LD" -b 40000 -o "$tmp/v4.bin" "$tmp/v4.o" "$tmp/ext.o" || exit 1
+check "image" "21 0c 00 04 c3 09 00 04 c9 01 02 03 04 02 00 04" \
+    "$(bytes "$tmp/v5.bin")"
+cmp -s "$tmp/v4.bin" "$tmp/v5.bin" ||
+    check "version 4" "same image" "different image"
+
+[ $status -eq 0 ] && echo "PASS: addends"
+exit $status
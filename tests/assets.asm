@@ -0,0 +1,12 @@
+; Two assets, read through the symbols the linker defines
+        assume adl=1
+        xref __asset_title_off, __asset_title_len
+        xref __asset_level_off, __asset_level_len
+        section code
+start:  ld hl,__asset_level_off
+        ld bc,__asset_level_len
+        ld de,level - title
+        ret
+        section asset
+title:  db "TITLE"
+level:  db 1,2,3
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Write asset sections to the asset file beside the program, and
+# define __asset_<name>_off and _len for the code that reads them.
+#
+# Usage: tests/assets.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/assets.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: assets: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+bytes() {
+    od -An -tx1 "$1" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//'
+}
+
+"$AS" -o "$tmp/assets.o" "$dir/assets.asm" &&
+"$LD" -m "$tmp/assets.map" -o "$tmp/game.bin" "$tmp/assets.o" ||
+    check "assets.asm" "links" "fails"
+
+# ld hl,__asset_level_off / ld bc,__asset_level_len / ld de,level-title
+check "code" "21 14 00 00 01 03 00 00 11 05 00 00 c9" \
+    "$(bytes "$tmp/game.bin")"
+# Count 2, then offset and length of each, then the data
+check "asset file" \
+"02 00 00 0f 00 00 05 00 00 14 00 00 03 00 00 54 49 54 4c 45 01 02 03" \
+    "$(bytes "$tmp/game.bin.ast")"
+got=$(sed -n '/^Assets/,/^$/p' "$tmp/assets.map" | sed "s|$tmp/||g")
+check "map" \
+"Assets (23 bytes, not loaded):
+  title                    00000F   5      assets.o
+  level                    000014   3      assets.o" "$got"
+
+"$LD" --assets="$tmp/data.ast" -o "$tmp/other.bin" "$tmp/assets.o" ||
+    check "--assets" "links" "fails"
+cmp -s "$tmp/game.bin.ast" "$tmp/data.ast" ||
+    check "--assets" "same asset file" "differs"
+
+got=$("$AS" -o "$tmp/bad.o" "$dir/assets_bad.asm" 2>&1 | sed "s|$dir/||g")
+check "assets_bad.asm" \
+"assets_bad.asm:4: error: asset 'title' has no address; use __asset_title_off
+assets_bad.asm:7: error: asset 'title' has no address; use __asset_title_off
+assets_bad.asm:8: error: ORG cannot be used in the asset section
+Assembly failed with 3 error(s)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: assets"
+exit $status
@@ -0,0 +1,8 @@
+; Asset labels have no address, and ORG cannot place them
+        assume adl=1
+        section code
+        ld hl,title
+        section asset
+title:  db 1
+        dl title
+        org 10
@@ -0,0 +1,11 @@
+; Exported routines: one calling into clobbers_inner.asm, one indirect
+        assume adl=1
+        xdef outer, nothing, wild
+        xref inner
+        section code
+outer:  ld a,(hl)
+        call inner
+        ret
+nothing:
+        ret
+wild:   jp (hl)
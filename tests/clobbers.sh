@@ -0,0 +1,48 @@
+#!/bin/sh
+# Summarise the registers exported routines change, adding a callee's
+# summary from another object; a callee without one, or an indirect
+# jump, changes anything.
+#
+# Usage: tests/clobbers.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/clobbers.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: clobbers: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+head="; Registers each routine may change, including through its calls
+; (* = anything, - = nothing but SP)"
+
+"$AS" --clobbers -o "$tmp/outer.o" "$dir/clobbers.asm" || exit 1
+"$AS" --clobbers -o "$tmp/inner.o" "$dir/clobbers_inner.asm" || exit 1
+"$AS" -o "$tmp/plain.o" "$dir/clobbers_inner.asm" || exit 1
+
+"$LD" --clobbers="$tmp/out.txt" -o "$tmp/out.bin" \
+    "$tmp/outer.o" "$tmp/inner.o" || exit 1
+check "summaries" "$head
+outer                    a bc de hl
+nothing                  -
+wild                     *
+inner                    bc de hl" "$(cat "$tmp/out.txt")"
+
+"$LD" --clobbers="$tmp/out.txt" -o "$tmp/out.bin" \
+    "$tmp/outer.o" "$tmp/plain.o" || exit 1
+check "no summary" "$head
+outer                    *
+nothing                  -
+wild                     *" "$(cat "$tmp/out.txt")"
+
+[ $status -eq 0 ] && echo "PASS: clobbers"
+exit $status
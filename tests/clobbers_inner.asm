@@ -0,0 +1,7 @@
+; Called by clobbers.asm: writes BC, DE and HL
+        assume adl=1
+        xdef inner
+        section code
+inner:  ld bc,0
+        ex de,hl
+        ret
@@ -0,0 +1,16 @@
+; COLD after code that cannot run on: a return, a jump, data
+        assume adl=1
+        section code
+f:      or a
+        branch z,@err
+        ret
+        cold
+@err:   ld a,1
+        ret
+g:      jp (hl)
+        cold
+@rare:  ld a,2
+        ret
+h:      db 1
+        cold
+@tab:   db 2
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Split routines with COLD: the hot code of each routine comes first,
+# then the cold parts, and COLD is an error where the hot code would
+# run on into the next routine.
+#
+# Usage: tests/cold.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/cold.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: cold: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+bytes() {
+    od -An -tx1 "$1" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//'
+}
+
+# Hot: or a / jp z,@err / ret / jp (hl) / db 1; then the cold parts
+"$AS" -o "$tmp/cold.o" "$dir/cold.asm" &&
+"$LD" -o "$tmp/cold.bin" "$tmp/cold.o" ||
+    check "cold.asm" "links" "fails"
+check "layout" \
+"b7 ca 08 00 00 c9 e9 01 3e 01 c9 3e 02 c9 02" "$(bytes "$tmp/cold.bin")"
+
+got=$("$AS" -o "$tmp/runon.o" "$dir/cold_runon.asm" 2>&1 | sed "s|$dir/||g")
+check "cold_runon.asm" \
+"cold_runon.asm:5: error: code before COLD would run on into the hot code that follows; end it with jp, jr or ret
+cold_runon.asm:11: error: code before COLD would run on into the hot code that follows; end it with jp, jr or ret
+cold_runon.asm:13: error: COLD directly after a label would leave the label on the hot code that follows
+Assembly failed with 3 error(s)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: cold"
+exit $status
@@ -0,0 +1,14 @@
+; COLD where the hot code would run on into the next routine
+        assume adl=1
+        section code
+f:      ld a,1
+        cold
+@c:     ld a,2
+        ret
+g:      ld a,3
+        ret
+h:      call z,g
+        cold
+@d:     ret
+k:      cold
+        ret
@@ -0,0 +1,11 @@
+; Numeric data lists, in every literal form the lexer reads
+        assume adl=1
+k       equ 9
+        section data
+        db 1, 2, 255, $7f, 0x1F, 0ffh, 12h, %101, 1Ah
+        db 300, 256, 01bh, 0b1h
+        dw 65535, $1234, 0, 65536
+        dl $123456, 16777215, 99999999, 1h
+        db 1, 'A', 3, k, 4
+        dl 4294967295, 4294967296, 123456789012
+        db	7	,	8
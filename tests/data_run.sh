@@ -0,0 +1,46 @@
+#!/bin/sh
+# Convert runs of plain numbers in db, dw and dl without the expression
+# parser.  Adding +0 to every element sends it down the normal path,
+# which must give the same bytes.
+#
+# Usage: tests/data_run.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/data_run.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: data_run: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+bytes() {
+    od -An -tx1 "$1" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//'
+}
+
+"$AS" -o "$tmp/fast.o" "$dir/data_run.asm" &&
+"$LD" -o "$tmp/fast.bin" "$tmp/fast.o" ||
+    check "data_run.asm" "links" "fails"
+check "bytes" \
+"01 02 ff 7f 1f ff 12 05 1a 2c 00 1b b1 ff ff 34 12 00 00 00 00 \
+56 34 12 ff ff ff ff e0 f5 01 00 00 01 41 03 09 04 \
+ff ff ff 00 00 00 14 1a 99 07 08" "$(bytes "$tmp/fast.bin")"
+
+sed '/^[[:space:]]*d[bwl][[:space:]]/{s/,/+0,/g; s/$/+0/;}' \
+    "$dir/data_run.asm" > "$tmp/slow.asm"
+"$AS" -o "$tmp/slow.o" "$tmp/slow.asm" &&
+"$LD" -o "$tmp/slow.bin" "$tmp/slow.o" ||
+    check "with +0" "links" "fails"
+cmp -s "$tmp/fast.bin" "$tmp/slow.bin" ||
+    check "with +0" "same bytes" "$(bytes "$tmp/slow.bin")"
+
+[ $status -eq 0 ] && echo "PASS: data_run"
+exit $status
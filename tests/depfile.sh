@@ -0,0 +1,49 @@
+#!/bin/sh
+# Write make depfiles for a link that pulls one member out of a
+# two-member library: -MD names the inputs, --dep-hashes adds the CRC
+# of the member used, and --dep-hashes alone writes nothing.
+#
+# Usage: tests/depfile.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/depfile.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+# A depfile with the temporary directory dropped and continuations joined
+deps() {
+    sed -e :a -e '/\\$/N; s/ *\\\n */ /; ta' "$1" | sed "s|$tmp/||g"
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: depfile: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/main.o" "$dir/ldlib_api.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+"$AS" -o "$tmp/inner.o" "$dir/clobbers_inner.asm" || exit 1
+cat "$tmp/inner.o" "$tmp/ext.o" > "$tmp/libt.a" || exit 1
+
+"$LD" -MD -L "$tmp" -lt -o "$tmp/out.bin" "$tmp/main.o" || exit 1
+check "-MD" "out.bin: main.o libt.a" \
+    "$(deps "$tmp/out.bin.d")"
+
+"$LD" -MD -MF "$tmp/named.d" --dep-hashes -L "$tmp" -lt \
+    -o "$tmp/out.bin" "$tmp/main.o" || exit 1
+check "--dep-hashes" "out.bin: main.o libt.a
+# member libt.a[1] ext 18D93F7C" "$(deps "$tmp/named.d")"
+
+rm -f "$tmp/out.bin.d"
+"$LD" --dep-hashes -L "$tmp" -lt -o "$tmp/out.bin" "$tmp/main.o" || exit 1
+[ -f "$tmp/out.bin.d" ] && check "--dep-hashes alone" "no depfile" "depfile"
+
+[ $status -eq 0 ] && echo "PASS: depfile"
+exit $status
@@ -0,0 +1,7 @@
+; RETI and RETN end a DI region after popping the return address
+        assume adl=1
+        section code
+h:      di
+        reti
+n:      di
+        retn
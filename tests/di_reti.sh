@@ -0,0 +1,49 @@
+#!/bin/sh
+# Cost RETI and RETN in the DI report, --di-budget and --wcet.  Both
+# take 8 cycles (2 fetches, 3 pops, 3 internal); the DI region runs
+# from the end of the DI to the end of the return.
+#
+# Usage: tests/di_reti.sh [as]   (default: as/as)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+tmp=${TMPDIR:-/tmp}/di_reti.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: di_reti: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+src="$dir/di_reti.asm"
+got=$("$AS" --di-report -o "$tmp/t.o" "$src" | sed "s|^$dir/||")
+check "--di-report" \
+"di_reti.asm:4: note: interrupts disabled for 8 cycles in 'h' (until reti at $src:5)
+di_reti.asm:6: note: interrupts disabled for 8 cycles in 'n' (until reti at $src:7)" "$got"
+
+got=$("$AS" --wcet -o "$tmp/t.o" "$src" | sed "s|^$dir/||")
+check "--wcet" \
+"di_reti.asm:4: note: 'h' takes 9 cycles at worst (lines 4-5)
+di_reti.asm:6: note: 'n' takes 9 cycles at worst (lines 6-7)" "$got"
+
+# One wait state on each of DI's fetch and RETI's 2 fetches and 3 pops
+got=$("$AS" --wcet --wait-states=1 -o "$tmp/t.o" "$src" | sed "s|^$dir/||")
+check "--wait-states=1" \
+"di_reti.asm:4: note: 'h' takes 15 cycles at worst (lines 4-5)
+di_reti.asm:6: note: 'n' takes 15 cycles at worst (lines 6-7)" "$got"
+
+"$AS" --di-budget=8 -o "$tmp/t.o" "$src" ||
+    check "--di-budget=8" "assembles" "fails"
+"$AS" --di-budget=7 -o "$tmp/t.o" "$src" 2>/dev/null &&
+    check "--di-budget=7" "fails" "assembles"
+got=$("$AS" --di-budget=abc -o "$tmp/t.o" "$src" 2>&1)
+check "--di-budget=abc" "error: invalid --di-budget" "$got"
+
+[ $status -eq 0 ] && echo "PASS: di_reti"
+exit $status
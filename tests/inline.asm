@@ -0,0 +1,18 @@
+; Routines called by inline_calls.asm: inc2 is tiny enough to inline, getv
+; reads a variable inline_calls.asm cannot name, big is too long and
+; loop branches
+        assume adl=1
+        xdef inc2, getv, big, loop
+        section code
+inc2:   inc hl
+        inc hl
+        ret
+getv:   ld a,(value)
+        ret
+big:    ld bc,1
+        ld de,2
+        ret
+loop:   djnz loop
+        ret
+        section data
+value:  db 7
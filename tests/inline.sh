@@ -0,0 +1,48 @@
+#!/bin/sh
+# Inline tiny leaf routines at ld -O3 and drop the one no longer
+# called; -O leaves every call alone.
+#
+# Usage: tests/inline.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/inline.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+link() {
+    "$LD" $1 -m "$tmp/out.map" -o "$tmp/out.bin" \
+        "$tmp/calls.o" "$tmp/inline.o" || exit 1
+    od -An -tx1 -v "$tmp/out.bin" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//'
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: inline: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/calls.o" "$dir/inline_calls.asm" || exit 1
+"$AS" -o "$tmp/inline.o" "$dir/inline.asm" || exit 1
+
+# The last call inc2 / ret only becomes a tail call at -O
+check "-O" "cd 14 00 00 cd 17 00 00 cd 1c 00 00 cd 25 00 00 c3 14 00 00 \
+23 23 c9 3a 28 00 00 c9 01 01 00 00 11 02 00 00 c9 10 fe c9 07" "$(link -O)"
+
+# inc / inc in place of both calls, and inc2 itself gone
+check "-O3" "23 23 cd 11 00 00 cd 16 00 00 cd 1f 00 00 23 23 c9 3a 22 00 \
+00 c9 01 01 00 00 11 02 00 00 c9 10 fe c9 07" "$(link -O3)"
+got=$(sed -n '/^Symbols:/,$p' "$tmp/out.map" | grep 'inline\.o$' |
+      sed "s|$tmp/||")
+check "map" "  inc2                     000011   0      func   inline.o
+  getv                     000011   5      func   inline.o
+  big                      000016   9      func   inline.o
+  loop                     00001F   3      func   inline.o" "$got"
+
+[ $status -eq 0 ] && echo "PASS: inline"
+exit $status
@@ -0,0 +1,10 @@
+; Calls inline.asm's routines; only the calls to inc2 are inlined
+        assume adl=1
+        xref inc2, getv, big, loop
+        section code
+main:   call inc2
+        call getv
+        call big
+        call loop
+        call inc2
+        ret
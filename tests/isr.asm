@@ -0,0 +1,25 @@
+; Interrupt handlers saving only what they change
+        assume adl=1
+        section code
+tick:   isr
+        ld hl,(ticks)
+        inc hl
+        ld (ticks),hl
+        endisr
+uart:   isr
+        ld a,(flag)
+        or a
+        jr z,@done
+        call clear
+@done:  endisr
+fast:   isr shadow
+        ld a,1
+        ld hl,0
+        ld ix,0
+        endisr
+clear:  ld bc,0
+        ld (flag),bc
+        ret
+        section data
+ticks:  dl 0
+flag:   dl 0
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Save only the registers an interrupt handler changes: through a
+# forward jump and a call, with ISR SHADOW, and the errors for a body
+# that returns by itself or uses what ISR SHADOW keeps.
+#
+# Usage: tests/isr.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/isr.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: isr: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+bytes() {
+    od -An -tx1 "$1" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//'
+}
+
+"$AS" -v -o "$tmp/isr.o" "$dir/isr.asm" > "$tmp/log" &&
+"$LD" -o "$tmp/isr.bin" "$tmp/isr.o" ||
+    check "isr.asm" "links" "fails"
+got=$(grep note "$tmp/log" | sed "s|$dir/||")
+check "-v" \
+"isr.asm:4: note: isr 'tick' saves HL: 8 cycles, 44 fewer than saving AF to IY
+isr.asm:9: note: isr 'uart' saves AF BC: 16 cycles, 36 fewer than saving AF to IY
+isr.asm:15: note: isr 'fast' saves IX on the stack and AF BC DE HL in the shadow registers: 14 cycles, 38 fewer than saving AF to IY" "$got"
+
+# tick: push hl ... pop hl; uart: push af/bc, BC from the call to clear;
+# fast: push ix, ex af,af', exx ... pop ix, ex af,af', exx
+check "bytes" \
+"e5 2a 40 00 00 23 22 40 00 00 e1 fb ed 4d \
+f5 c5 3a 43 00 00 b7 28 04 cd 36 00 00 c1 f1 fb ed 4d \
+dd e5 08 d9 3e 01 21 00 00 00 dd 21 00 00 00 dd e1 08 d9 fb ed 4d \
+01 00 00 00 ed 43 43 00 00 c9 00 00 00 00 00 00" "$(bytes "$tmp/isr.bin")"
+
+got=$("$AS" -o "$tmp/bad.o" "$dir/isr_bad.asm" 2>&1 | sed "s|$dir/||g")
+check "isr_bad.asm" \
+"isr_bad.asm:7: error: isr 'h' returns before ENDISR, skipping its restores; jump to a label on the ENDISR line instead
+isr_bad.asm:8: error: isr 'h' returns before ENDISR, skipping its restores; jump to a label on the ENDISR line instead
+isr_bad.asm:12: error: isr 's' uses the shadow registers, which ISR SHADOW keeps for its saves
+isr_bad.asm:15: error: isr 'e' enables interrupts, so a nested one would change the shadow registers
+Assembly failed with 4 error(s)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: isr"
+exit $status
@@ -0,0 +1,15 @@
+; ISR bodies that return by themselves or misuse ISR SHADOW
+        assume adl=1
+        section code
+h:      isr
+        ld a,(0)
+        or a
+        ret z
+        reti
+        endisr
+s:      isr shadow
+        exx
+        endisr
+e:      isr shadow
+        ei
+        endisr
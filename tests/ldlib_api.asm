@@ -0,0 +1,7 @@
+; Calls ldopt_ext.asm's ext; linked in-process by ldlib_api.c
+        assume adl=1
+        xdef start
+        xref ext
+        section code
+start:  call ext
+        ret
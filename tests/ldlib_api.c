@@ -0,0 +1,91 @@
+/*
+ * Link through the library API: two contexts at once, objects from
+ * memory, diagnostics through the callback, and a relink after
+ * ld_reset.  Prints what it saw for ldlib_api.sh to compare.
+ *
+ * Usage: ldlib_api <main.o> <ext.o>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ldlib.h"
+
+static uint8 *read_file(const char *name, long *size)
+{
+    FILE *fp = fopen(name, "rb");
+    uint8 *data;
+
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (uint8 *)malloc((size_t)*size);
+    if (data && fread(data, 1, (size_t)*size, fp) != (size_t)*size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+static void diag(void *user, int severity, const char *msg)
+{
+    printf("%s: %s: %s\n", (const char *)user,
+           severity == LD_ERROR ? "error" : "warning", msg);
+}
+
+static void print_image(const char *what, LinkerState *ls)
+{
+    const uint8 *image;
+    long size, i;
+
+    image = ld_image(ls, &size);
+    printf("%s:", what);
+    for (i = 0; image && i < size; i++) {
+        printf(" %02x", image[i]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    LinkerState *a, *b;
+    uint8 *main_o, *ext_o;
+    long main_size, ext_size;
+    int result;
+
+    if (argc != 3) return 2;
+    main_o = read_file(argv[1], &main_size);
+    ext_o = read_file(argv[2], &ext_size);
+    a = ld_create(NULL);
+    b = ld_create(NULL);
+    if (!main_o || !ext_o || !a || !b) return 2;
+    ld_set_diag(a, diag, "a");
+    ld_set_diag(b, diag, "b");
+
+    /* Both contexts are live at once; b's failure leaves a alone */
+    ld_set_base(a, 0x40000);
+    ld_add_object_mem(a, "main.o", main_o, main_size);
+    ld_add_object_mem(a, "ext.o", ext_o, ext_size);
+    ld_add_object_mem(b, "main.o", main_o, main_size);
+    result = ld_link(a);
+    printf("a: link %d\n", result);
+    result = ld_link(b);
+    printf("b: link %d, %d error(s)\n", result, ld_error_count(b));
+    print_image("a", a);
+
+    /* Relink a at another base */
+    ld_reset(a);
+    ld_set_base(a, 0);
+    ld_add_object_mem(a, "main.o", main_o, main_size);
+    ld_add_object_mem(a, "ext.o", ext_o, ext_size);
+    result = ld_link(a);
+    printf("a: relink %d\n", result);
+    print_image("a", a);
+
+    ld_destroy(a);
+    ld_destroy(b);
+    free(main_o);
+    free(ext_o);
+    return 0;
+}
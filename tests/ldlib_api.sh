@@ -0,0 +1,35 @@
+#!/bin/sh
+# Build ldlib_api.c against the linker library and link through it.
+#
+# Usage: tests/ldlib_api.sh [as] [ld]   (default: as/as; ld is unused,
+#        the library is built from ld/ with $CC, default cc)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+CC=${CC:-cc}
+src=$dir/../ld
+tmp=${TMPDIR:-/tmp}/ldlib_api.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+
+$CC -I"$src" -o "$tmp/ldlib_api" "$dir/ldlib_api.c" "$src/ldlib.c" \
+    "$src/ldopt.c" "$src/ldclob.c" "$src/ldres.c" "$src/lddep.c" \
+    "$src/ldout.c" "$src/ldwhy.c" "$src/ldasset.c" "$src/ldmod.c" \
+    "$src/ez80dec.c" "$src/timetrace.c" || exit 1
+"$AS" -o "$tmp/main.o" "$dir/ldlib_api.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+
+expect="a: link 0
+b: error: undefined symbol 'ext' referenced in 'main.o'
+b: link -1, 1 error(s)
+a: cd 05 00 04 c9 c9
+a: relink 0
+a: cd 05 00 00 c9 c9"
+got=$("$tmp/ldlib_api" "$tmp/main.o" "$tmp/ext.o")
+if [ "$got" != "$expect" ]; then
+    echo "FAIL: ldlib_api"
+    echo "  expected: $expect"
+    echo "  got:      $got"
+    exit 1
+fi
+echo "PASS: ldlib_api"
@@ -0,0 +1,5 @@
+; Routine called by ldopt_jumptable.asm
+        assume adl=1
+        xdef ext
+        section code
+ext:    ret
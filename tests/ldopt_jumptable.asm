@@ -0,0 +1,11 @@
+; Regression for ld -O: tail calls between JUMPTABLE offset targets
+        assume adl=1
+        xdef disp
+        xref ext
+        section code
+disp:   jumptable t0,t1,t2
+t0:     call ext
+        ret
+t1:     call ext
+        ret
+t2:     ret
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Link a jumptable with 8-bit offsets whose targets end in tail calls.
+# ld -O turns both calls into jumps, but must not delete the RETs after
+# them: the offsets in the table have no relocations to follow a move.
+#
+# Usage: tests/ldopt_jumptable.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/ldopt_jt.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+
+"$AS" -o "$tmp/disp.o" "$dir/ldopt_jumptable.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+"$LD" -O -o "$tmp/out.bin" "$tmp/disp.o" "$tmp/ext.o" || exit 1
+
+# Table 00 05 0A, then t0: jp ext / ret, t1: jp ext / ret, t2: ret
+expect="11 00 00 00 5f 21 11 00 00 19 5e 21 14 00 00 19 e9 00 05 0a c3 1f 00 00 c9 c3 1f 00 00 c9 c9 c9"
+got=$(od -An -tx1 -v "$tmp/out.bin" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//')
+if [ "$got" != "$expect" ]; then
+    echo "FAIL: ldopt_jumptable"
+    echo "  expected: $expect"
+    echo "  got:      $got"
+    exit 1
+fi
+echo "PASS: ldopt_jumptable"
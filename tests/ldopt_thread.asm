@@ -0,0 +1,12 @@
+; Jumps to a jump, and tail calls to another object
+        assume adl=1
+        xdef start, two, hop
+        xref ext
+        section code
+start:  call hop
+        jp z,hop
+        call nz,ext
+        ret
+two:    call ext
+        ret
+hop:    jp ext
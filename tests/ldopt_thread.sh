@@ -0,0 +1,45 @@
+#!/bin/sh
+# Thread a call and a jp through a jp to ldopt_ext.asm, and turn a
+# conditional and a plain tail call into jumps.  -O1 keeps every byte;
+# -O also deletes the RET after the plain one, but not the RET after
+# the conditional one, which is still reached.
+#
+# Usage: tests/ldopt_thread.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/ldopt_thread.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+link() {
+    "$LD" $1 -o "$tmp/out.bin" "$tmp/thread.o" "$tmp/ext.o" || exit 1
+    od -An -tx1 -v "$tmp/out.bin" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//'
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: ldopt_thread: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/thread.o" "$dir/ldopt_thread.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+
+check "no -O" \
+"cd 12 00 00 ca 12 00 00 c4 16 00 00 c9 cd 16 00 00 c9 c3 16 00 00 c9" \
+"$(link "")"
+check "-O1" \
+"cd 16 00 00 ca 16 00 00 c2 16 00 00 c9 c3 16 00 00 c9 c3 16 00 00 c9" \
+"$(link -O1)"
+check "-O" \
+"cd 15 00 00 ca 15 00 00 c2 15 00 00 c9 c3 15 00 00 c3 15 00 00 c9" \
+"$(link -O)"
+
+[ $status -eq 0 ] && echo "PASS: ldopt_thread"
+exit $status
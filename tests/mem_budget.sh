@@ -0,0 +1,52 @@
+#!/bin/sh
+# Keep the symbol table within --mem-budget: 2000 long names spill to
+# disk without changing the object, and a budget too small for the
+# symbols themselves is one error, not one per remaining line.
+#
+# Usage: tests/mem_budget.sh [as]   (default: as/as)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+tmp=${TMPDIR:-/tmp}/mem_budget.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: mem_budget: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+# Each routine calls another, so lookups read spilled names back
+awk 'BEGIN {
+    print "; generated by mem_budget.sh"
+    print "        section code"
+    for (i = 0; i < 2000; i++)
+        printf "a_symbol_name_long_enough_to_fill_the_name_pages_quickly_%04d: call a_symbol_name_long_enough_to_fill_the_name_pages_quickly_%04d\n", i, (i * 7) % 2000
+}' > "$tmp/names.asm"
+
+"$AS" -o "$tmp/all.o" "$tmp/names.asm" ||
+    check "no budget" "assembles" "fails"
+got=$("$AS" --mem-budget=96 -v -o "$tmp/spill.o" "$tmp/names.asm" |
+      grep -c "Names spilled")
+check "--mem-budget=96 spills" "1" "$got"
+cmp -s "$tmp/all.o" "$tmp/spill.o" ||
+    check "--mem-budget=96 object" "same as without a budget" "differs"
+
+got=$("$AS" --mem-budget=4 -o "$tmp/t.o" "$tmp/names.asm" 2>&1 |
+      sed 's/^.*: error: //')
+check "--mem-budget=4" \
+"symbol table does not fit in --mem-budget (4 KB)
+Assembly failed with 1 error(s)" "$got"
+
+for arg in 0 -1 4x 99999999999999999999; do
+    got=$("$AS" --mem-budget=$arg -o "$tmp/t.o" "$tmp/names.asm" 2>&1)
+    check "--mem-budget=$arg" "error: invalid --mem-budget" "$got"
+done
+
+[ $status -eq 0 ] && echo "PASS: mem_budget"
+exit $status
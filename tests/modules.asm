@@ -0,0 +1,11 @@
+; A module: one fixup in the code, an import, an export and BSS
+        assume adl=1
+        xdef entry
+        xref api
+        section code
+entry:  ld hl,msg
+        jp api
+        section data
+msg:    db 1
+        section bss
+buf:    ds 4
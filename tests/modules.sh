@@ -0,0 +1,68 @@
+#!/bin/sh
+# Link a program with --exports and the loader, and a module with
+# --module: check the export tables, the module file and its errors.
+#
+# Usage: tests/modules.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/modules.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: modules: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+bytes() {
+    od -An -tx1 "$@" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//'
+}
+
+"$AS" -o "$tmp/prog.o" "$dir/modules_prog.asm" &&
+"$LD" --exports -m "$tmp/prog.map" -o "$tmp/prog.bin" "$tmp/prog.o" ||
+    check "modules_prog.asm" "links" "fails"
+got=$(grep -e "^Export" -e "^  api " "$tmp/prog.map" | sed "s|$tmp/||")
+check "program map" \
+"Export Table: 0001B8 (15 bytes)
+  api                      0001B1   1      func   prog.o" "$got"
+# At 1B8 (440): mask 0, bucket offsets 6 and 15, then the hash, value
+# and name of api
+check "program exports" "00 00 06 00 0f 00 dd 34 b1 01 00 61 70 69 00" \
+    "$(bytes -j 440 "$tmp/prog.bin")"
+
+"$AS" -o "$tmp/level.o" "$dir/modules.asm" &&
+"$LD" --module -m "$tmp/level.map" -o "$tmp/level.mod" "$tmp/level.o" ||
+    check "modules.asm" "links" "fails"
+# Header: memory 65, image 26, BSS 4, exports at 9, 2 fixups, 1 import
+check "header" "45 5a 38 4d 01 41 00 00 1a 00 00 04 00 00 09 00 00 02 00 00 01 00 00" \
+    "$(bytes -N 23 "$tmp/level.mod")"
+# ld hl,msg / jp api / msg, then the export table of entry
+check "image" "21 08 00 00 c3 00 00 00 01 \
+00 00 06 00 11 00 51 4b 00 00 00 65 6e 74 72 79 00" \
+    "$(bytes -j 23 -N 26 "$tmp/level.mod")"
+# Fixups at 1 and 17 (entry's value), then api going into offset 5
+check "fixups and imports" "01 00 00 11 00 00 61 70 69 00 01 00 00 05 00 00" \
+    "$(bytes -j 49 "$tmp/level.mod")"
+got=$(sed -n '/^Module:/,/^$/p' "$tmp/level.map")
+check "module map" \
+"Module: 2 fixups, 1 imports
+  api                      1 field" "$got"
+
+got=$("$LD" --module -b 100 -o "$tmp/t.mod" "$tmp/level.o" 2>&1)
+check "--module -b" \
+"error: a module is linked at 0; it cannot have a base address
+Link failed with 1 error(s)" "$got"
+got=$("$LD" -o "$tmp/t.bin" "$tmp/level.o" 2>&1 | sed "s|$tmp/||")
+check "without --module" \
+"error: undefined symbol 'api' referenced in 'level.o'
+Link failed with 1 error(s)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: modules"
+exit $status
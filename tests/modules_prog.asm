@@ -0,0 +1,17 @@
+; A program that exports api and loads a module with modloader
+        assume adl=1
+        xdef api
+        xref __exports
+        section code
+start:  ld hl,buffer                ; the module read in here
+        ld de,__exports
+        call modload
+        ret c
+        ld de,name
+        jp modload.find             ; its entry
+modload: modloader
+api:    ret
+        section data
+name:   db "entry",0
+        section bss
+buffer: ds 100
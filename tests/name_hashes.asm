@@ -0,0 +1,7 @@
+; Mixed-case names: hashed folded to lower case, and linked to
+; ldopt_ext.asm's ext whatever their case
+        assume adl=1
+        xdef Start
+        xref EXT
+        section code
+Start:  jp EXT
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Write the hashes of mixed-case names folded to lower case, as
+# objformat.h defines them (djb2 with XOR over the lower-cased name),
+# and resolve through them from an object and from a library index.
+#
+# Usage: tests/name_hashes.sh [as] [ld] [objdump]
+#        (default: as/as, ld/ld, objdump/objdump)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+OBJDUMP=${3:-$dir/../objdump/objdump}
+tmp=${TMPDIR:-/tmp}/name_hashes.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+bytes() {
+    od -An -tx1 -v "$1" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//'
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: name_hashes: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/main.o" "$dir/name_hashes.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+"$AS" -o "$tmp/inner.o" "$dir/clobbers_inner.asm" || exit 1
+cat "$tmp/inner.o" "$tmp/ext.o" > "$tmp/libt.a" || exit 1
+
+# "start" and "ext", whatever the case in the source
+got=$("$OBJDUMP" "$tmp/main.o" | sed -n '/NAME_HASHES/,/^  [A-Z]/p' |
+      grep '\[')
+check "hashes" "    [0] 0B9FEF85
+    [1] 0B8724CC" "$got"
+
+"$LD" -o "$tmp/out.bin" "$tmp/main.o" "$tmp/ext.o" || exit 1
+check "object" "c3 04 00 00 c9" "$(bytes "$tmp/out.bin")"
+"$LD" -o "$tmp/out.bin" -L "$tmp" -lt "$tmp/main.o" || exit 1
+check "library" "c3 04 00 00 c9" "$(bytes "$tmp/out.bin")"
+
+[ $status -eq 0 ] && echo "PASS: name_hashes"
+exit $status
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Replace the output only when the whole link succeeds: a failed link,
+# or a map file that cannot be written after it, leaves the previous
+# output alone and no temporary file; a symlinked output is written
+# through.
+#
+# Usage: tests/output.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/output.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+bytes() {
+    od -An -tx1 -v "$1" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//'
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: output: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/main.o" "$dir/ldlib_api.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+out="$tmp/out.bin"
+
+echo old > "$out"
+"$LD" -o "$out" -m "$tmp/missing/out.map" "$tmp/main.o" "$tmp/ext.o" \
+    2>/dev/null && check "map failure" "exit 1" "exit 0"
+check "map failure" "old" "$(cat "$out")"
+
+"$LD" -o "$out" "$tmp/main.o" 2>/dev/null &&
+    check "link failure" "exit 1" "exit 0"
+check "link failure" "old" "$(cat "$out")"
+[ -e "$out.tmp" ] && check "link failure" "no $out.tmp" "$out.tmp"
+
+"$LD" -o "$out" "$tmp/main.o" "$tmp/ext.o" || check "link" "exit 0" "exit 1"
+check "link" "cd 05 00 00 c9 c9" "$(bytes "$out")"
+[ -e "$out.tmp" ] && check "link" "no $out.tmp" "$out.tmp"
+
+echo old > "$tmp/target.bin"
+ln -s target.bin "$tmp/link.bin" || exit 1
+"$LD" -o "$tmp/link.bin" "$tmp/main.o" "$tmp/ext.o" ||
+    check "symlink" "exit 0" "exit 1"
+[ -L "$tmp/link.bin" ] || check "symlink" "still a link" "replaced"
+check "symlink" "cd 05 00 00 c9 c9" "$(bytes "$tmp/target.bin")"
+
+[ $status -eq 0 ] && echo "PASS: output"
+exit $status
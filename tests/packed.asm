@@ -0,0 +1,9 @@
+; Packed data, its sizes and the unpackers
+        assume adl=1
+        section code
+unrle:  unpacker rle
+unlz:   unpacker lz
+        section data
+sizes:  dl rl.size, rl.packed, lz.size, lz.packed
+rl:     db_packed rle, 0,0,0,0,0,0,0,0,1,2,3,4,4,4,4,4,4,4,4,4,4,9
+lz:     db_packed lz, "abcabcabcabcabcabc", 1,2,3, "xyzabcabc", 0,0,0,0,0,0
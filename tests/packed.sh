@@ -0,0 +1,93 @@
+#!/bin/sh
+# Pack data with db_packed, unpack the streams here by the format the
+# README gives and compare them with the data, and reuse packed results
+# from --pack-cache.
+#
+# Usage: tests/packed.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/packed.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: packed: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+bytes() {
+    od -An -tx1 "$@" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//'
+}
+
+# Unpack a stream of control bytes ended by 0: 1 to 127 copies that
+# many bytes; above, rle repeats the next byte (control - 126) times and
+# lz copies (control - 125) bytes from a 16-bit offset back
+unpack() {
+    bytes -j "$2" "$tmp/packed.bin" | tr ' ' '\n' | awk -v codec="$1" '
+    function hex(s) { return index("0123456789abcdef", substr(s, 1, 1)) * 16 \
+                           + index("0123456789abcdef", substr(s, 2, 1)) - 17 }
+    { in_[n++] = hex($0) }
+    END {
+        i = 0
+        while ((c = in_[i++]) != 0) {
+            if (c < 128) {
+                while (c-- > 0) out[m++] = in_[i++]
+            } else if (codec == "rle") {
+                for (k = 0; k < c - 126; k++) out[m++] = in_[i]
+                i++
+            } else {
+                back = in_[i] + 256 * in_[i + 1]
+                i += 2
+                for (k = 0; k < c - 125; k++) { out[m] = out[m - back]; m++ }
+            }
+        }
+        for (k = 0; k < m; k++) printf "%s%02x", k ? " " : "", out[k]
+    }'
+}
+
+"$AS" -v -o "$tmp/packed.o" "$dir/packed.asm" > "$tmp/log" &&
+"$LD" -o "$tmp/packed.bin" "$tmp/packed.o" ||
+    check "packed.asm" "links" "fails"
+got=$(grep note "$tmp/log" | sed "s|$dir/||")
+check "-v" \
+"packed.asm:8: note: packed 22 bytes to 11 with rle (50%)
+packed.asm:9: note: packed 36 bytes to 23 with lz (63%)" "$got"
+
+# 28 and 46 bytes of unpackers, then sizes, then the rle and lz streams
+check "sizes" "16 00 00 0b 00 00 24 00 00 17 00 00" \
+    "$(bytes -j 74 -N 12 "$tmp/packed.bin")"
+check "rle" \
+"00 00 00 00 00 00 00 00 01 02 03 04 04 04 04 04 04 04 04 04 04 09" \
+    "$(unpack rle 86)"
+check "lz" \
+"61 62 63 61 62 63 61 62 63 61 62 63 61 62 63 61 62 63 01 02 03 \
+78 79 7a 61 62 63 61 62 63 00 00 00 00 00 00" "$(unpack lz 97)"
+
+# The second build takes both results from the cache; one that does
+# not unpack to the data is packed again
+mkdir "$tmp/cache"
+"$AS" --pack-cache="$tmp/cache" -o "$tmp/p1.o" "$dir/packed.asm" ||
+    check "--pack-cache" "assembles" "fails"
+got=$("$AS" -v --pack-cache="$tmp/cache" -o "$tmp/p2.o" "$dir/packed.asm" |
+      grep -c "from the cache")
+check "--pack-cache reused" "2" "$got"
+cmp -s "$tmp/packed.o" "$tmp/p2.o" ||
+    check "--pack-cache object" "same" "differs"
+for f in "$tmp"/cache/*; do
+    printf '\001\377' | dd of="$f" bs=1 seek=1 conv=notrunc 2>/dev/null
+done
+got=$("$AS" -v --pack-cache="$tmp/cache" -o "$tmp/p3.o" "$dir/packed.asm" |
+      grep -c "from the cache")
+check "--pack-cache damaged" "0" "$got"
+cmp -s "$tmp/packed.o" "$tmp/p3.o" ||
+    check "--pack-cache damaged object" "same" "differs"
+
+[ $status -eq 0 ] && echo "PASS: packed"
+exit $status
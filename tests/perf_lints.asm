@@ -0,0 +1,27 @@
+; One instance of each -Wperf rule, and near misses that must not warn
+        assume adl=1
+        section code
+f:      jp z,@near
+        ld a,0
+        or a
+@near:  call g
+        ret
+g:      ld a,0
+        push bc
+        pop bc
+        push de                 ; Changed in between: no push-pop
+        ld e,1
+        pop de
+        ld hl,table
+        add a,l
+        ld l,a
+        ld a,(hl)
+        ret
+h:      ld a,0
+        jr nc,@l                ; Tests the flags: no ld-zero
+        ld b,4
+@l:     ld a,(ix+0)
+        ld (ix+1),a
+        djnz @l
+        ret
+table:  db 1,2,3
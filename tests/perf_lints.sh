@@ -0,0 +1,48 @@
+#!/bin/sh
+# Raise each -Wperf rule once, leave the near misses alone, apply the
+# rules in command-line order, and leave the object unchanged.
+#
+# Usage: tests/perf_lints.sh [as]   (default: as/as)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+tmp=${TMPDIR:-/tmp}/perf_lints.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: perf_lints: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+src="$dir/perf_lints.asm"
+got=$("$AS" -Wperf -o "$tmp/perf.o" "$src" 2>&1 | sed "s|$dir/||g")
+check "-Wperf" \
+"perf_lints.asm:4: warning: jp could be jr (saves 2 bytes, 2 cycles) [-Wperf-jp-jr]
+perf_lints.asm:5: warning: ld a,0 could be xor a if the flags are not needed (saves 1 byte, 1 cycle) [-Wperf-ld-zero]
+perf_lints.asm:7: warning: call followed by ret could be jp (saves 1 byte, 8 cycles) [-Wperf-tail-call]
+perf_lints.asm:9: warning: ld a,0 could be xor a if the flags are not needed (saves 1 byte, 1 cycle) [-Wperf-ld-zero]
+perf_lints.asm:10: warning: push and pop cancel out; nothing between them changes the register (saves 2 bytes, 8 cycles) [-Wperf-push-pop]
+perf_lints.asm:15: warning: table 'table' (3 bytes) is indexed with an 8-bit add at perf_lints.asm:16, which is only correct if it is linked within one 256-byte page (saves 4 bytes, 4 cycles over a 24-bit add) [-Wperf-table-page]
+perf_lints.asm:23: warning: 1 load through an index register in the loop at perf_lints.asm:23; HL is free to walk the data instead (saves 2 bytes, 2 cycles per iteration) [-Wperf-ix-loop]" "$got"
+
+got=$("$AS" -Wperf-ld-zero -Wperf -Wno-perf-ld-zero -Wno-perf-table-page \
+      -Wno-perf-ix-loop -Wno-perf-push-pop -Wno-perf-tail-call \
+      -o "$tmp/perf.o" "$src" 2>&1 | sed "s|$dir/||g")
+check "rule order" \
+"perf_lints.asm:4: warning: jp could be jr (saves 2 bytes, 2 cycles) [-Wperf-jp-jr]" "$got"
+
+got=$("$AS" -Wperf-jr -o "$tmp/perf.o" "$src" 2>&1 | head -1)
+check "unknown rule" "error: unknown warning '-Wperf-jr'" "$got"
+
+"$AS" -o "$tmp/plain.o" "$src" || status=1
+cmp -s "$tmp/perf.o" "$tmp/plain.o" ||
+    check "object" "unchanged by -Wperf" "changed"
+
+[ $status -eq 0 ] && echo "PASS: perf_lints"
+exit $status
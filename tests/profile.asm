@@ -0,0 +1,19 @@
+; A mostly-taken branch moves the block it skips to the routine's end; a
+; mostly-not-taken one stays, and BRANCH picks jr or jp by distance
+        assume adl=1
+        section code
+f:      or a
+        jr z,@skip
+        ld a,1
+        ld b,2
+@skip:  inc a
+        ret
+g:      or a
+        jr z,@s2
+        ld a,1
+@s2:    ret
+h:      branch z,@near
+        nop
+@near:  branch nz,@far
+        ds 200
+@far:   ret
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Lay out a routine for a branch profile and check the moved block,
+# the inverted branch, the branch back and the BRANCH encodings.
+#
+# Usage: tests/profile.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/profile.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: profile: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+got=$("$AS" --profile="$dir/profile.txt" -o "$tmp/profile.o" \
+      "$dir/profile.asm" | sed "s|$dir/||g")
+check "note" \
+"profile.asm: note: profile layout moved 1 block, branch cycles 4910 -> 4410 (-500)" "$got"
+"$LD" -o "$tmp/out.bin" "$tmp/profile.o" || exit 1
+
+# f: or a / jr nz,moved / inc a / ret / moved: ld a,1 / ld b,2 / jr @skip
+# g: unchanged; h: jr z,@near / nop / jp nz,@far (200 bytes on)
+expect="b7 20 02 3c c9 3e 01 06 02 18 f8 b7 28 02 3e 01 c9 28 01 00 c2 e0 00 00"
+got=$(od -An -tx1 -v -N 24 "$tmp/out.bin" | tr -s ' \n' '  ' |
+      sed 's/^ //; s/ $//')
+check "layout" "$expect" "$got"
+got=$(wc -c < "$tmp/out.bin" | tr -d ' ')
+check "size" 225 "$got"
+
+[ $status -eq 0 ] && echo "PASS: profile"
+exit $status
@@ -0,0 +1,8 @@
+; Calls ext in a resident image linked from ldopt_ext.asm, and reads
+; the image's CRC
+        assume adl=1
+        xref ext, __resident_crc
+        section code
+app:    call ext
+        ld hl,__resident_crc
+        ret
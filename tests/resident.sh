@@ -0,0 +1,53 @@
+#!/bin/sh
+# Link ldopt_ext.asm as a resident image with --symbols, then link
+# resident.asm against its list: ext resolves to the image, unless the
+# application links its own, __resident_crc is the image's CRC-24, and
+# overlapping the image is an error.
+#
+# Usage: tests/resident.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/resident.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+bytes() {
+    od -An -tx1 -v "$1" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//'
+}
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: resident: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+"$AS" -o "$tmp/app.o" "$dir/resident.asm" || exit 1
+"$LD" -b 40000 -o "$tmp/rt.bin" --symbols="$tmp/rt.sym" "$tmp/ext.o" || exit 1
+check "symbols" "; eZ80 linked image symbols
+resident 1
+image 040000 000001 6C4067
+symbol ext 040000" "$(cat "$tmp/rt.sym")"
+
+"$LD" -b 50000 -o "$tmp/app.bin" --resident="$tmp/rt.sym" "$tmp/app.o" ||
+    exit 1
+check "resident" "cd 00 00 04 21 67 40 6c c9" "$(bytes "$tmp/app.bin")"
+
+"$LD" -b 50000 -o "$tmp/app.bin" --resident="$tmp/rt.sym" \
+    "$tmp/app.o" "$tmp/ext.o" || exit 1
+check "own ext" "cd 09 00 05 21 67 40 6c c9 c9" "$(bytes "$tmp/app.bin")"
+
+got=$("$LD" -b 40000 -o "$tmp/app.bin" --resident="$tmp/rt.sym" \
+      "$tmp/app.o" 2>&1 | sed "s|$tmp/||g")
+check "overlap" \
+"error: image 040000-040008 overlaps resident image 'rt.sym' at 040000-040000
+Link failed with 1 error(s)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: resident"
+exit $status
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Run every test script, passing each the tools' paths.
+#
+# Usage: tests/run.sh [as] [ld] [objdump]
+#        (default: as/as, ld/ld, objdump/objdump)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+OBJDUMP=${3:-$dir/../objdump/objdump}
+failed=0
+
+for t in "$dir"/*.sh; do
+    [ "$(basename "$t")" = run.sh ] && continue
+    sh "$t" "$AS" "$LD" "$OBJDUMP" || failed=$((failed + 1))
+done
+if [ $failed -ne 0 ]; then
+    echo "$failed test script(s) failed"
+    exit 1
+fi
@@ -0,0 +1,19 @@
+; Field offsets, sizes and REORDER, emitted as IX displacements
+        assume adl=1
+        section code
+task    struct
+next:   dl 0
+state:  db 0
+        ends
+big     struct reorder
+pad:    ds 200
+flags:  db 0, hot
+sp:     dl 0, hot 10
+        ends
+        ld a,(ix+task.state)
+        ld hl,(ix+task.next)
+        ld bc,task
+        ld a,(iy+big.flags)
+        ld hl,(iy+big.sp)
+        ld bc,big.pad
+        ld de,big.sp.size
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Lay out STRUCTs, with and without REORDER, and use their offsets as
+# index displacements; a field out of (ix+d) reach warns, and using it
+# is an error.
+#
+# Usage: tests/struct.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/struct.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: struct: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/struct.o" "$dir/struct.asm" || exit 1
+"$LD" -o "$tmp/out.bin" "$tmp/struct.o" || exit 1
+
+# task: next 0, state 3, size 4; big reordered: sp 0, flags 3, pad 4
+expect="dd 7e 03 dd 27 00 01 04 00 00 fd 7e 03 fd 27 00 01 04 00 00 11 03 00 00"
+got=$(od -An -tx1 -v "$tmp/out.bin" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//')
+check "layout" "$expect" "$got"
+
+got=$("$AS" -o "$tmp/range.o" "$dir/struct_range.asm" 2>&1 | sed "s|$dir/||g")
+check "range" \
+"struct_range.asm:6: warning: field 's.far' at offset 130 is beyond (ix+d) range
+struct_range.asm:8: error: index displacement 130 out of range (-128..127)
+Assembly failed with 1 error(s)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: struct"
+exit $status
@@ -0,0 +1,8 @@
+; A field beyond (ix+d) reach: a warning, and an error where it is used
+        assume adl=1
+        section code
+s       struct
+pad:    ds 130
+far:    db 0
+        ends
+        ld a,(ix+s.far)
@@ -0,0 +1,18 @@
+; Sizes up to the next label, from SIZE, and kinds from the section,
+; TYPE and EQU
+        assume adl=1
+        xdef func, two, tab, table, buf, limit
+        section code
+func:   ld a,1
+@loop:  djnz @loop
+        ret
+        size func, $ - func
+        db 0                    ; Not part of func
+two:    ret
+tab:    dw 1,2
+        type tab, object
+        section data
+table:  db 1,2,3
+        section bss
+buf:    ds 10
+limit   equ 100
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Record each exported symbol's size and kind: up to the next label or
+# from SIZE, by section or from TYPE, and constant for EQU; check them
+# in objdump and the ld map.
+#
+# Usage: tests/symbol_info.sh [as] [ld] [objdump]
+#        (default: as/as, ld/ld, objdump/objdump)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+OBJDUMP=${3:-$dir/../objdump/objdump}
+tmp=${TMPDIR:-/tmp}/symbol_info.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: symbol_info: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+"$AS" -o "$tmp/info.o" "$dir/symbol_info.asm" || exit 1
+got=$("$OBJDUMP" "$tmp/info.o" | sed -n '/SYMBOL_INFO/,$p' | sed 1,3d)
+check "objdump" "    func                     5      func
+    two                      1      func
+    tab                      4      object
+    table                    3      object
+    buf                      10     object
+    limit                    0      const" "$got"
+
+"$LD" -m "$tmp/out.map" -o "$tmp/out.bin" "$tmp/info.o" || exit 1
+got=$(sed -n '/^Symbols:/,$p' "$tmp/out.map" | grep 'info\.o$' |
+      sed "s|$tmp/||")
+check "map" "  func                     000000   5      func   info.o
+  two                      000006   1      func   info.o
+  tab                      000007   4      object info.o
+  table                    00000B   3      object info.o
+  buf                      00000E   10     object info.o
+  limit                    000064   -      const  info.o" "$got"
+
+[ $status -eq 0 ] && echo "PASS: symbol_info"
+exit $status
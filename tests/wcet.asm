@@ -0,0 +1,36 @@
+; Routines with bounded loops, calls and a loop with no bound
+        assume adl=1
+        xref putc
+        section code
+copy:   ld b,16                 ; bound 16, from ld b,n
+@l:     ld a,(hl)
+        ld (de),a
+        inc hl
+        inc de
+        djnz @l
+        ret
+
+sum:    ld c,4
+@outer: ld b,8
+@inner: add a,(hl)
+        inc hl
+        djnz @inner
+        dec c
+        loopbound 4
+        jr nz,@outer
+        ret
+
+main:   call sum
+        call copy
+        ret
+
+show:   call putc
+        ret
+
+spin:   ld a,(hl)
+        or a
+        jr nz,spin
+        ret
+
+skip:   loopbound 2
+        ret
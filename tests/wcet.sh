@@ -0,0 +1,46 @@
+#!/bin/sh
+# Bound the cycles of each routine with --wcet: a djnz loop bounded by
+# its ld b,n, nested loops with loopbound, calls within the file, and
+# what makes a bound "at least".
+#
+# Usage: tests/wcet.sh [as]   (default: as/as)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+tmp=${TMPDIR:-/tmp}/wcet.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+status=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: wcet: $1"
+        echo "  expected: $2"
+        echo "  got:      $3"
+        status=1
+    fi
+}
+
+src="$dir/wcet.asm"
+got=$("$AS" --wcet -o "$tmp/t.o" "$src" 2>"$tmp/err" | sed "s|$dir/||g")
+check "--wcet" \
+"wcet.asm:5: note: 'copy' takes 167 cycles at worst (lines 5-11; loop at 6: 16 x 10)
+wcet.asm:13: note: 'sum' takes 251 cycles at worst (lines 13-21; loop at 14: 4 x 61, loop at 15: 8 x 7)
+wcet.asm:23: note: 'main' takes 438 cycles at worst (lines 23-25; calls 'sum' 251, calls 'copy' 167)
+wcet.asm:27: note: 'show' takes at least 13 cycles at worst (lines 27-28; calls external 'putc' at wcet.asm:27)
+wcet.asm:30: note: 'spin' takes at least 11 cycles at worst (lines 30-33; loop at wcet.asm:30 has no bound)
+wcet.asm:36: note: 'skip' takes 6 cycles at worst (line 36)" "$got"
+check "loopbound outside a loop" \
+"wcet.asm:36: warning: LOOPBOUND is not inside a loop" \
+    "$(sed "s|$dir/||g" "$tmp/err")"
+
+# One wait state on each code fetch and two on each data access
+got=$("$AS" --wcet --wait-states=1,2 -o "$tmp/t.o" "$src" 2>/dev/null |
+      sed "s|$dir/||g" | head -3)
+check "--wait-states=1,2" \
+"wcet.asm:5: note: 'copy' takes 336 cycles at worst (lines 5-11; loop at 6: 16 x 20)
+wcet.asm:13: note: 'sum' takes 472 cycles at worst (lines 13-21; loop at 14: 4 x 114, loop at 15: 8 x 13)
+wcet.asm:23: note: 'main' takes 855 cycles at worst (lines 23-25; calls 'sum' 472, calls 'copy' 336)" "$got"
+
+[ $status -eq 0 ] && echo "PASS: wcet"
+exit $status
@@ -0,0 +1,7 @@
+; Entry object for why_live.sh: calls outer (clobbers.asm, which calls
+; inner from a library) and only declares start (ldlib_api.asm)
+        assume adl=1
+        xref outer, start
+        section code
+main:   call outer
+        ret
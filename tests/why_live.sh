@@ -0,0 +1,46 @@
+#!/bin/sh
+# Explain why inputs are linked and list the ones the entry does not
+# use: a chain through an object into a library, a member pulled in by
+# an xref no instruction uses, and inputs only that member reaches.
+#
+# Usage: tests/why_live.sh [as] [ld]   (default: as/as, ld/ld)
+
+dir=$(dirname "$0")
+AS=${1:-$dir/../as/as}
+LD=${2:-$dir/../ld/ld}
+tmp=${TMPDIR:-/tmp}/why_live.$$
+trap 'rm -rf "$tmp"' 0
+mkdir -p "$tmp" || exit 1
+
+"$AS" -o "$tmp/main.o" "$dir/why_live.asm" || exit 1
+"$AS" -o "$tmp/outer.o" "$dir/clobbers.asm" || exit 1
+"$AS" -o "$tmp/ext.o" "$dir/ldopt_ext.asm" || exit 1
+"$AS" -o "$tmp/spare.o" "$dir/struct.asm" || exit 1
+"$AS" -o "$tmp/liba.a" "$dir/clobbers_inner.asm" || exit 1
+"$AS" -o "$tmp/libn.a" "$dir/ldlib_api.asm" || exit 1
+
+expect="; Why 'inner' is linked: defined in liba.a[0]
+main.o (entry)
+  refers to outer in outer.o
+  refers to inner in liba.a[0]
+; Why 'ext' is linked: defined in ext.o
+main.o (entry)
+  declares start in libn.a[0]
+  refers to ext in ext.o
+; Why outer.o is linked
+main.o (entry)
+  refers to outer in outer.o
+; Inputs main.o does not use
+object  ext.o
+object  spare.o
+library libn.a"
+got=$("$LD" -o "$tmp/out.bin" "$tmp/main.o" "$tmp/outer.o" "$tmp/ext.o" \
+      "$tmp/spare.o" -L "$tmp" -la -ln --why-live inner --why-live=ext \
+      --why-live "$tmp/outer.o" --report-unused | sed "s|$tmp/||g")
+if [ "$got" != "$expect" ]; then
+    echo "FAIL: why_live"
+    echo "  expected: $expect"
+    echo "  got:      $got"
+    exit 1
+fi
+echo "PASS: why_live"